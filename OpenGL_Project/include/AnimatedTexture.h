@@ -0,0 +1,183 @@
+#ifndef ANIMATED_TEXTURE_H
+#define ANIMATED_TEXTURE_H
+
+#include <glad/glad.h>
+#include <stb_image.h>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Plays an animated GIF from a GL_TEXTURE_2D_ARRAY whose layers are a ring of decoded frames, frame k of the playback goes to
+// layer k % depth. Sample it with a sampler2DArray at vec3(uv, layer())
+// Frames are decoded one at a time with stbi_gif_next when the ring has room for them, so however long the animation is it only
+// takes the file, the decoder's canvas and the ring (stbi_load_gif_from_memory keeps every frame), and update() never decodes
+// more than decodesPerUpdate frames. The ring is filled up to depth - 1 frames past the one shown, so the decoding is spread over
+// the frames and a slow frame does not hold up the playback
+// Animations with no more frames than the ring has layers stay in it after the first loop and are not decoded again
+class AnimatedTexture {
+public:
+    unsigned int ID = 0;
+    int width = 0, height = 0;
+
+    AnimatedTexture() = default;
+    AnimatedTexture(const AnimatedTexture&) = delete;
+    AnimatedTexture& operator=(const AnimatedTexture&) = delete;
+
+    ~AnimatedTexture()
+    {
+        release();
+    }
+
+    // depth = layers in the ring (at least 2), flip on the y axis to match the OpenGL texture coordinates
+    // Decodes and uploads the first frame before it returns
+    bool load(const std::string& path, int depth = 4, bool flip = false, int decodesPerUpdate = 1)
+    {
+        release();
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (file)
+        {
+            contents.resize((size_t)file.tellg());
+            file.seekg(0);
+            file.read((char*)contents.data(), contents.size());
+        }
+        if (!file || contents.empty())
+        {
+            std::cout << "ERROR::ANIMATED_TEXTURE::FAILED_TO_READ " << path << std::endl;
+            return false;
+        }
+
+        stbi_options options = {};
+        options.flip_vertically = flip;
+        options.desired_channels = 4;
+        frames = stbi_gif_begin(&options, contents.data(), (int)contents.size(), &width, &height);
+        if (frames == NULL)
+        {
+            std::cout << "ERROR::ANIMATED_TEXTURE::FAILED_TO_LOAD " << path << " (" << stbi_failure_reason() << ")" << std::endl;
+            release();
+            return false;
+        }
+        this->depth = depth > 2 ? depth : 2;
+        this->decodesPerUpdate = decodesPerUpdate > 1 ? decodesPerUpdate : 1;
+        delays.assign(this->depth, 0);
+
+        glGenTextures(1, &ID);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, ID);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, width, height, this->depth, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0); // one mip level, regenerating them for every frame costs too much
+        if (!decodeNext())
+        {
+            std::cout << "ERROR::ANIMATED_TEXTURE::FAILED_TO_LOAD " << path << " (" << stbi_failure_reason() << ")" << std::endl;
+            release();
+            return false;
+        }
+        return true;
+    }
+
+    // Advances the animation by deltaTime seconds, call it once per frame
+    // A frame that is not decoded yet when it is due keeps the previous one on screen a little longer
+    void update(float deltaTime)
+    {
+        if (frames == NULL && !cached)
+            return;
+        for (int i = 0; i < decodesPerUpdate && !cached && decoded - shown < depth; i++)
+        {
+            if (!decodeNext())
+                break;
+        }
+
+        elapsed += deltaTime * 1000.0;
+        for (;;)
+        {
+            double delay = frameDelay(shown);
+            if (elapsed < delay)
+                break;
+            if (!cached && shown + 1 >= decoded)
+            {
+                elapsed = delay;
+                break;
+            }
+            elapsed -= delay;
+            shown++;
+        }
+    }
+
+    // Layer of the texture array holding the frame to draw
+    int layer() const
+    {
+        return (int)(cached ? shown % frameCount : shown % depth);
+    }
+
+    void release()
+    {
+        if (frames != NULL)
+            stbi_gif_free(frames);
+        frames = NULL;
+        if (ID != 0)
+            glDeleteTextures(1, &ID);
+        ID = 0;
+        width = height = 0;
+        contents.clear();
+        contents.shrink_to_fit();
+        delays.clear();
+        shown = decoded = 0;
+        elapsed = 0.0;
+        frameCount = 0;
+        cached = false;
+    }
+
+private:
+    std::vector<unsigned char> contents; // the GIF file, stbi_gif_next reads it a frame at a time
+    stbi_gif_frames* frames = NULL;
+    int depth = 0, decodesPerUpdate = 1;
+    std::vector<int> delays;            // delay of each frame in the ring, in milliseconds
+    long long shown = 0, decoded = 0;   // frames of the playback (counting every loop) shown and decoded so far
+    double elapsed = 0.0;               // milliseconds the frame shown has been on screen
+    int frameCount = 0;                 // frames in the file, known after the first loop
+    bool cached = false;                // every frame is in the ring, layer i holds frame i
+
+    // Decodes the next frame (the first one again after the last) into the layer after the last one decoded
+    bool decodeNext()
+    {
+        int delay = 0;
+        const stbi_uc* pixels = stbi_gif_next(frames, &delay);
+        if (pixels == NULL && stbi_gif_frame_count(frames) > 0)
+        {
+            frameCount = stbi_gif_frame_count(frames);
+            if (decoded == frameCount && frameCount <= depth)
+            {
+                // the first loop filled layers 0 to frameCount - 1, nothing needs decoding anymore
+                cached = true;
+                stbi_gif_free(frames);
+                frames = NULL;
+                contents.clear();
+                contents.shrink_to_fit();
+                return false;
+            }
+            stbi_gif_rewind(frames);
+            pixels = stbi_gif_next(frames, &delay);
+        }
+        if (pixels == NULL)
+            return false;
+
+        int layer = (int)(decoded % depth);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, ID);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        delays[layer] = delay;
+        decoded++;
+        return true;
+    }
+
+    // Like browsers, delays of 10ms or less (often 0, meaning "as fast as possible") play at 100ms
+    double frameDelay(long long frame) const
+    {
+        int delay = delays[cached ? frame % frameCount : frame % depth];
+        return delay > 10 ? delay : 100;
+    }
+};
+#endif
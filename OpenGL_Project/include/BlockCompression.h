@@ -0,0 +1,593 @@
+#ifndef BLOCK_COMPRESSION_H
+#define BLOCK_COMPRESSION_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLOCK_COMPRESSION_SSE2
+#include <emmintrin.h>
+#endif
+
+// GPU block compression formats, every 4x4 block of pixels becomes a fixed size block of bits that the GPU decodes while sampling
+// BC1: RGB, 8 bytes per block (4 bits per pixel, 1/6 of RGB8 as the driver stores it)
+// BC3: RGBA, 16 bytes per block, BC1 colour plus a separate 8 byte block for alpha
+// BC7: RGBA, 16 bytes per block, much better quality than BC1/BC3 at the same size as BC3
+enum class BlockFormat { BC1, BC3, BC7 };
+
+// Fast: bounding box endpoints, Normal: endpoints along the main axis of the colours, High: also refines the endpoints with least squares
+enum class CompressionQuality { Fast, Normal, High };
+
+inline unsigned int blockBytes(BlockFormat format)
+{
+    return format == BlockFormat::BC1 ? 8 : 16;
+}
+
+// Size of one compressed mip level, partial blocks at the edges still take a whole block
+inline size_t compressedSize(int width, int height, BlockFormat format)
+{
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockBytes(format);
+}
+
+// CPU encoder for BC1, BC3 and BC7
+// Blocks are encoded independently, compress() splits the rows of blocks over several threads
+// The nearest palette entry search (the inner loop of every format) uses SSE2 when the compiler targets it
+// BC7 only uses mode 6 (one RGBA endpoint pair with 16 interpolation steps), which handles photos and smooth alpha well
+class BlockCompressor {
+public:
+    BlockCompressor(BlockFormat format, CompressionQuality quality = CompressionQuality::Normal)
+        : format(format), quality(quality)
+    {
+    }
+
+    // Compresses a whole RGBA8 image, threadCount = 0 uses every core
+    std::vector<unsigned char> compress(const unsigned char* rgba, int width, int height, unsigned int threadCount = 0) const
+    {
+        int blocksX = (width + 3) / 4;
+        int blocksY = (height + 3) / 4;
+        unsigned int size = blockBytes(format);
+        std::vector<unsigned char> output((size_t)blocksX * blocksY * size);
+
+        std::atomic<int> nextRow(0);
+        auto work = [&]() {
+            unsigned char pixels[64];
+            for (int by = nextRow++; by < blocksY; by = nextRow++)
+            {
+                for (int bx = 0; bx < blocksX; bx++)
+                {
+                    // blocks that hang over the edge repeat the last row/column, those pixels are never sampled
+                    for (int y = 0; y < 4; y++)
+                    {
+                        int sy = by * 4 + y < height ? by * 4 + y : height - 1;
+                        for (int x = 0; x < 4; x++)
+                        {
+                            int sx = bx * 4 + x < width ? bx * 4 + x : width - 1;
+                            memcpy(pixels + (y * 4 + x) * 4, rgba + ((size_t)sy * width + sx) * 4, 4);
+                        }
+                    }
+                    encodeBlock(pixels, &output[((size_t)by * blocksX + bx) * size]);
+                }
+            }
+        };
+
+        if (threadCount == 0)
+            threadCount = std::thread::hardware_concurrency();
+        if (threadCount > (unsigned int)blocksY)
+            threadCount = blocksY;
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < threadCount; i++)
+            threads.push_back(std::thread(work));
+        work();
+        for (std::thread& thread : threads)
+            thread.join();
+        return output;
+    }
+
+    // pixels = 16 RGBA8 pixels in rows, output = blockBytes(format) bytes
+    void encodeBlock(const unsigned char* pixels, unsigned char* output) const
+    {
+        Block block;
+        for (int i = 0; i < 16; i++)
+            for (int c = 0; c < 4; c++)
+                block.channel[c][i] = pixels[i * 4 + c];
+
+        switch (format)
+        {
+        case BlockFormat::BC1:
+            encodeColor(block, output);
+            break;
+        case BlockFormat::BC3:
+            encodeAlpha(block, output);
+            encodeColor(block, output + 8);
+            break;
+        case BlockFormat::BC7:
+            encodeMode6(block, output);
+            break;
+        }
+    }
+
+private:
+    BlockFormat format;
+    CompressionQuality quality;
+
+    // The 16 pixels stored per channel so four pixels can be processed at once
+    struct Block {
+        float channel[4][16];
+    };
+
+    // Picks the closest palette entry for every pixel using the channels [first, first + count) and returns the summed squared error
+    static float fitIndices(const Block& block, const float palette[][4], int paletteSize, int first, int count, unsigned char indices[16])
+    {
+        float total = 0.0f;
+#ifdef BLOCK_COMPRESSION_SSE2
+        for (int group = 0; group < 16; group += 4)
+        {
+            __m128 best = _mm_set1_ps(FLT_MAX);
+            __m128i bestIndex = _mm_setzero_si128();
+            for (int p = 0; p < paletteSize; p++)
+            {
+                __m128 distance = _mm_setzero_ps();
+                for (int c = first; c < first + count; c++)
+                {
+                    __m128 difference = _mm_sub_ps(_mm_loadu_ps(&block.channel[c][group]), _mm_set1_ps(palette[p][c]));
+                    distance = _mm_add_ps(distance, _mm_mul_ps(difference, difference));
+                }
+                __m128i closer = _mm_castps_si128(_mm_cmplt_ps(distance, best));
+                best = _mm_min_ps(distance, best);
+                bestIndex = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(p)), _mm_andnot_si128(closer, bestIndex));
+            }
+            int lanes[4];
+            float errors[4];
+            _mm_storeu_si128((__m128i*)lanes, bestIndex);
+            _mm_storeu_ps(errors, best);
+            for (int i = 0; i < 4; i++)
+            {
+                indices[group + i] = (unsigned char)lanes[i];
+                total += errors[i];
+            }
+        }
+#else
+        for (int i = 0; i < 16; i++)
+        {
+            float best = FLT_MAX;
+            int bestIndex = 0;
+            for (int p = 0; p < paletteSize; p++)
+            {
+                float distance = 0.0f;
+                for (int c = first; c < first + count; c++)
+                {
+                    float difference = block.channel[c][i] - palette[p][c];
+                    distance += difference * difference;
+                }
+                if (distance < best)
+                {
+                    best = distance;
+                    bestIndex = p;
+                }
+            }
+            indices[i] = (unsigned char)bestIndex;
+            total += best;
+        }
+#endif
+        return total;
+    }
+
+    // Endpoints at the corners of the bounding box, pulled in a little since the extremes are rarely worth a palette entry
+    static void boundingBoxEndpoints(const Block& block, int count, float e0[4], float e1[4])
+    {
+        for (int c = 0; c < count; c++)
+        {
+            float low = 255.0f, high = 0.0f;
+            for (int i = 0; i < 16; i++)
+            {
+                low = std::fmin(low, block.channel[c][i]);
+                high = std::fmax(high, block.channel[c][i]);
+            }
+            float inset = (high - low) / 16.0f;
+            e0[c] = low + inset;
+            e1[c] = high - inset;
+        }
+    }
+
+    // Endpoints at both ends of the pixels projected onto their principal axis (found with power iteration on the covariance)
+    static void principalEndpoints(const Block& block, int count, float e0[4], float e1[4])
+    {
+        float mean[4] = {};
+        for (int c = 0; c < count; c++)
+        {
+            for (int i = 0; i < 16; i++)
+                mean[c] += block.channel[c][i];
+            mean[c] /= 16.0f;
+        }
+
+        float covariance[4][4] = {};
+        for (int i = 0; i < 16; i++)
+            for (int a = 0; a < count; a++)
+                for (int b = 0; b < count; b++)
+                    covariance[a][b] += (block.channel[a][i] - mean[a]) * (block.channel[b][i] - mean[b]);
+
+        float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        for (int iteration = 0; iteration < 8; iteration++)
+        {
+            float next[4] = {};
+            float length = 0.0f;
+            for (int a = 0; a < count; a++)
+            {
+                for (int b = 0; b < count; b++)
+                    next[a] += covariance[a][b] * axis[b];
+                length = std::fmax(length, std::fabs(next[a]));
+            }
+            if (length == 0.0f) // every pixel is the same
+            {
+                for (int c = 0; c < count; c++)
+                    e0[c] = e1[c] = mean[c];
+                return;
+            }
+            for (int c = 0; c < count; c++)
+                axis[c] = next[c] / length;
+        }
+        float lengthSquared = 0.0f;
+        for (int c = 0; c < count; c++)
+            lengthSquared += axis[c] * axis[c];
+
+        float low = FLT_MAX, high = -FLT_MAX;
+        for (int i = 0; i < 16; i++)
+        {
+            float t = 0.0f;
+            for (int c = 0; c < count; c++)
+                t += (block.channel[c][i] - mean[c]) * axis[c];
+            low = std::fmin(low, t);
+            high = std::fmax(high, t);
+        }
+        for (int c = 0; c < count; c++)
+        {
+            e0[c] = clamp255(mean[c] + axis[c] * low / lengthSquared);
+            e1[c] = clamp255(mean[c] + axis[c] * high / lengthSquared);
+        }
+    }
+
+    // Best endpoints for fixed indices: solves the 2x2 normal equations of sum |(1 - w) e0 + w e1 - pixel|^2
+    // weights[index] = how far along from e0 to e1 that palette entry is, returns false if the system is singular
+    static bool leastSquaresEndpoints(const Block& block, const unsigned char indices[16], const float* weights, int count, float e0[4], float e1[4])
+    {
+        float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+        float ax[4] = {}, bx[4] = {};
+        for (int i = 0; i < 16; i++)
+        {
+            float w = weights[indices[i]];
+            aa += (1.0f - w) * (1.0f - w);
+            ab += (1.0f - w) * w;
+            bb += w * w;
+            for (int c = 0; c < count; c++)
+            {
+                ax[c] += (1.0f - w) * block.channel[c][i];
+                bx[c] += w * block.channel[c][i];
+            }
+        }
+        float determinant = aa * bb - ab * ab;
+        if (std::fabs(determinant) < 1e-6f)
+            return false;
+        for (int c = 0; c < count; c++)
+        {
+            e0[c] = clamp255((bb * ax[c] - ab * bx[c]) / determinant);
+            e1[c] = clamp255((aa * bx[c] - ab * ax[c]) / determinant);
+        }
+        return true;
+    }
+
+    static float clamp255(float value)
+    {
+        return value < 0.0f ? 0.0f : (value > 255.0f ? 255.0f : value);
+    }
+
+    // ---- BC1 colour block ----
+
+    static unsigned short to565(const float color[4])
+    {
+        int r = (int)(color[0] * 31.0f / 255.0f + 0.5f);
+        int g = (int)(color[1] * 63.0f / 255.0f + 0.5f);
+        int b = (int)(color[2] * 31.0f / 255.0f + 0.5f);
+        return (unsigned short)((r << 11) | (g << 5) | b);
+    }
+
+    static void from565(unsigned short packed, float color[4])
+    {
+        int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+        color[0] = (float)((r << 3) | (r >> 2));
+        color[1] = (float)((g << 2) | (g >> 4));
+        color[2] = (float)((b << 3) | (b >> 2));
+        color[3] = 255.0f;
+    }
+
+    // Palette of the four colour mode: index 0 = c0, 1 = c1, 2 = 2/3 c0 + 1/3 c1, 3 = 1/3 c0 + 2/3 c1
+    static float fitColor(const Block& block, unsigned short c0, unsigned short c1, unsigned char indices[16])
+    {
+        float palette[4][4];
+        from565(c0, palette[0]);
+        from565(c1, palette[1]);
+        for (int c = 0; c < 4; c++)
+        {
+            palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+            palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+        }
+        return fitIndices(block, palette, 4, 0, 3, indices);
+    }
+
+    void encodeColor(const Block& block, unsigned char* output) const
+    {
+        static const float weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+        float e0[4], e1[4];
+        if (quality == CompressionQuality::Fast)
+            boundingBoxEndpoints(block, 3, e0, e1);
+        else
+            principalEndpoints(block, 3, e0, e1);
+
+        // the larger endpoint goes first, c0 > c1 selects the four colour mode
+        unsigned short c0 = to565(e1), c1 = to565(e0);
+        unsigned char indices[16];
+        float error = fitColor(block, c0, c1, indices);
+
+        if (quality == CompressionQuality::High)
+        {
+            for (int iteration = 0; iteration < 2; iteration++)
+            {
+                // e0/e1 here follow the palette order, so weight 0 = c0
+                if (!leastSquaresEndpoints(block, indices, weights, 3, e0, e1))
+                    break;
+                unsigned short r0 = to565(e0), r1 = to565(e1);
+                unsigned char refined[16];
+                float refinedError = fitColor(block, r0, r1, refined);
+                if (refinedError >= error)
+                    break;
+                c0 = r0;
+                c1 = r1;
+                error = refinedError;
+                memcpy(indices, refined, 16);
+            }
+        }
+
+        if (c0 < c1)
+        {
+            unsigned short swap = c0;
+            c0 = c1;
+            c1 = swap;
+            for (int i = 0; i < 16; i++)
+                indices[i] ^= 1; // 0 <-> 1 and 2 <-> 3
+        }
+        else if (c0 == c1)
+        {
+            // c0 == c1 would be the three colour mode where index 3 is transparent black, every pixel is c0 anyway
+            memset(indices, 0, 16);
+        }
+
+        unsigned int bits = 0;
+        for (int i = 0; i < 16; i++)
+            bits |= (unsigned int)indices[i] << (i * 2);
+        output[0] = (unsigned char)(c0 & 0xff);
+        output[1] = (unsigned char)(c0 >> 8);
+        output[2] = (unsigned char)(c1 & 0xff);
+        output[3] = (unsigned char)(c1 >> 8);
+        for (int i = 0; i < 4; i++)
+            output[4 + i] = (unsigned char)(bits >> (i * 8));
+    }
+
+    // ---- BC3 alpha block (the same layout as BC4) ----
+
+    // a0 > a1: 8 alphas interpolated between them, a0 <= a1: 6 interpolated plus exact 0 and 255
+    static float fitAlpha(const Block& block, int a0, int a1, unsigned char indices[16])
+    {
+        float palette[8][4] = {};
+        palette[0][3] = (float)a0;
+        palette[1][3] = (float)a1;
+        if (a0 > a1)
+        {
+            for (int i = 2; i < 8; i++)
+                palette[i][3] = (float)(((8 - i) * a0 + (i - 1) * a1) / 7);
+        }
+        else
+        {
+            for (int i = 2; i < 6; i++)
+                palette[i][3] = (float)(((6 - i) * a0 + (i - 1) * a1) / 5);
+            palette[6][3] = 0.0f;
+            palette[7][3] = 255.0f;
+        }
+        return fitIndices(block, palette, 8, 3, 1, indices);
+    }
+
+    void encodeAlpha(const Block& block, unsigned char* output) const
+    {
+        int low = 255, high = 0;
+        int innerLow = 255, innerHigh = 0; // ignoring fully transparent and fully opaque pixels
+        for (int i = 0; i < 16; i++)
+        {
+            int alpha = (int)block.channel[3][i];
+            low = alpha < low ? alpha : low;
+            high = alpha > high ? alpha : high;
+            if (alpha != 0 && alpha != 255)
+            {
+                innerLow = alpha < innerLow ? alpha : innerLow;
+                innerHigh = alpha > innerHigh ? alpha : innerHigh;
+            }
+        }
+
+        int a0 = high, a1 = low;
+        unsigned char indices[16];
+        float error = fitAlpha(block, a0, a1, indices);
+
+        // Cut-outs (mostly 0 and 255 with a soft edge) keep the exact extremes and spend the 6 steps on the edge
+        if (quality == CompressionQuality::High && innerLow <= innerHigh && (low == 0 || high == 255))
+        {
+            unsigned char sixIndices[16];
+            float sixError = fitAlpha(block, innerLow, innerHigh, sixIndices);
+            if (sixError < error)
+            {
+                a0 = innerLow;
+                a1 = innerHigh;
+                memcpy(indices, sixIndices, 16);
+            }
+        }
+
+        unsigned long long bits = 0;
+        for (int i = 0; i < 16; i++)
+            bits |= (unsigned long long)indices[i] << (i * 3);
+        output[0] = (unsigned char)a0;
+        output[1] = (unsigned char)a1;
+        for (int i = 0; i < 6; i++)
+            output[2 + i] = (unsigned char)(bits >> (i * 8));
+    }
+
+    // ---- BC7 mode 6 ----
+
+    // Endpoints are 7 bits per channel plus one shared low bit (the p-bit) per endpoint
+    struct Mode6Endpoint {
+        int value[4]; // 7 bit
+        int pbit;
+    };
+
+    static Mode6Endpoint quantizeMode6(const float color[4], int pbit)
+    {
+        Mode6Endpoint endpoint;
+        endpoint.pbit = pbit;
+        for (int c = 0; c < 4; c++)
+        {
+            int value = (int)((color[c] - pbit) / 2.0f + 0.5f);
+            endpoint.value[c] = value < 0 ? 0 : (value > 127 ? 127 : value);
+        }
+        return endpoint;
+    }
+
+    static float quantizationError(const float color[4], const Mode6Endpoint& endpoint)
+    {
+        float error = 0.0f;
+        for (int c = 0; c < 4; c++)
+        {
+            float difference = color[c] - (float)((endpoint.value[c] << 1) | endpoint.pbit);
+            error += difference * difference;
+        }
+        return error;
+    }
+
+    // p-bit that keeps the endpoint closest to the unquantized colour
+    static Mode6Endpoint quantizeMode6(const float color[4])
+    {
+        Mode6Endpoint zero = quantizeMode6(color, 0);
+        Mode6Endpoint one = quantizeMode6(color, 1);
+        return quantizationError(color, zero) <= quantizationError(color, one) ? zero : one;
+    }
+
+    static const int* mode6Weights()
+    {
+        static const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+        return weights;
+    }
+
+    static float fitMode6(const Block& block, const Mode6Endpoint& e0, const Mode6Endpoint& e1, unsigned char indices[16])
+    {
+        const int* weights = mode6Weights();
+        float palette[16][4];
+        for (int c = 0; c < 4; c++)
+        {
+            int v0 = (e0.value[c] << 1) | e0.pbit;
+            int v1 = (e1.value[c] << 1) | e1.pbit;
+            for (int i = 0; i < 16; i++)
+                palette[i][c] = (float)(((64 - weights[i]) * v0 + weights[i] * v1 + 32) >> 6);
+        }
+        return fitIndices(block, palette, 16, 0, 4, indices);
+    }
+
+    // Tries the p-bits for a pair of endpoints, High tries all four combinations by their actual fit error
+    float bestMode6(const Block& block, const float f0[4], const float f1[4], Mode6Endpoint& e0, Mode6Endpoint& e1, unsigned char indices[16]) const
+    {
+        if (quality != CompressionQuality::High)
+        {
+            e0 = quantizeMode6(f0);
+            e1 = quantizeMode6(f1);
+            return fitMode6(block, e0, e1, indices);
+        }
+
+        float best = FLT_MAX;
+        for (int p = 0; p < 4; p++)
+        {
+            Mode6Endpoint q0 = quantizeMode6(f0, p & 1);
+            Mode6Endpoint q1 = quantizeMode6(f1, p >> 1);
+            unsigned char candidate[16];
+            float error = fitMode6(block, q0, q1, candidate);
+            if (error < best)
+            {
+                best = error;
+                e0 = q0;
+                e1 = q1;
+                memcpy(indices, candidate, 16);
+            }
+        }
+        return best;
+    }
+
+    void encodeMode6(const Block& block, unsigned char* output) const
+    {
+        float f0[4], f1[4];
+        if (quality == CompressionQuality::Fast)
+            boundingBoxEndpoints(block, 4, f0, f1);
+        else
+            principalEndpoints(block, 4, f0, f1);
+
+        Mode6Endpoint e0, e1;
+        unsigned char indices[16];
+        float error = bestMode6(block, f0, f1, e0, e1, indices);
+
+        if (quality == CompressionQuality::High)
+        {
+            float weights[16];
+            for (int i = 0; i < 16; i++)
+                weights[i] = mode6Weights()[i] / 64.0f;
+            for (int iteration = 0; iteration < 2; iteration++)
+            {
+                if (!leastSquaresEndpoints(block, indices, weights, 4, f0, f1))
+                    break;
+                Mode6Endpoint r0, r1;
+                unsigned char refined[16];
+                float refinedError = bestMode6(block, f0, f1, r0, r1, refined);
+                if (refinedError >= error)
+                    break;
+                e0 = r0;
+                e1 = r1;
+                error = refinedError;
+                memcpy(indices, refined, 16);
+            }
+        }
+
+        // The first index is stored with 3 bits, its top bit is implied 0, so swap the endpoints if it is set
+        if (indices[0] >= 8)
+        {
+            Mode6Endpoint swap = e0;
+            e0 = e1;
+            e1 = swap;
+            for (int i = 0; i < 16; i++)
+                indices[i] = (unsigned char)(15 - indices[i]);
+        }
+
+        memset(output, 0, 16);
+        int position = 0;
+        auto write = [&](unsigned int value, int count) {
+            for (int i = 0; i < count; i++, position++)
+                output[position >> 3] |= (unsigned char)(((value >> i) & 1) << (position & 7));
+        };
+        write(1 << 6, 7); // mode 6 = six 0 bits then a 1
+        for (int c = 0; c < 4; c++)
+        {
+            write(e0.value[c], 7);
+            write(e1.value[c], 7);
+        }
+        write(e0.pbit, 1);
+        write(e1.pbit, 1);
+        write(indices[0], 3);
+        for (int i = 1; i < 16; i++)
+            write(indices[i], 4);
+    }
+};
+#endif
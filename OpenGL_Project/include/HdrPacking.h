@@ -0,0 +1,115 @@
+#ifndef HDR_PACKING_H
+#define HDR_PACKING_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HDR_PACKING_SSE2
+#include <emmintrin.h>
+#endif
+
+// Packs float (HDR) pixels into the formats the GPU samples directly, so an environment map takes a half or a quarter of the
+// memory of GL_RGB32F and needs no conversion by the driver
+// GL_RGB9_E5: 4 bytes per pixel, three 9 bit mantissas sharing a 5 bit exponent (upload with GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV)
+// GL_RGB16F: 6 bytes per pixel, one half float per channel (upload with GL_RGB, GL_HALF_FLOAT)
+// Both give the same bits as glm::packF3x9_E1x5 and glm::packHalf1x16, the SSE2 versions (used when the compiler targets it)
+// do four pixels or values at a time and glm does the rest
+// The output may be the input buffer itself (packed texels are smaller than the floats), so a loaded image can be packed in place
+
+// Exponent bits of the largest colour replace glm's floor(log2()), they only differ just below a power of two where glm's log2
+// rounds up to it, and there the mantissa rounds up to the next exponent anyway. NaN channels count as 0 (glm leaves them undefined)
+inline void packRGB9E5(const float* rgb, unsigned int* out, size_t count)
+{
+    size_t i = 0;
+#ifdef HDR_PACKING_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maxValue = _mm_set1_ps(32768.0f); // the clamp glm uses, 2^15
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 maxMantissa = _mm_set1_ps(512.0f);
+    for (; i + 4 <= count; i += 4)
+    {
+        // three vectors of r g b r | g b r g | b r g b to one vector per channel
+        __m128 v0 = _mm_loadu_ps(rgb + i * 3);
+        __m128 v1 = _mm_loadu_ps(rgb + i * 3 + 4);
+        __m128 v2 = _mm_loadu_ps(rgb + i * 3 + 8);
+        __m128 r = _mm_shuffle_ps(v0, _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+        __m128 g = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 b = _mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 2, 2)), v2, _MM_SHUFFLE(3, 0, 2, 0));
+        r = _mm_min_ps(_mm_max_ps(r, zero), maxValue);
+        g = _mm_min_ps(_mm_max_ps(g, zero), maxValue);
+        b = _mm_min_ps(_mm_max_ps(b, zero), maxValue);
+        __m128 maxColor = _mm_max_ps(r, _mm_max_ps(g, b));
+
+        // shared exponent = max(-16, floor(log2(maxColor))) + 16, as an integer
+        __m128i exponent = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(maxColor), 23), _mm_set1_epi32(127));
+        exponent = _mm_cvttps_epi32(_mm_max_ps(_mm_cvtepi32_ps(exponent), _mm_set1_ps(-16.0f)));
+        exponent = _mm_add_epi32(exponent, _mm_set1_epi32(16));
+        // 2^(24 - exponent) from its exponent bits, multiplying by it is exact like glm's division by 2^(exponent - 24)
+        __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(151), exponent), 23));
+        __m128 maxShared = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(maxColor, scale), half)));
+        // the largest mantissa rounded up to 512: one more for the exponent (the mask is -1)
+        exponent = _mm_sub_epi32(exponent, _mm_castps_si128(_mm_cmpeq_ps(maxShared, maxMantissa)));
+        scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(151), exponent), 23));
+
+        // the values are positive, so truncating is floor()
+        __m128i packed = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(r, scale), half));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(g, scale), half)), 9));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half)), 18));
+        packed = _mm_or_si128(packed, _mm_slli_epi32(exponent, 27));
+        _mm_storeu_si128((__m128i*)(out + i), packed);
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = glm::packF3x9_E1x5(glm::vec3(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]));
+}
+
+// Rounds half way cases away from zero like glm (not to even), four values with a NaN among them go to glm for its NaN bits
+inline void packHalfFloats(const float* values, unsigned short* out, size_t count)
+{
+    size_t i = 0;
+#ifdef HDR_PACKING_SSE2
+    const __m128i absMask = _mm_set1_epi32(0x7fffffff);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i infinity = _mm_set1_epi32(0x7c00);
+    const __m128i smallestNormal = _mm_set1_epi32(113 << 23); // 2^-14, floats below it become denormal halves
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(values + i);
+        if (_mm_movemask_ps(_mm_cmpunord_ps(v, v)))
+        {
+            for (size_t j = i; j < i + 4; j++)
+                out[j] = glm::packHalf1x16(values[j]);
+            continue;
+        }
+        __m128i bits = _mm_castps_si128(v);
+        __m128i sign = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+        __m128i magnitude = _mm_and_si128(bits, absMask);
+
+        // normal: rebias the exponent, keep the top 10 mantissa bits and add the next bit to round, a carry out of the
+        // mantissa moves on into the exponent, anything past the largest half becomes infinity
+        __m128i normal = _mm_sub_epi32(_mm_srli_epi32(magnitude, 13), _mm_set1_epi32((127 - 15) << 10));
+        normal = _mm_add_epi32(normal, _mm_and_si128(_mm_srli_epi32(magnitude, 12), one));
+        __m128i overflow = _mm_cmpgt_epi32(normal, infinity);
+        normal = _mm_or_si128(_mm_andnot_si128(overflow, normal), _mm_and_si128(overflow, infinity));
+
+        // denormal: counts of 2^-24, floor(|v| * 2^24 + 0.5) is what glm's shifts and rounding bit come to
+        // (below 2^-25 the + 0.5 can round up to 1, glm returns 0 for those straight away)
+        __m128 scaled = _mm_mul_ps(_mm_castsi128_ps(magnitude), _mm_set1_ps(16777216.0f));
+        __m128i denormal = _mm_cvttps_epi32(_mm_add_ps(scaled, _mm_set1_ps(0.5f)));
+        denormal = _mm_andnot_si128(_mm_cmplt_epi32(magnitude, _mm_set1_epi32(102 << 23)), denormal);
+
+        __m128i isDenormal = _mm_cmplt_epi32(magnitude, smallestNormal);
+        __m128i packed = _mm_or_si128(_mm_andnot_si128(isDenormal, normal), _mm_and_si128(isDenormal, denormal));
+        packed = _mm_or_si128(packed, sign);
+        // sign extend so the signed saturating pack keeps all 16 bits
+        packed = _mm_srai_epi32(_mm_slli_epi32(packed, 16), 16);
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packs_epi32(packed, packed));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = glm::packHalf1x16(values[i]);
+}
+#endif
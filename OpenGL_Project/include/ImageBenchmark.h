@@ -0,0 +1,507 @@
+#ifndef IMAGE_BENCHMARK_H
+#define IMAGE_BENCHMARK_H
+
+#include <stb_image.h>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Times stb_image's conversions between channel counts and bit depths, one line per combination:
+// OpenGL_Project.exe --bench-convert [size] [runs]
+// The sources are uncompressed PNGs made in memory so decoding them is little more than a copy, and a conversion costs
+// the time to load with it minus the time to load the same image as it is (the best of all runs for both)
+//
+// Decodes every image under a directory with each SIMD level stb_image can use, to catch decoder regressions:
+// OpenGL_Project.exe --bench-decode <directory> [runs] [output.json]
+// Files are read into memory first and grouped by format (baseline and progressive JPEG, 8 and 16 bit PNG, HDR, GIF, TGA and
+// the rest), each group is reported per kernel (scalar, SSE2, AVX2) as MB/s of file data, megapixels/s, allocations and peak
+// heap per decode, and the process' peak RSS so far. Times are the best of all runs for each file, summed over the group
+class ImageBenchmark {
+public:
+    static int runCommandLine(int argc, char* argv[])
+    {
+        int size = 1024, runs = 20;
+        if (argc > 2) size = std::atoi(argv[2]);
+        if (argc > 3) runs = std::atoi(argv[3]);
+        if (size <= 0 || runs <= 0)
+        {
+            std::cout << "usage: --bench-convert [size] [runs]" << std::endl;
+            return 1;
+        }
+        double megapixels = (double)size * size / 1e6;
+        std::cout << size << "x" << size << ", best of " << runs << " runs" << std::endl;
+
+        for (int bits = 8; bits <= 16; bits += 8)
+        {
+            for (int channels = 1; channels <= 4; channels++)
+            {
+                std::vector<unsigned char> png = makePng(size, size, channels, bits);
+                double base = time(png, bits, 0, runs);
+                for (int desired = 1; desired <= 4; desired++)
+                {
+                    if (desired != channels)
+                        report(std::to_string(bits) + " bit " + std::to_string(channels) + " -> " + std::to_string(desired),
+                            base, time(png, bits, desired, runs), megapixels);
+                }
+            }
+        }
+
+        // bit depth changes, same channel count: 16 bit files read as 8 bit, 8 bit files read as 16 bit and as float
+        for (int channels = 1; channels <= 4; channels++)
+        {
+            std::vector<unsigned char> png16 = makePng(size, size, channels, 16);
+            std::vector<unsigned char> png8 = makePng(size, size, channels, 8);
+            std::string name = std::to_string(channels) + " channels";
+            report("16 -> 8 bit, " + name, time(png16, 16, 0, runs), time(png16, 8, 0, runs), megapixels);
+            double base8 = time(png8, 8, 0, runs);
+            report("8 -> 16 bit, " + name, base8, time(png8, 16, 0, runs), megapixels);
+            report("8 bit -> float, " + name, base8, time(png8, 32, 0, runs), megapixels);
+        }
+        return 0;
+    }
+
+    // OpenGL_Project.exe --bench-decode <directory> [runs] [output.json]
+    static int runDecodeCommandLine(int argc, char* argv[])
+    {
+        if (argc < 3)
+        {
+            std::cout << "usage: --bench-decode <directory> [runs] [output.json]" << std::endl;
+            return 1;
+        }
+        int runs = 10;
+        std::string jsonPath;
+        for (int i = 3; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (!arg.empty() && arg.find_first_not_of("0123456789") == std::string::npos) runs = std::atoi(arg.c_str());
+            else jsonPath = arg;
+        }
+        if (runs <= 0)
+        {
+            std::cout << "usage: --bench-decode <directory> [runs] [output.json]" << std::endl;
+            return 1;
+        }
+
+        std::vector<CorpusFile> corpus = readCorpus(argv[2]);
+        if (corpus.empty())
+        {
+            std::cout << "ERROR::IMAGE_BENCHMARK::NO_IMAGES " << argv[2] << std::endl;
+            return 1;
+        }
+        std::cout << corpus.size() << " images, best of " << runs << " runs" << std::endl;
+        std::cout << std::left << std::setw(18) << "format" << std::setw(8) << "kernel" << std::right << std::setw(6) << "files"
+            << std::setw(11) << "ms" << std::setw(10) << "MB/s" << std::setw(10) << "MP/s" << std::setw(10) << "allocs"
+            << std::setw(12) << "heap MB" << std::setw(10) << "RSS MB" << std::endl;
+
+        std::vector<FileResult> files;
+        std::vector<GroupResult> groups;
+        for (const char* format : FORMATS)
+        {
+            for (int level = STBI_SIMD_NONE; level <= STBI_SIMD_AVX2; level++)
+            {
+                // levels the build or the CPU don't have would only measure a lower one again
+                if (stbi_set_simd_level(level) != level)
+                    continue;
+                GroupResult group;
+                group.format = format;
+                group.kernel = KERNELS[level];
+                for (const CorpusFile& file : corpus)
+                {
+                    if (file.format != format)
+                        continue;
+                    FileResult result;
+                    if (!decode(file, runs, result))
+                        continue;
+                    result.kernel = group.kernel;
+                    group.files++;
+                    group.bytes += file.data.size();
+                    group.pixels += (unsigned long long)result.width * result.height;
+                    group.ms += result.ms;
+                    group.allocations += result.allocations;
+                    if (result.peakHeap > group.peakHeap) group.peakHeap = result.peakHeap;
+                    files.push_back(result);
+                }
+                if (group.files == 0)
+                    continue;
+                group.peakRss = peakRss();
+                report(group);
+                groups.push_back(group);
+            }
+        }
+        stbi_set_simd_level(STBI_SIMD_AVX2);
+
+        if (!jsonPath.empty() && !writeJson(jsonPath, runs, groups, files))
+        {
+            std::cout << "ERROR::IMAGE_BENCHMARK::FAILED_TO_WRITE " << jsonPath << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+private:
+    // The groups in the order they're reported, the names are the ones formatOf gives
+    static constexpr const char* FORMATS[] = { "jpeg", "jpeg-progressive", "png8", "png16", "hdr", "gif", "tga", "bmp", "psd", "pic", "pnm" };
+    static constexpr const char* KERNELS[] = { "scalar", "sse2", "avx2" }; // indexed by STBI_SIMD_*
+
+    struct CorpusFile {
+        std::string path;
+        std::string format;
+        std::vector<unsigned char> data;
+    };
+
+    struct FileResult {
+        std::string path;
+        std::string format;
+        std::string kernel;
+        size_t bytes = 0;
+        int width = 0, height = 0;
+        double ms = 0.0;
+        size_t allocations = 0;  // per decode, made through the stbi_allocator on the decoding thread
+        size_t peakHeap = 0;     // bytes allocated at once at most, the result included
+    };
+
+    struct GroupResult {
+        std::string format;
+        std::string kernel;
+        int files = 0;
+        unsigned long long bytes = 0, pixels = 0;
+        double ms = 0.0;
+        size_t allocations = 0, peakHeap = 0;
+        unsigned long long peakRss = 0;
+    };
+
+    // An stbi_allocator that counts what the decoder asks for, every block keeps its size in front of it
+    struct AllocationStats {
+        size_t count = 0;
+        size_t current = 0, peak = 0;
+    };
+
+    static const size_t ALLOCATION_HEADER = 16; // keeps the blocks 16 byte aligned for the SIMD code
+
+    static void* countedAlloc(void* user, size_t size)
+    {
+        AllocationStats* stats = (AllocationStats*)user;
+        unsigned char* block = (unsigned char*)malloc(size + ALLOCATION_HEADER);
+        if (block == NULL)
+            return NULL;
+        memcpy(block, &size, sizeof(size));
+        stats->count++;
+        stats->current += size;
+        if (stats->current > stats->peak) stats->peak = stats->current;
+        return block + ALLOCATION_HEADER;
+    }
+
+    static void countedFree(void* user, void* p)
+    {
+        AllocationStats* stats = (AllocationStats*)user;
+        unsigned char* block = (unsigned char*)p - ALLOCATION_HEADER;
+        size_t size;
+        memcpy(&size, block, sizeof(size));
+        stats->current -= size;
+        free(block);
+    }
+
+    static void* countedRealloc(void* user, void* p, size_t oldSize, size_t newSize)
+    {
+        void* q = countedAlloc(user, newSize);
+        if (q == NULL)
+            return NULL;
+        if (p != NULL)
+        {
+            memcpy(q, p, oldSize < newSize ? oldSize : newSize);
+            countedFree(user, p);
+        }
+        return q;
+    }
+
+    // Every file under directory that stb_image can read the header of
+    static std::vector<CorpusFile> readCorpus(const std::string& directory)
+    {
+        std::vector<CorpusFile> corpus;
+        std::error_code error;
+        for (std::filesystem::recursive_directory_iterator it(directory, error), end; !error && it != end; it.increment(error))
+        {
+            if (!it->is_regular_file(error))
+                continue;
+            CorpusFile file;
+            std::ifstream in(it->path(), std::ios::binary | std::ios::ate);
+            std::streamoff size = in.tellg();
+            if (!in || size <= 0 || size > INT_MAX)
+                continue;
+            file.data.resize((size_t)size);
+            in.seekg(0);
+            if (!in.read((char*)file.data.data(), size))
+                continue;
+            int width, height, channels;
+            if (!stbi_info_from_memory(file.data.data(), (int)file.data.size(), &width, &height, &channels))
+                continue;
+            file.path = it->path().lexically_relative(directory).generic_string();
+            file.format = formatOf(file.data);
+            corpus.push_back(std::move(file));
+        }
+        return corpus;
+    }
+
+    // The group of a file from its signature, PNGs by bit depth and JPEGs by their frame type
+    static std::string formatOf(const std::vector<unsigned char>& data)
+    {
+        const unsigned char* p = data.data();
+        size_t size = data.size();
+        if (size >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0)
+            return stbi_is_16_bit_from_memory(p, (int)size) ? "png16" : "png8";
+        if (size >= 2 && p[0] == 0xff && p[1] == 0xd8)
+            return isProgressiveJpeg(data) ? "jpeg-progressive" : "jpeg";
+        if (size >= 2 && memcmp(p, "#?", 2) == 0) return "hdr";
+        if (size >= 4 && memcmp(p, "GIF8", 4) == 0) return "gif";
+        if (size >= 2 && memcmp(p, "BM", 2) == 0) return "bmp";
+        if (size >= 4 && memcmp(p, "8BPS", 4) == 0) return "psd";
+        if (size >= 4 && memcmp(p, "\x53\x80\xf6\x34", 4) == 0) return "pic";
+        if (size >= 2 && p[0] == 'P' && (p[1] == '5' || p[1] == '6')) return "pnm";
+        return "tga"; // the one format without a signature
+    }
+
+    // Walks the segments up to the frame header, SOF2, SOF6, SOF10 and SOF14 are the progressive ones
+    static bool isProgressiveJpeg(const std::vector<unsigned char>& data)
+    {
+        size_t pos = 2;
+        while (pos + 4 <= data.size() && data[pos] == 0xff)
+        {
+            unsigned char marker = data[pos + 1];
+            if (marker == 0xff)
+            {
+                pos++; // fill byte
+                continue;
+            }
+            if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+                return (marker & 3) == 2;
+            pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+        }
+        return false;
+    }
+
+    // Best of runs decodes of file at its own bit depth (float for HDR) and channel count, false if it doesn't decode
+    static bool decode(const CorpusFile& file, int runs, FileResult& result)
+    {
+        AllocationStats stats;
+        stbi_allocator allocator = { countedAlloc, countedRealloc, countedFree, &stats };
+        stbi_options options = {};
+        options.bits_per_channel = file.format == "png16" ? 16 : file.format == "hdr" ? 32 : 8;
+        options.alloc = &allocator;
+
+        result.path = file.path;
+        result.format = file.format;
+        result.bytes = file.data.size();
+        result.ms = 1e30;
+        for (int run = 0; run < runs; run++)
+        {
+            int channels;
+            stats = AllocationStats();
+            auto start = std::chrono::steady_clock::now();
+            void* pixels = stbi_load_from_memory_ex(&options, file.data.data(), (int)file.data.size(), &result.width, &result.height, &channels);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (pixels == NULL)
+            {
+                std::cout << "ERROR::IMAGE_BENCHMARK::FAILED_TO_LOAD " << file.path << " (" << stbi_failure_reason() << ")" << std::endl;
+                return false;
+            }
+            countedFree(&stats, pixels);
+            if (ms < result.ms) result.ms = ms;
+        }
+        result.allocations = stats.count;
+        result.peakHeap = stats.peak;
+        return true;
+    }
+
+    // The most memory the process has had resident, in bytes
+    static unsigned long long peakRss()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return counters.PeakWorkingSetSize;
+        return 0;
+#else
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+#ifdef __APPLE__
+        return (unsigned long long)usage.ru_maxrss; // bytes
+#else
+        return (unsigned long long)usage.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+    }
+
+    static void report(const GroupResult& group)
+    {
+        double seconds = group.ms / 1000.0;
+        std::cout << std::left << std::setw(18) << group.format << std::setw(8) << group.kernel << std::right << std::setw(6) << group.files
+            << std::fixed << std::setprecision(2) << std::setw(11) << group.ms
+            << std::setw(10) << (seconds > 0.0 ? group.bytes / 1e6 / seconds : 0.0)
+            << std::setw(10) << (seconds > 0.0 ? group.pixels / 1e6 / seconds : 0.0)
+            << std::setprecision(1) << std::setw(10) << (double)group.allocations / group.files
+            << std::setw(12) << group.peakHeap / 1e6 << std::setw(10) << group.peakRss / 1e6 << std::endl;
+    }
+
+    static bool writeJson(const std::string& path, int runs, const std::vector<GroupResult>& groups, const std::vector<FileResult>& files)
+    {
+        std::ofstream out(path);
+        out << std::fixed << std::setprecision(3);
+        out << "{\n  \"runs\": " << runs << ",\n  \"groups\": [";
+        for (size_t i = 0; i < groups.size(); i++)
+        {
+            const GroupResult& group = groups[i];
+            double seconds = group.ms / 1000.0;
+            out << (i ? "," : "") << "\n    { \"format\": \"" << group.format << "\", \"kernel\": \"" << group.kernel
+                << "\", \"files\": " << group.files << ", \"bytes\": " << group.bytes << ", \"pixels\": " << group.pixels
+                << ", \"ms\": " << group.ms
+                << ", \"mb_per_s\": " << (seconds > 0.0 ? group.bytes / 1e6 / seconds : 0.0)
+                << ", \"mp_per_s\": " << (seconds > 0.0 ? group.pixels / 1e6 / seconds : 0.0)
+                << ", \"allocations_per_decode\": " << (double)group.allocations / group.files
+                << ", \"peak_heap_bytes\": " << group.peakHeap << ", \"peak_rss_bytes\": " << group.peakRss << " }";
+        }
+        out << "\n  ],\n  \"files\": [";
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            const FileResult& file = files[i];
+            out << (i ? "," : "") << "\n    { \"path\": \"" << jsonEscape(file.path) << "\", \"format\": \"" << file.format
+                << "\", \"kernel\": \"" << file.kernel << "\", \"bytes\": " << file.bytes << ", \"width\": " << file.width
+                << ", \"height\": " << file.height << ", \"ms\": " << file.ms << ", \"allocations\": " << file.allocations
+                << ", \"peak_heap_bytes\": " << file.peakHeap << " }";
+        }
+        out << "\n  ]\n}\n";
+        return (bool)out;
+    }
+
+    static std::string jsonEscape(const std::string& text)
+    {
+        std::string escaped;
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\') escaped += '\\';
+            if ((unsigned char)c < 0x20)
+            {
+                static const char hex[] = "0123456789abcdef";
+                escaped += "\\u00";
+                escaped += hex[(unsigned char)c >> 4];
+                escaped += hex[c & 15];
+                continue;
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    // Best time in milliseconds to load png with bits per channel (8, 16 or 32 for float) and desired channels
+    static double time(const std::vector<unsigned char>& png, int bits, int desired, int runs)
+    {
+        double best = 1e30;
+        for (int run = 0; run < runs; run++)
+        {
+            int width, height, channels;
+            auto start = std::chrono::steady_clock::now();
+            void* pixels;
+            if (bits == 8) pixels = stbi_load_from_memory(png.data(), (int)png.size(), &width, &height, &channels, desired);
+            else if (bits == 16) pixels = stbi_load_16_from_memory(png.data(), (int)png.size(), &width, &height, &channels, desired);
+            else pixels = stbi_loadf_from_memory(png.data(), (int)png.size(), &width, &height, &channels, desired);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (pixels == NULL)
+            {
+                std::cout << "ERROR::IMAGE_BENCHMARK::FAILED_TO_LOAD (" << stbi_failure_reason() << ")" << std::endl;
+                return 0.0;
+            }
+            stbi_image_free(pixels);
+            if (ms < best) best = ms;
+        }
+        return best;
+    }
+
+    static void report(const std::string& name, double base, double converted, double megapixels)
+    {
+        double convert = converted > base ? converted - base : 0.0;
+        std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(2)
+            << "load " << std::setw(8) << converted << " ms   convert " << std::setw(8) << convert << " ms";
+        if (convert > 0.0) std::cout << std::setw(10) << std::setprecision(0) << megapixels / convert * 1000.0 << " MP/s";
+        std::cout << std::endl;
+    }
+
+    // An 8 or 16 bit grey, grey alpha, RGB or RGBA PNG of noise, stored without compression
+    static std::vector<unsigned char> makePng(int width, int height, int channels, int bits)
+    {
+        static const unsigned char colourTypes[4] = { 0, 4, 2, 6 };
+        size_t rowSize = (size_t)width * channels * bits / 8 + 1;
+        std::vector<unsigned char> raw(rowSize * height);
+        unsigned int state = 0x12345678u;
+        for (size_t i = 0; i < raw.size(); i++)
+        {
+            // xorshift, every row starts with filter type 0 (none)
+            state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+            raw[i] = i % rowSize == 0 ? 0 : (unsigned char)state;
+        }
+
+        // zlib stream of stored deflate blocks
+        std::vector<unsigned char> zlib = { 0x78, 0x01 };
+        for (size_t offset = 0; offset < raw.size(); offset += 65535)
+        {
+            size_t length = raw.size() - offset < 65535 ? raw.size() - offset : 65535;
+            zlib.push_back(offset + length == raw.size() ? 1 : 0);
+            zlib.push_back((unsigned char)length); zlib.push_back((unsigned char)(length >> 8));
+            zlib.push_back((unsigned char)~length); zlib.push_back((unsigned char)(~length >> 8));
+            zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+        }
+        unsigned int a = 1, b = 0;
+        for (unsigned char byte : raw)
+        {
+            a = (a + byte) % 65521;
+            b = (b + a) % 65521;
+        }
+        putBigEndian(zlib, (b << 16) | a);
+
+        std::vector<unsigned char> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        std::vector<unsigned char> header;
+        putBigEndian(header, width);
+        putBigEndian(header, height);
+        header.insert(header.end(), { (unsigned char)bits, colourTypes[channels - 1], 0, 0, 0 });
+        putChunk(png, "IHDR", header);
+        putChunk(png, "IDAT", zlib);
+        putChunk(png, "IEND", {});
+        return png;
+    }
+
+    static void putBigEndian(std::vector<unsigned char>& out, unsigned int value)
+    {
+        out.insert(out.end(), { (unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value });
+    }
+
+    static void putChunk(std::vector<unsigned char>& png, const char* type, const std::vector<unsigned char>& data)
+    {
+        putBigEndian(png, (unsigned int)data.size());
+        size_t start = png.size();
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data.begin(), data.end());
+        unsigned int crc = 0xffffffffu;
+        for (size_t i = start; i < png.size(); i++)
+        {
+            crc ^= png[i];
+            for (int k = 0; k < 8; k++)
+                crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+        }
+        putBigEndian(png, ~crc);
+    }
+};
+#endif
@@ -0,0 +1,230 @@
+#ifndef MESH_BUFFER_H
+#define MESH_BUFFER_H
+
+#include <glad/glad.h>
+#include <OffsetAllocator.h>
+#include <VertexLayout.h>
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+// Packs many meshes into one big vertex buffer and one big index buffer
+// Each mesh is placed at an offset found by an OffsetAllocator and drawn with glDrawElementsBaseVertex,
+// so drawing a different mesh only changes the draw call arguments instead of rebinding buffers
+// The VAO comes from a VertexArrayCache, so every MeshBuffer with the same vertex layout shares it
+class MeshBuffer {
+public:
+    unsigned int VBO, EBO;
+
+    // Where a mesh currently lives inside the shared buffers (in vertices and indices, not bytes)
+    struct Mesh {
+        unsigned int baseVertex;
+        unsigned int vertexCount;
+        unsigned int firstIndex;
+        unsigned int indexCount;
+        bool alive;
+        OffsetAllocator::Allocation vertexAllocation;
+        OffsetAllocator::Allocation indexAllocation;
+    };
+
+    // layout = format of the vertices (all attributes read from binding 0), capacities are the number of vertices and indices the buffers start with
+    MeshBuffer(VertexArrayCache& vertexArrays, const VertexLayout& layout, unsigned int vertexCapacity, unsigned int indexCapacity)
+        : vertexArrays(vertexArrays), layout(layout), vertexStride(layout.stride(0)), vertexAllocator(vertexCapacity), indexAllocator(indexCapacity)
+    {
+        glBindVertexArray(0); // creating the EBO must not change whichever VAO is currently bound
+        VBO = createBuffer(GL_ARRAY_BUFFER, (GLsizeiptr)vertexCapacity * vertexStride);
+        EBO = createBuffer(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)indexCapacity * sizeof(unsigned int));
+    }
+
+    MeshBuffer(const MeshBuffer&) = delete;
+    MeshBuffer& operator=(const MeshBuffer&) = delete;
+
+    // Copies the mesh into the shared buffers and returns a handle for drawing it
+    // The handle stays valid when the buffers are defragmented or grown, only the offsets inside it change
+    unsigned int addMesh(const void* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount)
+    {
+        if (vertexCount == 0 || indexCount == 0)
+            return NO_MESH;
+
+        OffsetAllocator::Allocation vertexAllocation = vertexAllocator.allocate(vertexCount);
+        OffsetAllocator::Allocation indexAllocation = indexAllocator.allocate(indexCount);
+
+        // Out of space (or too fragmented), compact everything into bigger buffers and try again
+        if (vertexAllocation.offset == OffsetAllocator::NO_SPACE || indexAllocation.offset == OffsetAllocator::NO_SPACE)
+        {
+            vertexAllocator.free(vertexAllocation);
+            indexAllocator.free(indexAllocation);
+            unsigned int vertexCapacity = std::max(vertexAllocator.capacity() * 2, vertexAllocator.capacity() + vertexCount);
+            unsigned int indexCapacity = std::max(indexAllocator.capacity() * 2, indexAllocator.capacity() + indexCount);
+            reallocate(vertexCapacity, indexCapacity);
+
+            vertexAllocation = vertexAllocator.allocate(vertexCount);
+            indexAllocation = indexAllocator.allocate(indexCount);
+            if (vertexAllocation.offset == OffsetAllocator::NO_SPACE || indexAllocation.offset == OffsetAllocator::NO_SPACE)
+            {
+                std::cout << "ERROR::MESH_BUFFER::OUT_OF_SPACE" << std::endl;
+                vertexAllocator.free(vertexAllocation);
+                indexAllocator.free(indexAllocation);
+                return NO_MESH;
+            }
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)vertexAllocation.offset * vertexStride, (GLsizeiptr)vertexCount * vertexStride, vertices);
+        // Binding the EBO while a VAO is bound would change that VAO, so unbind first
+        glBindVertexArray(0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, (GLintptr)indexAllocation.offset * sizeof(unsigned int), (GLsizeiptr)indexCount * sizeof(unsigned int), indices);
+
+        Mesh mesh = { vertexAllocation.offset, vertexCount, indexAllocation.offset, indexCount, true, vertexAllocation, indexAllocation };
+        unsigned int handle;
+        if (!freeHandles.empty())
+        {
+            handle = freeHandles.back();
+            freeHandles.pop_back();
+            meshes[handle] = mesh;
+        }
+        else
+        {
+            handle = (unsigned int)meshes.size();
+            meshes.push_back(mesh);
+        }
+        return handle;
+    }
+
+    // Gives the mesh's space back to the allocators (the data stays in the buffer until it gets overwritten)
+    void removeMesh(unsigned int handle)
+    {
+        if (!isAlive(handle))
+            return;
+        vertexAllocator.free(meshes[handle].vertexAllocation);
+        indexAllocator.free(meshes[handle].indexAllocation);
+        meshes[handle].alive = false;
+        freeHandles.push_back(handle);
+    }
+
+    // handle must be a live mesh (not NO_MESH or a removed one)
+    const Mesh& getMesh(unsigned int handle) const
+    {
+        assert(isAlive(handle));
+        return meshes[handle];
+    }
+
+    bool isAlive(unsigned int handle) const
+    {
+        return handle < meshes.size() && meshes[handle].alive;
+    }
+
+    // Bind once, then draw any number of meshes from this buffer
+    // Binds the shared VAO for the layout and points it at this buffer's VBO/EBO (nothing is respecified if it already is)
+    void bind() const
+    {
+        vertexArrays.setVertexBuffer(layout, 0, VBO);
+        vertexArrays.setIndexBuffer(layout, EBO);
+    }
+
+    // Does nothing for NO_MESH or a removed handle, its range may already belong to another mesh
+    void draw(unsigned int handle, GLenum mode = GL_TRIANGLES) const
+    {
+        if (!isAlive(handle))
+            return;
+        const Mesh& mesh = meshes[handle];
+        // indices are relative to the mesh, baseVertex is added to each of them on the GPU
+        glDrawElementsBaseVertex(mode, mesh.indexCount, GL_UNSIGNED_INT, (void*)((size_t)mesh.firstIndex * sizeof(unsigned int)), mesh.baseVertex);
+    }
+
+    // Moves every live mesh to the front of the buffers (GPU side copy with glCopyBufferSubData) so the free space is one block again
+    void defragment()
+    {
+        reallocate(vertexAllocator.capacity(), indexAllocator.capacity());
+    }
+
+    // Free space that is left in each buffer (in vertices/indices)
+    unsigned int freeVertices() const { return vertexAllocator.totalFree(); }
+    unsigned int freeIndices() const { return indexAllocator.totalFree(); }
+
+    // Deletes the buffers (the VAO belongs to the VertexArrayCache), call this before the context gets destroyed
+    void release()
+    {
+        deleteBuffer(VBO);
+        deleteBuffer(EBO);
+        VBO = EBO = 0;
+    }
+
+    static const unsigned int NO_MESH = 0xffffffff;
+
+private:
+    VertexArrayCache& vertexArrays;
+    VertexLayout layout;
+    unsigned int vertexStride;
+    OffsetAllocator vertexAllocator;
+    OffsetAllocator indexAllocator;
+    std::vector<Mesh> meshes;
+    std::vector<unsigned int> freeHandles;
+
+    static unsigned int createBuffer(GLenum target, GLsizeiptr size)
+    {
+        unsigned int buffer;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(target, buffer);
+        glBufferData(target, size, NULL, GL_STATIC_DRAW); // allocate the storage only, meshes are copied in with glBufferSubData
+        return buffer;
+    }
+
+    void deleteBuffer(unsigned int buffer)
+    {
+        vertexArrays.forgetBuffer(buffer);
+        glDeleteBuffers(1, &buffer);
+    }
+
+    // Copies the live meshes tightly packed into new buffers of the given capacity and rebuilds the allocators
+    void reallocate(unsigned int vertexCapacity, unsigned int indexCapacity)
+    {
+        // Copy in offset order so meshes keep their relative placement
+        std::vector<unsigned int> order;
+        for (unsigned int i = 0; i < meshes.size(); i++)
+            if (meshes[i].alive)
+                order.push_back(i);
+        std::sort(order.begin(), order.end(), [this](unsigned int a, unsigned int b) { return meshes[a].baseVertex < meshes[b].baseVertex; });
+
+        glBindVertexArray(0);
+        unsigned int newVBO = createBuffer(GL_ARRAY_BUFFER, (GLsizeiptr)vertexCapacity * vertexStride);
+        unsigned int newEBO = createBuffer(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)indexCapacity * sizeof(unsigned int));
+
+        OffsetAllocator newVertexAllocator(vertexCapacity);
+        OffsetAllocator newIndexAllocator(indexCapacity);
+
+        // GL_COPY_READ_BUFFER/GL_COPY_WRITE_BUFFER exist so copies do not disturb the other binding points
+        glBindBuffer(GL_COPY_READ_BUFFER, VBO);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, newVBO);
+        for (unsigned int handle : order)
+        {
+            Mesh& mesh = meshes[handle];
+            mesh.vertexAllocation = newVertexAllocator.allocate(mesh.vertexCount);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)mesh.baseVertex * vertexStride,
+                (GLintptr)mesh.vertexAllocation.offset * vertexStride, (GLsizeiptr)mesh.vertexCount * vertexStride);
+            mesh.baseVertex = mesh.vertexAllocation.offset;
+        }
+
+        glBindBuffer(GL_COPY_READ_BUFFER, EBO);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, newEBO);
+        for (unsigned int handle : order)
+        {
+            Mesh& mesh = meshes[handle];
+            mesh.indexAllocation = newIndexAllocator.allocate(mesh.indexCount);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)mesh.firstIndex * sizeof(unsigned int),
+                (GLintptr)mesh.indexAllocation.offset * sizeof(unsigned int), (GLsizeiptr)mesh.indexCount * sizeof(unsigned int));
+            mesh.firstIndex = mesh.indexAllocation.offset;
+        }
+
+        deleteBuffer(VBO);
+        deleteBuffer(EBO);
+        VBO = newVBO;
+        EBO = newEBO;
+        vertexAllocator = newVertexAllocator;
+        indexAllocator = newIndexAllocator;
+    }
+};
+#endif
@@ -0,0 +1,294 @@
+#ifndef OFFSET_ALLOCATOR_H
+#define OFFSET_ALLOCATOR_H
+
+#include <vector>
+
+// TLSF (two level segregated fit) style allocator that hands out offsets into a range [0, size)
+// It never touches memory itself, the offsets are used to place data inside large GPU buffers
+// Free blocks are sorted into 256 bins, each power of two is split into 8 linear steps (like a tiny float: 5 bit exponent, 3 bit mantissa)
+// so finding a big enough free block is two bitmap lookups instead of walking a free list
+class OffsetAllocator {
+public:
+    static const unsigned int NO_SPACE = 0xffffffff;
+
+    // offset = where the block starts, metadata = internal node index (needed to free the block again)
+    struct Allocation {
+        unsigned int offset = NO_SPACE;
+        unsigned int metadata = NO_SPACE;
+    };
+
+    OffsetAllocator(unsigned int size)
+        : size(size)
+    {
+        reset();
+    }
+
+    // Drops every allocation and makes the whole range one free block again
+    void reset()
+    {
+        nodes.clear();
+        freeNodes.clear();
+        usedBinsTop = 0;
+        for (unsigned int i = 0; i < NUM_TOP_BINS; i++)
+            usedBins[i] = 0;
+        for (unsigned int i = 0; i < NUM_LEAF_BINS; i++)
+            binHeads[i] = NO_NODE;
+        freeStorage = 0;
+
+        if (size > 0)
+            insertFreeNode(0, size, NO_NODE, NO_NODE);
+    }
+
+    Allocation allocate(unsigned int allocSize)
+    {
+        Allocation allocation;
+        if (allocSize == 0)
+            return allocation;
+
+        // Round the size up to a bin so that every block in the found bin is guaranteed to be large enough
+        unsigned int minBin = binRoundUp(allocSize);
+        unsigned int bin = findFreeBin(minBin);
+        if (bin == NO_NODE)
+            return allocation;
+
+        unsigned int nodeIndex = binHeads[bin];
+        removeFromBin(nodeIndex);
+
+        Node& node = nodes[nodeIndex];
+        unsigned int remainder = node.size - allocSize;
+        freeStorage -= node.size;
+        node.size = allocSize;
+        node.used = true;
+
+        // Put the unused tail of the block back as a new free block right after this one
+        if (remainder > 0)
+        {
+            unsigned int next = nodes[nodeIndex].neighborNext;
+            unsigned int newIndex = insertFreeNode(nodes[nodeIndex].offset + allocSize, remainder, nodeIndex, next);
+            if (next != NO_NODE)
+                nodes[next].neighborPrev = newIndex;
+            nodes[nodeIndex].neighborNext = newIndex;
+        }
+
+        allocation.offset = nodes[nodeIndex].offset;
+        allocation.metadata = nodeIndex;
+        return allocation;
+    }
+
+    void free(Allocation allocation)
+    {
+        if (allocation.metadata == NO_SPACE || allocation.metadata >= nodes.size())
+            return;
+
+        unsigned int nodeIndex = allocation.metadata;
+        Node& node = nodes[nodeIndex];
+        if (!node.used)
+            return;
+
+        unsigned int offset = node.offset;
+        unsigned int blockSize = node.size;
+        unsigned int prev = node.neighborPrev;
+        unsigned int next = node.neighborNext;
+        freeStorage += blockSize;
+
+        // Merge with the free neighbours so the range does not stay fragmented
+        if (prev != NO_NODE && !nodes[prev].used)
+        {
+            offset = nodes[prev].offset;
+            blockSize += nodes[prev].size;
+            unsigned int prevPrev = nodes[prev].neighborPrev;
+            removeFromBin(prev);
+            releaseNode(prev);
+            prev = prevPrev;
+        }
+        if (next != NO_NODE && !nodes[next].used)
+        {
+            blockSize += nodes[next].size;
+            unsigned int nextNext = nodes[next].neighborNext;
+            removeFromBin(next);
+            releaseNode(next);
+            next = nextNext;
+        }
+        releaseNode(nodeIndex);
+
+        // insertFreeNode counts the size as free again, so take it back out here first
+        freeStorage -= blockSize;
+        unsigned int merged = insertFreeNode(offset, blockSize, prev, next);
+        if (prev != NO_NODE)
+            nodes[prev].neighborNext = merged;
+        if (next != NO_NODE)
+            nodes[next].neighborPrev = merged;
+    }
+
+    unsigned int capacity() const { return size; }
+    unsigned int totalFree() const { return freeStorage; }
+
+    // Size of the biggest free block
+    unsigned int largestFree() const
+    {
+        if (usedBinsTop == 0)
+            return 0;
+        unsigned int top = highestBit(usedBinsTop);
+        unsigned int leaf = highestBit(usedBins[top]);
+        unsigned int bin = (top << LEAF_BITS) | leaf;
+        unsigned int largest = 0;
+        for (unsigned int i = binHeads[bin]; i != NO_NODE; i = nodes[i].binListNext)
+            if (nodes[i].size > largest)
+                largest = nodes[i].size;
+        return largest;
+    }
+
+private:
+    static const unsigned int NO_NODE = 0xffffffff;
+    static const unsigned int LEAF_BITS = 3;
+    static const unsigned int NUM_TOP_BINS = 32;
+    static const unsigned int BINS_PER_LEAF = 1 << LEAF_BITS;
+    static const unsigned int NUM_LEAF_BINS = NUM_TOP_BINS * BINS_PER_LEAF;
+
+    struct Node {
+        unsigned int offset = 0;
+        unsigned int size = 0;
+        unsigned int binListPrev = NO_NODE; // free blocks in the same bin
+        unsigned int binListNext = NO_NODE;
+        unsigned int neighborPrev = NO_NODE; // blocks next to this one in the range (used or free)
+        unsigned int neighborNext = NO_NODE;
+        bool used = false;
+    };
+
+    unsigned int size;
+    unsigned int freeStorage = 0;
+    unsigned int usedBinsTop = 0; // bit per top bin that has any free block
+    unsigned char usedBins[NUM_TOP_BINS] = {}; // bit per leaf bin that has a free block
+    unsigned int binHeads[NUM_LEAF_BINS];
+    std::vector<Node> nodes;
+    std::vector<unsigned int> freeNodes; // recycled node slots
+
+    static unsigned int highestBit(unsigned int v)
+    {
+        unsigned int bit = 0;
+        while (v >>= 1)
+            bit++;
+        return bit;
+    }
+
+    static unsigned int lowestBitAfter(unsigned int mask, unsigned int startBit)
+    {
+        unsigned int masked = mask & ~((1u << startBit) - 1);
+        if (masked == 0)
+            return NO_NODE;
+        unsigned int bit = 0;
+        while (!(masked & (1u << bit)))
+            bit++;
+        return bit;
+    }
+
+    // Bin that a block of this size is stored in (the bin's size is <= the block size)
+    static unsigned int binRoundDown(unsigned int value)
+    {
+        if (value < BINS_PER_LEAF)
+            return value;
+        unsigned int high = highestBit(value);
+        unsigned int shift = high - LEAF_BITS;
+        unsigned int mantissa = (value >> shift) & (BINS_PER_LEAF - 1);
+        return ((shift + 1) << LEAF_BITS) | mantissa;
+    }
+
+    // Smallest bin where every block is at least this size
+    static unsigned int binRoundUp(unsigned int value)
+    {
+        unsigned int bin = binRoundDown(value);
+        if (value >= BINS_PER_LEAF)
+        {
+            unsigned int shift = highestBit(value) - LEAF_BITS;
+            if (value & ((1u << shift) - 1))
+                bin++;
+        }
+        return bin;
+    }
+
+    unsigned int findFreeBin(unsigned int minBin) const
+    {
+        unsigned int top = minBin >> LEAF_BITS;
+        if (top >= NUM_TOP_BINS)
+            return NO_NODE;
+
+        // First try the leaf bins of the same top bin, then the next used top bin
+        unsigned int leaf = lowestBitAfter(usedBins[top], minBin & (BINS_PER_LEAF - 1));
+        if (leaf == NO_NODE)
+        {
+            if (top + 1 >= NUM_TOP_BINS)
+                return NO_NODE;
+            top = lowestBitAfter(usedBinsTop, top + 1);
+            if (top == NO_NODE)
+                return NO_NODE;
+            leaf = lowestBitAfter(usedBins[top], 0);
+        }
+        return (top << LEAF_BITS) | leaf;
+    }
+
+    unsigned int newNode()
+    {
+        if (!freeNodes.empty())
+        {
+            unsigned int index = freeNodes.back();
+            freeNodes.pop_back();
+            nodes[index] = Node();
+            return index;
+        }
+        nodes.push_back(Node());
+        return (unsigned int)nodes.size() - 1;
+    }
+
+    void releaseNode(unsigned int index)
+    {
+        nodes[index].used = false;
+        nodes[index].size = 0;
+        freeNodes.push_back(index);
+    }
+
+    unsigned int insertFreeNode(unsigned int offset, unsigned int blockSize, unsigned int neighborPrev, unsigned int neighborNext)
+    {
+        unsigned int bin = binRoundDown(blockSize);
+        unsigned int index = newNode();
+        Node& node = nodes[index];
+        node.offset = offset;
+        node.size = blockSize;
+        node.neighborPrev = neighborPrev;
+        node.neighborNext = neighborNext;
+        node.binListNext = binHeads[bin];
+        if (binHeads[bin] != NO_NODE)
+            nodes[binHeads[bin]].binListPrev = index;
+        binHeads[bin] = index;
+
+        usedBinsTop |= 1u << (bin >> LEAF_BITS);
+        usedBins[bin >> LEAF_BITS] |= (unsigned char)(1u << (bin & (BINS_PER_LEAF - 1)));
+        freeStorage += blockSize;
+        return index;
+    }
+
+    void removeFromBin(unsigned int index)
+    {
+        Node& node = nodes[index];
+        if (node.binListPrev != NO_NODE)
+        {
+            nodes[node.binListPrev].binListNext = node.binListNext;
+        }
+        else
+        {
+            unsigned int bin = binRoundDown(node.size);
+            binHeads[bin] = node.binListNext;
+            if (binHeads[bin] == NO_NODE)
+            {
+                unsigned int top = bin >> LEAF_BITS;
+                usedBins[top] &= (unsigned char)~(1u << (bin & (BINS_PER_LEAF - 1)));
+                if (usedBins[top] == 0)
+                    usedBinsTop &= ~(1u << top);
+            }
+        }
+        if (node.binListNext != NO_NODE)
+            nodes[node.binListNext].binListPrev = node.binListPrev;
+        node.binListPrev = NO_NODE;
+        node.binListNext = NO_NODE;
+    }
+};
+#endif
@@ -0,0 +1,304 @@
+#ifndef TEXTURE_COOKER_H
+#define TEXTURE_COOKER_H
+
+#include <glad/glad.h>
+#include <stb_image.h>
+#include <BlockCompression.h>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+// One mip level inside CompressedTexture::data
+struct CompressedLevel {
+    int width, height;
+    size_t offset, size;
+};
+
+// A block compressed texture with its mip chain, as stored in a .dds file
+struct CompressedTexture {
+    BlockFormat format = BlockFormat::BC1;
+    int width = 0, height = 0;
+    std::vector<CompressedLevel> levels;
+    std::vector<unsigned char> data;
+};
+
+// Converts images into block compressed .dds files ahead of time (compressing is far too slow to do while loading)
+// and reads those files back for TextureLoader
+// The whole mip chain is generated and compressed here because glGenerateMipmap cannot write compressed textures
+class TextureCooker {
+public:
+    // Loads an image, builds its mip chain and writes it compressed to destination
+    // flip is applied here, the cooked file is already in OpenGL's bottom to top row order
+    static bool cook(const std::string& source, const std::string& destination, BlockFormat format,
+        CompressionQuality quality = CompressionQuality::Normal, bool flip = false, unsigned int threadCount = 0)
+    {
+        stbi_options options = {};
+        options.flip_vertically = flip;
+        options.desired_channels = 4;
+        int width, height, channels;
+        unsigned char* pixels = (unsigned char*)stbi_load_ex(&options, source.c_str(), &width, &height, &channels);
+        if (pixels == NULL)
+        {
+            std::cout << "ERROR::TEXTURE_COOKER::FAILED_TO_LOAD " << source << " (" << stbi_failure_reason() << ")" << std::endl;
+            return false;
+        }
+
+        CompressedTexture texture;
+        texture.format = format;
+        texture.width = width;
+        texture.height = height;
+
+        BlockCompressor compressor(format, quality);
+        std::vector<unsigned char> level(pixels, pixels + (size_t)width * height * 4);
+        stbi_image_free(pixels);
+        for (;;)
+        {
+            std::vector<unsigned char> blocks = compressor.compress(level.data(), width, height, threadCount);
+            texture.levels.push_back(CompressedLevel{ width, height, texture.data.size(), blocks.size() });
+            texture.data.insert(texture.data.end(), blocks.begin(), blocks.end());
+            if (width == 1 && height == 1)
+                break;
+            level = downsample(level, width, height);
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+        }
+
+        if (!writeDDS(destination, texture))
+        {
+            std::cout << "ERROR::TEXTURE_COOKER::FAILED_TO_WRITE " << destination << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // OpenGL_Project.exe --cook <image> <output.dds> [bc1|bc3|bc7] [fast|normal|high] [flip]
+    static int runCommandLine(int argc, char* argv[])
+    {
+        if (argc < 4)
+        {
+            std::cout << "usage: --cook <image> <output.dds> [bc1|bc3|bc7] [fast|normal|high] [flip]" << std::endl;
+            return 1;
+        }
+        BlockFormat format = BlockFormat::BC7;
+        CompressionQuality quality = CompressionQuality::Normal;
+        bool flip = false;
+        for (int i = 4; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "bc1") format = BlockFormat::BC1;
+            else if (arg == "bc3") format = BlockFormat::BC3;
+            else if (arg == "bc7") format = BlockFormat::BC7;
+            else if (arg == "fast") quality = CompressionQuality::Fast;
+            else if (arg == "normal") quality = CompressionQuality::Normal;
+            else if (arg == "high") quality = CompressionQuality::High;
+            else if (arg == "flip") flip = true;
+            else
+            {
+                std::cout << "unknown option " << arg << std::endl;
+                return 1;
+            }
+        }
+        return cook(argv[2], argv[3], format, quality, flip) ? 0 : 1;
+    }
+
+    // The cooked .dds next to the source image if there is one the GPU can sample, the source image otherwise
+    // Needs a current GL context for the extension check
+    static std::string cookedPath(const std::string& source)
+    {
+        size_t dot = source.find_last_of('.');
+        std::string cooked = source.substr(0, dot) + ".dds";
+
+        std::ifstream file(cooked, std::ios::binary);
+        unsigned char header[DDS_HEADER_SIZE + DX10_HEADER_SIZE] = {};
+        if (!file.read((char*)header, DDS_HEADER_SIZE))
+            return source;
+        file.read((char*)header + DDS_HEADER_SIZE, DX10_HEADER_SIZE);
+        BlockFormat format;
+        if (!parseFormat(header, format) || !isSupported(format))
+            return source;
+        return cooked;
+    }
+
+    static bool isSupported(BlockFormat format)
+    {
+        if (format == BlockFormat::BC7)
+            return GLAD_GL_ARB_texture_compression_bptc || GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 2);
+        return GLAD_GL_EXT_texture_compression_s3tc != 0;
+    }
+
+    static GLenum glFormat(BlockFormat format)
+    {
+        switch (format)
+        {
+        case BlockFormat::BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BlockFormat::BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        default: return GL_COMPRESSED_RGBA_BPTC_UNORM_ARB;
+        }
+    }
+
+    static bool isDDS(const std::string& path)
+    {
+        return path.size() >= 4 && (path.compare(path.size() - 4, 4, ".dds") == 0 || path.compare(path.size() - 4, 4, ".DDS") == 0);
+    }
+
+    // Reads a .dds written by cook() (DXT1, DXT5 or DX10 BC1/BC3/BC7), error is set when it returns false
+    static bool readDDS(const std::string& path, CompressedTexture& texture, const char*& error)
+    {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+        {
+            error = "can't fopen";
+            return false;
+        }
+        size_t fileSize = (size_t)file.tellg();
+        file.seekg(0);
+        std::vector<unsigned char> contents(fileSize);
+        if (fileSize < DDS_HEADER_SIZE || !file.read((char*)contents.data(), fileSize))
+        {
+            error = "truncated dds";
+            return false;
+        }
+
+        bool dx10 = memcmp(contents.data() + 84, "DX10", 4) == 0;
+        if (dx10 && fileSize < DDS_HEADER_SIZE + DX10_HEADER_SIZE)
+        {
+            error = "truncated dds";
+            return false;
+        }
+        if (!parseFormat(contents.data(), texture.format))
+        {
+            error = "unsupported dds format";
+            return false;
+        }
+        texture.height = (int)read32(contents.data() + 12);
+        texture.width = (int)read32(contents.data() + 16);
+        if (texture.width <= 0 || texture.height <= 0)
+        {
+            error = "bad dds size";
+            return false;
+        }
+        unsigned int levelCount = read32(contents.data() + 28);
+        if (levelCount == 0)
+            levelCount = 1;
+        size_t offset = DDS_HEADER_SIZE + (dx10 ? DX10_HEADER_SIZE : 0);
+
+        texture.levels.clear();
+        int width = texture.width, height = texture.height;
+        size_t dataStart = offset;
+        for (unsigned int i = 0; i < levelCount; i++)
+        {
+            size_t size = compressedSize(width, height, texture.format);
+            if (offset + size > fileSize)
+            {
+                error = "truncated dds";
+                return false;
+            }
+            texture.levels.push_back(CompressedLevel{ width, height, offset - dataStart, size });
+            offset += size;
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+        }
+        texture.data.assign(contents.begin() + dataStart, contents.begin() + offset);
+        return true;
+    }
+
+    static bool writeDDS(const std::string& path, const CompressedTexture& texture)
+    {
+        unsigned char header[DDS_HEADER_SIZE + DX10_HEADER_SIZE] = {};
+        bool dx10 = texture.format == BlockFormat::BC7;
+        memcpy(header, "DDS ", 4);
+        write32(header + 4, 124);                                // header size
+        write32(header + 8, 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000); // caps, height, width, pixel format, mip count, linear size
+        write32(header + 12, texture.height);
+        write32(header + 16, texture.width);
+        write32(header + 20, (unsigned int)(texture.levels.empty() ? 0 : texture.levels[0].size));
+        write32(header + 28, (unsigned int)texture.levels.size());
+        write32(header + 76, 32);                                // pixel format size
+        write32(header + 80, 0x4);                               // DDPF_FOURCC
+        memcpy(header + 84, dx10 ? "DX10" : (texture.format == BlockFormat::BC1 ? "DXT1" : "DXT5"), 4);
+        write32(header + 108, 0x1000 | 0x8 | 0x400000);          // texture, complex, mipmap
+        if (dx10)
+        {
+            write32(header + 128, DXGI_FORMAT_BC7_UNORM);
+            write32(header + 132, 3);                            // 2D texture
+            write32(header + 140, 1);                            // array size
+        }
+
+        std::ofstream file(path, std::ios::binary);
+        file.write((const char*)header, DDS_HEADER_SIZE + (dx10 ? DX10_HEADER_SIZE : 0));
+        file.write((const char*)texture.data.data(), texture.data.size());
+        return (bool)file;
+    }
+
+    // Halves an RGBA8 image with a box filter, odd sizes reuse the last row/column
+    static std::vector<unsigned char> downsample(const std::vector<unsigned char>& pixels, int width, int height)
+    {
+        int newWidth = width > 1 ? width / 2 : 1;
+        int newHeight = height > 1 ? height / 2 : 1;
+        std::vector<unsigned char> result((size_t)newWidth * newHeight * 4);
+        for (int y = 0; y < newHeight; y++)
+        {
+            int y0 = y * 2, y1 = y * 2 + 1 < height ? y * 2 + 1 : height - 1;
+            for (int x = 0; x < newWidth; x++)
+            {
+                int x0 = x * 2, x1 = x * 2 + 1 < width ? x * 2 + 1 : width - 1;
+                for (int c = 0; c < 4; c++)
+                {
+                    int sum = pixels[((size_t)y0 * width + x0) * 4 + c] + pixels[((size_t)y0 * width + x1) * 4 + c]
+                        + pixels[((size_t)y1 * width + x0) * 4 + c] + pixels[((size_t)y1 * width + x1) * 4 + c];
+                    result[((size_t)y * newWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    static const size_t DDS_HEADER_SIZE = 128; // "DDS " + DDS_HEADER
+    static const size_t DX10_HEADER_SIZE = 20; // DDS_HEADER_DXT10
+    static const unsigned int DXGI_FORMAT_BC1_UNORM = 71;
+    static const unsigned int DXGI_FORMAT_BC3_UNORM = 77;
+    static const unsigned int DXGI_FORMAT_BC7_UNORM = 98;
+
+    static unsigned int read32(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    }
+
+    static void write32(unsigned char* p, unsigned int value)
+    {
+        for (int i = 0; i < 4; i++)
+            p[i] = (unsigned char)(value >> (i * 8));
+    }
+
+    // header = the first DDS_HEADER_SIZE + DX10_HEADER_SIZE bytes of the file
+    static bool parseFormat(const unsigned char* header, BlockFormat& format)
+    {
+        if (memcmp(header, "DDS ", 4) != 0 || read32(header + 4) != 124)
+            return false;
+        const unsigned char* fourCC = header + 84;
+        if (memcmp(fourCC, "DXT1", 4) == 0)
+            format = BlockFormat::BC1;
+        else if (memcmp(fourCC, "DXT5", 4) == 0)
+            format = BlockFormat::BC3;
+        else if (memcmp(fourCC, "DX10", 4) == 0)
+        {
+            unsigned int dxgiFormat = read32(header + 128);
+            if (dxgiFormat == DXGI_FORMAT_BC1_UNORM)
+                format = BlockFormat::BC1;
+            else if (dxgiFormat == DXGI_FORMAT_BC3_UNORM)
+                format = BlockFormat::BC3;
+            else if (dxgiFormat == DXGI_FORMAT_BC7_UNORM)
+                format = BlockFormat::BC7;
+            else
+                return false;
+        }
+        else
+            return false;
+        return true;
+    }
+};
+#endif
@@ -0,0 +1,1102 @@
+#ifndef TEXTURE_LOADER_H
+#define TEXTURE_LOADER_H
+
+#include <glad/glad.h>
+#include <stb_image.h>
+#include <TextureCooker.h>
+#include <HdrPacking.h>
+
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+
+// How the texture should be sampled once it is loaded
+struct TextureOptions {
+    GLint wrapS = GL_REPEAT;
+    GLint wrapT = GL_REPEAT;
+    GLint minFilter = GL_LINEAR_MIPMAP_LINEAR;
+    GLint magFilter = GL_LINEAR;
+    bool mipmaps = true;
+    bool flip = false; // flip on the y axis to match the OpenGL texture coordinates
+    GLenum hdrFormat = 0; // GL_RGB9_E5 or GL_RGB16F keeps the range of .hdr files, 0 converts them to 8 bits like the other formats
+    bool preview = true;  // progressive JPEGs: show a blurry 1/8 size version made from the first scan while the rest loads
+};
+
+// Loads textures without blocking the render loop and keeps track of how much video memory they use
+// Worker threads decode the image files with stb_image, then update() (called once per frame on the GL thread) copies the pixels into a
+// pixel unpack buffer (PBO) and uploads them with glTexSubImage2D a few rows at a time, never more than uploadBudget bytes per frame
+// The files are read a piece at a time and fed to a stbi_stream, so for baseline JPEGs and non-interlaced PNGs the first rows are
+// uploaded while the rest of the file is still being read and decoded (other formats are uploaded once they are fully decoded)
+// Until a texture is fully uploaded get() returns a 1x1 placeholder texture, so the first frame does not wait on any image
+// Progressive JPEGs can only be decoded once the whole file is in, but their first scan (the average colour of every 8x8 block) is
+// a small part of it, so as soon as it has been read get() returns a 1/8 size preview made from it instead of the placeholder
+// .dds files made by TextureCooker are uploaded as they are with glCompressedTexImage2D (one mip level at a time), their mip chain
+// and orientation come from the file so the mipmaps and flip options are ignored for them
+// .hdr files loaded with an hdrFormat are decoded to floats and packed on the worker into GL_RGB9_E5 (4 bytes per pixel) or
+// GL_RGB16F (6 bytes, 8 on the GPU) texels, GL_RGB9_E5 cannot be rendered to so it gets no mip levels and is never shrunk
+//
+// Loaded textures are shared: loading the same path with the same options again returns the same handle (and adds a reference),
+// and two different files that decode to the same pixels share one GL texture (found by a hash of the pixels, for images uploaded
+// while decoding the hash is only known at the end and the duplicate texture is deleted then)
+// When the textures take more than memoryBudget bytes, update() frees the least recently used ones: textures nobody holds a
+// reference to are deleted, textures still in use lose their largest mip level (half the resolution, a quarter of the memory)
+// The full resolution is loaded again once the texture is being drawn and there is room for it
+class TextureLoader {
+public:
+    unsigned int placeholder; // 1x1 texture bound while the real one is loading
+
+    // uploadBudget = max bytes copied to the GPU per update() call, workerCount = 0 picks one from the number of cores
+    TextureLoader(size_t uploadBudget = 4 * 1024 * 1024, unsigned int workerCount = 0)
+        : uploadBudget(uploadBudget)
+    {
+        unsigned char white[4] = { 255, 255, 255, 255 };
+        glGenTextures(1, &placeholder);
+        glBindTexture(GL_TEXTURE_2D, placeholder);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        if (workerCount == 0)
+        {
+            unsigned int cores = std::thread::hardware_concurrency();
+            workerCount = cores > 2 ? (cores - 1 < 4 ? cores - 1 : 4) : 1; // leave a core for the render thread
+        }
+        for (unsigned int i = 0; i < workerCount; i++)
+            workers.push_back(std::thread(&TextureLoader::workerLoop, this));
+    }
+
+    TextureLoader(const TextureLoader&) = delete;
+    TextureLoader& operator=(const TextureLoader&) = delete;
+
+    ~TextureLoader()
+    {
+        stopWorkers();
+    }
+
+    // Returns a handle for the file and adds a reference to it, the file is only queued for loading if it is not loaded already
+    unsigned int load(const std::string& path, const TextureOptions& options = TextureOptions())
+    {
+        std::string key = pathKey(path, options);
+        unsigned int handle;
+        auto found = byPath.find(key);
+        if (found != byPath.end())
+        {
+            handle = found->second;
+        }
+        else
+        {
+            handle = (unsigned int)textures.size();
+            Texture texture;
+            texture.path = path;
+            texture.options = options;
+            textures.push_back(texture);
+            byPath[key] = handle;
+        }
+
+        Texture& texture = textures[handle];
+        texture.refCount++;
+        if (texture.image != NO_IMAGE)
+            images[texture.image].lastUsed = frame;
+        else if (!texture.loading)
+            queueLoad(handle);
+        return handle;
+    }
+
+    // Drops a reference, a texture without references stays loaded until the memory is needed for something else
+    void unload(unsigned int handle)
+    {
+        if (handle < textures.size() && textures[handle].refCount > 0)
+            textures[handle].refCount--;
+    }
+
+    // Texture to bind for the handle (the preview or the placeholder until the image is resident)
+    // Call it every frame instead of keeping the ID: it marks the texture as used, and the ID changes when mip levels are dropped
+    unsigned int get(unsigned int handle)
+    {
+        if (!isResident(handle))
+            return handle < textures.size() && textures[handle].preview ? textures[handle].preview : placeholder;
+        Image& image = images[textures[handle].image];
+        image.lastUsed = frame;
+        return image.ID;
+    }
+
+    bool isResident(unsigned int handle) const
+    {
+        return handle < textures.size() && textures[handle].image != NO_IMAGE;
+    }
+
+    // Everything requested so far is resident (or failed to load)
+    bool idle()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return requests.empty() && decoded.empty() && busyWorkers == 0 && uploads.empty();
+    }
+
+    // Video memory the resident textures are allowed to use before update() starts freeing them
+    void setMemoryBudget(size_t bytes) { memoryBudget = bytes; }
+    size_t getMemoryBudget() const { return memoryBudget; }
+
+    // Estimated video memory used by all resident textures, including their mip levels
+    size_t residentBytes() const { return totalBytes; }
+
+    // Estimated video memory used by one texture (shared textures report the same memory for every handle)
+    size_t textureBytes(unsigned int handle) const
+    {
+        return isResident(handle) ? images[textures[handle].image].bytes : 0;
+    }
+
+    // How many mip levels have been dropped from the texture to stay in budget (0 = full resolution)
+    int droppedLevels(unsigned int handle) const
+    {
+        return isResident(handle) ? images[textures[handle].image].droppedLevels : 0;
+    }
+
+    // Call once per frame on the thread that owns the GL context
+    void update()
+    {
+        frame++;
+        std::vector<Preview> readyPreviews;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            readyPreviews.assign(previews.begin(), previews.end());
+            previews.clear();
+            while (!decoded.empty())
+            {
+                Upload upload = std::move(decoded.front());
+                decoded.pop_front();
+                if (upload.error == NULL && upload.compressed && !TextureCooker::isSupported(upload.blocks.format))
+                    upload.error = "block compression format not supported by this GPU";
+                if (upload.error == NULL && !upload.progress && shareExisting(upload))
+                    continue;
+                uploads.push_back(std::move(upload));
+            }
+            for (Upload& upload : uploads)
+                syncProgress(upload);
+        }
+        for (Preview& preview : readyPreviews)
+            uploadPreview(preview);
+
+        // every upload gets a turn, one that waits for its file to be read does not hold back the ones behind it
+        size_t budget = uploadBudget;
+        for (auto it = uploads.begin(); it != uploads.end() && budget > 0;)
+        {
+            Upload& upload = *it;
+            if (upload.error != NULL)
+            {
+                std::cout << "Failed to load texture: " << textures[upload.handle].path << " (" << upload.error << ")" << std::endl;
+                failUpload(upload);
+                it = uploads.erase(it);
+                continue;
+            }
+            if (upload.texture == 0)
+                beginUpload(upload);
+
+            if (upload.compressed)
+                budget -= uploadLevels(upload, budget);
+            else if (upload.nextRow < upload.rowsReady)
+                budget -= uploadRows(upload, budget);
+
+            if (upload.compressed ? upload.nextLevel >= (int)upload.blocks.levels.size() : upload.nextRow >= upload.height && !upload.decoding)
+            {
+                finishUpload(upload);
+                it = uploads.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        enforceBudget();
+        restoreOne();
+    }
+
+    // Deletes every texture and stops the workers, call this before the context gets destroyed
+    void release()
+    {
+        stopWorkers();
+        for (Upload& upload : uploads)
+        {
+            if (upload.pbo)
+                glDeleteBuffers(1, &upload.pbo);
+            if (upload.texture)
+                glDeleteTextures(1, &upload.texture);
+            freePixels(upload);
+        }
+        uploads.clear();
+        for (Upload& upload : decoded)
+            freePixels(upload);
+        decoded.clear();
+        for (Preview& preview : previews)
+            stbi_image_free(preview.pixels);
+        previews.clear();
+        for (Texture& texture : textures)
+            dropPreview(texture);
+        for (Image& image : images)
+            if (image.ID)
+                glDeleteTextures(1, &image.ID);
+        images.clear();
+        freeImages.clear();
+        textures.clear();
+        byPath.clear();
+        byContent.clear();
+        totalBytes = 0;
+        if (copyFramebuffer)
+            glDeleteFramebuffers(1, &copyFramebuffer);
+        copyFramebuffer = 0;
+        glDeleteTextures(1, &placeholder);
+        placeholder = 0;
+    }
+
+private:
+    static const unsigned int NO_IMAGE = 0xffffffff;
+
+    // What the user asked for, one per path + options
+    struct Texture {
+        std::string path;
+        TextureOptions options;
+        unsigned int refCount = 0;
+        unsigned int image = NO_IMAGE; // the GL texture it currently uses (shared with other handles that have the same pixels)
+        bool loading = false;          // a request for it is queued, decoding or uploading
+        unsigned int preview = 0;      // GL texture get() returns while it is loading, 0 if there is none
+    };
+
+    // One GL texture
+    struct Image {
+        unsigned int ID = 0;
+        unsigned long long contentKey = 0; // hash of the pixels and the sampling options
+        TextureOptions options;
+        int width = 0, height = 0, channels = 0; // size of the full resolution image
+        GLenum compressedFormat = 0;             // 0 for uncompressed textures
+        GLenum hdrFormat = 0;                    // GL_RGB9_E5 or GL_RGB16F for packed HDR textures
+        int fullLevels = 0;                      // mip levels at full resolution
+        int levels = 0;                          // mip levels the GL texture has right now
+        int droppedLevels = 0;                   // largest mip levels freed to stay in budget
+        size_t bytes = 0;
+        unsigned long long lastUsed = 0;         // frame the texture was last bound
+        bool restoring = false;                  // the full resolution image is being loaded again
+        bool restorable = true;                  // false once reloading the file failed
+    };
+
+    struct Request {
+        unsigned int handle;
+        std::string path;
+        bool flip;
+        GLenum hdrFormat;
+        bool preview;
+    };
+
+    // First scan of a progressive JPEG decoded at 1/8 size, see TextureOptions::preview
+    struct Preview {
+        unsigned int handle;
+        unsigned char* pixels;
+        int width, height, channels;
+    };
+
+    // How far the worker got with an image that is uploaded while it is being decoded, guarded by mutex
+    struct Progress {
+        int rows = 0;                       // rows decoded so far
+        bool finished = false;              // all rows are decoded and contentHash is set
+        const char* error = NULL;
+        unsigned long long contentHash = 0;
+        stbi_stream* stream = NULL;         // set when decoding failed, owns the pixels (update() may still be reading them)
+    };
+
+    // A decoded image on its way to the GPU
+    struct Upload {
+        unsigned int handle = 0;
+        unsigned char* pixels = NULL;
+        const char* error = NULL;
+        int width = 0, height = 0, channels = 0;
+        bool compressed = false;
+        CompressedTexture blocks; // the whole file when compressed, pixels is NULL then
+        GLenum hdrFormat = 0;     // GL_RGB9_E5 or GL_RGB16F when pixels holds packed HDR texels
+        unsigned long long contentHash = 0;
+        unsigned int texture = 0;
+        unsigned int pbo = 0;
+        int nextRow = 0;
+        int nextLevel = 0;
+        std::shared_ptr<Progress> progress; // NULL when the worker was done with the image before handing it over
+        int rowsReady = 0;                  // rows of pixels that can be uploaded, copied from progress by update()
+        bool decoding = false;
+        bool bottomUp = false;              // flipped: rows are decoded from the end of pixels towards its start
+    };
+
+    // Worker side of a stbi_stream, see streamImage()
+    struct StreamState {
+        TextureLoader* loader = NULL;
+        Upload* upload = NULL;
+        stbi_stream* stream = NULL;
+        std::shared_ptr<Progress> progress; // set once the upload has been handed over
+    };
+
+    static const size_t STREAM_CHUNK = 256 * 1024; // bytes read from the file per stbi_stream_feed
+
+    size_t uploadBudget;
+    size_t memoryBudget = 256 * 1024 * 1024;
+
+    // Only touched by the GL thread
+    std::vector<Texture> textures;
+    std::vector<Image> images;
+    std::vector<unsigned int> freeImages; // recycled image slots
+    std::unordered_map<std::string, unsigned int> byPath;              // path + options -> handle
+    std::unordered_map<unsigned long long, unsigned int> byContent;    // content key -> image
+    size_t totalBytes = 0;
+    unsigned long long frame = 0;
+    unsigned int copyFramebuffer = 0; // reads the old texture's mip levels when dropping one
+
+    // Shared with the workers
+    std::mutex mutex;
+    std::condition_variable wakeWorkers;
+    std::deque<Request> requests;
+    std::deque<Upload> decoded;
+    std::deque<Preview> previews;
+    unsigned int busyWorkers = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    std::deque<Upload> uploads; // decoded images being uploaded, oldest first
+
+    void workerLoop()
+    {
+        for (;;)
+        {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeWorkers.wait(lock, [this] { return stopping || !requests.empty(); });
+                if (stopping)
+                    return;
+                request = requests.front();
+                requests.pop_front();
+                busyWorkers++;
+            }
+
+            Upload upload;
+            upload.handle = request.handle;
+            bool handedOver = false;
+            if (TextureCooker::isDDS(request.path))
+            {
+                upload.compressed = true;
+                if (TextureCooker::readDDS(request.path, upload.blocks, upload.error))
+                {
+                    upload.width = upload.blocks.width;
+                    upload.height = upload.blocks.height;
+                    upload.channels = upload.blocks.format == BlockFormat::BC1 ? 3 : 4;
+                    upload.contentHash = hashBytes(upload, upload.blocks.data.data(), upload.blocks.data.size());
+                }
+            }
+            else if (request.hdrFormat != 0 && stbi_is_hdr(request.path.c_str()))
+                loadHdr(request, upload);
+            else
+                handedOver = streamImage(request, upload);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!handedOver)
+                decoded.push_back(std::move(upload));
+            busyWorkers--;
+        }
+    }
+
+    // Decodes the whole file to RGB floats and packs them in place, the texels are smaller than the floats they come from
+    static void loadHdr(const Request& request, Upload& upload)
+    {
+        stbi_options options = {};
+        options.flip_vertically = request.flip;
+        options.desired_channels = 3;
+        options.bits_per_channel = 32;
+        float* pixels = (float*)stbi_load_ex(&options, request.path.c_str(), &upload.width, &upload.height, &upload.channels);
+        if (pixels == NULL)
+        {
+            upload.error = stbi_failure_reason();
+            return;
+        }
+        size_t count = (size_t)upload.width * upload.height;
+        if (request.hdrFormat == GL_RGB9_E5)
+            packRGB9E5(pixels, (unsigned int*)pixels, count);
+        else
+            packHalfFloats(pixels, (unsigned short*)pixels, count * 3);
+        upload.channels = 3;
+        upload.hdrFormat = request.hdrFormat;
+        upload.pixels = (unsigned char*)pixels;
+        upload.contentHash = hashBytes(upload, upload.pixels, count * pixelBytes(upload.channels, upload.hdrFormat));
+    }
+
+    // Feeds the file to a stbi_stream a piece at a time, onRows() hands the upload to update() with the first decoded rows
+    // Returns true if that happened, the result then goes to the shared Progress instead of upload
+    bool streamImage(const Request& request, Upload& upload)
+    {
+        std::ifstream file(request.path, std::ios::binary);
+        if (!file)
+        {
+            upload.error = "can't fopen";
+            return false;
+        }
+        // the options are per call, the workers share no stb_image state
+        stbi_options options = {};
+        options.flip_vertically = request.flip;
+        // the workers already decode in parallel, more threads per JPEG would only oversubscribe the cores
+        options.jpeg_threads = 1;
+        upload.bottomUp = request.flip;
+        StreamState state;
+        state.loader = this;
+        state.upload = &upload;
+        state.stream = stbi_stream_begin(&options, onRows, &state);
+        if (state.stream == NULL)
+        {
+            upload.error = stbi_failure_reason();
+            return false;
+        }
+
+        std::vector<char> chunk(STREAM_CHUNK);
+        const char* error = NULL;
+        bool wantPreview = request.preview;
+        while (error == NULL && file)
+        {
+            file.read(chunk.data(), chunk.size());
+            if (file.bad())
+                error = "can't read";
+            else if (file.gcount() > 0 && !stbi_stream_feed(state.stream, chunk.data(), (int)file.gcount()))
+                error = stbi_failure_reason();
+            else if (wantPreview)
+                wantPreview = !makePreview(request, state.stream);
+        }
+        unsigned char* pixels = NULL;
+        if (error == NULL)
+        {
+            pixels = stbi_stream_end(state.stream, &upload.width, &upload.height, &upload.channels);
+            if (pixels == NULL)
+                error = stbi_failure_reason();
+        }
+        unsigned long long contentHash = pixels ? hashBytes(upload, pixels, (size_t)upload.width * upload.height * upload.channels) : 0;
+
+        if (!state.progress)
+        {
+            stbi_stream_free(state.stream);
+            upload.pixels = pixels;
+            upload.error = error;
+            upload.contentHash = contentHash;
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pixels)
+        {
+            state.progress->finished = true;
+            state.progress->contentHash = contentHash;
+            stbi_stream_free(state.stream);
+        }
+        else
+        {
+            state.progress->error = error;
+            state.progress->stream = state.stream;
+        }
+        return true;
+    }
+
+    // Returns false until the stream holds the first scan of a progressive JPEG (and for every other file), so the worker tries
+    // again after the next piece of the file, that costs little as stbi_stream_preview() only looks at the new input
+    bool makePreview(const Request& request, stbi_stream* stream)
+    {
+        Preview preview{ request.handle, NULL, 0, 0, 0 };
+        preview.pixels = stbi_stream_preview(stream, 1, 8, &preview.width, &preview.height, &preview.channels);
+        if (preview.pixels == NULL)
+            return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        previews.push_back(preview);
+        return true;
+    }
+
+    // Called by stbi_stream on the worker for every band of decoded rows
+    static void onRows(void* user, const stbi_uc* rows, int y, int rowCount)
+    {
+        StreamState& state = *(StreamState*)user;
+        std::lock_guard<std::mutex> lock(state.loader->mutex);
+        if (!state.progress)
+        {
+            Upload& upload = *state.upload;
+            stbi_stream_info(state.stream, &upload.width, &upload.height, &upload.channels);
+            upload.pixels = (unsigned char*)rows - (size_t)y * upload.width * upload.channels;
+            upload.progress = state.progress = std::make_shared<Progress>();
+            state.loader->decoded.push_back(upload);
+        }
+        state.progress->rows += rowCount;
+    }
+
+    void stopWorkers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeWorkers.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+    void queueLoad(unsigned int handle)
+    {
+        Texture& texture = textures[handle];
+        texture.loading = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        bool preview = texture.options.preview && texture.image == NO_IMAGE; // a texture being restored already has one to show
+        requests.push_back(Request{ handle, texture.path, texture.options.flip, texture.options.hdrFormat, preview });
+        wakeWorkers.notify_one();
+    }
+
+    static std::string pathKey(const std::string& path, const TextureOptions& options)
+    {
+        return path + '\n' + std::to_string(optionsHash(options));
+    }
+
+    // FNV-1a, shared by the option and pixel hashes
+    static void mix(unsigned long long& h, unsigned long long value)
+    {
+        h ^= value;
+        h *= 1099511628211ull;
+    }
+
+    static unsigned long long optionsHash(const TextureOptions& options)
+    {
+        unsigned long long h = 14695981039346656037ull;
+        mix(h, (unsigned int)options.wrapS); mix(h, (unsigned int)options.wrapT);
+        mix(h, (unsigned int)options.minFilter); mix(h, (unsigned int)options.magFilter);
+        mix(h, options.mipmaps); mix(h, options.flip);
+        mix(h, options.hdrFormat);
+        return h;
+    }
+
+    // Runs on the worker, 8 bytes at a time so hashing stays cheap next to decoding
+    static unsigned long long hashBytes(const Upload& upload, const unsigned char* data, size_t size)
+    {
+        unsigned long long h = 14695981039346656037ull;
+        mix(h, (unsigned int)upload.width); mix(h, (unsigned int)upload.height); mix(h, (unsigned int)upload.channels);
+        mix(h, upload.compressed ? (unsigned int)upload.blocks.format + 1 : 0);
+        mix(h, upload.hdrFormat);
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            unsigned long long word;
+            memcpy(&word, data + i, 8);
+            mix(h, word);
+        }
+        for (; i < size; i++)
+            mix(h, data[i]);
+        return h;
+    }
+
+    // Sampling options are part of the texture object, so the same pixels with different options need their own texture
+    static unsigned long long contentKeyFor(const Upload& upload, const TextureOptions& options)
+    {
+        unsigned long long h = upload.contentHash;
+        mix(h, optionsHash(options));
+        return h;
+    }
+
+    static int mipLevels(int width, int height, bool mipmaps)
+    {
+        int levels = 1;
+        if (mipmaps)
+            while (width > 1 || height > 1)
+            {
+                width = width > 1 ? width / 2 : 1;
+                height = height > 1 ? height / 2 : 1;
+                levels++;
+            }
+        return levels;
+    }
+
+    // Estimate of the memory the driver allocates for levels mip levels starting at width x height
+    static size_t imageBytes(int width, int height, int channels, GLenum compressedFormat, GLenum hdrFormat, int levels)
+    {
+        size_t pixelBytes = channels == 3 ? 4 : (size_t)channels; // drivers pad RGB8 texels to 4 bytes
+        if (hdrFormat)
+            pixelBytes = hdrFormat == GL_RGB9_E5 ? 4 : 8;         // RGB16F is stored as RGBA16F
+        size_t bytes = 0;
+        for (int level = 0; level < levels; level++)
+        {
+            if (compressedFormat)
+                bytes += (size_t)((width + 3) / 4) * ((height + 3) / 4) * (compressedFormat == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16);
+            else
+                bytes += (size_t)width * height * pixelBytes;
+            width = width > 1 ? width / 2 : 1;
+            height = height > 1 ? height / 2 : 1;
+        }
+        return bytes;
+    }
+
+    // Points the handle at a texture that already has exactly these pixels instead of uploading them again
+    bool shareExisting(Upload& upload)
+    {
+        Texture& texture = textures[upload.handle];
+        if (texture.image != NO_IMAGE) // restoring the full resolution of a texture that is already resident
+            return false;
+        auto found = byContent.find(contentKeyFor(upload, texture.options));
+        if (found == byContent.end())
+            return false;
+
+        texture.image = found->second;
+        texture.loading = false;
+        dropPreview(texture);
+        images[found->second].lastUsed = frame;
+        stbi_image_free(upload.pixels);
+        return true;
+    }
+
+    // Copies what the worker has decoded so far, called with mutex locked
+    static void syncProgress(Upload& upload)
+    {
+        if (!upload.progress)
+        {
+            upload.rowsReady = upload.height;
+            return;
+        }
+        upload.rowsReady = upload.progress->rows;
+        upload.decoding = !upload.progress->finished;
+        upload.error = upload.progress->error;
+        upload.contentHash = upload.progress->contentHash;
+    }
+
+    // Until the worker has finished decoding them the pixels belong to its stream
+    static void freePixels(Upload& upload)
+    {
+        if (upload.progress && !upload.progress->finished)
+            stbi_stream_free(upload.progress->stream);
+        else
+            stbi_image_free(upload.pixels);
+        upload.pixels = NULL;
+    }
+
+    void failUpload(Upload& upload)
+    {
+        if (upload.pbo)
+            glDeleteBuffers(1, &upload.pbo);
+        if (upload.texture)
+            glDeleteTextures(1, &upload.texture);
+        freePixels(upload);
+        Texture& texture = textures[upload.handle];
+        texture.loading = false;
+        dropPreview(texture);
+        if (texture.image != NO_IMAGE)
+        {
+            images[texture.image].restoring = false;
+            images[texture.image].restorable = false;
+        }
+    }
+
+    // Small enough to go up in one call, it is not counted in residentBytes()
+    void uploadPreview(Preview& preview)
+    {
+        Texture& texture = textures[preview.handle];
+        if (texture.loading && texture.image == NO_IMAGE && texture.preview == 0)
+        {
+            glGenTextures(1, &texture.preview);
+            glBindTexture(GL_TEXTURE_2D, texture.preview);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, texture.options.wrapS);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, texture.options.wrapT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            setSwizzle(preview.channels);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, formatFor(preview.channels), preview.width, preview.height, 0,
+                formatFor(preview.channels), GL_UNSIGNED_BYTE, preview.pixels);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        }
+        stbi_image_free(preview.pixels);
+    }
+
+    static void dropPreview(Texture& texture)
+    {
+        if (texture.preview)
+            glDeleteTextures(1, &texture.preview);
+        texture.preview = 0;
+    }
+
+    static void setSampling(const TextureOptions& options)
+    {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, options.wrapS);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, options.wrapT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, options.minFilter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, options.magFilter);
+    }
+
+    // Grey and grey alpha images stay GL_RED/GL_RG to save memory, the swizzle makes them sample as (r, r, r, 1) and (r, r, r, g)
+    // like the RGB/RGBA the shaders expect
+    static void setSwizzle(int channels)
+    {
+        if (channels > 2)
+            return;
+        GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, channels == 2 ? GL_GREEN : GL_ONE };
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    }
+
+    static GLenum formatFor(int channels)
+    {
+        switch (channels)
+        {
+        case 1: return GL_RED;
+        case 2: return GL_RG;
+        case 3: return GL_RGB;
+        default: return GL_RGBA;
+        }
+    }
+
+    // GL_RGB16F does not have to be renderable, GL_RGBA16F does, which glGenerateMipmap and the copies in dropTopLevel() need
+    static GLenum internalFormatFor(int channels, GLenum hdrFormat)
+    {
+        if (hdrFormat)
+            return hdrFormat == GL_RGB16F ? GL_RGBA16F : hdrFormat;
+        return formatFor(channels);
+    }
+
+    static GLenum typeFor(GLenum hdrFormat)
+    {
+        if (hdrFormat)
+            return hdrFormat == GL_RGB9_E5 ? GL_UNSIGNED_INT_5_9_9_9_REV : GL_HALF_FLOAT;
+        return GL_UNSIGNED_BYTE;
+    }
+
+    // Size of one pixel in Upload::pixels
+    static size_t pixelBytes(int channels, GLenum hdrFormat)
+    {
+        if (hdrFormat)
+            return hdrFormat == GL_RGB9_E5 ? 4 : 6;
+        return channels;
+    }
+
+    // GL_RGB9_E5 cannot be rendered to, so glGenerateMipmap cannot fill its levels
+    static bool hasMipmaps(const TextureOptions& options, GLenum hdrFormat)
+    {
+        return options.mipmaps && hdrFormat != GL_RGB9_E5;
+    }
+
+    // Allocates the texture storage (no data yet) and a PBO big enough for the whole image
+    // Compressed levels are allocated by glCompressedTexImage2D as they are uploaded
+    void beginUpload(Upload& upload)
+    {
+        glGenTextures(1, &upload.texture);
+        glBindTexture(GL_TEXTURE_2D, upload.texture);
+        setSampling(textures[upload.handle].options);
+        size_t size;
+        if (upload.compressed)
+        {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)upload.blocks.levels.size() - 1);
+            size = upload.blocks.data.size();
+        }
+        else
+        {
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormatFor(upload.channels, upload.hdrFormat), upload.width, upload.height, 0,
+                formatFor(upload.channels), typeFor(upload.hdrFormat), NULL);
+            if (!upload.hdrFormat)
+                setSwizzle(upload.channels);
+            if (!hasMipmaps(textures[upload.handle].options, upload.hdrFormat))
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            size = (size_t)upload.width * upload.height * pixelBytes(upload.channels, upload.hdrFormat);
+        }
+
+        glGenBuffers(1, &upload.pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)size, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    // Uploads as many of the decoded rows as fit in the budget (at least one) and returns the bytes used
+    size_t uploadRows(Upload& upload, size_t budget)
+    {
+        size_t rowBytes = (size_t)upload.width * pixelBytes(upload.channels, upload.hdrFormat);
+        int rows = (int)(budget / rowBytes);
+        if (rows < 1)
+            rows = 1;
+        if (rows > upload.rowsReady - upload.nextRow)
+            rows = upload.rowsReady - upload.nextRow;
+        // nextRow counts the rows uploaded so far, in decode order
+        int first = upload.bottomUp ? upload.height - upload.nextRow - rows : upload.nextRow;
+        size_t offset = rowBytes * first;
+        size_t bytes = rowBytes * rows;
+
+        // Copy the band into the PBO, the driver then copies it into the texture without stalling this thread
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.pbo);
+        void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, (GLintptr)offset, (GLsizeiptr)bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        if (mapped)
+        {
+            memcpy(mapped, upload.pixels + offset, bytes);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+
+        glBindTexture(GL_TEXTURE_2D, upload.texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // rows of RGB images are not always a multiple of 4 bytes
+        // with a PBO bound the last argument is a byte offset into the PBO instead of a pointer
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, upload.width, rows, formatFor(upload.channels), typeFor(upload.hdrFormat), (void*)offset);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        upload.nextRow += rows;
+        return bytes < budget ? bytes : budget;
+    }
+
+    // Uploads whole mip levels of a compressed texture while they fit in the budget (at least one) and returns the bytes used
+    size_t uploadLevels(Upload& upload, size_t budget)
+    {
+        GLenum format = TextureCooker::glFormat(upload.blocks.format);
+        size_t used = 0;
+        glBindTexture(GL_TEXTURE_2D, upload.texture);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload.pbo);
+        while (upload.nextLevel < (int)upload.blocks.levels.size())
+        {
+            const CompressedLevel& level = upload.blocks.levels[upload.nextLevel];
+            if (used > 0 && used + level.size > budget)
+                break;
+            void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, (GLintptr)level.offset, (GLsizeiptr)level.size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+            if (mapped)
+            {
+                memcpy(mapped, upload.blocks.data.data() + level.offset, level.size);
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            }
+            glCompressedTexImage2D(GL_TEXTURE_2D, upload.nextLevel, format, level.width, level.height, 0, (GLsizei)level.size, (void*)level.offset);
+            used += level.size;
+            upload.nextLevel++;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return used < budget ? used : budget;
+    }
+
+    void finishUpload(Upload& upload)
+    {
+        if (upload.progress && shareExisting(upload)) // the pixels were only known once the upload was done
+        {
+            glDeleteBuffers(1, &upload.pbo);
+            glDeleteTextures(1, &upload.texture);
+            return;
+        }
+        Texture& texture = textures[upload.handle];
+        glBindTexture(GL_TEXTURE_2D, upload.texture);
+        if (hasMipmaps(texture.options, upload.hdrFormat) && !upload.compressed)
+            glGenerateMipmap(GL_TEXTURE_2D);
+
+        glDeleteBuffers(1, &upload.pbo);
+        stbi_image_free(upload.pixels);
+        upload.pixels = NULL;
+        upload.blocks.data.clear();
+        texture.loading = false;
+        dropPreview(texture);
+
+        unsigned int index = texture.image;
+        if (index == NO_IMAGE)
+        {
+            index = newImage();
+            texture.image = index;
+        }
+        else
+        {
+            // full resolution version of a texture that had mip levels dropped, replaces the smaller one for every handle sharing it
+            glDeleteTextures(1, &images[index].ID);
+            totalBytes -= images[index].bytes;
+            byContent.erase(images[index].contentKey);
+        }
+
+        Image& image = images[index];
+        image.ID = upload.texture;
+        image.contentKey = contentKeyFor(upload, texture.options);
+        image.options = texture.options;
+        image.width = upload.width;
+        image.height = upload.height;
+        image.channels = upload.channels;
+        image.compressedFormat = upload.compressed ? TextureCooker::glFormat(upload.blocks.format) : 0;
+        image.hdrFormat = upload.hdrFormat;
+        image.fullLevels = upload.compressed ? (int)upload.blocks.levels.size() : mipLevels(upload.width, upload.height, hasMipmaps(texture.options, upload.hdrFormat));
+        image.levels = image.fullLevels;
+        image.droppedLevels = 0;
+        image.bytes = imageBytes(image.width, image.height, image.channels, image.compressedFormat, image.hdrFormat, image.levels);
+        image.lastUsed = frame;
+        image.restoring = false;
+        totalBytes += image.bytes;
+        byContent[image.contentKey] = index;
+    }
+
+    unsigned int newImage()
+    {
+        if (!freeImages.empty())
+        {
+            unsigned int index = freeImages.back();
+            freeImages.pop_back();
+            images[index] = Image();
+            return index;
+        }
+        images.push_back(Image());
+        return (unsigned int)images.size() - 1;
+    }
+
+    // Frees textures until the total is back under the memory budget
+    // Unreferenced textures are deleted first (least recently used first), then the referenced ones lose one mip level
+    // at a time, oldest first, so every texture gets a bit blurrier instead of the most recent ones disappearing
+    void enforceBudget()
+    {
+        if (totalBytes <= memoryBudget)
+            return;
+
+        std::vector<unsigned int> refCounts(images.size(), 0);
+        for (const Texture& texture : textures)
+            if (texture.image != NO_IMAGE)
+                refCounts[texture.image] += texture.refCount;
+
+        std::vector<unsigned int> order;
+        for (unsigned int i = 0; i < images.size(); i++)
+            if (images[i].ID != 0)
+                order.push_back(i);
+        std::sort(order.begin(), order.end(), [this, &refCounts](unsigned int a, unsigned int b) {
+            if ((refCounts[a] > 0) != (refCounts[b] > 0))
+                return refCounts[a] == 0;
+            return images[a].lastUsed < images[b].lastUsed;
+        });
+
+        for (unsigned int index : order)
+        {
+            if (totalBytes <= memoryBudget)
+                return;
+            if (refCounts[index] == 0)
+                evict(index);
+        }
+
+        bool dropped = true;
+        while (totalBytes > memoryBudget && dropped)
+        {
+            dropped = false;
+            for (unsigned int index : order)
+            {
+                if (totalBytes <= memoryBudget)
+                    return;
+                if (images[index].ID != 0 && dropTopLevel(index))
+                    dropped = true;
+            }
+        }
+    }
+
+    void evict(unsigned int index)
+    {
+        Image& image = images[index];
+        glDeleteTextures(1, &image.ID);
+        totalBytes -= image.bytes;
+        byContent.erase(image.contentKey);
+        image.ID = 0;
+        freeImages.push_back(index);
+        // a restore that is still loading turns into a normal load of its handle
+        for (Texture& texture : textures)
+            if (texture.image == index)
+                texture.image = NO_IMAGE;
+    }
+
+    // Replaces the texture with a copy that starts at mip level 1, the copy is done on the GPU by reading every
+    // remaining level through a framebuffer (glCopyImageSubData would need GL 4.3)
+    // Compressed textures cannot be a framebuffer attachment, their levels are read back with glGetCompressedTexImage instead
+    bool dropTopLevel(unsigned int index)
+    {
+        Image& image = images[index];
+        if (image.levels <= 1)
+            return false;
+
+        // size of the current level 1, halving stops at 1 on each axis
+        int width = std::max(image.width >> (image.droppedLevels + 1), 1);
+        int height = std::max(image.height >> (image.droppedLevels + 1), 1);
+        int levels = image.levels - 1;
+
+        std::vector<std::vector<unsigned char>> compressedLevels;
+        if (image.compressedFormat)
+        {
+            glBindTexture(GL_TEXTURE_2D, image.ID);
+            for (int level = 1; level <= levels; level++)
+            {
+                GLint size = 0;
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+                compressedLevels.push_back(std::vector<unsigned char>(size));
+                glGetCompressedTexImage(GL_TEXTURE_2D, level, compressedLevels.back().data());
+            }
+        }
+
+        unsigned int smaller;
+        glGenTextures(1, &smaller);
+        glBindTexture(GL_TEXTURE_2D, smaller);
+        setSampling(image.options);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+        if (image.compressedFormat)
+        {
+            int levelWidth = width, levelHeight = height;
+            for (int level = 0; level < levels; level++)
+            {
+                glCompressedTexImage2D(GL_TEXTURE_2D, level, image.compressedFormat, levelWidth, levelHeight, 0,
+                    (GLsizei)compressedLevels[level].size(), compressedLevels[level].data());
+                levelWidth = levelWidth > 1 ? levelWidth / 2 : 1;
+                levelHeight = levelHeight > 1 ? levelHeight / 2 : 1;
+            }
+        }
+        else
+        {
+            GLenum internalFormat = internalFormatFor(image.channels, image.hdrFormat);
+            GLenum format = formatFor(image.channels);
+            GLenum type = typeFor(image.hdrFormat);
+            if (!image.hdrFormat)
+                setSwizzle(image.channels);
+            GLint previousFramebuffer;
+            glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &previousFramebuffer);
+            if (copyFramebuffer == 0)
+                glGenFramebuffers(1, &copyFramebuffer);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, copyFramebuffer);
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+
+            int levelWidth = width, levelHeight = height;
+            for (int level = 0; level < levels; level++)
+            {
+                glTexImage2D(GL_TEXTURE_2D, level, internalFormat, levelWidth, levelHeight, 0, format, type, NULL);
+                glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, image.ID, level + 1);
+                glCopyTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, 0, 0, levelWidth, levelHeight);
+                levelWidth = levelWidth > 1 ? levelWidth / 2 : 1;
+                levelHeight = levelHeight > 1 ? levelHeight / 2 : 1;
+            }
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, previousFramebuffer);
+        }
+
+        glDeleteTextures(1, &image.ID);
+        totalBytes -= image.bytes;
+        image.ID = smaller;
+        image.levels = levels;
+        image.droppedLevels++;
+        image.bytes = imageBytes(width, height, image.channels, image.compressedFormat, image.hdrFormat, levels);
+        totalBytes += image.bytes;
+        return true;
+    }
+
+    // Loads the full resolution of one shrunk texture again if it was drawn last frame and fits comfortably
+    // (with 1/8 of the budget to spare, so it is not shrunk again as soon as anything else loads)
+    void restoreOne()
+    {
+        for (unsigned int index = 0; index < images.size(); index++)
+        {
+            Image& image = images[index];
+            if (image.ID == 0 || image.droppedLevels == 0 || image.restoring || !image.restorable || image.lastUsed + 1 < frame)
+                continue;
+            size_t fullBytes = imageBytes(image.width, image.height, image.channels, image.compressedFormat, image.hdrFormat, image.fullLevels);
+            if (totalBytes - image.bytes + fullBytes > memoryBudget - memoryBudget / 8)
+                continue;
+
+            for (unsigned int handle = 0; handle < textures.size(); handle++)
+            {
+                if (textures[handle].image == index && !textures[handle].loading)
+                {
+                    image.restoring = true;
+                    queueLoad(handle);
+                    return;
+                }
+            }
+        }
+    }
+};
+#endif
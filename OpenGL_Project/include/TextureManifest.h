@@ -0,0 +1,370 @@
+#ifndef TEXTURE_MANIFEST_H
+#define TEXTURE_MANIFEST_H
+
+#include <stb_image.h>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <climits>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// What the manifest knows about one image, everything is read from the file header without decoding any pixels
+struct ManifestEntry {
+    std::string path;         // relative to the scanned directory, with '/' separators
+    int width = 0, height = 0;
+    int channels = 0;         // channels in the file, as stbi_info reports them
+    int bitsPerChannel = 8;   // 8, 16 (stbi_is_16_bit) or 32 for float HDR images
+    unsigned long long fileSize = 0;
+    unsigned long long contentHash = 0; // hash of the file bytes, 0 when the scan was told not to hash
+};
+
+// Lists the dimensions, channels and bit depth of every image under a directory, so texture memory and atlases can be planned
+// at startup before any image is decoded
+// The files are probed in parallel: each one is memory mapped and stbi_info only touches the first PROBE_SIZE bytes of it (the
+// rest of the mapping is only read for files whose header is further in, JPEGs with large EXIF blocks, and for the content hash)
+// The result is saved as a small binary file that read() loads back without touching the images at all
+class TextureManifest {
+public:
+    std::vector<ManifestEntry> entries;
+
+    // Probes every regular file under directory (recursively), files stb_image can't read are left out
+    // threadCount = 0 uses every core, hashContents = false skips the content hash and keeps the scan to the file headers
+    static TextureManifest scan(const std::string& directory, unsigned int threadCount = 0, bool hashContents = true)
+    {
+        std::vector<std::filesystem::path> files;
+        std::error_code error;
+        for (std::filesystem::recursive_directory_iterator it(directory, error), end; !error && it != end; it.increment(error))
+            if (it->is_regular_file(error))
+                files.push_back(it->path());
+
+        std::vector<ManifestEntry> probed(files.size());
+        std::vector<char> valid(files.size(), 0);
+        std::atomic<size_t> next(0);
+        auto work = [&]()
+        {
+            for (size_t i = next++; i < files.size(); i = next++)
+            {
+                probed[i].path = files[i].lexically_relative(directory).generic_string();
+                valid[i] = probe(files[i].string(), probed[i], hashContents);
+            }
+        };
+
+        if (threadCount == 0)
+            threadCount = std::thread::hardware_concurrency();
+        if (threadCount > files.size())
+            threadCount = (unsigned int)files.size();
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < threadCount; i++)
+            threads.push_back(std::thread(work));
+        work();
+        for (std::thread& thread : threads)
+            thread.join();
+
+        TextureManifest manifest;
+        for (size_t i = 0; i < files.size(); i++)
+            if (valid[i])
+                manifest.entries.push_back(std::move(probed[i]));
+        manifest.buildIndex();
+        return manifest;
+    }
+
+    // Reads one file's header into entry, false if stb_image can't read the file
+    static bool probe(const std::string& path, ManifestEntry& entry, bool hashContents = true)
+    {
+        MappedFile file;
+        if (!file.open(path))
+            return false;
+        size_t probeSize = file.size;
+        if (probeSize > PROBE_SIZE)
+            probeSize = PROBE_SIZE;
+        int channels;
+        if (!stbi_info_from_memory(file.data, (int)probeSize, &entry.width, &entry.height, &channels))
+        {
+            // the header goes on past the first PROBE_SIZE bytes, look at the whole file
+            if (probeSize == file.size || !stbi_info_from_memory(file.data, (int)file.size, &entry.width, &entry.height, &channels))
+                return false;
+            probeSize = file.size;
+        }
+        entry.channels = channels;
+        if (stbi_is_hdr_from_memory(file.data, (int)probeSize))
+            entry.bitsPerChannel = 32;
+        else
+            entry.bitsPerChannel = stbi_is_16_bit_from_memory(file.data, (int)probeSize) ? 16 : 8;
+        entry.fileSize = file.size;
+        entry.contentHash = hashContents ? hashBytes(file.data, file.size) : 0;
+        return true;
+    }
+
+    // nullptr if the manifest has no entry for path (relative to the scanned directory)
+    const ManifestEntry* find(const std::string& path) const
+    {
+        auto found = byPath.find(path);
+        return found != byPath.end() ? &entries[found->second] : nullptr;
+    }
+
+    // Layout: "TMAN", version, entry count, then ENTRY_SIZE bytes per entry (width, height, file size, content hash, offset of
+    // the path in the string table, channels, bits per channel, path length) and the string table, all little endian
+    bool write(const std::string& path) const
+    {
+        std::vector<unsigned char> data(HEADER_SIZE + entries.size() * ENTRY_SIZE);
+        std::string strings;
+        memcpy(data.data(), "TMAN", 4);
+        write32(data.data() + 4, VERSION);
+        write32(data.data() + 8, (unsigned int)entries.size());
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const ManifestEntry& entry = entries[i];
+            if (entry.path.size() > 0xffff)
+                return false;
+            unsigned char* p = data.data() + HEADER_SIZE + i * ENTRY_SIZE;
+            write32(p, (unsigned int)entry.width);
+            write32(p + 4, (unsigned int)entry.height);
+            write64(p + 8, entry.fileSize);
+            write64(p + 16, entry.contentHash);
+            write32(p + 24, (unsigned int)strings.size());
+            p[28] = (unsigned char)entry.channels;
+            p[29] = (unsigned char)entry.bitsPerChannel;
+            p[30] = (unsigned char)entry.path.size();
+            p[31] = (unsigned char)(entry.path.size() >> 8);
+            strings += entry.path;
+        }
+
+        std::ofstream file(path, std::ios::binary);
+        file.write((const char*)data.data(), data.size());
+        file.write(strings.data(), strings.size());
+        return (bool)file;
+    }
+
+    static bool read(const std::string& path, TextureManifest& manifest)
+    {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+        size_t fileSize = (size_t)file.tellg();
+        file.seekg(0);
+        std::vector<unsigned char> data(fileSize);
+        if (fileSize < HEADER_SIZE || !file.read((char*)data.data(), fileSize))
+            return false;
+        if (memcmp(data.data(), "TMAN", 4) != 0 || read32(data.data() + 4) != VERSION)
+            return false;
+        size_t count = read32(data.data() + 8);
+        if (count > (fileSize - HEADER_SIZE) / ENTRY_SIZE)
+            return false;
+        size_t stringsStart = HEADER_SIZE + count * ENTRY_SIZE;
+
+        manifest.entries.clear();
+        manifest.entries.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            ManifestEntry& entry = manifest.entries[i];
+            const unsigned char* p = data.data() + HEADER_SIZE + i * ENTRY_SIZE;
+            size_t offset = read32(p + 24), length = p[30] | (p[31] << 8);
+            if (offset + length > fileSize - stringsStart)
+                return false;
+            entry.width = (int)read32(p);
+            entry.height = (int)read32(p + 4);
+            entry.fileSize = read64(p + 8);
+            entry.contentHash = read64(p + 16);
+            entry.channels = p[28];
+            entry.bitsPerChannel = p[29];
+            entry.path.assign((const char*)data.data() + stringsStart + offset, length);
+        }
+        manifest.buildIndex();
+        return true;
+    }
+
+    // OpenGL_Project.exe --manifest <directory> <output> [nohash] [threads]
+    static int runCommandLine(int argc, char* argv[])
+    {
+        if (argc < 4)
+        {
+            std::cout << "usage: --manifest <directory> <output> [nohash] [threads]" << std::endl;
+            return 1;
+        }
+        bool hashContents = true;
+        unsigned int threadCount = 0;
+        for (int i = 4; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (arg == "nohash") hashContents = false;
+            else if (!arg.empty() && arg.find_first_not_of("0123456789") == std::string::npos) threadCount = (unsigned int)std::stoul(arg);
+            else
+            {
+                std::cout << "unknown option " << arg << std::endl;
+                return 1;
+            }
+        }
+        TextureManifest manifest = scan(argv[2], threadCount, hashContents);
+        if (!manifest.write(argv[3]))
+        {
+            std::cout << "ERROR::TEXTURE_MANIFEST::FAILED_TO_WRITE " << argv[3] << std::endl;
+            return 1;
+        }
+        std::cout << manifest.entries.size() << " images in " << argv[3] << std::endl;
+        return 0;
+    }
+
+private:
+    static const size_t PROBE_SIZE = 4096; // enough for the headers of everything but JPEGs with big metadata blocks
+    static const size_t HEADER_SIZE = 12;
+    static const size_t ENTRY_SIZE = 32;
+    static const unsigned int VERSION = 1;
+
+    std::unordered_map<std::string, size_t> byPath;
+
+    // A read only mapping of a whole file, or the file read into memory where it can't be mapped
+    struct MappedFile {
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+        std::vector<unsigned char> buffer;
+#ifdef _WIN32
+        HANDLE mapping = NULL;
+#else
+        bool mapped = false;
+#endif
+
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile()
+        {
+#ifdef _WIN32
+            if (mapping)
+            {
+                UnmapViewOfFile(data);
+                CloseHandle(mapping);
+            }
+#else
+            if (mapped)
+                munmap((void*)data, size);
+#endif
+        }
+
+        // Files over 2GB are refused, stb_image takes int sizes
+        bool open(const std::string& path)
+        {
+#ifdef _WIN32
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file != INVALID_HANDLE_VALUE)
+            {
+                LARGE_INTEGER fileSize;
+                if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && fileSize.QuadPart <= INT_MAX)
+                {
+                    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+                    if (mapping)
+                    {
+                        data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                        if (data)
+                        {
+                            size = (size_t)fileSize.QuadPart;
+                            CloseHandle(file); // the mapping keeps the file open
+                            return true;
+                        }
+                        CloseHandle(mapping);
+                        mapping = NULL;
+                    }
+                }
+                CloseHandle(file);
+            }
+#else
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd >= 0)
+            {
+                struct stat st;
+                if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= INT_MAX)
+                {
+                    void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (p != MAP_FAILED)
+                    {
+                        close(fd); // the mapping stays valid after the descriptor is closed
+                        data = (const unsigned char*)p;
+                        size = (size_t)st.st_size;
+                        mapped = true;
+                        return true;
+                    }
+                }
+                close(fd);
+            }
+#endif
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            if (!file)
+                return false;
+            std::streamoff fileSize = file.tellg();
+            if (fileSize <= 0 || fileSize > INT_MAX)
+                return false;
+            buffer.resize((size_t)fileSize);
+            file.seekg(0);
+            if (!file.read((char*)buffer.data(), fileSize))
+                return false;
+            data = buffer.data();
+            size = buffer.size();
+            return true;
+        }
+    };
+
+    void buildIndex()
+    {
+        byPath.clear();
+        for (size_t i = 0; i < entries.size(); i++)
+            byPath[entries[i].path] = i;
+    }
+
+    // FNV-1a over 8 bytes at a time, the same mixing TextureLoader uses for its pixel hashes
+    static unsigned long long hashBytes(const unsigned char* data, size_t size)
+    {
+        unsigned long long h = 14695981039346656037ull;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            unsigned long long word;
+            memcpy(&word, data + i, 8);
+            h ^= word;
+            h *= 1099511628211ull;
+        }
+        for (; i < size; i++)
+        {
+            h ^= data[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    static unsigned int read32(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    }
+
+    static unsigned long long read64(const unsigned char* p)
+    {
+        return read32(p) | ((unsigned long long)read32(p + 4) << 32);
+    }
+
+    static void write32(unsigned char* p, unsigned int value)
+    {
+        for (int i = 0; i < 4; i++)
+            p[i] = (unsigned char)(value >> (i * 8));
+    }
+
+    static void write64(unsigned char* p, unsigned long long value)
+    {
+        write32(p, (unsigned int)value);
+        write32(p + 4, (unsigned int)(value >> 32));
+    }
+};
+#endif
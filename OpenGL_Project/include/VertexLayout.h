@@ -0,0 +1,258 @@
+#ifndef VERTEX_LAYOUT_H
+#define VERTEX_LAYOUT_H
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+// One vertex attribute: the shader location it feeds and where it is stored inside a vertex
+struct VertexAttribute {
+    unsigned int location; // layout (location = n) in the vertex shader
+    int size;              // number of components (1 to 4)
+    GLenum type;           // GL_FLOAT, GL_UNSIGNED_BYTE, ...
+    GLboolean normalized;  // map integer types to 0,1 or -1,1
+    bool integer;          // read as int/uint in the shader instead of float
+    unsigned int offset;   // byte offset inside one vertex
+    unsigned int binding;  // which vertex buffer binding the attribute reads from
+
+    bool operator==(const VertexAttribute& other) const
+    {
+        return location == other.location && size == other.size && type == other.type && normalized == other.normalized
+            && integer == other.integer && offset == other.offset && binding == other.binding;
+    }
+};
+
+// One vertex buffer binding slot: the distance between vertices and how often it advances (0 = per vertex, n = per n instances)
+struct VertexBinding {
+    unsigned int stride = 0;
+    unsigned int divisor = 0;
+
+    bool operator==(const VertexBinding& other) const
+    {
+        return stride == other.stride && divisor == other.divisor;
+    }
+};
+
+// Describes the format of the vertex data only, not which buffer it comes from
+// Two layouts with the same attributes are equal (and hash the same) no matter what order they were declared in,
+// so every mesh using the same format can share one VAO
+class VertexLayout {
+public:
+    std::vector<VertexAttribute> attributes;
+    std::vector<VertexBinding> bindings;
+
+    VertexLayout& setBinding(unsigned int binding, unsigned int stride, unsigned int divisor = 0)
+    {
+        if (bindings.size() <= binding)
+            bindings.resize(binding + 1);
+        bindings[binding].stride = stride;
+        bindings[binding].divisor = divisor;
+        return *this;
+    }
+
+    // Float attribute (integers can be converted to floats, normalized or not)
+    VertexLayout& add(unsigned int location, int size, GLenum type, GLboolean normalized, unsigned int offset, unsigned int binding = 0)
+    {
+        VertexAttribute attribute = { location, size, type, normalized, false, offset, binding };
+        return add(attribute);
+    }
+
+    // Integer attribute (ivecn/uvecn in the shader)
+    VertexLayout& addInteger(unsigned int location, int size, GLenum type, unsigned int offset, unsigned int binding = 0)
+    {
+        VertexAttribute attribute = { location, size, type, GL_FALSE, true, offset, binding };
+        return add(attribute);
+    }
+
+    VertexLayout& add(const VertexAttribute& attribute)
+    {
+        if (bindings.size() <= attribute.binding)
+            bindings.resize(attribute.binding + 1);
+        // keep the attributes sorted by location so declaration order does not matter for equality
+        std::vector<VertexAttribute>::iterator it = attributes.begin();
+        while (it != attributes.end() && it->location < attribute.location)
+            it++;
+        if (it != attributes.end() && it->location == attribute.location)
+            *it = attribute;
+        else
+            attributes.insert(it, attribute);
+        return *this;
+    }
+
+    unsigned int stride(unsigned int binding = 0) const
+    {
+        return binding < bindings.size() ? bindings[binding].stride : 0;
+    }
+
+    bool operator==(const VertexLayout& other) const
+    {
+        return attributes == other.attributes && bindings == other.bindings;
+    }
+
+    // FNV-1a over every field
+    size_t hash() const
+    {
+        unsigned long long h = 14695981039346656037ull;
+        auto mix = [&h](unsigned long long value) {
+            h ^= value;
+            h *= 1099511628211ull;
+        };
+        for (const VertexAttribute& a : attributes)
+        {
+            mix(a.location); mix((unsigned int)a.size); mix(a.type); mix(a.normalized); mix(a.integer); mix(a.offset); mix(a.binding);
+        }
+        for (const VertexBinding& b : bindings)
+        {
+            mix(b.stride); mix(b.divisor);
+        }
+        return (size_t)h;
+    }
+};
+
+struct VertexLayoutHash {
+    size_t operator()(const VertexLayout& layout) const { return layout.hash(); }
+};
+
+// Builds one VAO per unique vertex layout and reuses it for every buffer with that layout
+// With ARB_vertex_attrib_binding (core in 4.3) the attribute formats are set once when the VAO is made and switching the
+// source buffer is a single glBindVertexBuffer. Without it the attributes have to be respecified with glVertexAttribPointer
+// whenever the buffer changes, which is only done when the buffer is actually different from the one already in the VAO
+class VertexArrayCache {
+public:
+    VertexArrayCache() = default;
+    VertexArrayCache(const VertexArrayCache&) = delete;
+    VertexArrayCache& operator=(const VertexArrayCache&) = delete;
+
+    static bool hasAttribBinding()
+    {
+        return GLAD_GL_ARB_vertex_attrib_binding && glBindVertexBuffer != NULL;
+    }
+
+    // Binds (and creates the first time) the VAO for this layout and returns its ID
+    unsigned int bind(const VertexLayout& layout)
+    {
+        Entry& entry = getEntry(layout);
+        glBindVertexArray(entry.VAO);
+        return entry.VAO;
+    }
+
+    // Makes a binding of the layout's VAO read from the given buffer, offset = byte offset of the first vertex
+    // Leaves the VAO bound
+    void setVertexBuffer(const VertexLayout& layout, unsigned int binding, unsigned int buffer, GLintptr offset = 0)
+    {
+        Entry& entry = getEntry(layout);
+        glBindVertexArray(entry.VAO);
+        if (binding >= entry.vertexBuffers.size())
+            return;
+        if (entry.vertexBuffers[binding].buffer == buffer && entry.vertexBuffers[binding].offset == offset)
+            return;
+        entry.vertexBuffers[binding].buffer = buffer;
+        entry.vertexBuffers[binding].offset = offset;
+
+        if (hasAttribBinding())
+        {
+            glBindVertexBuffer(binding, buffer, offset, layout.stride(binding));
+            return;
+        }
+
+        // Fallback: glVertexAttribPointer stores whatever is bound to GL_ARRAY_BUFFER right now
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        for (const VertexAttribute& attribute : layout.attributes)
+        {
+            if (attribute.binding != binding)
+                continue;
+            const void* pointer = (const void*)(size_t)(offset + attribute.offset);
+            if (attribute.integer)
+                glVertexAttribIPointer(attribute.location, attribute.size, attribute.type, layout.stride(binding), pointer);
+            else
+                glVertexAttribPointer(attribute.location, attribute.size, attribute.type, attribute.normalized, layout.stride(binding), pointer);
+        }
+    }
+
+    // The element buffer is part of the VAO state too, leaves the VAO bound
+    void setIndexBuffer(const VertexLayout& layout, unsigned int buffer)
+    {
+        Entry& entry = getEntry(layout);
+        glBindVertexArray(entry.VAO);
+        if (entry.indexBuffer == buffer)
+            return;
+        entry.indexBuffer = buffer;
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+    }
+
+    // Call before deleting a buffer, a new buffer can get the same ID later and must not be mistaken for the old one
+    void forgetBuffer(unsigned int buffer)
+    {
+        for (auto& pair : vaos)
+        {
+            for (BufferBinding& bound : pair.second.vertexBuffers)
+                if (bound.buffer == buffer)
+                    bound.buffer = 0;
+            if (pair.second.indexBuffer == buffer)
+                pair.second.indexBuffer = 0;
+        }
+    }
+
+    unsigned int count() const { return (unsigned int)vaos.size(); }
+
+    // Deletes every VAO, call this before the context gets destroyed
+    void release()
+    {
+        for (auto& pair : vaos)
+            glDeleteVertexArrays(1, &pair.second.VAO);
+        vaos.clear();
+    }
+
+private:
+    struct BufferBinding {
+        unsigned int buffer = 0;
+        GLintptr offset = 0;
+    };
+
+    struct Entry {
+        unsigned int VAO = 0;
+        std::vector<BufferBinding> vertexBuffers; // what each binding currently reads from
+        unsigned int indexBuffer = 0;
+    };
+
+    std::unordered_map<VertexLayout, Entry, VertexLayoutHash> vaos;
+
+    Entry& getEntry(const VertexLayout& layout)
+    {
+        auto found = vaos.find(layout);
+        if (found != vaos.end())
+            return found->second;
+
+        Entry entry;
+        entry.vertexBuffers.resize(layout.bindings.size());
+        glGenVertexArrays(1, &entry.VAO);
+        glBindVertexArray(entry.VAO);
+
+        bool separateFormat = hasAttribBinding();
+        for (const VertexAttribute& attribute : layout.attributes)
+        {
+            if (separateFormat)
+            {
+                // The format is stored once in the VAO, independent of any buffer
+                if (attribute.integer)
+                    glVertexAttribIFormat(attribute.location, attribute.size, attribute.type, attribute.offset);
+                else
+                    glVertexAttribFormat(attribute.location, attribute.size, attribute.type, attribute.normalized, attribute.offset);
+                glVertexAttribBinding(attribute.location, attribute.binding);
+            }
+            else
+            {
+                glVertexAttribDivisor(attribute.location, layout.bindings[attribute.binding].divisor);
+            }
+            glEnableVertexAttribArray(attribute.location);
+        }
+        if (separateFormat)
+            for (unsigned int i = 0; i < layout.bindings.size(); i++)
+                glVertexBindingDivisor(i, layout.bindings[i].divisor);
+
+        return vaos.emplace(layout, entry).first->second;
+    }
+};
+#endif
@@ -220,6 +220,35 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// FILE INPUT:
+//
+//   stbi_load, stbi_load_16 and stbi_loadf map the whole file into memory
+//   (mmap on POSIX systems) and decode it the same way as the _from_memory
+//   functions, instead of pulling it through a small buffer with one fread
+//   per refill. Where mapping isn't available the file is read with a single
+//   fread. Files that can't be handled this way (pipes, files over 2GB) fall
+//   back to the stdio path. Define STBI_NO_MMAP to never map files; they are
+//   still read in one go.
+//
+// THREADS:
+//
+//   Baseline JPEGs that contain restart markers (a DRI segment, which most
+//   encoders can be asked to write) are decoded with several threads: every
+//   restart interval restarts the entropy decoder and the DC prediction, so
+//   the intervals can be Huffman decoded and IDCT'd independently. Large
+//   JPEGs also resample and color convert in parallel row bands. Everything
+//   else decodes on the calling thread, as do files read through callbacks.
+//   Call stbi_set_jpeg_thread_count() to choose the number of threads (the
+//   default is one per core), or set stbi_options::jpeg_threads for one load;
+//   code that already decodes several images in parallel should pass 1 so
+//   the machine isn't oversubscribed. The helper threads are started the
+//   first time they're needed and then wait for the next decode instead of
+//   exiting; while one decode is using them, a decode on another thread runs
+//   serially. Threads are std::thread when compiled as C++11 and pthreads on
+//   POSIX systems; define STBI_NO_THREADS to never use them.
+//
+// ===========================================================================
+//
 // Philosophy
 //
 // stb libraries are designed with the following priorities:
@@ -274,6 +303,13 @@ RECENT REVISION HISTORY:
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
+// stbi_set_simd_level() caps the x86 kernels at run time: STBI_SIMD_NONE
+// (the generic C versions), STBI_SIMD_SSE2 (SSE2 and SSSE3) or
+// STBI_SIMD_AVX2 (everything, the default). It returns the level that is
+// actually used, which is lower if the build or the CPU doesn't have the
+// one asked for. It's meant for benchmarks and for checking the kernels
+// against each other; the output is the same at every level.
+//
 // ===========================================================================
 //
 // HDR image support   (disable by defining STBI_NO_HDR)
@@ -355,6 +391,13 @@ RECENT REVISION HISTORY:
 //        STBI_ONLY_PIC
 //        STBI_ONLY_PNM   (.ppm and .pgm)
 //
+//  - At run time, stbi_set_enabled_formats(STBI_FORMAT_PNG | ...) (or
+//    stbi_options::formats for one load) limits the decoders that are tried
+//    further. The format is picked from the first bytes of the file in one
+//    look, without running each decoder's test in turn; a file of a known
+//    but disabled format fails with "format disabled". TGA has no signature,
+//    so it is what's left when nothing else matches.
+//
 //   - If you use STBI_NO_PNG (or _ONLY_ without PNG), and you still
 //     want the zlib decoder to be available, #define STBI_SUPPORT_ZLIB
 //
@@ -383,6 +426,29 @@ enum
    STBI_rgb_alpha  = 4
 };
 
+// levels for stbi_set_simd_level
+enum
+{
+   STBI_SIMD_NONE = 0,
+   STBI_SIMD_SSE2 = 1,
+   STBI_SIMD_AVX2 = 2
+};
+
+// bits for stbi_set_enabled_formats and stbi_options::formats
+enum
+{
+   STBI_FORMAT_JPEG = 1 << 0,
+   STBI_FORMAT_PNG  = 1 << 1,
+   STBI_FORMAT_BMP  = 1 << 2,
+   STBI_FORMAT_PSD  = 1 << 3,
+   STBI_FORMAT_TGA  = 1 << 4,
+   STBI_FORMAT_GIF  = 1 << 5,
+   STBI_FORMAT_HDR  = 1 << 6,
+   STBI_FORMAT_PIC  = 1 << 7,
+   STBI_FORMAT_PNM  = 1 << 8,
+   STBI_FORMAT_ALL  = (1 << 9) - 1
+};
+
 #include <stdlib.h>
 typedef unsigned char stbi_uc;
 typedef unsigned short stbi_us;
@@ -433,6 +499,148 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
 
+// scaled loading: the image comes back at 1/scale_denom of its size in each
+// dimension (rounded up), scale_denom must be 1, 2, 4 or 8. JPEGs are decoded
+// straight at the reduced size, which is much faster and needs less memory;
+// other formats are loaded at full size and box filtered down
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int scale_denom);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled     (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int scale_denom);
+#endif
+
+// region loading: only the rectangle of region_w x region_h pixels at
+// region_x,region_y (from the top left of the file's image, clipped to it) is
+// returned, and *x,*y are its size. JPEGs decode only the blocks around it
+// (the rest is just entropy decoded, and nothing below it at all) and
+// non-interlaced PNGs inflate and unfilter only down to its last row, keeping
+// its columns, so time and memory go with the region instead of the image;
+// other formats are loaded whole and cropped
+STBIDEF stbi_uc *stbi_load_region_from_memory(stbi_uc const *buffer, int len, int region_x, int region_y, int region_w, int region_h, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region     (char const *filename, int region_x, int region_y, int region_w, int region_h, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+// decoding into your own memory: the image is written to 'out', 'out_stride'
+// bytes per row, which must hold at least x*channels bytes, and the whole
+// image must fit in the 'out_size' bytes at 'out' (use stbi_info to get the
+// size first). the size is checked as soon as the header has been read, and
+// JPEG, HDR and 8-bit non-interlaced PNG store their rows straight into 'out'
+// for any desired_channels, BMP for 0, 3 or 4, and TGA and 8-bit PNM for 0 or
+// the file's own channel count. only the other formats and cases (and loads
+// with a region or scale set) fall back to decoding into a buffer of their
+// own and copying it over, so they need the memory for a second image. the
+// bytes between the rows are left alone, but 'out' may be partly written when
+// a load fails. returns 1 on success, 0 on failure (see stbi_failure_reason).
+// the decoder's working memory comes from 'alloc' instead of STBI_MALLOC etc.
+// if it isn't NULL, so an arena or free list that gets reset between images
+// keeps a steady stream of loads off the heap. everything it allocates is
+// freed again before the call returns
+typedef struct
+{
+   void    *(*alloc)  (void *user, size_t size);
+   void    *(*realloc)(void *user, void *p, size_t old_size, size_t new_size); // may be NULL (alloc, copy and free)
+   void     (*free)   (void *user, void *p);
+   void     *user;
+} stbi_allocator;
+
+STBIDEF int stbi_load_from_memory_into   (stbi_uc           const *buffer, int len   , stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+STBIDEF int stbi_load_from_callbacks_into(stbi_io_callbacks const *clbk  , void *user, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into               (char const *filename,                        stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *channels_in_file, int desired_channels, stbi_allocator const *alloc);
+#endif
+
+// loading with per-call settings: everything that otherwise comes from the
+// stbi_set_* globals/thread locals is taken from 'opt' instead, so concurrent
+// loads with different settings don't interfere. a zeroed stbi_options loads
+// 8-bit, unflipped, with the file's channel count. the result is stbi_uc*,
+// stbi_us* or float* (like stbi_loadf) depending on bits_per_channel, and if
+// 'alloc' is set it was allocated with it and must be freed with it
+// (otherwise stbi_image_free)
+typedef struct
+{
+   int      flip_vertically;        // first row of the result is the bottom of the image
+   int      desired_channels;       // 0 for the number of channels in the file
+   int      bits_per_channel;       // 8 (or 0), 16 or 32 (float)
+   int      unpremultiply;          // iPhone PNGs: undo premultiplied alpha (with convert_iphone_png)
+   int      convert_iphone_png;     // iPhone PNGs: convert BGR to RGB
+   stbi_allocator const *alloc;     // working memory and result, NULL for STBI_MALLOC etc.
+   int      max_scans;              // progressive JPEGs: only decode the first max_scans scans (0 for all), see below
+   int      formats;                // STBI_FORMAT_* bits of the decoders to try, 0 for stbi_set_enabled_formats'
+   int      jpeg_threads;           // threads for this JPEG (see THREADS above), 0 for stbi_set_jpeg_thread_count's
+} stbi_options;
+
+STBIDEF void *stbi_load_from_memory_ex   (stbi_options const *opt, stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file);
+STBIDEF void *stbi_load_from_callbacks_ex(stbi_options const *opt, stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file);
+#ifndef STBI_NO_STDIO
+STBIDEF void *stbi_load_ex               (stbi_options const *opt, char const *filename,                        int *x, int *y, int *channels_in_file);
+#endif
+
+// max_scans: a progressive JPEG is a series of scans that each refine the
+// whole image, and most encoders start with a scan of every block's DC
+// coefficient (the average of its 8x8 pixels), so with max_scans 1 the file
+// gives a blurry but complete image from a fraction of its data. the rest of
+// the file isn't read. it fails if the input ends before those scans do, and
+// doesn't change anything for other files. combined with stbi_load_scaled's
+// 1/8 size (see stbi_stream_preview) a DC-only image skips the IDCT too
+
+// incremental decoding: feed the file in pieces as they arrive (from async
+// reads, the network...) and every band of rows is passed to 'on_rows' as soon
+// as it's decoded, so using the top of the image can start before the rest of
+// the file has even been read. 'rows' is row y of the final image followed by
+// row_count-1 more; they don't change anymore and stay valid until the stream
+// is ended or freed. bands come in decode order, which with flip_vertically
+// means from the end of the image buffer towards its start.
+// baseline JPEGs and non-interlaced PNGs of up to 8 bits are decoded as the
+// data comes in; anything else is kept and decoded by stbi_stream_end, which
+// then passes all rows in one band. only 8 bits per channel.
+//    stbi_stream_feed  returns 0 on error (see stbi_failure_reason)
+//    stbi_stream_info  returns 1 once the size is known
+//    stbi_stream_end   decodes what's left and returns the image (free it like
+//                      a stbi_load_ex result), or NULL
+//    stbi_stream_free  frees the stream, always call it after stbi_stream_end
+//                      too: on failure the rows passed out so far stay valid
+//                      until then
+typedef struct stbi__stream stbi_stream;
+typedef void stbi_stream_rows(void *user, stbi_uc const *rows, int y, int row_count);
+
+STBIDEF stbi_stream *stbi_stream_begin(stbi_options const *opt, stbi_stream_rows *on_rows, void *user);
+STBIDEF int          stbi_stream_feed (stbi_stream *st, void const *data, int len);
+STBIDEF int          stbi_stream_info (stbi_stream *st, int *x, int *y, int *channels_in_file);
+STBIDEF stbi_uc     *stbi_stream_end  (stbi_stream *st, int *x, int *y, int *channels_in_file);
+STBIDEF void         stbi_stream_free (stbi_stream *st);
+
+// progressive JPEGs are kept for stbi_stream_end, but a placeholder can be made
+// from the input so far once it holds the first max_scans scans (see
+// stbi_options::max_scans), at 1/scale_denom size (1, 2, 4 or 8). returns NULL
+// while the scans aren't all in or if the input isn't a progressive JPEG; free
+// the result like a stbi_stream_end result. the stream isn't changed
+STBIDEF stbi_uc     *stbi_stream_preview(stbi_stream *st, int max_scans, int scale_denom, int *x, int *y, int *channels_in_file);
+
+#ifndef STBI_NO_GIF
+// animated GIFs a frame at a time: stbi_load_gif_from_memory decodes every
+// frame into one allocation, these decode a frame only when it's asked for and
+// keep just the decoder's canvas and the last two frames (for the "restore
+// previous" disposal), so memory doesn't grow with the length of the
+// animation. 'buffer' must stay valid until stbi_gif_free. 'opt' is used as
+// for stbi_load_ex, except that frames are always 8 bits per channel (4
+// channels if desired_channels is 0)
+//    stbi_gif_begin   reads the header, returns NULL if it isn't a GIF
+//    stbi_gif_next    decodes the next frame and returns it (*x * *y *
+//                     channels bytes, valid until the next call), and its
+//                     delay in milliseconds. returns NULL after the last
+//                     frame, and stbi_gif_frame_count then returns the number
+//                     of frames, or on error (stbi_gif_frame_count stays 0)
+//    stbi_gif_rewind  goes back to before the first frame, for looping
+//    stbi_gif_free    frees the iterator
+typedef struct stbi__gif_frames stbi_gif_frames;
+
+STBIDEF stbi_gif_frames *stbi_gif_begin      (stbi_options const *opt, stbi_uc const *buffer, int len, int *x, int *y);
+STBIDEF stbi_uc const   *stbi_gif_next       (stbi_gif_frames *f, int *delay_ms);
+STBIDEF int              stbi_gif_frame_count(stbi_gif_frames *f);
+STBIDEF void             stbi_gif_rewind     (stbi_gif_frames *f);
+STBIDEF void             stbi_gif_free       (stbi_gif_frames *f);
+#endif
+
 #ifdef STBI_WINDOWS_UTF8
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
@@ -524,6 +732,18 @@ STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpre
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// number of threads used to decode one JPEG (see THREADS above); 0 means one
+// per core, 1 always decodes serially. has no effect with STBI_NO_THREADS
+STBIDEF void stbi_set_jpeg_thread_count(int thread_count);
+
+// the STBI_FORMAT_* bits of the decoders to try, 0 (the default) for every
+// one compiled in. see ADDITIONAL CONFIGURATION above
+STBIDEF void stbi_set_enabled_formats(int formats);
+
+// the most SIMD the decoders may use (STBI_SIMD_*), returns the level in
+// effect. see SIMD support above
+STBIDEF int stbi_set_simd_level(int level);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -583,6 +803,55 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #define STBI_NO_ZLIB
 #endif
 
+// the STBI_FORMAT_* bits of the decoders compiled in
+#ifdef STBI_NO_JPEG
+#define STBI__BUILT_JPEG 0
+#else
+#define STBI__BUILT_JPEG STBI_FORMAT_JPEG
+#endif
+#ifdef STBI_NO_PNG
+#define STBI__BUILT_PNG 0
+#else
+#define STBI__BUILT_PNG STBI_FORMAT_PNG
+#endif
+#ifdef STBI_NO_BMP
+#define STBI__BUILT_BMP 0
+#else
+#define STBI__BUILT_BMP STBI_FORMAT_BMP
+#endif
+#ifdef STBI_NO_PSD
+#define STBI__BUILT_PSD 0
+#else
+#define STBI__BUILT_PSD STBI_FORMAT_PSD
+#endif
+#ifdef STBI_NO_TGA
+#define STBI__BUILT_TGA 0
+#else
+#define STBI__BUILT_TGA STBI_FORMAT_TGA
+#endif
+#ifdef STBI_NO_GIF
+#define STBI__BUILT_GIF 0
+#else
+#define STBI__BUILT_GIF STBI_FORMAT_GIF
+#endif
+#ifdef STBI_NO_HDR
+#define STBI__BUILT_HDR 0
+#else
+#define STBI__BUILT_HDR STBI_FORMAT_HDR
+#endif
+#ifdef STBI_NO_PIC
+#define STBI__BUILT_PIC 0
+#else
+#define STBI__BUILT_PIC STBI_FORMAT_PIC
+#endif
+#ifdef STBI_NO_PNM
+#define STBI__BUILT_PNM 0
+#else
+#define STBI__BUILT_PNM STBI_FORMAT_PNM
+#endif
+#define STBI__FORMATS_BUILT (STBI__BUILT_JPEG | STBI__BUILT_PNG | STBI__BUILT_BMP | STBI__BUILT_PSD | STBI__BUILT_TGA \
+                           | STBI__BUILT_GIF | STBI__BUILT_HDR | STBI__BUILT_PIC | STBI__BUILT_PNM)
+
 
 #include <stdarg.h>
 #include <stddef.h> // ptrdiff_t on osx
@@ -596,6 +865,13 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
+#if !defined(STBI_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define STBI__USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #endif
 
 #ifndef STBI_ASSERT
@@ -638,17 +914,67 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
    #endif
 #endif
 
+#if !defined(STBI_NO_THREADS) && !defined(STBI_NO_JPEG)
+   #if defined(__cplusplus) && (__cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L))
+      #define STBI__THREADS_CPP
+      #include <thread>
+      #include <mutex>
+      #include <condition_variable>
+   #elif defined(__unix__) || defined(__APPLE__)
+      #define STBI__THREADS_PTHREAD
+      #include <pthread.h>
+      #include <unistd.h>
+   #endif
+   #if defined(STBI__THREADS_CPP) || defined(STBI__THREADS_PTHREAD)
+      #define STBI__THREADS
+   #endif
+#endif
+
+// the few ints that threads share (the JPEG workers' failed flag, the cached
+// cpuid answer) are read and written through these. it's the caller's threads
+// too, so they're needed even with STBI_NO_THREADS
+#if defined(__cplusplus) && (__cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L))
+   #include <atomic>
+   typedef std::atomic<int> stbi__atomic_int;
+   #define stbi__atomic_load(a)        (a)->load()
+   #define stbi__atomic_store(a,v)     (a)->store(v)
+   #define stbi__atomic_exchange(a,v)  (a)->exchange(v)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+   #include <stdatomic.h>
+   typedef atomic_int stbi__atomic_int;
+   #define stbi__atomic_load(a)        atomic_load(a)
+   #define stbi__atomic_store(a,v)     atomic_store(a,v)
+   #define stbi__atomic_exchange(a,v)  atomic_exchange(a,v)
+#elif defined(_MSC_VER)
+   #include <intrin.h>
+   typedef long stbi__atomic_int;
+   #define stbi__atomic_load(a)        _InterlockedOr(a, 0)
+   #define stbi__atomic_store(a,v)     ((void) _InterlockedExchange(a, v))
+   #define stbi__atomic_exchange(a,v)  _InterlockedExchange(a, v)
+#else
+   typedef int stbi__atomic_int;
+   #define stbi__atomic_load(a)        __atomic_load_n(a, __ATOMIC_SEQ_CST)
+   #define stbi__atomic_store(a,v)     __atomic_store_n(a, v, __ATOMIC_SEQ_CST)
+   #define stbi__atomic_exchange(a,v)  __atomic_exchange_n(a, v, __ATOMIC_SEQ_CST)
+#endif
+
 #if defined(_MSC_VER) || defined(__SYMBIAN32__)
 typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi__uint64;
+#else
+typedef unsigned long long stbi__uint64;
+#endif
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -660,16 +986,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 #endif
 
-#ifdef _MSC_VER
-#define STBI_HAS_LROTL
-#endif
-
-#ifdef STBI_HAS_LROTL
-   #define stbi_lrot(x,y)  _lrotl(x,y)
-#else
-   #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (-(y) & 31)))
-#endif
-
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
 // ok
 #elif !defined(STBI_MALLOC) && !defined(STBI_FREE) && !defined(STBI_REALLOC) && !defined(STBI_REALLOC_SIZED)
@@ -721,6 +1037,9 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_NO_SIMD
 #endif
 
+// set by stbi_set_simd_level, the _available functions below check it first
+static int stbi__simd_level = STBI_SIMD_AVX2;
+
 #if !defined(STBI_NO_SIMD) && (defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET))
 #define STBI_SSE2
 #include <emmintrin.h>
@@ -750,28 +1069,145 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
-   int info3 = stbi__cpuid3();
+   int info3;
+   if (stbi__simd_level < STBI_SIMD_SSE2) return 0;
+   info3 = stbi__cpuid3();
    return ((info3 >> 26) & 1) != 0;
 }
-#endif
 
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
    // -msse2 is on, which means the compiler is allowed to use SSE2
    // instructions at will, and so are we.
-   return 1;
+   return stbi__simd_level >= STBI_SIMD_SSE2;
+}
+
+#endif
+#endif
+
+// AVX2 versions of the JPEG and format conversion kernels are compiled next to
+// the SSE2 ones (with a function target attribute on GCC/Clang, so no -mavx2 is
+// needed) and are only used if stbi__avx2_available() finds the CPU and OS
+// support them. define STBI_NO_AVX2 to leave them out. the channel shuffles
+// use SSSE3 the same way, define STBI_NO_SSSE3 to leave those out.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2)
+   #if defined(_MSC_VER) && !defined(__clang__)
+      #if _MSC_VER >= 1800 // VS2013
+         #define STBI_AVX2
+         #define STBI__AVX2_TARGET
+      #endif
+   #elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+      #define STBI_AVX2
+      #define STBI__AVX2_TARGET __attribute__((target("avx2")))
+   #endif
+#endif
+
+#if defined(STBI_SSE2) && !defined(STBI_NO_SSSE3)
+   #if defined(_MSC_VER) && !defined(__clang__)
+      #if _MSC_VER >= 1500 // VS2008
+         #define STBI_SSSE3
+         #define STBI__SSSE3_TARGET
+      #endif
+   #elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+      #define STBI_SSSE3
+      #define STBI__SSSE3_TARGET __attribute__((target("ssse3")))
+   #endif
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+#endif
+#ifdef STBI_SSSE3
+#include <tmmintrin.h>
+#endif
+#if (defined(STBI_AVX2) || defined(STBI_SSSE3)) && !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+
+#ifdef STBI_AVX2
+static int stbi__avx2_detect(void)
+{
+   // AVX2 needs the CPU flag, and the OS has to save the ymm registers
+   // (OSXSAVE and AVX set, XCR0 enables SSE and AVX state)
+   unsigned int osxsave_avx = (1u << 27) | (1u << 28);
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info, 0);
+   if (info[0] < 7) return 0;
+   __cpuid(info, 1);
+   if (((unsigned int) info[2] & osxsave_avx) != osxsave_avx) return 0;
+   if ((_xgetbv(0) & 6) != 6) return 0;
+   __cpuidex(info, 7, 0);
+   return (info[1] >> 5) & 1;
+#else
+   unsigned int a, b, c, d, xcr0;
+   if (__get_cpuid_max(0, NULL) < 7) return 0;
+   __cpuid(1, a, b, c, d);
+   if ((c & osxsave_avx) != osxsave_avx) return 0;
+   __asm__ ("xgetbv" : "=a" (xcr0), "=d" (d) : "c" (0));
+   if ((xcr0 & 6) != 6) return 0;
+   __cpuid_count(7, 0, a, b, c, d);
+   return (b >> 5) & 1;
+#endif
+}
+#endif
+
+#if defined(STBI_AVX2) || defined(STBI_SSSE3)
+#define STBI__CPU_CHECKED  1
+#define STBI__CPU_SSSE3    2
+#define STBI__CPU_AVX2     4
+
+// cpuid is slow (a VM exit under a hypervisor) and the conversions ask once
+// per row, so both features are detected together the first time and kept.
+// any loading thread can be the first to ask, hence the atomic
+static stbi__atomic_int stbi__cpu_features_cache;
+
+static int stbi__cpu_features(void)
+{
+   int features = stbi__atomic_load(&stbi__cpu_features_cache);
+   if (!features) {
+      features = STBI__CPU_CHECKED;
+#ifdef STBI_SSSE3
+      {
+#ifdef _MSC_VER
+         int info[4];
+         __cpuid(info, 1);
+         if ((info[2] >> 9) & 1) features |= STBI__CPU_SSSE3;
+#else
+         unsigned int a, b, c, d;
+         if (__get_cpuid(1, &a, &b, &c, &d) && ((c >> 9) & 1)) features |= STBI__CPU_SSSE3;
+#endif
+      }
+#endif
+#ifdef STBI_AVX2
+      if (stbi__avx2_detect()) features |= STBI__CPU_AVX2;
+#endif
+      stbi__atomic_store(&stbi__cpu_features_cache, features);
+   }
+   return features;
 }
 #endif
 
+#ifdef STBI_AVX2
+static int stbi__avx2_available(void)
+{
+   if (stbi__simd_level < STBI_SIMD_AVX2) return 0;
+   return (stbi__cpu_features() & STBI__CPU_AVX2) != 0;
+}
 #endif
+
+#ifdef STBI_SSSE3
+static int stbi__ssse3_available(void)
+{
+   if (stbi__simd_level < STBI_SIMD_SSE2) return 0;
+   return (stbi__cpu_features() & STBI__CPU_SSSE3) != 0;
+}
 #endif
 
 // ARM NEON
@@ -817,6 +1253,18 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   int scale_shift; // load at 1/(1<<scale_shift) size, see stbi_load_scaled
+   int max_scans;   // progressive JPEGs: stop after this many scans, 0 for all
+   int formats;     // STBI_FORMAT_* bits, 0 uses stbi_set_enabled_formats
+   int jpeg_threads; // threads for a JPEG, 0 uses stbi_set_jpeg_thread_count
+   int region_x, region_y, region_w, region_h; // only this part, see stbi_load_region; region_w == 0 for all
+   stbi_uc *out;    // stbi_load_into's buffer, NULL for the other loads
+   int out_stride;
+   size_t out_size;
+
+   // per-load settings from stbi_options, -1 uses the stbi_set_* value
+   int flip, unpremultiply, de_iphone;
 } stbi__context;
 
 
@@ -830,6 +1278,13 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->scale_shift = 0;
+   s->max_scans = 0;
+   s->formats = 0;
+   s->jpeg_threads = 0;
+   s->region_w = 0;
+   s->out = NULL;
+   s->flip = s->unpremultiply = s->de_iphone = -1;
 }
 
 // initialize a callback-based context
@@ -840,6 +1295,13 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
+   s->scale_shift = 0;
+   s->max_scans = 0;
+   s->formats = 0;
+   s->jpeg_threads = 0;
+   s->region_w = 0;
+   s->out = NULL;
+   s->flip = s->unpremultiply = s->de_iphone = -1;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
@@ -903,6 +1365,10 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int scale_shift;   // how much the loader already scaled down by itself
+   int flipped;       // the loader already stored the rows bottom up
+   int region_x, region_y; // where the result starts in the whole image, for loaders that decode only around s->region
+   int direct;        // the loader wrote the final rows straight to s->out, see stbi__out_image
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -982,11 +1448,48 @@ static int stbi__err(const char *str)
 }
 #endif
 
+// the allocator passed to the load running on this thread, NULL for
+// STBI_MALLOC/STBI_REALLOC/STBI_FREE. without thread locals it's shared
+// by all threads, so only one such load may run at a time
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+stbi_allocator const *stbi__allocator;
+
 static void *stbi__malloc(size_t size)
 {
+    if (stbi__allocator)
+       return stbi__allocator->alloc(stbi__allocator->user, size);
     return STBI_MALLOC(size);
 }
 
+static void stbi__free(void *p)
+{
+   if (stbi__allocator) {
+      if (p) stbi__allocator->free(stbi__allocator->user, p);
+      return;
+   }
+   STBI_FREE(p);
+}
+
+static void *stbi__realloc_sized(void *p, size_t oldsz, size_t newsz)
+{
+   void *q;
+   if (!stbi__allocator)
+      return STBI_REALLOC_SIZED(p, oldsz, newsz);
+   if (stbi__allocator->realloc)
+      return stbi__allocator->realloc(stbi__allocator->user, p, oldsz, newsz);
+   // no realloc, so allocate and copy
+   q = stbi__malloc(newsz);
+   if (q == NULL) return NULL;
+   if (p) {
+      memcpy(q, p, oldsz < newsz ? oldsz : newsz);
+      stbi__free(p);
+   }
+   return q;
+}
+
 // stb_image uses ints pervasively, including for offset calculations.
 // therefore the largest decoded image size we can support with the
 // current code, even on 64-bit targets, is INT_MAX. this is not a
@@ -1134,88 +1637,294 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
+#define stbi__flip_on_load(s)  ((s)->flip >= 0 ? (s)->flip : stbi__vertically_flip_on_load)
+
+// loaders that can store their rows bottom up as they go call this, and do
+// so if it returns 1; the flip pass after loading is then skipped. not when
+// the image is box filtered afterwards, as that would group the rows from
+// the wrong end
+static int stbi__flip_in_loader(stbi__context *s, stbi__result_info *ri)
+{
+   ri->flipped = stbi__flip_on_load(s) && s->scale_shift == ri->scale_shift;
+   return ri->flipped;
+}
+
+// clips s->region to a w x h image, or to a w x h part of it that starts at
+// ox,oy, and makes it relative to that; returns 0 if none of it is left
+static int stbi__region_clip(stbi__context *s, int ox, int oy, stbi__uint32 w, stbi__uint32 h, stbi__uint32 *rx, stbi__uint32 *ry, stbi__uint32 *rw, stbi__uint32 *rh)
+{
+   stbi__uint32 x = (stbi__uint32) (s->region_x - ox), y = (stbi__uint32) (s->region_y - oy);
+   if (x >= w || y >= h) return 0;
+   *rx = x;
+   *ry = y;
+   *rw = (stbi__uint32) s->region_w < w - x ? (stbi__uint32) s->region_w : w - x;
+   *rh = (stbi__uint32) s->region_h < h - y ? (stbi__uint32) s->region_h : h - y;
+   return 1;
+}
+
+// stbi_load_into: fails if a w x h image of n channels doesn't fit the
+// caller's buffer. the loaders call it once they've read the header, so no
+// time goes into decoding an image that can't be stored
+static int stbi__out_check(stbi__context *s, stbi__uint32 w, stbi__uint32 h, int n)
+{
+   size_t row = (size_t) w * n;
+   if (!s->out) return 1;
+   if (row == 0 || row > s->out_size || (size_t) s->out_stride < row || (h > 1 && (size_t) (h-1) > (s->out_size - row) / (size_t) s->out_stride))
+      return stbi__err("buffer too small", "Output buffer too small for image");
+   return 1;
+}
+
+// whether a loader can store its rows straight into stbi_load_into's buffer:
+// not when the image is cropped or box filtered afterwards
+static int stbi__out_direct(stbi__context *s)
+{
+   return s->out && !s->region_w && !s->scale_shift;
+}
+
+// loaders that write every row once, 8 bits per channel and already
+// converted to the channels asked for, get their image from here: for
+// stbi_load_into the caller's buffer (if 'final', ie. the rows really are),
+// which sets *direct, otherwise a new w*h*n image with 'extra' bytes after
+// it. *stride is set to the bytes from one row to the next. the loader must
+// store the rows bottom up itself when flipping, and must not free the
+// caller's buffer
+static stbi_uc *stbi__out_image(stbi__context *s, int *direct, int final, int w, int h, int n, int extra, int *stride)
+{
+   if (final && stbi__out_direct(s)) {
+      *direct = 1;
+      *stride = s->out_stride;
+      return s->out;
+   }
+   *stride = w * n;
+   return (stbi_uc *) stbi__malloc_mad3(w, h, n, extra);
+}
+
+static int stbi__jpeg_thread_count = 0;
+
+STBIDEF void stbi_set_jpeg_thread_count(int thread_count)
+{
+   stbi__jpeg_thread_count = thread_count;
+}
+
+STBIDEF int stbi_set_simd_level(int level)
+{
+   stbi__simd_level = level < STBI_SIMD_NONE ? STBI_SIMD_NONE : level > STBI_SIMD_AVX2 ? STBI_SIMD_AVX2 : level;
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) return STBI_SIMD_AVX2;
+#endif
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) return STBI_SIMD_SSE2;
+#endif
+   return STBI_SIMD_NONE;
+}
+
+static int stbi__enabled_formats_global = 0;
+
+STBIDEF void stbi_set_enabled_formats(int formats)
+{
+   stbi__enabled_formats_global = formats;
+}
+
+// the decoders to try: the per-load bits, else the global ones, limited to
+// the ones compiled in
+static int stbi__enabled_formats(int formats)
+{
+   if (!formats) formats = stbi__enabled_formats_global;
+   if (!formats) formats = STBI_FORMAT_ALL;
+   return formats & STBI__FORMATS_BUILT;
+}
+
+#define STBI__PEEK 92 // up to the "PICT" of a Softimage PIC header
+
+// picks the decoder from the first bytes in the buffer, so unlike the _test
+// functions nothing is read or rewound. it checks the same bytes they do
+// (past the end of the file they're 0, as stbi__get8 returns), so the result
+// is the one the tests would give: STBI_FORMAT_TGA when no signature
+// matches, as TGA has none. returns 0 when a callback read came up short and
+// the bytes needed aren't all buffered yet; then the tests have to be run
+static int stbi__peek_format(stbi__context *s)
+{
+   stbi_uc h[STBI__PEEK];
+   int n = (int) (s->img_buffer_end - s->img_buffer), i;
+   stbi__uint32 sz;
+   if (n > STBI__PEEK) n = STBI__PEEK;
+   if (n < STBI__PEEK && s->read_from_callbacks && !(s->io.eof)(s->io_user_data))
+      return 0;
+   memcpy(h, s->img_buffer, n);
+   memset(h + n, 0, STBI__PEEK - n);
+
+   if (memcmp(h, "\x89PNG\r\n\x1a\n", 8) == 0) return STBI_FORMAT_PNG;
+   if (h[0] == 'B' && h[1] == 'M') {
+      sz = h[14] | (h[15] << 8) | (h[16] << 16) | ((stbi__uint32) h[17] << 24);
+      if (sz == 12 || sz == 40 || sz == 56 || sz == 108 || sz == 124) return STBI_FORMAT_BMP;
+   }
+   if (memcmp(h, "GIF8", 4) == 0 && (h[4] == '7' || h[4] == '9') && h[5] == 'a') return STBI_FORMAT_GIF;
+   if (memcmp(h, "8BPS", 4) == 0) return STBI_FORMAT_PSD;
+   if (memcmp(h, "\x53\x80\xF6\x34", 4) == 0 && memcmp(h + 88, "PICT", 4) == 0) return STBI_FORMAT_PIC;
+   if (h[0] == 0xff) {
+      // an SOI marker, which may have fill bytes before it
+      for (i=1; i < STBI__PEEK && h[i] == 0xff; ++i)
+         ;
+      if (i == STBI__PEEK) return 0;
+      if (h[i] == 0xd8) return STBI_FORMAT_JPEG;
+   }
+   if (h[0] == 'P' && (h[1] == '5' || h[1] == '6')) return STBI_FORMAT_PNM;
+   if (memcmp(h, "#?RADIANCE\n", 11) == 0 || memcmp(h, "#?RGBE\n", 7) == 0) return STBI_FORMAT_HDR;
+   return STBI_FORMAT_TGA;
+}
+
+// whether to go on with decoder 'f': the one the peek picked, or, if it
+// couldn't pick one, any enabled decoder whose test passes
+#define STBI__USE(f, test)  (fmt ? fmt == (f) : (enabled & (f)) && (test))
+
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
+   int fmt, enabled;
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
    ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
    ri->num_channels = 0;
 
-   // test the formats with a very explicit header first (at least a FOURCC
-   // or distinctive magic number first)
+   fmt = stbi__peek_format(s);
+   enabled = stbi__enabled_formats(s->formats);
+   if (fmt && fmt != STBI_FORMAT_TGA && !(fmt & enabled))
+      return stbi__errpuc("format disabled", "Image format not enabled");
+
+   // without a peek, test the formats with a very explicit header first (at
+   // least a FOURCC or distinctive magic number first)
    #ifndef STBI_NO_PNG
-   if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp, ri);
+   if (STBI__USE(STBI_FORMAT_PNG, stbi__png_test(s)))  return stbi__png_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_BMP
-   if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
+   if (STBI__USE(STBI_FORMAT_BMP, stbi__bmp_test(s)))  return stbi__bmp_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_GIF
-   if (stbi__gif_test(s))  return stbi__gif_load(s,x,y,comp,req_comp, ri);
+   if (STBI__USE(STBI_FORMAT_GIF, stbi__gif_test(s)))  return stbi__gif_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PSD
-   if (stbi__psd_test(s))  return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
+   if (STBI__USE(STBI_FORMAT_PSD, stbi__psd_test(s)))  return stbi__psd_load(s,x,y,comp,req_comp, ri, bpc);
    #else
    STBI_NOTUSED(bpc);
    #endif
    #ifndef STBI_NO_PIC
-   if (stbi__pic_test(s))  return stbi__pic_load(s,x,y,comp,req_comp, ri);
+   if (STBI__USE(STBI_FORMAT_PIC, stbi__pic_test(s)))  return stbi__pic_load(s,x,y,comp,req_comp, ri);
    #endif
 
    // then the formats that can end up attempting to load with just 1 or 2
    // bytes matching expectations; these are prone to false positives, so
    // try them later
    #ifndef STBI_NO_JPEG
-   if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
+   if (STBI__USE(STBI_FORMAT_JPEG, stbi__jpeg_test(s))) return stbi__jpeg_load(s,x,y,comp,req_comp, ri);
    #endif
    #ifndef STBI_NO_PNM
-   if (stbi__pnm_test(s))  return stbi__pnm_load(s,x,y,comp,req_comp, ri);
+   if (STBI__USE(STBI_FORMAT_PNM, stbi__pnm_test(s)))  return stbi__pnm_load(s,x,y,comp,req_comp, ri);
    #endif
 
    #ifndef STBI_NO_HDR
-   if (stbi__hdr_test(s)) {
+   if (STBI__USE(STBI_FORMAT_HDR, stbi__hdr_test(s))) {
       float *hdr = stbi__hdr_load(s, x,y,comp,req_comp, ri);
+      if (hdr && ri->direct) {
+         // the rows went to s->out as LDR, hdr only holds the last one
+         stbi__free(hdr);
+         return s->out;
+      }
       return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
    }
    #endif
 
    #ifndef STBI_NO_TGA
-   // test tga last because it's a crappy test!
-   if (stbi__tga_test(s))
+   // test tga last because it's a crappy test! it runs even after a peek
+   if ((fmt == 0 || fmt == STBI_FORMAT_TGA) && (enabled & STBI_FORMAT_TGA) && stbi__tga_test(s))
       return stbi__tga_load(s,x,y,comp,req_comp, ri);
    #endif
 
    return stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
-static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int channels)
+#ifdef STBI_AVX2
+// both return the number of channels done, the SSE2 and scalar loops do the rest
+STBI__AVX2_TARGET
+static int stbi__convert_16_to_8_avx2(stbi_uc *reduced, stbi__uint16 const *orig, int len)
 {
    int i;
+   for (i = 0; i + 32 <= len; i += 32) {
+      __m256i lo = _mm256_srli_epi16(_mm256_loadu_si256((__m256i const *) (orig + i)), 8);
+      __m256i hi = _mm256_srli_epi16(_mm256_loadu_si256((__m256i const *) (orig + i + 16)), 8);
+      // packus works per 128-bit lane, the permute puts the quarters back in order
+      _mm256_storeu_si256((__m256i *) (reduced + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8));
+   }
+   return i;
+}
+
+STBI__AVX2_TARGET
+static int stbi__convert_8_to_16_avx2(stbi__uint16 *enlarged, stbi_uc const *orig, int len)
+{
+   int i;
+   for (i = 0; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_permute4x64_epi64(_mm256_loadu_si256((__m256i const *) (orig + i)), 0xd8);
+      // a byte next to itself is the byte * 257
+      _mm256_storeu_si256((__m256i *) (enlarged + i), _mm256_unpacklo_epi8(v, v));
+      _mm256_storeu_si256((__m256i *) (enlarged + i + 16), _mm256_unpackhi_epi8(v, v));
+   }
+   return i;
+}
+#endif
+
+static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int channels)
+{
+   int i = 0;
    int img_len = w * h * channels;
    stbi_uc *reduced;
 
    reduced = (stbi_uc *) stbi__malloc(img_len);
    if (reduced == NULL) return stbi__errpuc("outofmem", "Out of memory");
 
-   for (i = 0; i < img_len; ++i)
+#ifdef STBI_AVX2
+   if (stbi__avx2_available())
+      i = stbi__convert_16_to_8_avx2(reduced, orig, img_len);
+#endif
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      for (; i + 16 <= img_len; i += 16) {
+         __m128i lo = _mm_srli_epi16(_mm_loadu_si128((__m128i const *) (orig + i)), 8);
+         __m128i hi = _mm_srli_epi16(_mm_loadu_si128((__m128i const *) (orig + i + 8)), 8);
+         _mm_storeu_si128((__m128i *) (reduced + i), _mm_packus_epi16(lo, hi));
+      }
+   }
+#endif
+   for (; i < img_len; ++i)
       reduced[i] = (stbi_uc)((orig[i] >> 8) & 0xFF); // top half of each byte is sufficient approx of 16->8 bit scaling
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return reduced;
 }
 
 static stbi__uint16 *stbi__convert_8_to_16(stbi_uc *orig, int w, int h, int channels)
 {
-   int i;
+   int i = 0;
    int img_len = w * h * channels;
    stbi__uint16 *enlarged;
 
    enlarged = (stbi__uint16 *) stbi__malloc(img_len*2);
    if (enlarged == NULL) return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
 
-   for (i = 0; i < img_len; ++i)
+#ifdef STBI_AVX2
+   if (stbi__avx2_available())
+      i = stbi__convert_8_to_16_avx2(enlarged, orig, img_len);
+#endif
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      for (; i + 16 <= img_len; i += 16) {
+         __m128i v = _mm_loadu_si128((__m128i const *) (orig + i));
+         _mm_storeu_si128((__m128i *) (enlarged + i), _mm_unpacklo_epi8(v, v));
+         _mm_storeu_si128((__m128i *) (enlarged + i + 8), _mm_unpackhi_epi8(v, v));
+      }
+   }
+#endif
+   for (; i < img_len; ++i)
       enlarged[i] = (stbi__uint16)((orig[i] << 8) + orig[i]); // replicate to high and low byte, maps 0->0, 255->0xffff
 
-   STBI_FREE(orig);
+   stbi__free(orig);
    return enlarged;
 }
 
@@ -1257,6 +1966,52 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 }
 #endif
 
+// cuts s->region out of a loaded image in place. the loader may have returned
+// only the part around it, starting at ri->region_x,region_y, and if it stored
+// the rows bottom up the region's rows are counted from the bottom
+static void *stbi__crop_region(stbi__context *s, stbi__result_info *ri, void *image, int *x, int *y, int bytes_per_pixel)
+{
+   stbi_uc *p = (stbi_uc *) image;
+   stbi__uint32 rx, ry, rw, rh, j;
+   size_t in_stride = (size_t) *x * bytes_per_pixel;
+   if (!stbi__region_clip(s, ri->region_x, ri->region_y, *x, *y, &rx, &ry, &rw, &rh)) {
+      stbi__free(image);
+      return stbi__errpuc("bad region", "Region outside of the image");
+   }
+   if (ri->flipped) ry = *y - ry - rh;
+   for (j=0; j < rh; ++j)
+      memmove(p + (size_t) j * rw * bytes_per_pixel, p + in_stride * (ry + j) + (size_t) rx * bytes_per_pixel, (size_t) rw * bytes_per_pixel);
+   *x = rw;
+   *y = rh;
+   return image;
+}
+
+// box filters an image down by 1<<shift in place (the output never overtakes
+// the rows still being read); edge blocks average only the pixels they cover
+static void stbi__downscale_box(stbi_uc *data, int *x, int *y, int channels, int shift)
+{
+   int d = 1 << shift;
+   int w = *x, h = *y;
+   int nw = (w + d-1) >> shift, nh = (h + d-1) >> shift;
+   int i,j,k,u,v;
+   for (j=0; j < nh; ++j) {
+      int y0 = j << shift, y1 = y0+d < h ? y0+d : h;
+      for (i=0; i < nw; ++i) {
+         int x0 = i << shift, x1 = x0+d < w ? x0+d : w;
+         int count = (x1-x0) * (y1-y0);
+         for (k=0; k < channels; ++k) {
+            int sum = count >> 1;
+            for (v=y0; v < y1; ++v)
+               for (u=x0; u < x1; ++u)
+                  sum += data[((size_t) v*w + u)*channels + k];
+            data[((size_t) j*nw + i)*channels + k] = (stbi_uc) (sum / count);
+         }
+      }
+   }
+   *x = nw;
+   *y = nh;
+}
+
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
@@ -1265,6 +2020,10 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    if (result == NULL)
       return NULL;
 
+   // the rows are in the caller's buffer as they should be
+   if (ri.direct)
+      return (unsigned char *) result;
+
    // it is the responsibility of the loaders to make sure we get either 8 or 16 bit.
    STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
 
@@ -1275,7 +2034,17 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->region_w) {
+      result = stbi__crop_region(s, &ri, result, x, y, req_comp ? req_comp : *comp);
+      if (result == NULL) return NULL;
+   }
+
+   if (s->scale_shift > ri.scale_shift) {
+      int channels = req_comp ? req_comp : *comp;
+      stbi__downscale_box((stbi_uc *) result, x, y, channels, s->scale_shift - ri.scale_shift);
+   }
+
+   if (stbi__flip_on_load(s) && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1302,7 +2071,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (stbi__flip_on_load(s) && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1311,9 +2080,9 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
 }
 
 #if !defined(STBI_NO_HDR) && !defined(STBI_NO_LINEAR)
-static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
+static void stbi__float_postprocess(stbi__context *s, stbi__result_info *ri, float *result, int *x, int *y, int *comp, int req_comp)
 {
-   if (stbi__vertically_flip_on_load && result != NULL) {
+   if (stbi__flip_on_load(s) && !ri->flipped && result != NULL) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(float));
    }
@@ -1362,11 +2131,79 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
    return f;
 }
 
+// the whole file in memory, either mapped or read with one fread
+typedef struct
+{
+   stbi_uc *data;
+   size_t size;
+   int mapped;
+} stbi__whole_file;
+
+// returns 0 if the file can't be opened this way; the caller then uses the stdio path
+static int stbi__open_whole_file(char const *filename, stbi__whole_file *w)
+{
+   FILE *f;
+   long len;
+#ifdef STBI__USE_MMAP
+   int fd = open(filename, O_RDONLY);
+   if (fd >= 0) {
+      struct stat st;
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= INT_MAX) {
+         void *p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (p != MAP_FAILED) {
+            close(fd); // the mapping stays valid after the descriptor is closed
+            w->data = (stbi_uc *) p;
+            w->size = (size_t) st.st_size;
+            w->mapped = 1;
+            return 1;
+         }
+      }
+      close(fd);
+   }
+#endif
+   f = stbi__fopen(filename, "rb");
+   if (!f) return 0;
+   if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) <= 0 || len > INT_MAX || fseek(f, 0, SEEK_SET) != 0) {
+      fclose(f);
+      return 0;
+   }
+   w->data = (stbi_uc *) stbi__malloc((size_t) len);
+   if (w->data && fread(w->data, 1, (size_t) len, f) == (size_t) len) {
+      fclose(f);
+      w->size = (size_t) len;
+      w->mapped = 0;
+      return 1;
+   }
+   if (w->data) stbi__free(w->data);
+   fclose(f);
+   return 0;
+}
+
+static void stbi__close_whole_file(stbi__whole_file *w)
+{
+#ifdef STBI__USE_MMAP
+   if (w->mapped) {
+      munmap(w->data, w->size);
+      return;
+   }
+#endif
+   stbi__free(w->data);
+}
+
 
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    unsigned char *result;
+   stbi__whole_file w;
+   if (stbi__open_whole_file(filename, &w)) {
+      stbi__context s;
+      stbi__start_mem(&s, w.data, (int) w.size);
+      result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+      stbi__close_whole_file(&w);
+      return result;
+   }
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -1401,8 +2238,17 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
 
 STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
    stbi__uint16 *result;
+   stbi__whole_file w;
+   if (stbi__open_whole_file(filename, &w)) {
+      stbi__context s;
+      stbi__start_mem(&s, w.data, (int) w.size);
+      result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+      stbi__close_whole_file(&w);
+      return result;
+   }
+   f = stbi__fopen(filename, "rb");
    if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file_16(f,x,y,comp,req_comp);
    fclose(f);
@@ -1440,16 +2286,255 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
-#ifndef STBI_NO_GIF
-STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
+static int stbi__scale_shift(int scale_denom)
 {
-   unsigned char *result;
-   stbi__context s;
-   stbi__start_mem(&s,buffer,len);
+   switch (scale_denom) {
+      case 1: return 0;
+      case 2: return 1;
+      case 4: return 2;
+      case 8: return 3;
+      default: return -1;
+   }
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale_denom)
+{
+   stbi__context s;
+   int shift = stbi__scale_shift(scale_denom);
+   if (shift < 0) return stbi__errpuc("bad scale", "scale_denom must be 1, 2, 4 or 8");
+   stbi__start_mem(&s,buffer,len);
+   s.scale_shift = shift;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale_denom)
+{
+   FILE *f;
+   unsigned char *result;
+   stbi__context s;
+   stbi__whole_file w;
+   int shift = stbi__scale_shift(scale_denom);
+   if (shift < 0) return stbi__errpuc("bad scale", "scale_denom must be 1, 2, 4 or 8");
+   if (stbi__open_whole_file(filename, &w)) {
+      stbi__start_mem(&s, w.data, (int) w.size);
+      s.scale_shift = shift;
+      result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+      stbi__close_whole_file(&w);
+      return result;
+   }
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   s.scale_shift = shift;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+#endif
+
+static int stbi__set_region(stbi__context *s, int region_x, int region_y, int region_w, int region_h)
+{
+   if (region_x < 0 || region_y < 0 || region_w <= 0 || region_h <= 0) return stbi__err("bad region", "Region must be inside the image and not empty");
+   s->region_x = region_x;
+   s->region_y = region_y;
+   s->region_w = region_w;
+   s->region_h = region_h;
+   return 1;
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_memory(stbi_uc const *buffer, int len, int region_x, int region_y, int region_w, int region_h, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   if (!stbi__set_region(&s, region_x, region_y, region_w, region_h)) return NULL;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int region_x, int region_y, int region_w, int region_h, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   unsigned char *result;
+   stbi__context s;
+   stbi__whole_file w;
+   if (stbi__open_whole_file(filename, &w)) {
+      stbi__start_mem(&s, w.data, (int) w.size);
+      result = stbi__set_region(&s, region_x, region_y, region_w, region_h) ? stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp) : NULL;
+      stbi__close_whole_file(&w);
+      return result;
+   }
+   f = stbi__fopen(filename, "rb");
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__set_region(&s, region_x, region_y, region_w, region_h) ? stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp) : NULL;
+   fclose(f);
+   return result;
+}
+#endif
+
+// decodes into the caller's buffer; stbi__allocator must already be set, as
+// the source may have been read with it. the loaders check the buffer size
+// after reading the header (see stbi__out_check), and the ones that write
+// each row once in its final form store the rows straight into it (see
+// stbi__out_image); the rest decode to an image of their own that's copied
+static int stbi__load_into(stbi__context *s, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi_uc *result;
+   size_t row;
+   int j;
+   if (out == NULL || out_stride <= 0) return stbi__err("buffer too small", "Output buffer too small for image");
+   s->out = out;
+   s->out_stride = out_stride;
+   s->out_size = out_size;
+   result = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+   if (result == NULL) return 0;
+   if (result == out) return 1;
+   row = (size_t) *x * (req_comp ? req_comp : *comp);
+   if (!stbi__out_check(s, *x, *y, req_comp ? req_comp : *comp)) {
+      stbi__free(result);
+      return 0;
+   }
+   for (j=0; j < *y; ++j)
+      memcpy(out + (size_t) out_stride * j, result + row * j, row);
+   stbi__free(result);
+   return 1;
+}
+
+STBIDEF int stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi__context s;
+   int result;
+   stbi__allocator = alloc;
+   stbi__start_mem(&s,buffer,len);
+   result = stbi__load_into(&s,out,out_stride,out_size,x,y,comp,req_comp);
+   stbi__allocator = prev;
+   return result;
+}
+
+STBIDEF int stbi_load_from_callbacks_into(stbi_io_callbacks const *clbk, void *user, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi__context s;
+   int result;
+   stbi__allocator = alloc;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   result = stbi__load_into(&s,out,out_stride,out_size,x,y,comp,req_comp);
+   stbi__allocator = prev;
+   return result;
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *out, int out_stride, size_t out_size, int *x, int *y, int *comp, int req_comp, stbi_allocator const *alloc)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi__context s;
+   stbi__whole_file w;
+   int result;
+   stbi__allocator = alloc;
+   if (stbi__open_whole_file(filename, &w)) {
+      stbi__start_mem(&s, w.data, (int) w.size);
+      result = stbi__load_into(&s,out,out_stride,out_size,x,y,comp,req_comp);
+      stbi__close_whole_file(&w);
+   } else {
+      FILE *f = stbi__fopen(filename, "rb");
+      if (f) {
+         stbi__start_file(&s,f);
+         result = stbi__load_into(&s,out,out_stride,out_size,x,y,comp,req_comp);
+         fclose(f);
+      } else
+         result = stbi__err("can't fopen", "Unable to open file");
+   }
+   stbi__allocator = prev;
+   return result;
+}
+#endif
+
+#ifndef STBI_NO_LINEAR
+static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+#endif
+
+// stbi__allocator must already be set to opt->alloc
+static void *stbi__load_ex(stbi__context *s, stbi_options const *opt, int *x, int *y, int *comp)
+{
+   s->flip = opt->flip_vertically != 0;
+   s->unpremultiply = opt->unpremultiply != 0;
+   s->de_iphone = opt->convert_iphone_png != 0;
+   s->max_scans = opt->max_scans > 0 ? opt->max_scans : 0;
+   s->formats = opt->formats;
+   s->jpeg_threads = opt->jpeg_threads > 0 ? opt->jpeg_threads : 0;
+   if (opt->bits_per_channel == 16)
+      return stbi__load_and_postprocess_16bit(s,x,y,comp,opt->desired_channels);
+   #ifndef STBI_NO_LINEAR
+   if (opt->bits_per_channel == 32)
+      return stbi__loadf_main(s,x,y,comp,opt->desired_channels);
+   #endif
+   if (opt->bits_per_channel != 8 && opt->bits_per_channel != 0)
+      return stbi__errpuc("bad bits_per_channel", "bits_per_channel must be 8, 16 or 32");
+   return stbi__load_and_postprocess_8bit(s,x,y,comp,opt->desired_channels);
+}
+
+STBIDEF void *stbi_load_from_memory_ex(stbi_options const *opt, stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi__context s;
+   void *result;
+   stbi__allocator = opt->alloc;
+   stbi__start_mem(&s,buffer,len);
+   result = stbi__load_ex(&s,opt,x,y,comp);
+   stbi__allocator = prev;
+   return result;
+}
+
+STBIDEF void *stbi_load_from_callbacks_ex(stbi_options const *opt, stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi__context s;
+   void *result;
+   stbi__allocator = opt->alloc;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   result = stbi__load_ex(&s,opt,x,y,comp);
+   stbi__allocator = prev;
+   return result;
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF void *stbi_load_ex(stbi_options const *opt, char const *filename, int *x, int *y, int *comp)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi__context s;
+   stbi__whole_file w;
+   void *result;
+   stbi__allocator = opt->alloc;
+   if (stbi__open_whole_file(filename, &w)) {
+      stbi__start_mem(&s, w.data, (int) w.size);
+      result = stbi__load_ex(&s,opt,x,y,comp);
+      stbi__close_whole_file(&w);
+   } else {
+      FILE *f = stbi__fopen(filename, "rb");
+      if (f) {
+         stbi__start_file(&s,f);
+         result = stbi__load_ex(&s,opt,x,y,comp);
+         fclose(f);
+      } else
+         result = stbi__errpuc("can't fopen", "Unable to open file");
+   }
+   stbi__allocator = prev;
+   return result;
+}
+#endif
+
+#ifndef STBI_NO_GIF
+STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
+{
+   unsigned char *result;
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
 
    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
-   if (stbi__vertically_flip_on_load) {
-      stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
+   if (stbi__flip_on_load(&s)) {
+      stbi__vertical_flip_slices( result, *x, *y, *z, req_comp ? req_comp : *comp );
    }
 
    return result;
@@ -1461,11 +2546,14 @@ static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int
 {
    unsigned char *data;
    #ifndef STBI_NO_HDR
-   if (stbi__hdr_test(s)) {
+   int fmt = stbi__peek_format(s), enabled = stbi__enabled_formats(s->formats);
+   if (STBI__USE(STBI_FORMAT_HDR, stbi__hdr_test(s))) {
       stbi__result_info ri;
-      float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
+      float *hdr_data;
+      memset(&ri, 0, sizeof(ri));
+      hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
       if (hdr_data)
-         stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
+         stbi__float_postprocess(s,&ri,hdr_data,x,y,comp,req_comp);
       return hdr_data;
    }
    #endif
@@ -1493,7 +2581,16 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
    float *result;
-   FILE *f = stbi__fopen(filename, "rb");
+   FILE *f;
+   stbi__whole_file w;
+   if (stbi__open_whole_file(filename, &w)) {
+      stbi__context s;
+      stbi__start_mem(&s, w.data, (int) w.size);
+      result = stbi__loadf_main(&s,x,y,comp,req_comp);
+      stbi__close_whole_file(&w);
+      return result;
+   }
+   f = stbi__fopen(filename, "rb");
    if (!f) return stbi__errpf("can't fopen", "Unable to open file");
    result = stbi_loadf_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -1591,7 +2688,8 @@ enum
 {
    STBI__SCAN_load=0,
    STBI__SCAN_type,
-   STBI__SCAN_header
+   STBI__SCAN_header,
+   STBI__SCAN_idat    // png: read everything up to the first IDAT's data
 };
 
 static void stbi__refill_buffer(stbi__context *s)
@@ -1752,9 +2850,229 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
+#ifdef STBI_SSSE3
+// the conversions that only move channels around shuffle 16 bytes at a time:
+// 'per' pixels of the source fit in the 16 bytes read and the same pixels of
+// the result in the 16 bytes written. indexed by [bytes-1][img_n-1][req_comp-1],
+// bytes is 1 or 2 (8 or 16 bits per channel). 128 clears a byte, 255 clears
+// it too and marks where the result gets an opaque alpha
+static const stbi_uc stbi__convert_shuf[2][4][4][16] =
+{
+   {
+      { { 0 },
+        {  0,255,  1,255,  2,255,  3,255,  4,255,  5,255,  6,255,  7,255 },  // 1 -> 2, 8 bits
+        {  0,  0,  0,  1,  1,  1,  2,  2,  2,  3,  3,  3,  4,  4,  4,128 },  // 1 -> 3, 8 bits
+        {  0,  0,  0,255,  1,  1,  1,255,  2,  2,  2,255,  3,  3,  3,255 } },  // 1 -> 4, 8 bits
+      { {  0,  2,  4,  6,  8, 10, 12, 14,128,128,128,128,128,128,128,128 },  // 2 -> 1, 8 bits
+        { 0 },
+        {  0,  0,  0,  2,  2,  2,  4,  4,  4,  6,  6,  6,  8,  8,  8,128 },  // 2 -> 3, 8 bits
+        {  0,  0,  0,  1,  2,  2,  2,  3,  4,  4,  4,  5,  6,  6,  6,  7 } },  // 2 -> 4, 8 bits
+      { { 0 },
+        { 0 },
+        { 0 },
+        {  0,  1,  2,255,  3,  4,  5,255,  6,  7,  8,255,  9, 10, 11,255 } },  // 3 -> 4, 8 bits
+      { { 0 },
+        { 0 },
+        {  0,  1,  2,  4,  5,  6,  8,  9, 10, 12, 13, 14,128,128,128,128 },  // 4 -> 3, 8 bits
+        { 0 } },
+   },
+   {
+      { { 0 },
+        {  0,  1,255,255,  2,  3,255,255,  4,  5,255,255,  6,  7,255,255 },  // 1 -> 2, 16 bits
+        {  0,  1,  0,  1,  0,  1,  2,  3,  2,  3,  2,  3,128,128,128,128 },  // 1 -> 3, 16 bits
+        {  0,  1,  0,  1,  0,  1,255,255,  2,  3,  2,  3,  2,  3,255,255 } },  // 1 -> 4, 16 bits
+      { {  0,  1,  4,  5,  8,  9, 12, 13,128,128,128,128,128,128,128,128 },  // 2 -> 1, 16 bits
+        { 0 },
+        {  0,  1,  0,  1,  0,  1,  4,  5,  4,  5,  4,  5,128,128,128,128 },  // 2 -> 3, 16 bits
+        {  0,  1,  0,  1,  0,  1,  2,  3,  4,  5,  4,  5,  4,  5,  6,  7 } },  // 2 -> 4, 16 bits
+      { { 0 },
+        { 0 },
+        { 0 },
+        {  0,  1,  2,  3,  4,  5,255,255,  6,  7,  8,  9, 10, 11,255,255 } },  // 3 -> 4, 16 bits
+      { { 0 },
+        { 0 },
+        {  0,  1,  2,  3,  4,  5,  8,  9, 10, 11, 12, 13,128,128,128,128 },  // 4 -> 3, 16 bits
+        { 0 } },
+   },
+};
+
+static int stbi__convert_per(int img_n, int req_comp, int bytes)
+{
+   return 16 / (bytes * (img_n > req_comp ? img_n : req_comp));
+}
+
+STBI__SSSE3_TARGET
+static stbi__uint32 stbi__convert_shuffle_ssse3(stbi_uc *dest, stbi_uc const *src, int img_n, int req_comp, stbi__uint32 x, int bytes)
+{
+   stbi__uint32 in = img_n * bytes, out = req_comp * bytes, per = stbi__convert_per(img_n, req_comp, bytes), i;
+   __m128i s = _mm_loadu_si128((__m128i const *) stbi__convert_shuf[bytes-1][img_n-1][req_comp-1]);
+   __m128i f = _mm_cmpeq_epi8(s, _mm_set1_epi8(-1));
+   // every step reads and writes 16 bytes, stop before that passes the end of the row
+   for (i=0; i*in + 16 <= x*in && i*out + 16 <= x*out; i += per)
+      _mm_storeu_si128((__m128i *) (dest + i*out), _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (src + i*in)), s), f));
+   return i;
+}
+
+// the conversions to grey (from 3 or 4 channels) gather every channel of 8
+// pixels into 16-bit lanes, from two reads of 4 pixels each, and compute
+// stbi__compute_y on the lanes. indexed by [img_n-3][channel], each mask
+// fills the low 8 bytes from one read, alpha goes to the high byte of a lane
+static const stbi_uc stbi__luma_shuf[2][4][16] =
+{
+   { {  0,128,  3,128,  6,128,  9,128,128,128,128,128,128,128,128,128 },  // 3 channels
+     {  1,128,  4,128,  7,128, 10,128,128,128,128,128,128,128,128,128 },
+     {  2,128,  5,128,  8,128, 11,128,128,128,128,128,128,128,128,128 } },
+   { {  0,128,  4,128,  8,128, 12,128,128,128,128,128,128,128,128,128 },  // 4 channels
+     {  1,128,  5,128,  9,128, 13,128,128,128,128,128,128,128,128,128 },
+     {  2,128,  6,128, 10,128, 14,128,128,128,128,128,128,128,128,128 },
+     {128,  3,128,  7,128, 11,128, 15,128,128,128,128,128,128,128,128 } },
+};
+
+STBI__SSSE3_TARGET
+static stbi__uint32 stbi__convert_luma_ssse3(stbi_uc *dest, stbi_uc const *src, int img_n, int req_comp, stbi__uint32 x)
+{
+   stbi_uc const (*masks)[16] = stbi__luma_shuf[img_n-3];
+   __m128i m[4], wr = _mm_set1_epi16(77), wg = _mm_set1_epi16(150), wb = _mm_set1_epi16(29);
+   __m128i low = _mm_setr_epi8(0,2,4,6,8,10,12,14, -1,-1,-1,-1,-1,-1,-1,-1);
+   stbi__uint32 in = img_n, i;
+   int c;
+   for (c=0; c < img_n; ++c)
+      m[c] = _mm_loadu_si128((__m128i const *) masks[c]);
+   for (i=0; (i + 4)*in + 16 <= x*in; i += 8) {
+      __m128i a = _mm_loadu_si128((__m128i const *) (src + i*in));
+      __m128i b = _mm_loadu_si128((__m128i const *) (src + (i + 4)*in));
+      __m128i r = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, m[0]), _mm_shuffle_epi8(b, m[0]));
+      __m128i g = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, m[1]), _mm_shuffle_epi8(b, m[1]));
+      __m128i bl = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, m[2]), _mm_shuffle_epi8(b, m[2]));
+      // the sum fits in 16 bits
+      __m128i y = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, wr), _mm_mullo_epi16(g, wg)), _mm_mullo_epi16(bl, wb)), 8);
+      if (req_comp == 1)
+         _mm_storel_epi64((__m128i *) (dest + i), _mm_shuffle_epi8(y, low));
+      else if (img_n == 4)
+         _mm_storeu_si128((__m128i *) (dest + i*2), _mm_or_si128(y, _mm_unpacklo_epi64(_mm_shuffle_epi8(a, m[3]), _mm_shuffle_epi8(b, m[3]))));
+      else
+         _mm_storeu_si128((__m128i *) (dest + i*2), _mm_or_si128(y, _mm_set1_epi16((short) 0xff00)));
+   }
+   return i;
+}
+
+// with 16 bits, 4 pixels in 32-bit lanes, red and green side by side so one
+// pmaddwd weighs both. pmaddwd is signed, so the values are biased by -32768
+// and the sum by 256*32768 (the weights add up to 256). [img_n-3][rg, b, alpha]
+static const stbi_uc stbi__luma16_shuf[2][3][16] =
+{
+   { {  0,  1,  2,  3,  6,  7,  8,  9,128,128,128,128,128,128,128,128 },  // 3 channels
+     {  4,  5,128,128, 10, 11,128,128,128,128,128,128,128,128,128,128 },
+     { 0 } },
+   { {  0,  1,  2,  3,  8,  9, 10, 11,128,128,128,128,128,128,128,128 },  // 4 channels
+     {  4,  5,128,128, 12, 13,128,128,128,128,128,128,128,128,128,128 },
+     {128,128,  6,  7,128,128, 14, 15,128,128,128,128,128,128,128,128 } },
+};
+
+STBI__SSSE3_TARGET
+static stbi__uint32 stbi__convert_luma16_ssse3(stbi_uc *dest, stbi_uc const *src, int img_n, int req_comp, stbi__uint32 x)
+{
+   stbi_uc const (*masks)[16] = stbi__luma16_shuf[img_n-3];
+   __m128i mrg = _mm_loadu_si128((__m128i const *) masks[0]);
+   __m128i mb = _mm_loadu_si128((__m128i const *) masks[1]);
+   __m128i ma = _mm_loadu_si128((__m128i const *) masks[2]);
+   __m128i wrg = _mm_setr_epi16(77,150, 77,150, 77,150, 77,150), wb = _mm_setr_epi16(29,0, 29,0, 29,0, 29,0);
+   __m128i flip = _mm_set1_epi16((short) 0x8000), bias = _mm_set1_epi32(256*32768);
+   __m128i low = _mm_setr_epi8(0,1,4,5,8,9,12,13, -1,-1,-1,-1,-1,-1,-1,-1);
+   stbi__uint32 in = img_n * 2, i;
+   for (i=0; (i + 2)*in + 16 <= x*in; i += 4) {
+      __m128i a = _mm_loadu_si128((__m128i const *) (src + i*in));
+      __m128i b = _mm_loadu_si128((__m128i const *) (src + (i + 2)*in));
+      __m128i rg = _mm_xor_si128(_mm_unpacklo_epi64(_mm_shuffle_epi8(a, mrg), _mm_shuffle_epi8(b, mrg)), flip);
+      __m128i bl = _mm_xor_si128(_mm_unpacklo_epi64(_mm_shuffle_epi8(a, mb), _mm_shuffle_epi8(b, mb)), flip);
+      __m128i y = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rg, wrg), _mm_madd_epi16(bl, wb)), bias), 8);
+      if (req_comp == 1)
+         _mm_storel_epi64((__m128i *) (dest + i*2), _mm_shuffle_epi8(y, low));
+      else if (img_n == 4)
+         _mm_storeu_si128((__m128i *) (dest + i*4), _mm_or_si128(y, _mm_unpacklo_epi64(_mm_shuffle_epi8(a, ma), _mm_shuffle_epi8(b, ma))));
+      else
+         _mm_storeu_si128((__m128i *) (dest + i*4), _mm_or_si128(y, _mm_set1_epi32((int) 0xffff0000)));
+   }
+   return i;
+}
+#endif
+
+#if defined(STBI_SSSE3) && defined(STBI_AVX2)
+// the SSSE3 shuffle with 2*per pixels per step, one 'per' in each 128-bit lane
+STBI__AVX2_TARGET
+static stbi__uint32 stbi__convert_shuffle_avx2(stbi_uc *dest, stbi_uc const *src, int img_n, int req_comp, stbi__uint32 x, int bytes)
+{
+   stbi__uint32 in = img_n * bytes, out = req_comp * bytes, per = stbi__convert_per(img_n, req_comp, bytes), i;
+   __m256i s = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) stbi__convert_shuf[bytes-1][img_n-1][req_comp-1]));
+   __m256i f = _mm256_cmpeq_epi8(s, _mm256_set1_epi8(-1));
+   for (i=0; (i + per)*in + 16 <= x*in && (i + per)*out + 16 <= x*out; i += 2*per) {
+      __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) (src + i*in))),
+                                          _mm_loadu_si128((__m128i const *) (src + (i + per)*in)), 1);
+      v = _mm256_or_si256(_mm256_shuffle_epi8(v, s), f);
+      // the second store overwrites what the first one wrote past its pixels
+      _mm_storeu_si128((__m128i *) (dest + i*out), _mm256_castsi256_si128(v));
+      _mm_storeu_si128((__m128i *) (dest + (i + per)*out), _mm256_extracti128_si256(v, 1));
+   }
+   return i;
+}
+#endif
+
+// converts as much of a row as the SIMD kernels handle and returns the
+// number of pixels done, the scalar loops finish the row
+static stbi__uint32 stbi__convert_row_simd(stbi_uc *dest, stbi_uc const *src, int img_n, int req_comp, stbi__uint32 x, int bytes)
+{
+#ifdef STBI_SSSE3
+   if (stbi__ssse3_available()) {
+      if (img_n >= 3 && req_comp <= 2)
+         return bytes == 1 ? stbi__convert_luma_ssse3(dest, src, img_n, req_comp, x)
+                           : stbi__convert_luma16_ssse3(dest, src, img_n, req_comp, x);
+      #ifdef STBI_AVX2
+      if (stbi__avx2_available())
+         return stbi__convert_shuffle_avx2(dest, src, img_n, req_comp, x, bytes);
+      #endif
+      return stbi__convert_shuffle_ssse3(dest, src, img_n, req_comp, x, bytes);
+   }
+#else
+   STBI_NOTUSED(dest); STBI_NOTUSED(src); STBI_NOTUSED(img_n); STBI_NOTUSED(req_comp); STBI_NOTUSED(x); STBI_NOTUSED(bytes);
+#endif
+   return 0;
+}
+
+// converts one row of x pixels from img_n to req_comp components
+static int stbi__convert_row(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   unsigned int done = img_n != req_comp ? stbi__convert_row_simd(dest, src, img_n, req_comp, x, 1) : 0;
+   dest += done * req_comp;
+   src += done * img_n;
+   x -= done;
+
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: STBI_ASSERT(0); return stbi__err("unsupported", "Unsupported format conversion");
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -1762,37 +3080,19 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
 
    good = (unsigned char *) stbi__malloc_mad3(req_comp, x, y, 0);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
+      if (!stbi__convert_row(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x)) {
+         stbi__free(data);
+         stbi__free(good);
+         return NULL;
       }
-      #undef STBI__CASE
    }
 
-   STBI_FREE(data);
+   stbi__free(data);
    return good;
 }
 #endif
@@ -1819,16 +3119,19 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
 
    good = (stbi__uint16 *) stbi__malloc(req_comp * x * y * 2);
    if (good == NULL) {
-      STBI_FREE(data);
+      stbi__free(data);
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
       stbi__uint16 *src  = data + j * x * img_n   ;
       stbi__uint16 *dest = good + j * x * req_comp;
+      unsigned int done = stbi__convert_row_simd((stbi_uc *) dest, (stbi_uc *) src, img_n, req_comp, x, 2);
+      src += done * img_n;
+      dest += done * req_comp;
 
       #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-done-1; i >= 0; --i, src += a, dest += b)
       // convert source image with img_n components to one with req_comp components;
       // avoid switch per pixel, so use switch per scanline and massive macros
       switch (STBI__COMBO(img_n, req_comp)) {
@@ -1844,12 +3147,12 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
          STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
          STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
          STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
+         default: STBI_ASSERT(0); stbi__free(data); stbi__free(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
       }
       #undef STBI__CASE
    }
 
-   STBI_FREE(data);
+   stbi__free(data);
    return good;
 }
 #endif
@@ -1859,14 +3162,17 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
    int i,k,n;
    float *output;
+   float linear[256]; // every channel value only has 256 possible results, so pow() runs once for each
    if (!data) return NULL;
    output = (float *) stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
+   if (output == NULL) { stbi__free(data); return stbi__errpf("outofmem", "Out of memory"); }
+   for (k=0; k < 256; ++k)
+      linear[k] = (float) (pow(k/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) (pow(data[i*comp+k]/255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+         output[i*comp + k] = linear[data[i*comp+k]];
       }
    }
    if (n < comp) {
@@ -1874,23 +3180,20 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
          output[i*comp + n] = data[i*comp + n]/255.0f;
       }
    }
-   STBI_FREE(data);
+   stbi__free(data);
    return output;
 }
 #endif
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
-static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+// converts 'count' pixels
+static void stbi__hdr_to_ldr_pixels(stbi_uc *output, float const *data, int count, int comp)
 {
    int i,k,n;
-   stbi_uc *output;
-   if (!data) return NULL;
-   output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
-   if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
-   for (i=0; i < x*y; ++i) {
+   for (i=0; i < count; ++i) {
       for (k=0; k < n; ++k) {
          float z = (float) pow(data[i*comp+k]*stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
          if (z < 0) z = 0;
@@ -1904,7 +3207,16 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (stbi_uc) stbi__float2int(z);
       }
    }
-   STBI_FREE(data);
+}
+
+static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
+{
+   stbi_uc *output;
+   if (!data) return NULL;
+   output = (stbi_uc *) stbi__malloc_mad3(x, y, comp, 0);
+   if (output == NULL) { stbi__free(data); return stbi__errpuc("outofmem", "Out of memory"); }
+   stbi__hdr_to_ldr_pixels(output, data, x*y, comp);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -1933,7 +3245,7 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 #ifndef STBI_NO_JPEG
 
 // huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+#define FAST_BITS   10 // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1952,7 +3264,7 @@ typedef struct
    stbi__huffman huff_dc[4];
    stbi__huffman huff_ac[4];
    stbi__uint16 dequant[4][64];
-   stbi__int16 fast_ac[4][1 << FAST_BITS];
+   stbi__int32 fast_ac[4][1 << FAST_BITS];
 
 // sizes for components, interleaved MCUs
    int img_h_max, img_v_max;
@@ -1976,7 +3288,7 @@ typedef struct
       int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
    } img_comp[4];
 
-   stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+   stbi__uint64   code_buffer; // jpeg entropy-coded buffer, valid bits at the top
    int            code_bits;   // number of valid bits
    unsigned char  marker;      // marker seen while filling entropy buffer
    int            nomore;      // flag if we saw a marker so must stop
@@ -1993,9 +3305,23 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift;   // blocks are decoded to (8>>scale_shift) pixels square
+   int flip;          // store the output rows bottom up
+   int req_comp;      // the channels asked for, for stbi__out_check
+
+   // region decode: the component buffers only hold MCU columns mcu_x0 to
+   // mcu_x1-1 of rows mcu_y0 to mcu_y1-1; the blocks around them are only
+   // entropy decoded, and the scan isn't decoded past them at all
+   int mcu_x0, mcu_y0, mcu_x1, mcu_y1;
+
+   // a block waiting for a second one so idct_2blocks_kernel can do both at once
+   short         *idct_pending;
+   stbi_uc       *idct_pending_out;
+   int            idct_pending_stride;
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_2blocks_kernel)(stbi_uc *out0, int out_stride0, short *data0, stbi_uc *out1, int out_stride1, short *data1);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -2045,9 +3371,13 @@ static int stbi__build_huffman(stbi__huffman *h, int *count)
    return 1;
 }
 
-// build a table that decodes both magnitude and value of small ACs in
-// one go.
-static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
+// fast_ac entries: bits 0-4 total length, 5-8 run, 9 end of block, 16-31 value;
+// 0 if the code needs the slow path
+#define STBI__FAST_AC_EOB  (1 << 9)
+
+// build a table that decodes the run, magnitude and value of common ACs
+// (and the end of block code) in one go.
+static void stbi__build_fast_ac(stbi__int32 *fast_ac, stbi__huffman *h)
 {
    int i;
    for (i=0; i < (1 << FAST_BITS); ++i) {
@@ -2059,14 +3389,14 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
          int magbits = rs & 15;
          int len = h->size[fast];
 
-         if (magbits && len + magbits <= FAST_BITS) {
+         if (rs == 0) {
+            fast_ac[i] = STBI__FAST_AC_EOB + len;
+         } else if (magbits && len + magbits <= FAST_BITS) {
             // magnitude code followed by receive_extend code
             int k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
             int m = 1 << (magbits - 1);
             if (k < m) k += (~0U << magbits) + 1;
-            // if the result is small enough, we can fit it in fast_ac table
-            if (k >= -128 && k <= 127)
-               fast_ac[i] = (stbi__int16) ((k * 256) + (run * 16) + (len + magbits));
+            fast_ac[i] = (k * 65536) + (run * 32) + (len + magbits);
          }
       }
    }
@@ -2074,36 +3404,51 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+   stbi__context *s = j->s;
+   // fast path: if the next 8 bytes are in memory, take as many as fit at
+   // once, unless one of them is 0xff (a marker or a stuffed byte)
+   if (!j->nomore && j->code_bits <= 56 && s->img_buffer_end - s->img_buffer >= 8) {
+      stbi_uc *p = s->img_buffer;
+      int n = (64 - j->code_bits) >> 3;
+      stbi__uint64 keep = ~(stbi__uint64) 0 << (64 - 8*n);
+      stbi__uint64 w = ((stbi__uint64) p[0] << 56) | ((stbi__uint64) p[1] << 48) | ((stbi__uint64) p[2] << 40) | ((stbi__uint64) p[3] << 32) |
+                       ((stbi__uint64) p[4] << 24) | ((stbi__uint64) p[5] << 16) | ((stbi__uint64) p[6] <<  8) |  (stbi__uint64) p[7];
+      // bytes we don't take become non-zero, then look for a zero byte (a 0xff in w)
+      stbi__uint64 x = ~w | ~keep;
+      stbi__uint64 ones = ~(stbi__uint64) 0 / 255;
+      if (((x - ones) & ~x & (ones << 7)) == 0) {
+         j->code_buffer |= (w & keep) >> j->code_bits;
+         j->code_bits += 8*n;
+         s->img_buffer += n;
+         return;
+      }
+   }
    do {
-      unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
+      unsigned int b = j->nomore ? 0 : stbi__get8(s);
       if (b == 0xff) {
-         int c = stbi__get8(j->s);
-         while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
+         int c = stbi__get8(s);
+         while (c == 0xff) c = stbi__get8(s); // consume fill bytes
          if (c != 0) {
             j->marker = (unsigned char) c;
             j->nomore = 1;
             return;
          }
       }
-      j->code_buffer |= b << (24 - j->code_bits);
+      j->code_buffer |= (stbi__uint64) b << (56 - j->code_bits);
       j->code_bits += 8;
-   } while (j->code_bits <= 24);
+   } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
-
-// decode a jpeg huffman value from the bitstream
-stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
+// decode a jpeg huffman value from the bitstream, which has been topped up
+// with stbi__grow_buffer_unsafe if it was short of 16 bits
+stbi_inline static int stbi__jpeg_huff_decode_filled(stbi__jpeg *j, stbi__huffman *h)
 {
    unsigned int temp;
    int c,k;
 
-   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-
    // look at the top FAST_BITS and determine what symbol ID it is,
    // if the code is <= FAST_BITS
-   c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+   c = (int) (j->code_buffer >> (64 - FAST_BITS));
    k = h->fast[c];
    if (k < 255) {
       int s = h->size[k];
@@ -2120,7 +3465,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    // end; in other words, regardless of the number of bits, it
    // wants to be compared against something shifted to have 16;
    // that way we don't need to shift inside the loop.
-   temp = j->code_buffer >> 16;
+   temp = (unsigned int) (j->code_buffer >> 48);
    for (k=FAST_BITS+1 ; ; ++k)
       if (temp < h->maxcode[k])
          break;
@@ -2134,10 +3479,10 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
       return -1;
 
    // convert the huffman code to the symbol id
-   c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
+   c = (int) (j->code_buffer >> (64 - k)) + h->delta[k];
    if(c < 0 || c >= 256) // symbol id out of bounds!
        return -1;
-   STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+   STBI_ASSERT((j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
    // convert the id to a symbol
    j->code_bits -= k;
@@ -2145,6 +3490,13 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
    return h->values[c];
 }
 
+// decode a jpeg huffman value from the bitstream
+stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
+{
+   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+   return stbi__jpeg_huff_decode_filled(j, h);
+}
+
 // bias[n] = (-1<<n) + 1
 static const int stbi__jbias[16] = {0,-1,-3,-7,-15,-31,-63,-127,-255,-511,-1023,-2047,-4095,-8191,-16383,-32767};
 
@@ -2157,36 +3509,52 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < n) return 0; // ran out of bits from stream, return 0s intead of continuing
 
-   sgn = j->code_buffer >> 31; // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   sgn = (int) (j->code_buffer >> 63); // sign bit always in MSB; 0 if MSB clear (positive), 1 if MSB set (negative)
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k + (stbi__jbias[n] & (sgn - 1));
 }
 
-// get some unsigned bits
+// get some unsigned bits (n >= 1)
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
    unsigned int k;
    if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < n) return 0; // ran out of bits from stream, return 0s intead of continuing
-   k = stbi_lrot(j->code_buffer, n);
-   j->code_buffer = k & ~stbi__bmask[n];
-   k &= stbi__bmask[n];
+   k = (unsigned int) (j->code_buffer >> (64 - n));
+   j->code_buffer <<= n;
    j->code_bits -= n;
    return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
-   unsigned int k;
+   int k;
    if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
    if (j->code_bits < 1) return 0; // ran out of bits from stream, return 0s intead of continuing
-   k = j->code_buffer;
+   k = (int) (j->code_buffer >> 63);
    j->code_buffer <<= 1;
    --j->code_bits;
-   return k & 0x80000000;
+   return k;
+}
+
+// stbi__jpeg_get_bit on a copy of the bit buffer held by the caller
+stbi_inline static int stbi__jpeg_refine_bit(stbi__jpeg *j, stbi__uint64 *buf, int *bits)
+{
+   int k;
+   if (*bits < 1) {
+      j->code_buffer = *buf;
+      j->code_bits = *bits;
+      stbi__grow_buffer_unsafe(j);
+      *buf = j->code_buffer;
+      *bits = j->code_bits;
+      if (*bits < 1) return 0; // ran out of bits from stream, return 0s intead of continuing
+   }
+   k = (int) (*buf >> 63);
+   *buf <<= 1;
+   --*bits;
+   return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2207,7 +3575,7 @@ static const stbi_uc stbi__jpeg_dezigzag[64+15] =
 };
 
 // decode one 64-entry block--
-static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
+static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int32 *fac, int b, stbi__uint16 *dequant)
 {
    int diff,dc,k;
    int t;
@@ -2232,17 +3600,18 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
       r = fac[c];
       if (r) { // fast-AC path
-         k += (r >> 4) & 15; // run
-         s = r & 15; // combined length
+         s = r & 31; // combined length
          if (s > j->code_bits) return stbi__err("bad huffman code", "Combined length longer than code bits available");
          j->code_buffer <<= s;
          j->code_bits -= s;
+         if (r & STBI__FAST_AC_EOB) break; // end block
+         k += (r >> 5) & 15; // run
          // decode into unzigzag'd location
          zig = stbi__jpeg_dezigzag[k++];
-         data[zig] = (short) ((r >> 8) * dequant[zig]);
+         data[zig] = (short) ((r >> 16) * dequant[zig]);
       } else {
          int rs = stbi__jpeg_huff_decode(j, hac);
          if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
@@ -2262,6 +3631,49 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
    return 1;
 }
 
+// decode_block for a block outside the region: reads past it, keeping just the
+// DC prediction
+static int stbi__jpeg_skip_block(stbi__jpeg *j, stbi__huffman *hdc, stbi__huffman *hac, stbi__int32 *fac, int b)
+{
+   int diff,k,t;
+
+   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+   t = stbi__jpeg_huff_decode(j, hdc);
+   if (t < 0 || t > 15) return stbi__err("bad huffman code","Corrupt JPEG");
+   diff = t ? stbi__extend_receive(j, t) : 0;
+   if (!stbi__addints_valid(j->img_comp[b].dc_pred, diff)) return stbi__err("bad delta","Corrupt JPEG");
+   j->img_comp[b].dc_pred += diff;
+
+   k = 1;
+   do {
+      int c,r,s;
+      if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+      c = (int) (j->code_buffer >> (64 - FAST_BITS));
+      r = fac[c];
+      if (r) { // fast-AC path
+         s = r & 31;
+         if (s > j->code_bits) return stbi__err("bad huffman code", "Combined length longer than code bits available");
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+         if (r & STBI__FAST_AC_EOB) break;
+         k += ((r >> 5) & 15) + 1;
+      } else {
+         int rs = stbi__jpeg_huff_decode(j, hac);
+         if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+         s = rs & 15;
+         r = rs >> 4;
+         if (s == 0) {
+            if (rs != 0xf0) break; // end block
+            k += 16;
+         } else {
+            k += r + 1;
+            stbi__extend_receive(j,s);
+         }
+      }
+   } while (k < 64);
+   return 1;
+}
+
 static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__huffman *hdc, int b)
 {
    int diff,dc;
@@ -2292,7 +3704,7 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__
 
 // @OPTIMIZE: store non-zigzagged during the decode passes,
 // and only de-zigzag when dequantizing
-static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__huffman *hac, stbi__int16 *fac)
+static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__huffman *hac, stbi__int32 *fac)
 {
    int k;
    if (j->spec_start == 0) return stbi__err("can't merge dc and ac", "Corrupt JPEG");
@@ -2310,16 +3722,17 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          unsigned int zig;
          int c,r,s;
          if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-         c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+         c = (int) (j->code_buffer >> (64 - FAST_BITS));
          r = fac[c];
          if (r) { // fast-AC path
-            k += (r >> 4) & 15; // run
-            s = r & 15; // combined length
+            s = r & 31; // combined length
             if (s > j->code_bits) return stbi__err("bad huffman code", "Combined length longer than code bits available");
             j->code_buffer <<= s;
             j->code_bits -= s;
+            if (r & STBI__FAST_AC_EOB) break; // end of band, eob_run stays 0
+            k += (r >> 5) & 15; // run
             zig = stbi__jpeg_dezigzag[k++];
-            data[zig] = (short) ((r >> 8) * (1 << shift));
+            data[zig] = (short) ((r >> 16) * (1 << shift));
          } else {
             int rs = stbi__jpeg_huff_decode(j, hac);
             if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
@@ -2342,62 +3755,81 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
          }
       } while (k <= j->spec_end);
    } else {
-      // refinement scan for these AC coefficients
-
+      // refinement scan for these AC coefficients. the bit buffer is kept in
+      // locals (the stores to data can't touch it then), and the common codes
+      // go through fac: with a magnitude of 1 its value is the sign bit
       short bit = (short) (1 << j->succ_low);
+      stbi__uint64 buf = j->code_buffer;
+      int bits = j->code_bits;
 
       if (j->eob_run) {
          --j->eob_run;
          for (k = j->spec_start; k <= j->spec_end; ++k) {
             short *p = &data[stbi__jpeg_dezigzag[k]];
-            if (*p != 0)
-               if (stbi__jpeg_get_bit(j))
-                  if ((*p & bit)==0) {
-                     if (*p > 0)
-                        *p += bit;
-                     else
-                        *p -= bit;
-                  }
+            if (*p != 0 && stbi__jpeg_refine_bit(j, &buf, &bits) && (*p & bit) == 0)
+               *p += *p > 0 ? bit : -bit;
          }
       } else {
          k = j->spec_start;
          do {
             int r,s;
-            int rs = stbi__jpeg_huff_decode(j, hac); // @OPTIMIZE see if we can use the fast path here, advance-by-r is so slow, eh
-            if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
-            s = rs & 15;
-            r = rs >> 4;
-            if (s == 0) {
-               if (r < 15) {
-                  j->eob_run = (1 << r) - 1;
-                  if (r)
-                     j->eob_run += stbi__jpeg_get_bits(j, r);
-                  r = 64; // force end of block
+            if (bits < 16) {
+               j->code_buffer = buf;
+               j->code_bits = bits;
+               stbi__grow_buffer_unsafe(j);
+               buf = j->code_buffer;
+               bits = j->code_bits;
+            }
+            r = bits >= 16 ? fac[buf >> (64 - FAST_BITS)] : 0;
+            if (r) {
+               buf <<= r & 31;
+               bits -= r & 31;
+               if (r & STBI__FAST_AC_EOB) {
+                  r = 64; // end of band, eob_run stays 0
+                  s = 0;
                } else {
-                  // r=15 s=0 should write 16 0s, so we just do
-                  // a run of 15 0s and then write s (which is 0),
-                  // so we don't have to do anything special here
+                  s = r >> 16;
+                  if (s != 1 && s != -1) return stbi__err("bad huffman code", "Corrupt JPEG");
+                  s = s > 0 ? bit : -bit;
+                  r = (r >> 5) & 15;
                }
             } else {
-               if (s != 1) return stbi__err("bad huffman code", "Corrupt JPEG");
-               // sign bit
-               if (stbi__jpeg_get_bit(j))
-                  s = bit;
-               else
-                  s = -bit;
+               int rs;
+               j->code_buffer = buf;
+               j->code_bits = bits;
+               rs = stbi__jpeg_huff_decode_filled(j, hac);
+               if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+               s = rs & 15;
+               r = rs >> 4;
+               if (s == 0) {
+                  if (r < 15) {
+                     j->eob_run = (1 << r) - 1;
+                     if (r)
+                        j->eob_run += stbi__jpeg_get_bits(j, r);
+                     r = 64; // force end of block
+                  } else {
+                     // r=15 s=0 should write 16 0s, so we just do
+                     // a run of 15 0s and then write s (which is 0),
+                     // so we don't have to do anything special here
+                  }
+               } else {
+                  if (s != 1) return stbi__err("bad huffman code", "Corrupt JPEG");
+                  // sign bit
+                  if (stbi__jpeg_get_bit(j))
+                     s = bit;
+                  else
+                     s = -bit;
+               }
+               buf = j->code_buffer;
+               bits = j->code_bits;
             }
 
             // advance by r
             while (k <= j->spec_end) {
                short *p = &data[stbi__jpeg_dezigzag[k++]];
                if (*p != 0) {
-                  if (stbi__jpeg_get_bit(j))
-                     if ((*p & bit)==0) {
-                        if (*p > 0)
-                           *p += bit;
-                        else
-                           *p -= bit;
-                     }
+                  if (stbi__jpeg_refine_bit(j, &buf, &bits) && (*p & bit) == 0)
+                     *p += *p > 0 ? bit : -bit;
                } else {
                   if (r == 0) {
                      *p = (short) s;
@@ -2408,6 +3840,8 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
             }
          } while (k <= j->spec_end);
       }
+      j->code_buffer = buf;
+      j->code_bits = bits;
    }
    return 1;
 }
@@ -2523,15 +3957,67 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
-#ifdef STBI_SSE2
-// sse2 integer IDCT. not the fastest possible implementation but it
-// produces bit-identical results to the generic C version so it's
-// fully "transparent".
-static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+// reduced size IDCTs for scaled decoding: only the top-left 4x4, 2x2 or DC
+// coefficients are used, which gives the low-pass version of the block at
+// 1/2, 1/4 or 1/8 size directly. the basis is C(u)/2 * cos((2x+1)*u*pi/2N)
+// scaled by 4096: 1448 for even u, 1892 and 784 for u = 1, 3 when N = 4
+#define STBI__IDCT4_1D(s0,s1,s2,s3) \
+   int e0,e1,o0,o1;                  \
+   e0 = 1448 * ((s0) + (s2));        \
+   e1 = 1448 * ((s0) - (s2));        \
+   o0 = 1892 * (s1) +  784 * (s3);   \
+   o1 =  784 * (s1) - 1892 * (s3);
+
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
 {
-   // This is constructed to match our regular (generic) integer IDCT exactly.
-   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
-   __m128i tmp;
+   int i,val[16],*v=val;
+   short *d = data;
+
+   // rows, keeping one extra bit of precision
+   for (i=0; i < 4; ++i, d += 8, v += 4) {
+      STBI__IDCT4_1D(d[0],d[1],d[2],d[3])
+      e0 += 1 << 10;
+      e1 += 1 << 10;
+      v[0] = (e0+o0) >> 11;
+      v[1] = (e1+o1) >> 11;
+      v[2] = (e1-o1) >> 11;
+      v[3] = (e0-o0) >> 11;
+   }
+
+   // columns, add the level shift and round
+   for (i=0, v=val; i < 4; ++i, ++v) {
+      STBI__IDCT4_1D(v[0],v[4],v[8],v[12])
+      e0 += (128 << 13) + (1 << 12);
+      e1 += (128 << 13) + (1 << 12);
+      out[i             ] = stbi__clamp((e0+o0) >> 13);
+      out[i+out_stride  ] = stbi__clamp((e1+o1) >> 13);
+      out[i+out_stride*2] = stbi__clamp((e1-o1) >> 13);
+      out[i+out_stride*3] = stbi__clamp((e0-o0) >> 13);
+   }
+}
+
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   int r00 = (1448 * (data[0] + data[1]) + (1 << 10)) >> 11;
+   int r01 = (1448 * (data[0] - data[1]) + (1 << 10)) >> 11;
+   int r10 = (1448 * (data[8] + data[9]) + (1 << 10)) >> 11;
+   int r11 = (1448 * (data[8] - data[9]) + (1 << 10)) >> 11;
+   int bias = (128 << 13) + (1 << 12);
+   out[0] = stbi__clamp((1448 * (r00 + r10) + bias) >> 13);
+   out[1] = stbi__clamp((1448 * (r01 + r11) + bias) >> 13);
+   out[out_stride  ] = stbi__clamp((1448 * (r00 - r10) + bias) >> 13);
+   out[out_stride+1] = stbi__clamp((1448 * (r01 - r11) + bias) >> 13);
+}
+
+#ifdef STBI_SSE2
+// sse2 integer IDCT. not the fastest possible implementation but it
+// produces bit-identical results to the generic C version so it's
+// fully "transparent".
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
+{
+   // This is constructed to match our regular (generic) integer IDCT exactly.
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
 
    // dot product constant: even elems=x, odd elems=y
    #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
@@ -2704,6 +4190,184 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// the SSE2 IDCT above, run on two blocks at once: every instruction it uses
+// works on each 128-bit half of a ymm register separately, so with block 0
+// in the low half and block 1 in the high half this is the same computation
+// (and gives the same bits) for both. data1 == NULL does block 0 only.
+STBI__AVX2_TARGET
+static void stbi__idct_avx2(stbi_uc *out0, int out_stride0, short *data0, stbi_uc *out1, int out_stride1, short *data1)
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+   int r;
+
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load, block 0 rows in the low half and block 1 rows in the high half
+   if (!data1) data1 = data0;
+   #define dct_load(r) _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) (data0 + (r)*8))), \
+                                               _mm_loadu_si128((const __m128i *) (data1 + (r)*8)), 1)
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack and 8bit 8x8 transpose
+      __m256i p0 = _mm256_packus_epi16(row0, row1);
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+      __m128i q[8];
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      dct_interleave8(p0, p1);
+      dct_interleave8(p2, p3);
+
+      dct_interleave8(p0, p2);
+      dct_interleave8(p1, p3);
+
+      // rows 0..7 of a block are the low/high 8 bytes of p0, p2, p1, p3
+      q[0] = _mm256_castsi256_si128(p0); q[4] = _mm256_extracti128_si256(p0, 1);
+      q[1] = _mm256_castsi256_si128(p2); q[5] = _mm256_extracti128_si256(p2, 1);
+      q[2] = _mm256_castsi256_si128(p1); q[6] = _mm256_extracti128_si256(p1, 1);
+      q[3] = _mm256_castsi256_si128(p3); q[7] = _mm256_extracti128_si256(p3, 1);
+      for (r=0; r < 4; ++r) {
+         _mm_storel_epi64((__m128i *) out0, q[r]); out0 += out_stride0;
+         _mm_storel_epi64((__m128i *) out0, _mm_shuffle_epi32(q[r], 0x4e)); out0 += out_stride0;
+      }
+      if (out1) {
+         for (r=4; r < 8; ++r) {
+            _mm_storel_epi64((__m128i *) out1, q[r]); out1 += out_stride1;
+            _mm_storel_epi64((__m128i *) out1, _mm_shuffle_epi32(q[r], 0x4e)); out1 += out_stride1;
+         }
+      }
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+}
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2946,13 +4610,433 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// IDCT block (bx,by) of component n. with a two block kernel the block is held
+// back until the next one arrives, so data must stay untouched until the next
+// call or stbi__jpeg_idct_flush (callers alternate between two data buffers)
+static void stbi__jpeg_idct(stbi__jpeg *z, int n, int bx, int by, short *data)
+{
+   int bs = 8 >> z->scale_shift;
+   int out_stride = z->img_comp[n].w2;
+   stbi_uc *out;
+   // the component buffers start at the region's first MCU
+   bx -= z->mcu_x0 * z->img_comp[n].h;
+   by -= z->mcu_y0 * z->img_comp[n].v;
+   out = z->img_comp[n].data + out_stride*by*bs + bx*bs;
+   if (bs == 4) {
+      stbi__idct_4x4(out, out_stride, data);
+   } else if (bs == 2) {
+      stbi__idct_2x2(out, out_stride, data);
+   } else if (bs == 1) {
+      out[0] = stbi__clamp(128 + ((data[0] + 4) >> 3)); // DC only: the block average
+   } else if (!z->idct_2blocks_kernel) {
+      z->idct_block_kernel(out, out_stride, data);
+   } else if (z->idct_pending) {
+      z->idct_2blocks_kernel(z->idct_pending_out, z->idct_pending_stride, z->idct_pending, out, out_stride, data);
+      z->idct_pending = NULL;
+   } else {
+      z->idct_pending = data;
+      z->idct_pending_out = out;
+      z->idct_pending_stride = out_stride;
+   }
+}
+
+static void stbi__jpeg_idct_flush(stbi__jpeg *z)
+{
+   if (z->idct_pending) {
+      z->idct_2blocks_kernel(z->idct_pending_out, z->idct_pending_stride, z->idct_pending, NULL, 0, NULL);
+      z->idct_pending = NULL;
+   }
+}
+
+// whether MCU i,j (of an interleaved scan) is in the region's component buffers
+static int stbi__jpeg_mcu_kept(stbi__jpeg *z, int i, int j)
+{
+   return i >= z->mcu_x0 && i < z->mcu_x1 && j >= z->mcu_y0 && j < z->mcu_y1;
+}
+
+// whether block bx,by of component n is in the region's component buffers
+static int stbi__jpeg_block_kept(stbi__jpeg *z, int n, int bx, int by)
+{
+   int h = z->img_comp[n].h, v = z->img_comp[n].v;
+   return bx >= z->mcu_x0*h && bx < z->mcu_x1*h && by >= z->mcu_y0*v && by < z->mcu_y1*v;
+}
+
+// once the region's last row is decoded the rest of the scan isn't needed:
+// skips to the marker after it
+static void stbi__jpeg_skip_scan(stbi__jpeg *j)
+{
+   stbi__context *s = j->s;
+   while (j->marker == STBI__MARKER_none || STBI__RESTART(j->marker)) {
+      stbi_uc x;
+      if (!s->read_from_callbacks) {
+         stbi_uc *p = (stbi_uc *) memchr(s->img_buffer, 0xff, s->img_buffer_end - s->img_buffer);
+         s->img_buffer = p ? p : s->img_buffer_end;
+      }
+      if (stbi__at_eof(s)) {
+         j->marker = STBI__MARKER_none;
+         return;
+      }
+      x = stbi__get8(s);
+      if (x != 0xff) continue;
+      while (x == 0xff) x = stbi__get8(s); // fill bytes; 0 at the end of the file
+      if (x != 0x00) j->marker = x; // not a stuffed zero
+   }
+}
+
+// decodes MCU m of a baseline scan (a block when scan_n == 1) and hands its
+// blocks to the IDCT, alternating between the two buffers in data
+static int stbi__jpeg_decode_mcu(stbi__jpeg *z, int m, short data[2][64], int *slot)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      int i = m % w, j = m / w;
+      int ha = z->img_comp[n].ha;
+      if (!stbi__jpeg_block_kept(z, n, i, j))
+         return stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n);
+      if (!stbi__jpeg_decode_block(z, data[*slot], z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+      stbi__jpeg_idct(z, n, i, j, data[*slot]);
+      *slot ^= 1;
+   } else {
+      int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+      int kept = stbi__jpeg_mcu_kept(z, i, j);
+      int k,x,y;
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         for (y=0; y < z->img_comp[n].v; ++y) {
+            for (x=0; x < z->img_comp[n].h; ++x) {
+               int ha = z->img_comp[n].ha;
+               if (!kept) {
+                  if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
+                  continue;
+               }
+               if (!stbi__jpeg_decode_block(z, data[*slot], z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               stbi__jpeg_idct(z, n, i*z->img_comp[n].h + x, j*z->img_comp[n].v + y, data[*slot]);
+               *slot ^= 1;
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+#ifdef STBI__THREADS
+// threading is only worth it for images with at least this many pixels
+#define STBI__JPEG_THREAD_MIN_PIXELS  (256*256)
+#define STBI__MAX_THREADS             64
+
+static int stbi__thread_count(stbi__context *s, int tasks)
+{
+   int n = s->jpeg_threads > 0 ? s->jpeg_threads : stbi__jpeg_thread_count;
+   if (n <= 0) {
+      #ifdef STBI__THREADS_CPP
+      n = (int) std::thread::hardware_concurrency();
+      #else
+      n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+      #endif
+   }
+   if (n > STBI__MAX_THREADS) n = STBI__MAX_THREADS;
+   if (n > tasks) n = tasks;
+   return n < 1 ? 1 : n;
+}
+
+typedef void (*stbi__task_func)(void *job, int worker, int task);
+
+// the helper threads are shared by every decode and live until the program
+// exits. a batch is one stbi__run_tasks call; the helpers 1..workers-1 take
+// part in it, and the caller waits until all of them are done with it
+typedef struct
+{
+   stbi__task_func func;
+   void *job;
+   int tasks, next, workers;
+   int batch;                       // bumped for every batch
+   int seen[STBI__MAX_THREADS];     // the last batch each helper woke up for
+   int helping;                     // helpers still working on the batch
+   int started;                     // helpers 1..started exist
+   int busy;                        // a batch is running
+} stbi__pool;
+
+static stbi__pool stbi__the_pool;
+
+#ifdef STBI__THREADS_CPP
+typedef struct stbi__pool_sync
+{
+   std::mutex lock;
+   std::condition_variable_any wake, done;
+} stbi__pool_sync;
+
+// never freed, the detached helpers are still waiting on it at exit
+static stbi__pool_sync *stbi__pool_get_sync(void)
+{
+   static stbi__pool_sync *sync = new stbi__pool_sync;
+   return sync;
+}
+
+#define stbi__pool_lock()        stbi__pool_get_sync()->lock.lock()
+#define stbi__pool_unlock()      stbi__pool_get_sync()->lock.unlock()
+#define stbi__pool_wait(c)       stbi__pool_get_sync()->c.wait(stbi__pool_get_sync()->lock)
+#define stbi__pool_broadcast(c)  stbi__pool_get_sync()->c.notify_all()
+#else
+static pthread_mutex_t stbi__pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  stbi__pool_wake  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  stbi__pool_done  = PTHREAD_COND_INITIALIZER;
+
+#define stbi__pool_lock()        pthread_mutex_lock(&stbi__pool_mutex)
+#define stbi__pool_unlock()      pthread_mutex_unlock(&stbi__pool_mutex)
+#define stbi__pool_wait(c)       pthread_cond_wait(&stbi__pool_##c, &stbi__pool_mutex)
+#define stbi__pool_broadcast(c)  pthread_cond_broadcast(&stbi__pool_##c)
+#endif
+
+// keeps taking the next unclaimed task of the current batch until there are none left
+static void stbi__pool_work(stbi__pool *p, int worker)
+{
+   for(;;) {
+      int t;
+      stbi__pool_lock();
+      t = p->next < p->tasks ? p->next++ : p->tasks;
+      stbi__pool_unlock();
+      if (t >= p->tasks) break;
+      p->func(p->job, worker, t);
+   }
+}
+
+static void stbi__pool_thread(int worker)
+{
+   stbi__pool *p = &stbi__the_pool;
+   stbi__pool_lock();
+   for(;;) {
+      while (p->batch == p->seen[worker])
+         stbi__pool_wait(wake);
+      p->seen[worker] = p->batch;
+      if (worker < p->workers) {
+         stbi__pool_unlock();
+         stbi__pool_work(p, worker);
+         stbi__pool_lock();
+         if (--p->helping == 0)
+            stbi__pool_broadcast(done);
+      }
+   }
+}
+
+#ifdef STBI__THREADS_CPP
+static int stbi__pool_start(int worker)
+{
+   std::thread(stbi__pool_thread, worker).detach();
+   return 1;
+}
+#else
+static void *stbi__pool_thread_main(void *arg)
+{
+   stbi__pool_thread((int) (size_t) arg);
+   return NULL;
+}
+
+static int stbi__pool_start(int worker)
+{
+   pthread_t t;
+   if (pthread_create(&t, NULL, stbi__pool_thread_main, (void *) (size_t) worker) != 0) return 0;
+   pthread_detach(t);
+   return 1;
+}
+#endif
+
+// calls func(job, worker, task) once for every task in [0,tasks) on 'workers'
+// threads; the calling thread is worker 0, and each worker keeps taking the
+// next unclaimed task until there are none left. if another decode has the
+// helpers, everything runs on the calling thread as worker 0
+static void stbi__run_tasks(stbi__task_func func, void *job, int tasks, int workers)
+{
+   stbi__pool *p = &stbi__the_pool;
+   int t;
+   stbi__pool_lock();
+   if (p->busy) {
+      stbi__pool_unlock();
+      for (t=0; t < tasks; ++t)
+         func(job, 0, t);
+      return;
+   }
+   p->busy = 1;
+   // a helper starts out having seen the current batch, so it waits for the next one
+   while (p->started < workers-1) {
+      p->seen[p->started+1] = p->batch;
+      if (!stbi__pool_start(p->started+1)) break; // the others do its share
+      ++p->started;
+   }
+   if (workers > p->started+1) workers = p->started+1;
+   p->func = func;
+   p->job = job;
+   p->tasks = tasks;
+   p->next = 0;
+   p->workers = workers;
+   p->helping = workers-1;
+   ++p->batch;
+   stbi__pool_broadcast(wake);
+   stbi__pool_unlock();
+
+   stbi__pool_work(p, 0);
+
+   stbi__pool_lock();
+   while (p->helping > 0)
+      stbi__pool_wait(done);
+   p->busy = 0;
+   stbi__pool_unlock();
+}
+
+// decodes 'count' MCUs of a baseline scan starting at MCU 'first', which must
+// be the first MCU of a restart interval (z->s holds just that interval's data)
+static int stbi__decode_jpeg_segment(stbi__jpeg *z, int first, int count)
+{
+   int m,slot=0;
+   STBI_SIMD_ALIGN(short, data[2][64]);
+   stbi__jpeg_reset(z);
+   for (m=first; m < first + count; ++m)
+      if (!stbi__jpeg_decode_mcu(z, m, data, &slot)) return 0;
+   stbi__jpeg_idct_flush(z);
+   return 1;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__jpeg *local;         // a copy of z for each worker...
+   stbi__context *local_s;    // ...reading from its own context
+   stbi_uc **bounds;          // restart interval k is bounds[2k] .. bounds[2k+1]
+   int mcus;
+   stbi__atomic_int failed;
+   const char *failure_reason; // set by the first worker that fails
+} stbi__jpeg_segments;
+
+// whether any of MCUs first .. first+count-1 are in the rows of a region decode
+static int stbi__jpeg_rows_kept(stbi__jpeg *z, int first, int count)
+{
+   int per_row, y0, y1;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      per_row = (z->img_comp[n].x+7) >> 3;
+      y0 = z->mcu_y0 * z->img_comp[n].v;
+      y1 = z->mcu_y1 * z->img_comp[n].v;
+   } else {
+      per_row = z->img_mcu_x;
+      y0 = z->mcu_y0;
+      y1 = z->mcu_y1;
+   }
+   return (first + count - 1) / per_row >= y0 && first / per_row < y1;
+}
+
+static void stbi__jpeg_segment_task(void *job, int worker, int task)
+{
+   stbi__jpeg_segments *g = (stbi__jpeg_segments *) job;
+   stbi__jpeg *z = &g->local[worker];
+   int first = task * g->z->restart_interval;
+   int count = g->mcus - first < g->z->restart_interval ? g->mcus - first : g->z->restart_interval;
+   if (stbi__atomic_load(&g->failed) || !stbi__jpeg_rows_kept(g->z, first, count)) return;
+   stbi__start_mem(&g->local_s[worker], g->bounds[2*task], (int) (g->bounds[2*task+1] - g->bounds[2*task]));
+   if (!stbi__decode_jpeg_segment(z, first, count)) {
+      // the failure reason is per thread, hand it back to the caller's thread
+      if (stbi__atomic_exchange(&g->failed, 1) == 0)
+         g->failure_reason = stbi_failure_reason();
+   }
+}
+
+// every restart interval starts the entropy decoder and DC prediction over, so
+// in a baseline scan with restart markers each interval can be decoded on its
+// own thread once the RSTn markers have been found. the MCUs of different
+// intervals cover different blocks, so the workers write disjoint parts of the
+// component buffers. returns -1 if the scan can't be split this way (the caller
+// then decodes it serially), otherwise the usual 1 on success, 0 on error
+static int stbi__parse_entropy_coded_data_threaded(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   stbi__jpeg_segments g;
+   stbi_uc *p, *end, *scan_end;
+   int segments, workers, k;
+
+   // the markers are found by looking ahead, so the whole scan must be in memory
+   if (z->progressive || z->restart_interval <= 0 || s->read_from_callbacks) return -1;
+   if ((stbi__uint32) s->img_x * s->img_y < STBI__JPEG_THREAD_MIN_PIXELS) return -1;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      g.mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else
+      g.mcus = z->img_mcu_x * z->img_mcu_y;
+   segments = (g.mcus + z->restart_interval - 1) / z->restart_interval;
+   workers = stbi__thread_count(s, segments);
+   if (workers < 2) return -1;
+
+   g.bounds = (stbi_uc **) stbi__malloc_mad2(segments, 2 * (int) sizeof(stbi_uc *), 0);
+   if (!g.bounds) return -1;
+
+   // find where each interval starts and ends; any marker other than RSTn ends the scan
+   p = s->img_buffer;
+   end = s->img_buffer_end;
+   scan_end = end;
+   g.bounds[0] = p;
+   k = 1;
+   while (p + 1 < end) {
+      stbi_uc *q;
+      if (*p != 0xff) { ++p; continue; }
+      q = p + 1;
+      while (q < end && *q == 0xff) ++q; // fill bytes
+      if (q == end) { scan_end = p; break; }
+      if (*q == 0x00) { p = q + 1; continue; } // stuffed 0xff data byte
+      if (!STBI__RESTART(*q)) { scan_end = p; break; }
+      // markers must come in order, one between each pair of intervals; if they
+      // don't, let the serial decoder deal with the file like it always has
+      if (k == segments || *q != 0xd0 + ((k-1) & 7)) { stbi__free(g.bounds); return -1; }
+      g.bounds[2*k-1] = p;
+      g.bounds[2*k] = q + 1;
+      ++k;
+      p = q + 1;
+   }
+   if (k != segments) { stbi__free(g.bounds); return -1; }
+   g.bounds[2*segments-1] = scan_end;
+
+   g.z = z;
+   g.local = (stbi__jpeg *) stbi__malloc_mad2(workers, (int) sizeof(stbi__jpeg), 0);
+   g.local_s = (stbi__context *) stbi__malloc_mad2(workers, (int) sizeof(stbi__context), 0);
+   if (!g.local || !g.local_s) {
+      stbi__free(g.bounds); stbi__free(g.local); stbi__free(g.local_s);
+      return -1;
+   }
+   for (k=0; k < workers; ++k) {
+      memcpy(&g.local[k], z, sizeof(stbi__jpeg));
+      g.local[k].s = &g.local_s[k];
+   }
+   stbi__atomic_store(&g.failed, 0);
+   g.failure_reason = NULL;
+
+   stbi__run_tasks(stbi__jpeg_segment_task, &g, segments, workers);
+
+   stbi__free(g.bounds);
+   stbi__free(g.local);
+   stbi__free(g.local_s);
+   if (stbi__atomic_load(&g.failed)) {
+      stbi__g_failure_reason = g.failure_reason;
+      return 0;
+   }
+
+   // leave the stream where the serial decoder would, in front of the marker after the scan
+   s->img_buffer = scan_end;
+   stbi__jpeg_reset(z);
+   return 1;
+}
+#endif // STBI__THREADS
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
+   z->idct_pending = NULL;
+#ifdef STBI__THREADS
+   {
+      int r = stbi__parse_entropy_coded_data_threaded(z);
+      if (r >= 0) return r;
+   }
+#endif
    stbi__jpeg_reset(z);
    if (!z->progressive) {
       if (z->scan_n == 1) {
-         int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
+         int i,j,slot=0;
+         STBI_SIMD_ALIGN(short, data[2][64]);
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
@@ -2961,26 +5045,45 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
+            if (j == z->mcu_y1 * z->img_comp[n].v) {
+               // below the region, nothing more to decode
+               stbi__jpeg_idct_flush(z);
+               stbi__jpeg_skip_scan(z);
+               return 1;
+            }
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (!stbi__jpeg_block_kept(z, n, i, j)) {
+                  if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
+               } else {
+                  if (!stbi__jpeg_decode_block(z, data[slot], z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  stbi__jpeg_idct(z, n, i, j, data[slot]);
+                  slot ^= 1;
+               }
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                   // if it's NOT a restart, then just bail, so we get corrupt data
                   // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { stbi__jpeg_idct_flush(z); return 1; }
                   stbi__jpeg_reset(z);
                }
             }
          }
+         stbi__jpeg_idct_flush(z);
          return 1;
       } else { // interleaved
-         int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
+         int i,j,k,x,y,slot=0;
+         STBI_SIMD_ALIGN(short, data[2][64]);
          for (j=0; j < z->img_mcu_y; ++j) {
+            if (j == z->mcu_y1) {
+               // below the region, nothing more to decode
+               stbi__jpeg_idct_flush(z);
+               stbi__jpeg_skip_scan(z);
+               return 1;
+            }
             for (i=0; i < z->img_mcu_x; ++i) {
+               int kept = stbi__jpeg_mcu_kept(z, i, j);
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
                   int n = z->order[k];
@@ -2988,11 +5091,14 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
                         int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        if (!kept) {
+                           if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
+                           continue;
+                        }
+                        if (!stbi__jpeg_decode_block(z, data[slot], z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        stbi__jpeg_idct(z, n, i*z->img_comp[n].h + x, j*z->img_comp[n].v + y, data[slot]);
+                        slot ^= 1;
                      }
                   }
                }
@@ -3000,11 +5106,12 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                // so now count down the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { stbi__jpeg_idct_flush(z); return 1; }
                   stbi__jpeg_reset(z);
                }
             }
          }
+         stbi__jpeg_idct_flush(z);
          return 1;
       }
    } else {
@@ -3018,6 +5125,11 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
+            if (j == z->mcu_y1 * z->img_comp[n].v) {
+               // the coefficients below the region are never used
+               stbi__jpeg_skip_scan(z);
+               return 1;
+            }
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                if (z->spec_start == 0) {
@@ -3040,6 +5152,11 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
       } else { // interleaved
          int i,j,k,x,y;
          for (j=0; j < z->img_mcu_y; ++j) {
+            if (j == z->mcu_y1) {
+               // the coefficients below the region are never used
+               stbi__jpeg_skip_scan(z);
+               return 1;
+            }
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
@@ -3085,14 +5202,18 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
       for (n=0; n < z->s->img_n; ++n) {
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
+         // only the blocks in the component buffers of a region decode
+         if (w > z->mcu_x1 * z->img_comp[n].h) w = z->mcu_x1 * z->img_comp[n].h;
+         if (h > z->mcu_y1 * z->img_comp[n].v) h = z->mcu_y1 * z->img_comp[n].v;
+         for (j=z->mcu_y0 * z->img_comp[n].v; j < h; ++j) {
+            for (i=z->mcu_x0 * z->img_comp[n].h; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_idct(z, n, i, j, data);
             }
          }
       }
+      stbi__jpeg_idct_flush(z);
    }
 }
 
@@ -3244,17 +5365,17 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__free(z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__free(z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__free(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
@@ -3318,6 +5439,24 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
+   z->mcu_x0 = z->mcu_y0 = 0;
+   z->mcu_x1 = z->img_mcu_x;
+   z->mcu_y1 = z->img_mcu_y;
+   if (s->region_w && !z->scale_shift) {
+      stbi__uint32 rx, ry, rw, rh;
+      if (!stbi__region_clip(s, 0, 0, s->img_x, s->img_y, &rx, &ry, &rw, &rh)) return stbi__err("bad region", "Region outside of the image");
+      // keep the MCUs with a pixel more above and left of the region and two
+      // more below and right too, so the chroma upsampling (which treats the
+      // first pixel and the last two of a plane differently) gives the region
+      // the same pixels as in the whole image
+      z->mcu_x0 = (rx ? rx-1 : 0) / z->img_mcu_w;
+      z->mcu_y0 = (ry ? ry-1 : 0) / z->img_mcu_h;
+      z->mcu_x1 = (rx + rw + 1) / z->img_mcu_w + 1;
+      z->mcu_y1 = (ry + rh + 1) / z->img_mcu_h + 1;
+      if (z->mcu_x1 > z->img_mcu_x) z->mcu_x1 = z->img_mcu_x;
+      if (z->mcu_y1 > z->img_mcu_y) z->mcu_y1 = z->img_mcu_y;
+   }
+
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
@@ -3329,8 +5468,11 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      //
+      // with a scaled decode every block only produces 8>>scale_shift pixels
+      // square, so the planes shrink with it
+      z->img_comp[i].w2 = (z->mcu_x1 - z->mcu_x0) * z->img_comp[i].h * (8 >> z->scale_shift);
+      z->img_comp[i].h2 = (z->mcu_y1 - z->mcu_y0) * z->img_comp[i].v * (8 >> z->scale_shift);
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3340,10 +5482,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // coefficients are always kept for every block, scaled or not
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3411,13 +5553,14 @@ static stbi_uc stbi__skip_jpeg_junk_at_end(stbi__jpeg *j)
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
-   int m;
+   int m, scans = 0;
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
    }
    j->restart_interval = 0;
    if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+   if (!stbi__out_check(j->s, j->s->img_x, j->s->img_y, j->req_comp ? j->req_comp : j->s->img_n >= 3 ? 3 : 1)) return 0;
    m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
@@ -3427,6 +5570,11 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
          }
+         if (j->progressive && j->s->max_scans && ++scans == j->s->max_scans) {
+            // a marker after the scan means none of it was cut off
+            if (j->marker == STBI__MARKER_none) return stbi__err("truncated scan", "Corrupt JPEG");
+            break;
+         }
          m = stbi__get_marker(j);
          if (STBI__RESTART(m))
             m = stbi__get_marker(j);
@@ -3437,7 +5585,8 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
          if (NL != j->s->img_y) return stbi__err("bad DNL height", "Corrupt JPEG");
          m = stbi__get_marker(j);
       } else {
-         if (!stbi__process_marker(j, m)) return 1;
+         // a partial image is fine, unless it's short of the scans asked for
+         if (!stbi__process_marker(j, m)) return !(j->progressive && j->s->max_scans);
          m = stbi__get_marker(j);
       }
    }
@@ -3643,24 +5792,81 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
-static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+#ifdef STBI_AVX2
+// stbi__resample_row_hv_2_simd 16 input pixels at a time
+STBI__AVX2_TARGET
+static stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
-   // resample with nearest-neighbor
-   int i,j;
-   STBI_NOTUSED(in_far);
-   for (i=0; i < w; ++i)
-      for (j=0; j < hs; ++j)
-         out[i*hs+j] = in_near[i];
-   return out;
-}
+   int i=0,t0,t1;
 
-// this is a reduced-precision calculation of YCbCr-to-RGB introduced
-// to make sure the code produces the same results in both SIMD and scalar
-#define stbi__float2fixed(x)  (((int) ((x) * 4096.0f + 0.5f)) << 8)
-static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step)
-{
-   int i;
-   for (i=0; i < count; ++i) {
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical pass: 3*near + far = 4*near + (far - near)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i curr  = _mm256_add_epi16(_mm256_slli_epi16(nearw, 2), _mm256_sub_epi16(farw, nearw));
+
+      // shift the row by one pixel each way across the two halves, then put in
+      // the previous pixel (t1) and the first pixel of the next group
+      __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+      __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+      __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+      __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal pass, even = 4*cur + (prev - cur), odd = 4*cur + (next - cur)
+      __m256i curb = _mm256_add_epi16(_mm256_slli_epi16(curr, 2), _mm256_set1_epi16(8));
+      __m256i even = _mm256_add_epi16(_mm256_sub_epi16(prev, curr), curb);
+      __m256i odd  = _mm256_add_epi16(_mm256_sub_epi16(next, curr), curb);
+
+      // interleave and undo scaling; packing each half puts the 32 outputs back in order
+      __m256i de0  = _mm256_srli_epi16(_mm256_unpacklo_epi16(even, odd), 4);
+      __m256i de1  = _mm256_srli_epi16(_mm256_unpackhi_epi16(even, odd), 4);
+      _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_packus_epi16(de0, de1));
+
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif
+
+static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // resample with nearest-neighbor
+   int i,j;
+   STBI_NOTUSED(in_far);
+   for (i=0; i < w; ++i)
+      for (j=0; j < hs; ++j)
+         out[i*hs+j] = in_near[i];
+   return out;
+}
+
+// this is a reduced-precision calculation of YCbCr-to-RGB introduced
+// to make sure the code produces the same results in both SIMD and scalar
+#define stbi__float2fixed(x)  (((int) ((x) * 4096.0f + 0.5f)) << 8)
+static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step)
+{
+   int i;
+   for (i=0; i < count; ++i) {
       int y_fixed = (y[i] << 20) + (1<<19); // rounding
       int r,g,b;
       int cr = pcr[i] - 128;
@@ -3817,10 +6023,71 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// stbi__YCbCr_to_RGB_simd 16 pixels at a time (step 4 only, like the SSE2 version)
+STBI__AVX2_TARGET
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+   if (step == 4) {
+      __m256i signflip  = _mm256_set1_epi16(0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(128);
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      for (; i+15 < count; i += 16) {
+         // widen to short with the byte in the high half, as the SSE2 unpack does
+         __m256i y_words  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (y+i)));
+         __m256i cr_words = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (pcr+i)));
+         __m256i cb_words = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (pcb+i)));
+         __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(y_words, 8), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_xor_si256(cr_words, signflip), 8); // -128
+         __m256i cbw = _mm256_slli_epi16(_mm256_xor_si256(cb_words, signflip), 8); // -128
+
+         // color transform
+         __m256i yws = _mm256_srli_epi16(yw, 4);
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         // back to byte and interleave channels; each half holds 8 pixels
+         __m256i brb = _mm256_packus_epi16(rw, bw);
+         __m256i gxb = _mm256_packus_epi16(gw, xw);
+         __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+         __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+         __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0-3, 8-11
+         __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4-7, 12-15
+
+         // store
+         _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+         out += 64;
+      }
+   }
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_2blocks_kernel = NULL;
+   j->idct_pending = NULL;
+   j->scale_shift = 0;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
@@ -3832,6 +6099,14 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_2blocks_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3862,16 +6137,215 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// step a resampler down one output row; y and w2 are the component's height and stride
+static void stbi__resample_next_row(stbi__resample *r, int y, int w2)
+{
+   if (++r->ystep >= r->vs) {
+      r->ystep = 0;
+      r->line0 = r->line1;
+      if (++r->ypos < y)
+         r->line1 += w2;
+   }
+}
+
+// resamples and color converts output rows y0..y1-1 into output, which points
+// at row y0, with out_stride bytes from one row to the next (negative to store
+// them bottom up); res_comp must be at row y0. every row must have a byte
+// after it that can be read, see below
+static void stbi__jpeg_output_rows(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc **linebuf, stbi_uc *output, int out_stride, int n, int decode_n, int is_rgb, unsigned int y0, unsigned int y1)
+{
+   int k;
+   unsigned int i,j;
+   size_t row_bytes = (size_t) n * z->s->img_x;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+
+   for (j=y0; j < y1; ++j) {
+      stbi_uc *row = output + (ptrdiff_t) out_stride * (int) (j - y0);
+      stbi_uc *out = row;
+      // the converters may store a byte after the row (the step 3 ones
+      // always do), which may be the row converted before (bottom up) or
+      // the caller's padding (stbi_load_into), so it's put back after
+      stbi_uc keep = row[row_bytes];
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         stbi__resample_next_row(r, z->img_comp[k].y, z->img_comp[k].w2);
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+      row[row_bytes] = keep;
+   }
+}
+
+// output_rows for a band of rows y0..y1-1 of the image at output, out_stride
+// bytes from one row to the next, that must not touch anything outside its
+// own rows (the step 3 color converters store a 4th byte after every pixel),
+// which takes a scratch row of n*img_x+1 bytes. res_comp must be at row y0
+static void stbi__jpeg_output_band(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc **linebuf, stbi_uc *row, stbi_uc *output, int out_stride, int n, int decode_n, int is_rgb, unsigned int y0, unsigned int y1)
+{
+   size_t row_bytes = (size_t) n * z->s->img_x;
+   if (z->flip) {
+      // bottom up, the byte after the band's first row is in the previous
+      // band (or past the end of the image), so that row goes through the
+      // scratch row, and is copied in last since the extra byte of the row
+      // after it lands on it
+      stbi_uc *first = output + (size_t) out_stride * (z->s->img_y-1 - y0);
+      stbi__jpeg_output_rows(z, res_comp, linebuf, row, 0, n, decode_n, is_rgb, y0, y0 + 1);
+      if (y1 > y0 + 1)
+         stbi__jpeg_output_rows(z, res_comp, linebuf, first - out_stride, -out_stride, n, decode_n, is_rgb, y0 + 1, y1);
+      memcpy(first, row, row_bytes);
+   } else {
+      // the band's last row would store into the next band (or past the end
+      // of the image), so it goes through the scratch row first
+      stbi__jpeg_output_rows(z, res_comp, linebuf, output + (size_t) out_stride * y0, out_stride, n, decode_n, is_rgb, y0, y1 - 1);
+      stbi__jpeg_output_rows(z, res_comp, linebuf, row, 0, n, decode_n, is_rgb, y1 - 1, y1);
+      memcpy(output + (size_t) out_stride * (y1 - 1), row, row_bytes);
+   }
+}
+
+#ifdef STBI__THREADS
+#define STBI__JPEG_BAND_ROWS  32
+
+typedef struct
 {
+   stbi__jpeg *z;
+   stbi__resample *res_comp;  // the resamplers at row 0
+   stbi_uc *output;
+   int out_stride;
+   stbi_uc *linebufs;         // decode_n line buffers and a row for each worker
    int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+} stbi__jpeg_bands;
 
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+static void stbi__jpeg_band_task(void *job, int worker, int task)
+{
+   stbi__jpeg_bands *b = (stbi__jpeg_bands *) job;
+   stbi__jpeg *z = b->z;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4];
+   size_t row_bytes = (size_t) b->n * z->s->img_x;
+   unsigned int j, y0 = task * STBI__JPEG_BAND_ROWS, y1 = y0 + STBI__JPEG_BAND_ROWS;
+   int k;
+   if (y1 > z->s->img_y) y1 = z->s->img_y;
+   for (k=0; k < b->decode_n; ++k) {
+      res_comp[k] = b->res_comp[k];
+      linebuf[k] = b->linebufs + (size_t) worker * (b->decode_n * (z->s->img_x + 3) + row_bytes + 1) + (size_t) k * (z->s->img_x + 3);
+      // the resampler state only depends on the row, so skip ahead to the band
+      for (j=0; j < y0; ++j)
+         stbi__resample_next_row(&res_comp[k], z->img_comp[k].y, z->img_comp[k].w2);
+   }
+   stbi__jpeg_output_band(z, res_comp, linebuf, linebuf[0] + (size_t) b->decode_n * (z->s->img_x + 3), b->output, b->out_stride, b->n, b->decode_n, b->is_rgb, y0, y1);
+}
+
+// rows only read the (already decoded) component buffers and write their own
+// part of the output, so bands of rows can be converted on separate threads.
+// returns 0 if the image is converted serially instead
+static int stbi__jpeg_output_threaded(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc *output, int out_stride, int n, int decode_n, int is_rgb)
+{
+   stbi__jpeg_bands b;
+   int bands = (z->s->img_y + STBI__JPEG_BAND_ROWS - 1) / STBI__JPEG_BAND_ROWS;
+   int workers;
+   if ((stbi__uint32) z->s->img_x * z->s->img_y < STBI__JPEG_THREAD_MIN_PIXELS) return 0;
+   workers = stbi__thread_count(z->s, bands);
+   if (workers < 2) return 0;
+   b.linebufs = (stbi_uc *) stbi__malloc_mad3(workers, decode_n * (z->s->img_x + 3) + n * z->s->img_x + 1, 1, 0);
+   if (!b.linebufs) return 0;
+   b.z = z;
+   b.res_comp = res_comp;
+   b.output = output;
+   b.out_stride = out_stride;
+   b.n = n;
+   b.decode_n = decode_n;
+   b.is_rgb = is_rgb;
+   stbi__run_tasks(stbi__jpeg_band_task, &b, bands, workers);
+   stbi__free(b.linebufs);
+   return 1;
+}
+#endif // STBI__THREADS
 
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+// picks the number of components to output and to decode for req_comp, and
+// sets up a resampler and line buffer for each decoded component
+static int stbi__jpeg_begin_output(stbi__jpeg *z, int req_comp, stbi__resample *res_comp, int *out_n, int *out_decode_n, int *out_is_rgb)
+{
+   int k, n, decode_n, is_rgb;
 
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
@@ -3885,138 +6359,98 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    // nothing to do if no components requested; check this now to avoid
    // accessing uninitialized coutput[0] later
-   if (decode_n <= 0) { stbi__cleanup_jpeg(z); return NULL; }
+   if (decode_n <= 0) return 0;
 
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
 
-      stbi__resample res_comp[4];
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
 
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
 
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+
+   *out_n = n;
+   *out_decode_n = decode_n;
+   *out_is_rgb = is_rgb;
+   return 1;
+}
 
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   int n, decode_n, is_rgb;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
 
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   z->req_comp = req_comp;
+   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   // a scaled decode made every component plane smaller, so shrink the image
+   // to match before resampling
+   if (z->scale_shift) {
+      int k, d = 1 << z->scale_shift;
+      z->s->img_x = (z->s->img_x + d-1) >> z->scale_shift;
+      z->s->img_y = (z->s->img_y + d-1) >> z->scale_shift;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->s->img_x * z->img_comp[k].h + z->img_h_max-1) / z->img_h_max;
+         z->img_comp[k].y = (z->s->img_y * z->img_comp[k].v + z->img_v_max-1) / z->img_v_max;
+      }
+   }
+
+   // a region decode only has the MCUs around the region, so they become the image
+   if (z->mcu_x0 || z->mcu_y0 || z->mcu_x1 < z->img_mcu_x || z->mcu_y1 < z->img_mcu_y) {
+      int k;
+      stbi__uint32 x1 = z->mcu_x1 * z->img_mcu_w, y1 = z->mcu_y1 * z->img_mcu_h;
+      if (x1 > z->s->img_x) x1 = z->s->img_x;
+      if (y1 > z->s->img_y) y1 = z->s->img_y;
+      z->s->img_x = x1 - z->mcu_x0 * z->img_mcu_w;
+      z->s->img_y = y1 - z->mcu_y0 * z->img_mcu_h;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->s->img_x * z->img_comp[k].h + z->img_h_max-1) / z->img_h_max;
+         z->img_comp[k].y = (z->s->img_y * z->img_comp[k].v + z->img_v_max-1) / z->img_v_max;
       }
+   }
+
+   // resample and color-convert
+   {
+      int k, out_stride;
+      stbi_uc *output, *scratch;
+      stbi__resample res_comp[4];
+
+      if (!stbi__jpeg_begin_output(z, req_comp, res_comp, &n, &decode_n, &is_rgb)) { stbi__cleanup_jpeg(z); return NULL; }
 
       // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+      scratch = (stbi_uc *) stbi__malloc_mad2(n, z->s->img_x, 1);
+      output = scratch ? stbi__out_image(z->s, &ri->direct, 1, z->s->img_x, z->s->img_y, n, 0, &out_stride) : NULL;
+      if (!output) { stbi__free(scratch); stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
+#ifdef STBI__THREADS
+      if (!stbi__jpeg_output_threaded(z, res_comp, output, out_stride, n, decode_n, is_rgb))
+#endif
+      {
+         stbi_uc *linebuf[4];
+         for (k=0; k < decode_n; ++k)
+            linebuf[k] = z->img_comp[k].linebuf;
+         stbi__jpeg_output_band(z, res_comp, linebuf, scratch, output, out_stride, n, decode_n, is_rgb, 0, z->s->img_y);
       }
+      stbi__free(scratch);
       stbi__cleanup_jpeg(z);
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
@@ -4031,11 +6465,15 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
    memset(j, 0, sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
-   result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   j->scale_shift = s->scale_shift;
+   ri->scale_shift = s->scale_shift;
+   j->flip = stbi__flip_in_loader(s, ri);
+   result = load_jpeg_image(j, x,y,comp,req_comp, ri);
+   ri->region_x = j->mcu_x0 * j->img_mcu_w;
+   ri->region_y = j->mcu_y0 * j->img_mcu_h;
+   stbi__free(j);
    return result;
 }
 
@@ -4049,7 +6487,7 @@ static int stbi__jpeg_test(stbi__context *s)
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__free(j);
    return r;
 }
 
@@ -4073,17 +6511,20 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    memset(j, 0, sizeof(stbi__jpeg));
    j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
-   STBI_FREE(j);
+   stbi__free(j);
    return result;
 }
 #endif
 
 // public domain zlib decode    v0.2  Sean Barrett 2006-11-18
 //    simple implementation
-//      - all input must be provided in an upfront buffer
+//      - all input must be provided in an upfront buffer, or be handed to
+//        stbi__zinflate as it arrives
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
 //      - fast huffman
+//      - main loop with a 64-bit bit buffer, one or two literals per lookup
+//        and 8-byte match copies
 
 #ifndef STBI_NO_ZLIB
 
@@ -4092,6 +6533,25 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 #define STBI__ZNSYMS 288 // number of symbols in literal/length alphabet
 
+// tables for the main inflate loop; wider than the ones above, and each entry
+// is fully resolved: bits 0-3 code length, 4-6 kind, 8-11 extra bits,
+// 16-31 the literal(s), length base or distance base
+#define STBI__ZLIT_BITS   11
+#define STBI__ZLIT_MASK   ((1 << STBI__ZLIT_BITS) - 1)
+#define STBI__ZDIST_BITS  10
+#define STBI__ZDIST_MASK  ((1 << STBI__ZDIST_BITS) - 1)
+
+#define STBI__ZK_LONG     0 // code longer than the table, decode the slow way
+#define STBI__ZK_LIT1     1 // one literal
+#define STBI__ZK_LIT2     2 // two literals in one lookup
+#define STBI__ZK_LEN      3
+#define STBI__ZK_EOB      4
+#define STBI__ZK_DIST     5
+#define STBI__ZK_BAD      6 // symbols DEFLATE doesn't allow
+
+// output room the main loop needs: the longest match plus word copy overrun
+#define STBI__ZFAST_OUT   (258 + 8)
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -4181,12 +6641,18 @@ typedef struct
    int hit_zeof_once;
    stbi__uint32 code_buffer;
 
+   int state;        // what stbi__zinflate reads next, STBI__ZSTATE_*
+   int final;        // the current block is the last one
+   int stored_left;  // bytes of a stored block not copied yet
+
    char *zout;
    char *zout_start;
    char *zout_end;
-   int   z_expandable;
+   int   z_expandable; // 1: grow zout when full, 0: fail, 2: return 2 so the caller can make room
 
    stbi__zhuffman z_length, z_distance;
+   stbi__uint32 z_fastlit[1 << STBI__ZLIT_BITS];
+   stbi__uint32 z_fastdist[1 << STBI__ZDIST_BITS];
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
@@ -4221,12 +6687,14 @@ stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
    return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+// decodes a code longer than STBI__ZFAST_BITS from the low 16 bits of code,
+// returns the symbol and its code length in *size, or -1 for an invalid code
+static int stbi__zhuffman_decode_long(stbi__zhuffman *z, int code, int *size)
 {
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse(code & 0xffff, 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4235,9 +6703,17 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
    if (b >= STBI__ZNSYMS) return -1; // some data was corrupt somewhere!
    if (z->size[b] != s) return -1;  // was originally an assert, but report failure instead.
+   *size = s;
+   return z->value[b];
+}
+
+static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+{
+   int s, v = stbi__zhuffman_decode_long(z, (int) a->code_buffer, &s);
+   if (v < 0) return -1;
    a->code_buffer >>= s;
    a->num_bits -= s;
-   return z->value[b];
+   return v;
 }
 
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
@@ -4283,7 +6759,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -4306,11 +6782,222 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
-static int stbi__parse_huffman_block(stbi__zbuf *a)
+// main loop table entry (without the code length) for a literal/length or a
+// distance symbol
+static stbi__uint32 stbi__zfast_entry(int i, int is_dist)
+{
+   if (is_dist)
+      return i < 30 ? (STBI__ZK_DIST << 4) | (stbi__zdist_extra[i] << 8) | ((stbi__uint32) stbi__zdist_base[i] << 16) : (STBI__ZK_BAD << 4);
+   if (i < 256) return (STBI__ZK_LIT1 << 4) | ((stbi__uint32) i << 16);
+   if (i == 256) return STBI__ZK_EOB << 4;
+   if (i < 286) return (STBI__ZK_LEN << 4) | (stbi__zlength_extra[i-257] << 8) | ((stbi__uint32) stbi__zlength_base[i-257] << 16);
+   return STBI__ZK_BAD << 4;
+}
+
+// builds a main loop table (see STBI__ZLIT_BITS) from code lengths that
+// stbi__zbuild_huffman has already validated
+static void stbi__zbuild_fast(stbi__uint32 *fast, int bits, const stbi_uc *sizelist, int num, int is_dist)
+{
+   int i,j,code,next_code[16],sizes[16];
+   memset(sizes, 0, sizeof(sizes));
+   memset(fast, 0, sizeof(*fast) << bits);
+   for (i=0; i < num; ++i)
+      ++sizes[sizelist[i]];
+   sizes[0] = 0;
+   code = 0;
+   for (i=1; i < 16; ++i) {
+      next_code[i] = code;
+      code = (code + sizes[i]) << 1;
+   }
+   for (i=0; i < num; ++i) {
+      int s = sizelist[i];
+      if (!s) continue;
+      if (s <= bits) {
+         stbi__uint32 e = stbi__zfast_entry(i, is_dist) | s;
+         j = stbi__bit_reverse(next_code[s], s);
+         while (j < (1 << bits)) {
+            fast[j] = e;
+            j += (1 << s);
+         }
+      }
+      ++next_code[s];
+   }
+   if (is_dist) return;
+   // pair up literals whose two codes fit in the table bits together. going
+   // downwards means fast[j >> s] (<= j) is still a single literal entry
+   for (j=(1 << bits)-1; j >= 0; --j) {
+      stbi__uint32 e = fast[j], e2;
+      int s = e & 15;
+      if (((e >> 4) & 7) != STBI__ZK_LIT1) continue;
+      e2 = fast[j >> s];
+      if (((e2 >> 4) & 7) == STBI__ZK_LIT1 && s + (int) (e2 & 15) <= bits)
+         fast[j] = (STBI__ZK_LIT2 << 4) | (s + (e2 & 15)) | (e & 0xff0000) | ((e2 & 0xff0000) << 8);
+   }
+}
+
+static int stbi__zbuild_tables(stbi__zbuf *a, const stbi_uc *lengths, int nlen, const stbi_uc *dists, int ndist)
+{
+   if (!stbi__zbuild_huffman(&a->z_length  , lengths, nlen )) return 0;
+   if (!stbi__zbuild_huffman(&a->z_distance, dists  , ndist)) return 0;
+   stbi__zbuild_fast(a->z_fastlit , STBI__ZLIT_BITS , lengths, nlen , 0);
+   stbi__zbuild_fast(a->z_fastdist, STBI__ZDIST_BITS, dists  , ndist, 1);
+   return 1;
+}
+
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return (stbi__uint64) p[0]       | ((stbi__uint64) p[1] << 8)  | ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+         ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) | ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+#endif
+}
+
+// looks up the main loop table entry for the next code; codes longer than the
+// table are decoded the slow way and turned into an entry. 0 for invalid codes
+stbi_inline static stbi__uint32 stbi__zfast_lookup(stbi__uint32 *fast, int mask, stbi__zhuffman *z, stbi__uint64 bits, int is_dist)
+{
+   stbi__uint32 e = fast[bits & mask];
+   if (e == 0) {
+      int s, v = stbi__zhuffman_decode_long(z, (int) (bits & 0xffff), &s);
+      if (v >= 0)
+         e = stbi__zfast_entry(v, is_dist) | s;
+   }
+   return e;
+}
+
+// main inflate loop, used while at least 8 bytes of input and STBI__ZFAST_OUT
+// bytes of output are left. a refill tops a local 64-bit bit buffer up to 56+
+// bits a word at a time, which is enough for up to two literal lookups (two
+// literals each) or a whole length/distance pair without checking for input.
+// returns 2 at the end of the block, 1 when the careful loop has to take over
+// near the ends of the buffers, 0 on error
+static int stbi__parse_huffman_block_fast(stbi__zbuf *a, char **pzout)
+{
+   stbi_uc *in = a->zbuffer, *in_end = a->zbuffer_end - 8;
+   stbi_uc *out = (stbi_uc *) *pzout;
+   stbi_uc *out_start = (stbi_uc *) a->zout_start;
+   stbi_uc *out_end = (stbi_uc *) a->zout_end - STBI__ZFAST_OUT;
+   stbi__uint64 bits = a->code_buffer;
+   int num_bits = a->num_bits, result = 1;
+
+   while (in <= in_end && out <= out_end) {
+      stbi__uint32 e;
+      int kind, len, dist, extra;
+      stbi_uc *src;
+
+      // refill. the byte only partly loaded at the top is loaded again at the
+      // same place by the next refill, so it doesn't need masking off
+      bits |= stbi__zload64(in) << num_bits;
+      in += (63 - num_bits) >> 3;
+      num_bits |= 56;
+
+      e = stbi__zfast_lookup(a->z_fastlit, STBI__ZLIT_MASK, &a->z_length, bits, 0);
+      kind = (e >> 4) & 7;
+      if (kind == STBI__ZK_LIT1 || kind == STBI__ZK_LIT2) {
+         out[0] = (stbi_uc) (e >> 16);
+         out[1] = (stbi_uc) (e >> 24);
+         out += kind;
+         bits >>= e & 15;
+         num_bits -= e & 15;
+         // a literal takes at most 15 bits, so there's always enough for another
+         e = stbi__zfast_lookup(a->z_fastlit, STBI__ZLIT_MASK, &a->z_length, bits, 0);
+         kind = (e >> 4) & 7;
+         if (kind == STBI__ZK_LIT1 || kind == STBI__ZK_LIT2) {
+            out[0] = (stbi_uc) (e >> 16);
+            out[1] = (stbi_uc) (e >> 24);
+            out += kind;
+            bits >>= e & 15;
+            num_bits -= e & 15;
+            continue;
+         }
+         // a length/distance pair can take 48 bits
+         if (num_bits < 48) continue;
+      }
+      if (kind != STBI__ZK_LEN) {
+         if (kind == STBI__ZK_EOB) {
+            bits >>= e & 15;
+            num_bits -= e & 15;
+            result = 2;
+         } else {
+            result = stbi__err("bad huffman code","Corrupt PNG");
+         }
+         break;
+      }
+
+      // length (at most 15+5 bits) then distance (15+13)
+      bits >>= e & 15;
+      num_bits -= e & 15;
+      extra = (e >> 8) & 15;
+      len = (int) (e >> 16) + (int) (bits & ((1 << extra) - 1));
+      bits >>= extra;
+      num_bits -= extra;
+
+      e = stbi__zfast_lookup(a->z_fastdist, STBI__ZDIST_MASK, &a->z_distance, bits, 1);
+      if (((e >> 4) & 7) != STBI__ZK_DIST) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+      bits >>= e & 15;
+      num_bits -= e & 15;
+      extra = (e >> 8) & 15;
+      dist = (int) (e >> 16) + (int) (bits & ((1 << extra) - 1));
+      bits >>= extra;
+      num_bits -= extra;
+      if (out - out_start < dist) { result = stbi__err("bad dist","Corrupt PNG"); break; }
+
+      src = out - dist;
+      if (dist >= 8) {
+         // 8 bytes at a time; each chunk's source is already written, and
+         // the overrun past the match lands in STBI__ZFAST_OUT
+         stbi_uc *end = out + len;
+         do {
+            memcpy(out, src, 8);
+            out += 8;
+            src += 8;
+         } while (out < end);
+         out = end;
+      } else if (dist == 1) { // run of one byte; common in images.
+         memset(out, *src, len);
+         out += len;
+      } else {
+         do *out++ = *src++; while (--len);
+      }
+   }
+
+   // hand the whole bytes still in the bit buffer back to the input, so the
+   // careful loop's 32-bit buffer carries on from the same place
+   in -= num_bits >> 3;
+   num_bits &= 7;
+   a->zbuffer = in;
+   a->code_buffer = (stbi__uint32) bits & ((1u << num_bits) - 1);
+   a->num_bits = num_bits;
+   *pzout = (char *) out;
+   return result;
+}
+
+// returns 1 at the end of the block, 0 on error, and 2 when fewer than
+// min_in bytes of input are left (stbi__zinflate waiting for more)
+static int stbi__parse_huffman_block(stbi__zbuf *a, int min_in)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (a->zbuffer_end - a->zbuffer < min_in || (a->z_expandable == 2 && a->zout_end - zout < STBI__ZFAST_OUT)) {
+         a->zout = zout;
+         return 2;
+      }
+      if (a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - zout >= STBI__ZFAST_OUT) {
+         z = stbi__parse_huffman_block_fast(a, &zout);
+         if (z == 0) return 0;
+         if (z == 2) {
+            a->zout = zout;
+            return 1;
+         }
+         // it stopped at one of the ends; see if that's where to pause
+         if (a->z_expandable == 2) continue;
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4401,11 +7088,10 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       }
    }
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
-   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
-   return 1;
+   return stbi__zbuild_tables(a, lencodes, hlit, lencodes+hlit, hdist);
 }
 
+// reads the header of a stored block, stbi__zinflate copies the bytes
 static int stbi__parse_uncompressed_block(stbi__zbuf *a)
 {
    stbi_uc header[4];
@@ -4426,12 +7112,7 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
-   if (a->zout + len > a->zout_end)
-      if (!stbi__zexpand(a, a->zout, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   a->stored_left = len;
    return 1;
 }
 
@@ -4478,33 +7159,110 @@ Init algorithm:
 }
 */
 
-static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+enum
 {
-   int final, type;
-   if (parse_header)
-      if (!stbi__parse_zlib_header(a)) return 0;
+   STBI__ZSTATE_header,
+   STBI__ZSTATE_block,
+   STBI__ZSTATE_stored,
+   STBI__ZSTATE_huffman,
+   STBI__ZSTATE_done
+};
+
+// input a block header may need: a dynamic header is at most ~600 bytes
+#define STBI__ZBLOCK_IN    1024
+// input one literal or match may need, with room for the bit buffer refills
+#define STBI__ZSYMBOL_IN   16
+
+static void stbi__zinit(stbi__zbuf *a, int parse_header)
+{
+   a->state = parse_header ? STBI__ZSTATE_header : STBI__ZSTATE_block;
+   a->final = 0;
+   a->stored_left = 0;
    a->num_bits = 0;
    a->code_buffer = 0;
    a->hit_zeof_once = 0;
-   do {
-      final = stbi__zreceive(a,1);
-      type = stbi__zreceive(a,2);
-      if (type == 0) {
-         if (!stbi__parse_uncompressed_block(a)) return 0;
-      } else if (type == 3) {
-         return 0;
-      } else {
-         if (type == 1) {
-            // use fixed code lengths
-            if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , STBI__ZNSYMS)) return 0;
-            if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
-         } else {
-            if (!stbi__compute_huffman_codes(a)) return 0;
+}
+
+// inflates as much as the input allows. with 'more' set, zbuffer..zbuffer_end
+// isn't the end of the stream: it stops before anything that might read past
+// zbuffer_end and returns 2, and the caller appends input and calls again (the
+// bit buffer and the state stay in 'a'). it also returns 2 when zout is nearly
+// full and z_expandable is 2. returns 1 at the end, 0 on error
+static int stbi__zinflate(stbi__zbuf *a, int more)
+{
+   for(;;) {
+      int avail = (int) (a->zbuffer_end - a->zbuffer);
+      switch (a->state) {
+         case STBI__ZSTATE_header:
+            if (more && avail < 3) return 2;
+            if (!stbi__parse_zlib_header(a)) return 0;
+            a->state = STBI__ZSTATE_block;
+            break;
+
+         case STBI__ZSTATE_block: {
+            int type;
+            if (a->final) {
+               a->state = STBI__ZSTATE_done;
+               break;
+            }
+            if (more && avail < STBI__ZBLOCK_IN) return 2;
+            a->final = stbi__zreceive(a,1);
+            type = stbi__zreceive(a,2);
+            if (type == 0) {
+               if (!stbi__parse_uncompressed_block(a)) return 0;
+               a->state = STBI__ZSTATE_stored;
+            } else if (type == 3) {
+               return 0;
+            } else {
+               if (type == 1) {
+                  // use fixed code lengths
+                  if (!stbi__zbuild_tables(a, stbi__zdefault_length, STBI__ZNSYMS, stbi__zdefault_distance, 32)) return 0;
+               } else {
+                  if (!stbi__compute_huffman_codes(a)) return 0;
+               }
+               a->state = STBI__ZSTATE_huffman;
+            }
+            break;
+         }
+
+         case STBI__ZSTATE_stored: {
+            int len = a->stored_left;
+            if (len > avail) {
+               if (!more) return stbi__err("read past buffer","Corrupt PNG");
+               len = avail;
+            }
+            if (a->zout + len > a->zout_end) {
+               if (a->z_expandable == 2)
+                  len = (int) (a->zout_end - a->zout); // the rest after the caller makes room
+               else if (!stbi__zexpand(a, a->zout, len))
+                  return 0;
+            }
+            memcpy(a->zout, a->zbuffer, len);
+            a->zbuffer += len;
+            a->zout += len;
+            a->stored_left -= len;
+            if (a->stored_left) return 2;
+            a->state = STBI__ZSTATE_block;
+            break;
          }
-         if (!stbi__parse_huffman_block(a)) return 0;
+
+         case STBI__ZSTATE_huffman: {
+            int r = stbi__parse_huffman_block(a, more ? STBI__ZSYMBOL_IN : 0);
+            if (r != 1) return r;
+            a->state = STBI__ZSTATE_block;
+            break;
+         }
+
+         default:
+            return 1;
       }
-   } while (!final);
-   return 1;
+   }
+}
+
+static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
+{
+   stbi__zinit(a, parse_header);
+   return stbi__zinflate(a, 0);
 }
 
 static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
@@ -4528,7 +7286,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4549,7 +7307,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4576,7 +7334,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      stbi__free(a.zout_start);
       return NULL;
    }
 }
@@ -4627,11 +7385,43 @@ static int stbi__check_png_header(stbi__context *s)
    return 1;
 }
 
+// non-interlaced images are decoded a row at a time while the IDAT data is
+// inflated: inflate writes to a window that only holds the deflate history
+// and a row or two, and every row is unfiltered straight into the image, gets
+// its tRNS alpha and palette lookup and (8 bits) is converted to req_comp. so
+// neither the compressed nor the filtered image is ever kept whole
+typedef struct
+{
+   stbi__zbuf z;                     // zbuffer..zbuffer_end is set by the caller
+   stbi_uc *out;                     // the image, set by the caller (not owned)
+   stbi__uint32 out_stride;          // bytes from one row of out to the next, x*out_n*bytes unless the caller changes it
+   stbi__uint32 x, y, row_bytes;     // filtered bytes per row, without the filter byte
+   int img_out_n, pal_out_n, out_n;  // channels unfiltered, after the palette lookup, in out
+   stbi_uc *filter_buf, *tmp;        // two rows of each (tmp has a third row)
+   char *win;                        // inflate's output
+   stbi__uint32 win_size, row_pos;   // row_pos: where the next row starts in win
+   stbi__uint32 rows_done;
+   stbi_uc *zin;                     // IDAT data read by stbi__parse_png_file
+   int zin_len;
+} stbi__png_rows;
+
 typedef struct
 {
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
+   stbi__png_rows *rows; // set while IDAT data is decoded a row at a time
    int depth;
+   int flip; // store the rows bottom up
+   int direct; // the rows went straight to s->out, see stbi__out_image
+
+   // what the chunks before the first IDAT said
+   stbi_uc palette[1024], pal_img_n;
+   stbi_uc has_trans, tc[3];
+   stbi__uint16 tc16[3];
+   stbi__uint32 pal_len;
+   int interlace, color, is_iphone;
+
+   stbi__uint32 region_x, region_y; // where out starts in the whole image
 } stbi__png;
 
 
@@ -4692,31 +7482,304 @@ static void stbi__create_png_alpha_expand8(stbi_uc *dest, stbi_uc *src, stbi__ui
    }
 }
 
+#ifdef STBI_SSE2
+// SSE2 unfiltering for rows of 3/4 byte (8-bit RGB/RGBA) and 4/6/8 byte
+// (16-bit) pixels. Sub, Avg and Paeth depend on the pixel to the left, so the
+// parallelism is across the channels of one pixel, which sits in the low
+// lanes of a register (wider vectors wouldn't help). the result goes straight
+// into the output image: out_bpp > bpp adds an opaque alpha channel, and
+// 16-bit samples are swapped to native order on the way out (and back for
+// prior, the previous output row).
+//
+// every pixel is loaded and stored 8 bytes at a time; the bytes past the
+// pixel belong to the next one (and get overwritten by it), and the last few
+// pixels of the row go through a small buffer so nothing outside the row is
+// touched
+
+// (a + b) >> 1 per byte
+stbi_inline static __m128i stbi__png_avg(__m128i a, __m128i b)
+{
+   return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+// stbi__paeth on 8 bytes at once, in 16-bit lanes
+stbi_inline static __m128i stbi__png_paeth(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a16 = _mm_unpacklo_epi8(a, zero);
+   __m128i b16 = _mm_unpacklo_epi8(b, zero);
+   __m128i c16 = _mm_unpacklo_epi8(c, zero);
+   __m128i pa = _mm_sub_epi16(b16, c16); // p-a
+   __m128i pb = _mm_sub_epi16(a16, c16); // p-b
+   __m128i pc = _mm_add_epi16(pa, pb);   // p-c
+   __m128i not_b, not_a, bc;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   // a if pa <= pb and pa <= pc, otherwise b if pb <= pc, otherwise c
+   not_b = _mm_cmpgt_epi16(pb, pc);
+   bc = _mm_or_si128(_mm_andnot_si128(not_b, b16), _mm_and_si128(not_b, c16));
+   not_a = _mm_cmpgt_epi16(pa, _mm_min_epi16(pb, pc));
+   a16 = _mm_or_si128(_mm_andnot_si128(not_a, a16), _mm_and_si128(not_a, bc));
+   return _mm_packus_epi16(a16, a16);
+}
+
+stbi_inline static __m128i stbi__png_swap16(__m128i x)
+{
+   return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+// unfilters n pixels; left and upleft carry the previous pixel (a and c in
+// stbi__paeth) from one call to the next
+static void stbi__png_unfilter_pixels_simd(int filter, stbi_uc *out, const stbi_uc *prior, const stbi_uc *raw, stbi__uint32 n, int bpp, int out_bpp, int swap16, __m128i alpha, __m128i *left, __m128i *upleft)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = *left, b, c = *upleft, x;
+   stbi__uint32 i;
+
+   #define STBI__PNG_LOAD_X()  x = _mm_loadl_epi64((const __m128i *) raw)
+   #define STBI__PNG_LOAD_B()  b = _mm_loadl_epi64((const __m128i *) prior); if (swap16) b = stbi__png_swap16(b); prior += out_bpp
+   #define STBI__PNG_STORE()   _mm_storel_epi64((__m128i *) out, _mm_or_si128(swap16 ? stbi__png_swap16(a) : a, alpha))
+   #define STBI__PNG_NEXT      ++i, raw += bpp, out += out_bpp
+
+   switch (filter) {
+      case STBI__F_none:
+         for (i=0; i < n; STBI__PNG_NEXT) { STBI__PNG_LOAD_X(); a = x; STBI__PNG_STORE(); }
+         break;
+      case STBI__F_sub:
+         for (i=0; i < n; STBI__PNG_NEXT) { STBI__PNG_LOAD_X(); a = _mm_add_epi8(x, a); STBI__PNG_STORE(); }
+         break;
+      case STBI__F_up:
+         for (i=0; i < n; STBI__PNG_NEXT) { STBI__PNG_LOAD_X(); STBI__PNG_LOAD_B(); a = _mm_add_epi8(x, b); STBI__PNG_STORE(); }
+         break;
+      case STBI__F_avg:
+         for (i=0; i < n; STBI__PNG_NEXT) { STBI__PNG_LOAD_X(); STBI__PNG_LOAD_B(); a = _mm_add_epi8(x, stbi__png_avg(a, b)); STBI__PNG_STORE(); }
+         break;
+      case STBI__F_paeth:
+         for (i=0; i < n; STBI__PNG_NEXT) { STBI__PNG_LOAD_X(); STBI__PNG_LOAD_B(); a = _mm_add_epi8(x, stbi__png_paeth(a, b, c)); c = b; STBI__PNG_STORE(); }
+         break;
+      case STBI__F_avg_first:
+         for (i=0; i < n; STBI__PNG_NEXT) { STBI__PNG_LOAD_X(); a = _mm_add_epi8(x, stbi__png_avg(a, zero)); STBI__PNG_STORE(); }
+         break;
+   }
+
+   #undef STBI__PNG_LOAD_X
+   #undef STBI__PNG_LOAD_B
+   #undef STBI__PNG_STORE
+   #undef STBI__PNG_NEXT
+
+   *left = a;
+   *upleft = c;
+}
+
+static void stbi__png_unfilter_row_simd(int filter, stbi_uc *out, const stbi_uc *prior, const stbi_uc *raw, stbi__uint32 width, int bpp, int out_bpp, int swap16)
+{
+   __m128i alpha = _mm_setzero_si128();
+   __m128i a = alpha, c = alpha;
+   stbi_uc tail_raw[32], tail_prior[32], tail_out[32];
+   stbi__uint32 n, tail;
+
+   if (out_bpp > bpp)
+      alpha = bpp == 3 ? _mm_cvtsi32_si128((int) 0xff000000) : _mm_set_epi16(0,0,0,0,-1,0,0,0);
+
+   // plain byte rows don't need to go a pixel at a time
+   if (filter == STBI__F_none && out_bpp > bpp && !swap16) {
+      stbi__convert_row(out, (stbi_uc *) raw, bpp, out_bpp, width);
+      return;
+   }
+   if (out_bpp == bpp && !swap16 && (filter == STBI__F_none || filter == STBI__F_up)) {
+      stbi__uint32 k = 0, nk = width * bpp;
+      if (filter == STBI__F_none) {
+         memcpy(out, raw, nk);
+         return;
+      }
+      for (; k + 16 <= nk; k += 16)
+         _mm_storeu_si128((__m128i *) (out + k), _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw + k)), _mm_loadu_si128((const __m128i *) (prior + k))));
+      for (; k < nk; ++k)
+         out[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return;
+   }
+
+   // the pixels that are at least 8 bytes from the end of the row, then the rest
+   tail = (8 + bpp-1) / bpp;
+   if (tail > width) tail = width;
+   n = width - tail;
+   stbi__png_unfilter_pixels_simd(filter, out, prior, raw, n, bpp, out_bpp, swap16, alpha, &a, &c);
+   memcpy(tail_raw, raw + n * bpp, tail * bpp);
+   if (prior) memcpy(tail_prior, prior + n * out_bpp, tail * out_bpp);
+   stbi__png_unfilter_pixels_simd(filter, tail_out, tail_prior, tail_raw, tail, bpp, out_bpp, swap16, alpha, &a, &c);
+   memcpy(out + n * out_bpp, tail_out, tail * out_bpp);
+}
+#endif
+
+// unfilters row j of an image into dest (out_n channels). raw points at the
+// row's filter byte, prior_out is the row above in the output (NULL for the
+// first row) and filter_buf two rows of workspace kept from row to row
+static int stbi__png_unfilter_row(stbi_uc *dest, stbi_uc *prior_out, stbi_uc *raw, stbi_uc *filter_buf, stbi__uint32 img_width_bytes, int img_n, int out_n, stbi__uint32 x, stbi__uint32 j, int depth, int color)
+{
+   int bytes = (depth == 16 ? 2 : 1);
+   // cur/prior filter buffers alternate
+   stbi_uc *cur = filter_buf + (j & 1)*img_width_bytes;
+   stbi_uc *prior = filter_buf + (~j & 1)*img_width_bytes;
+   int filter_bytes = img_n*bytes;
+   int width = x;
+   stbi__uint32 i;
+   int k, nk, filter;
+
+   // Filtering for low-bit-depth images
+   if (depth < 8) {
+      filter_bytes = 1;
+      width = img_width_bytes;
+   }
+   nk = width * filter_bytes;
+   filter = *raw++;
+
+   // check filter type
+   if (filter > 4)
+      return stbi__err("invalid filter","Corrupt PNG");
+
+   // if first row, use special filter that doesn't sample previous row
+   if (j == 0) filter = first_row_filter[filter];
+
+#ifdef STBI_SSE2
+   // 3+ byte pixels: unfilter straight into the output with SSE2
+   if (depth >= 8 && filter_bytes >= 3 && stbi__sse2_available()) {
+      stbi__png_unfilter_row_simd(filter, dest, prior_out, raw, x, filter_bytes, out_n*bytes, depth == 16);
+      return 1;
+   }
+#else
+   STBI_NOTUSED(prior_out);
+#endif
+
+   // perform actual filtering
+   switch (filter) {
+   case STBI__F_none:
+      memcpy(cur, raw, nk);
+      break;
+   case STBI__F_sub:
+      memcpy(cur, raw, filter_bytes);
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
+      break;
+   case STBI__F_up:
+      for (k = 0; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      break;
+   case STBI__F_avg:
+      for (k = 0; k < filter_bytes; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1));
+      break;
+   case STBI__F_paeth:
+      for (k = 0; k < filter_bytes; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes], prior[k], prior[k-filter_bytes]));
+      break;
+   case STBI__F_avg_first:
+      memcpy(cur, raw, filter_bytes);
+      for (k = filter_bytes; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1));
+      break;
+   }
+
+   // expand decoded bits in cur to dest, also adding an extra alpha channel if desired
+   if (depth < 8) {
+      stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+      stbi_uc *in = cur;
+      stbi_uc *out = dest;
+      stbi_uc inb = 0;
+      stbi__uint32 nsmp = x*img_n;
+
+      // expand bits to bytes first
+      if (depth == 4) {
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 1) == 0) inb = *in++;
+            *out++ = scale * (inb >> 4);
+            inb <<= 4;
+         }
+      } else if (depth == 2) {
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 3) == 0) inb = *in++;
+            *out++ = scale * (inb >> 6);
+            inb <<= 2;
+         }
+      } else {
+         STBI_ASSERT(depth == 1);
+         for (i=0; i < nsmp; ++i) {
+            if ((i & 7) == 0) inb = *in++;
+            *out++ = scale * (inb >> 7);
+            inb <<= 1;
+         }
+      }
+
+      // insert alpha=255 values if desired
+      if (img_n != out_n)
+         stbi__create_png_alpha_expand8(dest, dest, x, img_n);
+   } else if (depth == 8) {
+      if (img_n == out_n)
+         memcpy(dest, cur, x*img_n);
+      else
+         stbi__convert_row(dest, cur, img_n, out_n, x);
+   } else if (depth == 16) {
+      // convert the image data from big-endian to platform-native
+      stbi__uint16 *dest16 = (stbi__uint16*)dest;
+      stbi__uint32 nsmp = x*img_n;
+
+      if (img_n == out_n) {
+         for (i = 0; i < nsmp; ++i, ++dest16, cur += 2)
+            *dest16 = (cur[0] << 8) | cur[1];
+      } else {
+         STBI_ASSERT(img_n+1 == out_n);
+         if (img_n == 1) {
+            for (i = 0; i < x; ++i, dest16 += 2, cur += 2) {
+               dest16[0] = (cur[0] << 8) | cur[1];
+               dest16[1] = 0xffff;
+            }
+         } else {
+            STBI_ASSERT(img_n == 3);
+            for (i = 0; i < x; ++i, dest16 += 4, cur += 6) {
+               dest16[0] = (cur[0] << 8) | cur[1];
+               dest16[1] = (cur[2] << 8) | cur[3];
+               dest16[2] = (cur[4] << 8) | cur[5];
+               dest16[3] = 0xffff;
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+// bytes per filtered row of an image (without the filter byte), 0 if too large
+static stbi__uint32 stbi__png_row_bytes(int img_n, stbi__uint32 x, stbi__uint32 y, int depth)
+{
+   stbi__uint32 img_width_bytes;
+   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return 0;
+   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
+   if (!stbi__mad2sizes_valid(img_width_bytes, y, img_width_bytes)) return 0;
+   return img_width_bytes;
+}
+
 // create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color, int flip)
 {
    int bytes = (depth == 16 ? 2 : 1);
    stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
+   stbi__uint32 j,stride = x*out_n*bytes;
    stbi__uint32 img_len, img_width_bytes;
    stbi_uc *filter_buf;
    int all_ok = 1;
-   int k;
    int img_n = s->img_n; // copy it into a local for later
 
-   int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
-
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, out_n*bytes, 0); // extra bytes to write off the end into
    if (!a->out) return stbi__err("outofmem", "Out of memory");
 
    // note: error exits here don't need to clean up a->out individually,
    // stbi__do_png always does on error.
-   if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
-   img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   if (!stbi__mad2sizes_valid(img_width_bytes, y, img_width_bytes)) return stbi__err("too large", "Corrupt PNG");
+   img_width_bytes = stbi__png_row_bytes(img_n, x, y, depth);
+   if (!img_width_bytes) return stbi__err("too large", "Corrupt PNG");
    img_len = (img_width_bytes + 1) * y;
 
    // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
@@ -4728,133 +7791,123 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    filter_buf = (stbi_uc *) stbi__malloc_mad2(img_width_bytes, 2, 0);
    if (!filter_buf) return stbi__err("outofmem", "Out of memory");
 
-   // Filtering for low-bit-depth images
-   if (depth < 8) {
-      filter_bytes = 1;
-      width = img_width_bytes;
-   }
-
    for (j=0; j < y; ++j) {
-      // cur/prior filter buffers alternate
-      stbi_uc *cur = filter_buf + (j & 1)*img_width_bytes;
-      stbi_uc *prior = filter_buf + (~j & 1)*img_width_bytes;
-      stbi_uc *dest = a->out + stride*j;
-      int nk = width * filter_bytes;
-      int filter = *raw++;
-
-      // check filter type
-      if (filter > 4) {
-         all_ok = stbi__err("invalid filter","Corrupt PNG");
+      stbi_uc *dest = a->out + stride*(flip ? y-1-j : j);
+      stbi_uc *prior = j == 0 ? NULL : flip ? dest + stride : dest - stride;
+      if (!stbi__png_unfilter_row(dest, prior, raw, filter_buf, img_width_bytes, img_n, out_n, x, j, depth, color)) {
+         all_ok = 0;
          break;
       }
+      raw += img_width_bytes + 1;
+   }
 
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // perform actual filtering
-      switch (filter) {
-      case STBI__F_none:
-         memcpy(cur, raw, nk);
-         break;
-      case STBI__F_sub:
-         memcpy(cur, raw, filter_bytes);
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]);
-         break;
-      case STBI__F_up:
-         for (k = 0; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
-         break;
-      case STBI__F_avg:
-         for (k = 0; k < filter_bytes; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1));
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1));
-         break;
-      case STBI__F_paeth:
-         for (k = 0; k < filter_bytes; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + prior[k]); // prior[k] == stbi__paeth(0,prior[k],0)
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes], prior[k], prior[k-filter_bytes]));
-         break;
-      case STBI__F_avg_first:
-         memcpy(cur, raw, filter_bytes);
-         for (k = filter_bytes; k < nk; ++k)
-            cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1));
-         break;
-      }
+   stbi__free(filter_buf);
+   if (!all_ok) return 0;
 
-      raw += nk;
+   return 1;
+}
 
-      // expand decoded bits in cur to dest, also adding an extra alpha channel if desired
-      if (depth < 8) {
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-         stbi_uc *in = cur;
-         stbi_uc *out = dest;
-         stbi_uc inb = 0;
-         stbi__uint32 nsmp = x*img_n;
+// size of the filtered data of an interlaced image: every non-empty pass has
+// its own rows, each with a filter byte
+static stbi__uint32 stbi__png_interlaced_size(stbi__context *s, int depth)
+{
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
+   stbi__uint32 size = 0;
+   int p;
+   for (p=0; p < 7; ++p) {
+      stbi__uint32 x = (s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
+      stbi__uint32 y = (s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      if (x && y)
+         size += (((s->img_n * x * depth) + 7) >> 3) * y + y;
+   }
+   return size;
+}
 
-         // expand bits to bytes first
-         if (depth == 4) {
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 1) == 0) inb = *in++;
-               *out++ = scale * (inb >> 4);
-               inb <<= 4;
-            }
-         } else if (depth == 2) {
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 3) == 0) inb = *in++;
-               *out++ = scale * (inb >> 6);
-               inb <<= 2;
-            }
-         } else {
-            STBI_ASSERT(depth == 1);
-            for (i=0; i < nsmp; ++i) {
-               if ((i & 7) == 0) inb = *in++;
-               *out++ = scale * (inb >> 7);
-               inb <<= 1;
-            }
-         }
+// the region of a non-interlaced image, without inflating all of it: rows are
+// unfiltered as they come out of a sliding window that holds the deflate
+// history and a row or two, only up to the region's right edge, and decoding
+// stops after the region's last row. a->out and the image size become the
+// region's
+static int stbi__create_png_region(stbi__png *a, stbi_uc *idata, stbi__uint32 idata_len, int out_n, int depth, int color, int parse_header)
+{
+   int bytes = (depth == 16 ? 2 : 1);
+   stbi__context *s = a->s;
+   int img_n = s->img_n;
+   stbi__uint32 out_bpp = out_n*bytes;
+   stbi__uint32 rx, ry, rw, rh, xw, j, row_len, prefix_bytes, window;
+   stbi_uc *rows, *filter_buf, *rowp;
+   char *win;
+   stbi__zbuf z;
+   int r, all_ok = 0;
 
-         // insert alpha=255 values if desired
-         if (img_n != out_n)
-            stbi__create_png_alpha_expand8(dest, dest, x, img_n);
-      } else if (depth == 8) {
-         if (img_n == out_n)
-            memcpy(dest, cur, x*img_n);
-         else
-            stbi__create_png_alpha_expand8(dest, cur, x, img_n);
-      } else if (depth == 16) {
-         // convert the image data from big-endian to platform-native
-         stbi__uint16 *dest16 = (stbi__uint16*)dest;
-         stbi__uint32 nsmp = x*img_n;
-
-         if (img_n == out_n) {
-            for (i = 0; i < nsmp; ++i, ++dest16, cur += 2)
-               *dest16 = (cur[0] << 8) | cur[1];
-         } else {
-            STBI_ASSERT(img_n+1 == out_n);
-            if (img_n == 1) {
-               for (i = 0; i < x; ++i, dest16 += 2, cur += 2) {
-                  dest16[0] = (cur[0] << 8) | cur[1];
-                  dest16[1] = 0xffff;
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (i = 0; i < x; ++i, dest16 += 4, cur += 6) {
-                  dest16[0] = (cur[0] << 8) | cur[1];
-                  dest16[1] = (cur[2] << 8) | cur[3];
-                  dest16[2] = (cur[4] << 8) | cur[5];
-                  dest16[3] = 0xffff;
-               }
-            }
+   STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
+   if (!stbi__region_clip(s, 0, 0, s->img_x, s->img_y, &rx, &ry, &rw, &rh)) return stbi__err("bad region", "Region outside of the image");
+   xw = rx + rw;
+   row_len = stbi__png_row_bytes(img_n, s->img_x, s->img_y, depth);
+   if (!row_len || row_len > (0x7fffffff - 32768*3) / 2) return stbi__err("too large", "Corrupt PNG");
+   ++row_len; // filter byte
+   prefix_bytes = stbi__png_row_bytes(img_n, xw, 1, depth);
+   // 32k of history, the partial row and room to inflate at least a row more
+   window = 32768 + 2*row_len + 65536;
+
+   a->out = (stbi_uc *) stbi__malloc_mad3(rw, rh, out_bpp, 0);
+   if (!a->out) return stbi__err("outofmem", "Out of memory");
+   rows = (stbi_uc *) stbi__malloc_mad3(xw, out_bpp, 2, 0);
+   filter_buf = (stbi_uc *) stbi__malloc_mad2(prefix_bytes, 2, 0);
+   win = (char *) stbi__malloc(window);
+   if (!rows || !filter_buf || !win) {
+      stbi__err("outofmem", "Out of memory");
+      goto done;
+   }
+
+   z.zbuffer = idata;
+   z.zbuffer_end = idata + idata_len;
+   z.zout_start = z.zout = win;
+   z.zout_end = win + window;
+   z.z_expandable = 2;
+   stbi__zinit(&z, parse_header);
+   rowp = (stbi_uc *) win;
+   j = 0;
+   for (;;) {
+      char *keep;
+      r = stbi__zinflate(&z, 0);
+      if (!r) goto done;
+      while ((stbi__uint32) ((stbi_uc *) z.zout - rowp) >= row_len) {
+         stbi_uc *dest = rows + (j & 1) * xw * out_bpp;
+         stbi_uc *prior = j == 0 ? NULL : rows + (~j & 1) * xw * out_bpp;
+         if (!stbi__png_unfilter_row(dest, prior, rowp, filter_buf, prefix_bytes, img_n, out_n, xw, j, depth, color)) goto done;
+         if (j >= ry)
+            memcpy(a->out + (size_t) (a->flip ? ry+rh-1-j : j-ry) * rw * out_bpp, dest + (size_t) rx * out_bpp, (size_t) rw * out_bpp);
+         rowp += row_len;
+         if (++j == ry + rh) {
+            all_ok = 1;
+            goto done;
          }
       }
-   }
-
-   STBI_FREE(filter_buf);
+      if (r == 1) {
+         stbi__err("not enough pixels","Corrupt PNG");
+         goto done;
+      }
+      // make room, keeping the history matches can reach and the partial row
+      keep = z.zout - win > 32768 ? z.zout - 32768 : win;
+      if ((char *) rowp < keep) keep = (char *) rowp;
+      memmove(win, keep, z.zout - keep);
+      rowp -= keep - win;
+      z.zout -= keep - win;
+   }
+
+done:
+   stbi__free(rows);
+   stbi__free(filter_buf);
+   stbi__free(win);
    if (!all_ok) return 0;
-
+   a->region_x = rx;
+   a->region_y = ry;
+   s->img_x = rw;
+   s->img_y = rh;
    return 1;
 }
 
@@ -4865,7 +7918,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    stbi_uc *final;
    int p;
    if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color, a->flip);
 
    // de-interlacing
    final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
@@ -4881,19 +7934,20 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
+         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color, 0)) {
+            stbi__free(final);
             return 0;
          }
          for (j=0; j < y; ++j) {
             for (i=0; i < x; ++i) {
                int out_y = j*yspc[p]+yorig[p];
+               if (a->flip) out_y = a->s->img_y-1 - out_y;
                int out_x = i*xspc[p]+xorig[p];
                memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
                       a->out + (j*x+i)*out_bytes, out_bytes);
             }
          }
-         STBI_FREE(a->out);
+         stbi__free(a->out);
          image_data += img_len;
          image_data_len -= img_len;
       }
@@ -4903,11 +7957,9 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -4928,11 +7980,9 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__uint16 *p, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -4953,17 +8003,9 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+static void stbi__png_palette_lookup(stbi_uc *p, stbi_uc const *orig, stbi__uint32 pixel_count, stbi_uc const *palette, int pal_img_n)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   stbi__uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -4982,11 +8024,174 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
-   STBI_FREE(a->out);
-   a->out = temp_out;
-
-   STBI_NOTUSED(len);
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *temp_out;
+
+   temp_out = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+   if (temp_out == NULL) return stbi__err("outofmem", "Out of memory");
+
+   stbi__png_palette_lookup(temp_out, a->out, pixel_count, palette, pal_img_n);
+   stbi__free(a->out);
+   a->out = temp_out;
+
+   STBI_NOTUSED(len);
+
+   return 1;
+}
+
+// IDAT data stbi__parse_png_file reads at a time
+#define STBI__PNG_ZIN   65536
+
+// works out the formats for req_comp and allocates everything but out
+static int stbi__png_rows_begin(stbi__png *p, stbi__png_rows *r, int req_comp, int parse_header)
+{
+   stbi__context *s = p->s;
+   r->x = s->img_x;
+   r->y = s->img_y;
+   r->row_bytes = stbi__png_row_bytes(s->img_n, r->x, r->y, p->depth);
+   if (!r->row_bytes || r->row_bytes > (0x7fffffff - 32768*3) / 2) return stbi__err("too large", "Corrupt PNG");
+   if ((req_comp == s->img_n+1 && req_comp != 3 && !p->pal_img_n) || p->has_trans)
+      r->img_out_n = s->img_n+1;
+   else
+      r->img_out_n = s->img_n;
+   if (p->pal_img_n) {
+      r->pal_out_n = req_comp >= 3 ? req_comp : p->pal_img_n;
+      r->out_n = req_comp ? req_comp : r->pal_out_n;
+   } else {
+      r->pal_out_n = 0;
+      // 16 bits are converted to req_comp by the caller
+      r->out_n = req_comp && p->depth != 16 ? req_comp : r->img_out_n;
+   }
+   r->out = NULL;
+   r->out_stride = r->x * r->out_n * (p->depth == 16 ? 2 : 1);
+   r->rows_done = r->row_pos = 0;
+   r->zin = NULL;
+   r->zin_len = 0;
+   // 32k of history, the partial row and room to inflate at least a row more
+   r->win_size = 32768 + 2*(r->row_bytes + 1) + 65536;
+   r->win = (char *) stbi__malloc(r->win_size);
+   r->filter_buf = (stbi_uc *) stbi__malloc_mad2(r->row_bytes, 2, 0);
+   r->tmp = (stbi_uc *) stbi__malloc_mad2(r->x, 12, 0);
+   if (!r->win || !r->filter_buf || !r->tmp) return stbi__err("outofmem", "Out of memory");
+   r->z.zout_start = r->z.zout = r->win;
+   r->z.zout_end = r->win + r->win_size;
+   r->z.z_expandable = 2;
+   r->z.zbuffer = r->z.zbuffer_end = NULL;
+   stbi__zinit(&r->z, parse_header);
+   return 1;
+}
+
+static void stbi__png_rows_free(stbi__png_rows *r)
+{
+   stbi__free(r->win);
+   stbi__free(r->filter_buf);
+   stbi__free(r->tmp);
+   stbi__free(r->zin);
+   stbi__free(r);
+}
+
+// unfilters, then looks up/converts the next row into the image
+static int stbi__png_rows_emit(stbi__png *p, stbi__png_rows *r, stbi_uc *raw)
+{
+   stbi__uint32 j = r->rows_done, x = r->x, stride = r->out_stride;
+   stbi_uc *final = r->out + (size_t) stride * (p->flip ? r->y-1-j : j);
+   stbi_uc *row, *prior;
+   int direct = !p->pal_img_n && r->out_n == r->img_out_n;
+
+   if (direct) {
+      row = final;
+      prior = j == 0 ? NULL : p->flip ? final + stride : final - stride;
+   } else {
+      row = r->tmp + (size_t) (j & 1) * x * 4;
+      prior = j == 0 ? NULL : r->tmp + (size_t) (~j & 1) * x * 4;
+   }
+   if (!stbi__png_unfilter_row(row, prior, raw, r->filter_buf, r->row_bytes, p->s->img_n, r->img_out_n, x, j, p->depth, p->color)) return 0;
+   if (p->has_trans) {
+      if (p->depth == 16)
+         stbi__compute_transparency16((stbi__uint16 *) row, x, p->tc16, r->img_out_n);
+      else
+         stbi__compute_transparency(row, x, p->tc, r->img_out_n);
+   }
+   if (p->pal_img_n) {
+      if (r->pal_out_n == r->out_n)
+         stbi__png_palette_lookup(final, row, x, p->palette, r->pal_out_n);
+      else {
+         stbi_uc *expanded = r->tmp + (size_t) 8 * x;
+         stbi__png_palette_lookup(expanded, row, x, p->palette, r->pal_out_n);
+         if (!stbi__convert_row(final, expanded, r->pal_out_n, r->out_n, x)) return 0;
+      }
+   } else if (!direct) {
+      if (!stbi__convert_row(final, row, r->img_out_n, r->out_n, x)) return 0;
+   }
+   ++r->rows_done;
+   return 1;
+}
 
+// inflates r->z's input and decodes the rows it completes. with 'more' the
+// input isn't all there yet: it returns 1 once it needs more, leaving what it
+// can't use yet at zbuffer. without, the zlib stream must end with the rows
+// all done. output past the last row (issue #276) is inflated and dropped
+static int stbi__png_rows_inflate(stbi__png *p, stbi__png_rows *r, int more)
+{
+   stbi__zbuf *z = &r->z;
+   stbi__uint32 row_len = r->row_bytes + 1;
+   for (;;) {
+      stbi_uc *in = z->zbuffer;
+      char *zout = z->zout, *keep;
+      int res = stbi__zinflate(z, more);
+      if (!res) return 0;
+      while ((stbi__uint32) (z->zout - r->win) - r->row_pos >= row_len) {
+         if (r->rows_done < r->y && !stbi__png_rows_emit(p, r, (stbi_uc *) r->win + r->row_pos)) return 0;
+         r->row_pos += row_len;
+      }
+      if (res == 1) {
+         if (r->rows_done < r->y) return stbi__err("not enough pixels","Corrupt PNG");
+         return 1;
+      }
+      if (z->zbuffer == in && z->zout == zout) {
+         if (more) return 1;
+         return stbi__err("not enough pixels","Corrupt PNG");
+      }
+      // make room, keeping the history matches can reach and the partial row
+      keep = z->zout - r->win > 32768 ? z->zout - 32768 : r->win;
+      if (r->win + r->row_pos < keep) keep = r->win + r->row_pos;
+      memmove(r->win, keep, z->zout - keep);
+      r->row_pos -= (stbi__uint32) (keep - r->win);
+      z->zout -= keep - r->win;
+   }
+}
+
+// reads an IDAT chunk's data into r->zin a piece at a time and decodes it
+static int stbi__png_rows_idat(stbi__png *p, stbi__uint32 len)
+{
+   stbi__png_rows *r = p->rows;
+   stbi__zbuf *z = &r->z;
+   if (!r->zin) {
+      r->zin = (stbi_uc *) stbi__malloc(STBI__PNG_ZIN);
+      if (!r->zin) return stbi__err("outofmem", "Out of memory");
+   }
+   while (len > 0) {
+      // drop the data inflate is done with, but the last 4 bytes (which it
+      // may take back from its bit buffer)
+      int n, zpos = z->zbuffer ? (int) (z->zbuffer - r->zin) : 0;
+      if (zpos > 4) {
+         memmove(r->zin, r->zin + zpos - 4, r->zin_len - (zpos - 4));
+         r->zin_len -= zpos - 4;
+         zpos = 4;
+      }
+      n = STBI__PNG_ZIN - r->zin_len;
+      if ((stbi__uint32) n > len) n = (int) len;
+      if (!stbi__getn(p->s, r->zin + r->zin_len, n)) return stbi__err("outofdata","Corrupt PNG");
+      r->zin_len += n;
+      len -= n;
+      z->zbuffer = r->zin + zpos;
+      z->zbuffer_end = r->zin + r->zin_len;
+      if (!stbi__png_rows_inflate(p, r, 1)) return 0;
+   }
    return 1;
 }
 
@@ -5030,6 +8235,9 @@ STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_conve
                                 : stbi__de_iphone_flag_global)
 #endif // STBI_THREAD_LOCAL
 
+#define stbi__unpremultiply(s)  ((s)->unpremultiply >= 0 ? (s)->unpremultiply : stbi__unpremultiply_on_load)
+#define stbi__de_iphone_png(s)  ((s)->de_iphone >= 0 ? (s)->de_iphone : stbi__de_iphone_flag)
+
 static void stbi__de_iphone(stbi__png *z)
 {
    stbi__context *s = z->s;
@@ -5045,7 +8253,7 @@ static void stbi__de_iphone(stbi__png *z)
       }
    } else {
       STBI_ASSERT(s->img_out_n == 4);
-      if (stbi__unpremultiply_on_load) {
+      if (stbi__unpremultiply(s)) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
             stbi_uc a = p[3];
@@ -5077,16 +8285,22 @@ static void stbi__de_iphone(stbi__png *z)
 
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
-   stbi_uc palette[1024], pal_img_n=0;
-   stbi_uc has_trans=0, tc[3]={0};
-   stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   stbi__uint32 ioff=0, idata_limit=0, i;
+   int first=1,k;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->rows = NULL;
+   z->direct = 0;
+   z->pal_img_n = 0;
+   z->has_trans = 0;
+   z->tc[0] = z->tc[1] = z->tc[2] = 0;
+   z->pal_len = 0;
+   z->interlace = 0;
+   z->color = 0;
+   z->is_iphone = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5096,7 +8310,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
       stbi__pngchunk c = stbi__get_chunk_header(s);
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
-            is_iphone = 1;
+            z->is_iphone = 1;
             stbi__skip(s, c.length);
             break;
          case STBI__PNG_TYPE('I','H','D','R'): {
@@ -5109,15 +8323,15 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
             if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
             z->depth = stbi__get8(s);  if (z->depth != 1 && z->depth != 2 && z->depth != 4 && z->depth != 8 && z->depth != 16)  return stbi__err("1/2/4/8/16-bit only","PNG not supported: 1/2/4/8/16-bit only");
-            color = stbi__get8(s);  if (color > 6)         return stbi__err("bad ctype","Corrupt PNG");
-            if (color == 3 && z->depth == 16)                  return stbi__err("bad ctype","Corrupt PNG");
-            if (color == 3) pal_img_n = 3; else if (color & 1) return stbi__err("bad ctype","Corrupt PNG");
+            z->color = stbi__get8(s);  if (z->color > 6)         return stbi__err("bad ctype","Corrupt PNG");
+            if (z->color == 3 && z->depth == 16)                  return stbi__err("bad ctype","Corrupt PNG");
+            if (z->color == 3) z->pal_img_n = 3; else if (z->color & 1) return stbi__err("bad ctype","Corrupt PNG");
             comp  = stbi__get8(s);  if (comp) return stbi__err("bad comp method","Corrupt PNG");
             filter= stbi__get8(s);  if (filter) return stbi__err("bad filter method","Corrupt PNG");
-            interlace = stbi__get8(s); if (interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
+            z->interlace = stbi__get8(s); if (z->interlace>1) return stbi__err("bad interlace method","Corrupt PNG");
             if (!s->img_x || !s->img_y) return stbi__err("0-pixel image","Corrupt PNG");
-            if (!pal_img_n) {
-               s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+            if (!z->pal_img_n) {
+               s->img_n = (z->color & 2 ? 3 : 1) + (z->color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
             } else {
                // if paletted, then pal_n is our final components, and
@@ -5132,54 +8346,77 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('P','L','T','E'):  {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (c.length > 256*3) return stbi__err("invalid PLTE","Corrupt PNG");
-            pal_len = c.length / 3;
-            if (pal_len * 3 != c.length) return stbi__err("invalid PLTE","Corrupt PNG");
-            for (i=0; i < pal_len; ++i) {
-               palette[i*4+0] = stbi__get8(s);
-               palette[i*4+1] = stbi__get8(s);
-               palette[i*4+2] = stbi__get8(s);
-               palette[i*4+3] = 255;
+            z->pal_len = c.length / 3;
+            if (z->pal_len * 3 != c.length) return stbi__err("invalid PLTE","Corrupt PNG");
+            for (i=0; i < z->pal_len; ++i) {
+               z->palette[i*4+0] = stbi__get8(s);
+               z->palette[i*4+1] = stbi__get8(s);
+               z->palette[i*4+2] = stbi__get8(s);
+               z->palette[i*4+3] = 255;
             }
             break;
          }
 
          case STBI__PNG_TYPE('t','R','N','S'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (z->idata) return stbi__err("tRNS after IDAT","Corrupt PNG");
-            if (pal_img_n) {
+            if (z->idata || z->rows) return stbi__err("tRNS after IDAT","Corrupt PNG");
+            if (z->pal_img_n) {
                if (scan == STBI__SCAN_header) { s->img_n = 4; return 1; }
-               if (pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
-               if (c.length > pal_len) return stbi__err("bad tRNS len","Corrupt PNG");
-               pal_img_n = 4;
+               if (z->pal_len == 0) return stbi__err("tRNS before PLTE","Corrupt PNG");
+               if (c.length > z->pal_len) return stbi__err("bad tRNS len","Corrupt PNG");
+               z->pal_img_n = 4;
                for (i=0; i < c.length; ++i)
-                  palette[i*4+3] = stbi__get8(s);
+                  z->palette[i*4+3] = stbi__get8(s);
             } else {
                if (!(s->img_n & 1)) return stbi__err("tRNS with alpha","Corrupt PNG");
                if (c.length != (stbi__uint32) s->img_n*2) return stbi__err("bad tRNS len","Corrupt PNG");
-               has_trans = 1;
+               z->has_trans = 1;
                // non-paletted with tRNS = constant alpha. if header-scanning, we can stop now.
                if (scan == STBI__SCAN_header) { ++s->img_n; return 1; }
                if (z->depth == 16) {
                   for (k = 0; k < s->img_n && k < 3; ++k) // extra loop test to suppress false GCC warning
-                     tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
+                     z->tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
                } else {
                   for (k = 0; k < s->img_n && k < 3; ++k)
-                     tc[k] = (stbi_uc)(stbi__get16be(s) & 255) * stbi__depth_scale_table[z->depth]; // non 8-bit images will be larger
+                     z->tc[k] = (stbi_uc)(stbi__get16be(s) & 255) * stbi__depth_scale_table[z->depth]; // non 8-bit images will be larger
                }
             }
             break;
          }
 
          case STBI__PNG_TYPE('I','D','A','T'): {
+            stbi_uc *out;
+            int stride;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
-            if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
+            if (z->pal_img_n && !z->pal_len) return stbi__err("no PLTE","Corrupt PNG");
             if (scan == STBI__SCAN_header) {
                // header scan definitely stops at first IDAT
-               if (pal_img_n)
-                  s->img_n = pal_img_n;
+               if (z->pal_img_n)
+                  s->img_n = z->pal_img_n;
                return 1;
             }
+            if (scan == STBI__SCAN_idat) return 1;
             if (c.length > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
+            if (!z->idata && !z->rows && !stbi__out_check(s, s->img_x, s->img_y, req_comp ? req_comp : z->pal_img_n ? z->pal_img_n : s->img_n + z->has_trans)) return 0;
+            if (!z->interlace && !z->is_iphone && !s->region_w) {
+               // the passes of interlaced images cover the whole image, the
+               // region decode has its own window
+               if (!z->rows) {
+                  z->rows = (stbi__png_rows *) stbi__malloc(sizeof(stbi__png_rows));
+                  if (!z->rows) return stbi__err("outofmem", "Out of memory");
+                  memset(z->rows, 0, sizeof(stbi__png_rows));
+                  if (!stbi__png_rows_begin(z, z->rows, req_comp, 1)) return 0;
+                  // 8 bits are converted to req_comp as they go, so they're final
+                  // (16 bits are cut to 8 bits afterwards)
+                  out = stbi__out_image(s, &z->direct, z->depth != 16, s->img_x, s->img_y, z->rows->out_n * (z->depth == 16 ? 2 : 1), 0, &stride);
+                  if (!out) return stbi__err("outofmem", "Out of memory");
+                  if (!z->direct) z->out = out;
+                  z->rows->out = out;
+                  z->rows->out_stride = stride;
+               }
+               if (!stbi__png_rows_idat(z, c.length)) return 0;
+               break;
+            }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
@@ -5188,7 +8425,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
                STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__realloc_sized(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -5199,40 +8436,63 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('I','E','N','D'): {
             stbi__uint32 raw_len, bpl;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+            if (scan == STBI__SCAN_idat) return stbi__err("no IDAT","Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
+            if (z->rows) {
+               // the rows are done, but for the end of the zlib stream
+               if (!stbi__png_rows_inflate(z, z->rows, 0)) return 0;
+               s->img_out_n = z->rows->out_n;
+               if (z->pal_img_n)
+                  s->img_n = z->pal_img_n;
+               else if (z->has_trans)
+                  ++s->img_n;
+               stbi__png_rows_free(z->rows); z->rows = NULL;
+               stbi__get32be(s);
+               return 1;
+            }
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
-            if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+            if ((req_comp == s->img_n+1 && req_comp != 3 && !z->pal_img_n) || z->has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
-            if (has_trans) {
+            if (s->region_w && !z->interlace) {
+               // from here on the image is just the region
+               if (!stbi__create_png_region(z, z->idata, ioff, s->img_out_n, z->depth, z->color, !z->is_iphone)) return 0;
+               stbi__free(z->idata); z->idata = NULL;
+            } else {
+               // exact decoded data size, so inflate writes into one buffer without reallocs
+               if (!z->interlace) {
+                  bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
+                  raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+               } else {
+                  raw_len = stbi__png_interlaced_size(s, z->depth);
+               }
+               z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !z->is_iphone);
+               if (z->expanded == NULL) return 0; // zlib should set error
+               stbi__free(z->idata); z->idata = NULL;
+               if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, z->color, z->interlace)) return 0;
+            }
+            if (z->has_trans) {
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16((stbi__uint16 *) z->out, s->img_x * s->img_y, z->tc16, s->img_out_n)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, z->tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+            if (z->is_iphone && stbi__de_iphone_png(s) && s->img_out_n > 2)
                stbi__de_iphone(z);
-            if (pal_img_n) {
+            if (z->pal_img_n) {
                // pal_img_n == 3 or 4
-               s->img_n = pal_img_n; // record the actual colors we had
-               s->img_out_n = pal_img_n;
+               s->img_n = z->pal_img_n; // record the actual colors we had
+               s->img_out_n = z->pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
+               if (!stbi__expand_png_palette(z, z->palette, z->pal_len, s->img_out_n))
                   return 0;
-            } else if (has_trans) {
+            } else if (z->has_trans) {
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__free(z->expanded); z->expanded = NULL;
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
@@ -5264,6 +8524,8 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
 {
    void *result=NULL;
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   p->flip = stbi__flip_in_loader(p->s, ri);
+   p->region_x = p->region_y = 0;
    if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
       if (p->depth <= 8)
          ri->bits_per_channel = 8;
@@ -5271,7 +8533,8 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
          ri->bits_per_channel = 16;
       else
          return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
-      result = p->out;
+      result = p->direct ? p->s->out : p->out;
+      ri->direct = p->direct;
       p->out = NULL;
       if (req_comp && req_comp != p->s->img_out_n) {
          if (ri->bits_per_channel == 8)
@@ -5284,10 +8547,14 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       *x = p->s->img_x;
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
+      ri->region_x = p->region_x;
+      ri->region_y = p->region_y;
    }
-   STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__free(p->out);      p->out      = NULL;
+   stbi__free(p->expanded); p->expanded = NULL;
+   stbi__free(p->idata);    p->idata    = NULL;
+   if (p->rows) stbi__png_rows_free(p->rows);
+   p->rows = NULL;
 
    return result;
 }
@@ -5340,6 +8607,586 @@ static int stbi__png_is16(stbi__context *s)
 }
 #endif
 
+//////////////////////////////////////////////////////////////////////////////
+//
+//  incremental decoding (stbi_stream_*)
+//
+//  all input is kept until it's clear what the file is: from a JPEG's SOS
+//  segment or a PNG's first IDAT chunk on, baseline JPEGs and non-interlaced
+//  PNGs of up to 8 bits are decoded as the data arrives and the consumed input
+//  is dropped. anything else stays buffered for stbi__load_ex at the end
+
+enum
+{
+   STBI__STREAM_sniff,        // waiting for the signature
+   STBI__STREAM_buffer,       // keeping everything for stbi__load_ex
+   STBI__STREAM_jpeg,         // waiting for the headers up to the SOS segment
+   STBI__STREAM_jpeg_scan,    // decoding MCUs
+   STBI__STREAM_png,          // waiting for the chunks up to the first IDAT
+   STBI__STREAM_png_data,     // inflating and unfiltering IDAT data
+   STBI__STREAM_done,
+   STBI__STREAM_failed
+};
+
+// input the entropy coded data of one block can take: 27 bits for the DC and
+// 63 26-bit AC coefficients, every byte of it possibly stuffed
+#define STBI__STREAM_BLOCK_IN   418
+
+struct stbi__stream
+{
+   stbi_options opt;
+   stbi_stream_rows *on_rows;
+   void *user;
+   int mode;
+
+   stbi_uc *in;               // input, in[in_pos..in_len) not consumed yet
+   int in_len, in_cap, in_pos;
+
+   stbi__context s;
+   stbi_uc *out;              // the image, once the size is known
+   int x, y, comp, out_n;
+   int rows_done;             // rows finished, in decode order
+
+#ifndef STBI_NO_JPEG
+   stbi__jpeg *jpeg;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4], *scratch;
+   int decode_n, is_rgb;
+   int mcu, mcus;             // next MCU, MCUs in the scan
+   int mcu_row, mcu_h, lag;   // MCUs per MCU row, rows per MCU row, resampler lag
+   int mcu_in;                // input that's sure to hold the next MCU
+   int progressive;           // buffered progressive JPEG, see stbi_stream_preview
+   int scan_pos, in_scan;     // how far the input has been searched for scans
+   int scans_in, eoi;         // scans that are all in, EOI was found
+#endif
+
+#ifndef STBI_NO_PNG
+   stbi__png png;
+   stbi__png_rows *rows;
+   stbi_uc *zin;              // IDAT data, rows->z reads zin..zin+zin_len
+   int zin_len, zin_cap;
+   stbi__uint32 chunk_left;   // bytes of the current chunk (with CRC) to come
+   int chunk_idat, iend;
+#endif
+};
+
+static int stbi__stream_reserve(stbi_uc **p, int *cap, int need)
+{
+   if (need > *cap) {
+      int new_cap = *cap ? *cap : 4096;
+      stbi_uc *q;
+      while (new_cap < need) {
+         if (new_cap > INT_MAX / 2) return stbi__err("too large", "Stream too large");
+         new_cap *= 2;
+      }
+      q = (stbi_uc *) stbi__realloc_sized(*p, *cap, new_cap);
+      if (!q) return stbi__err("outofmem", "Out of memory");
+      *p = q;
+      *cap = new_cap;
+   }
+   return 1;
+}
+
+// rows rows_done..rows-1 (in decode order) are finished
+static void stbi__stream_rows_done(stbi_stream *st, int rows)
+{
+   if (rows > st->rows_done) {
+      if (st->on_rows) {
+         int y0 = st->opt.flip_vertically ? st->y - rows : st->rows_done;
+         st->on_rows(st->user, st->out + (size_t) y0 * st->x * st->out_n, y0, rows - st->rows_done);
+      }
+      st->rows_done = rows;
+   }
+}
+
+static void stbi__stream_release(stbi_stream *st)
+{
+#ifndef STBI_NO_JPEG
+   if (st->jpeg) {
+      stbi__cleanup_jpeg(st->jpeg);
+      stbi__free(st->jpeg);
+      st->jpeg = NULL;
+   }
+   stbi__free(st->scratch); st->scratch = NULL;
+#endif
+#ifndef STBI_NO_PNG
+   if (st->rows) stbi__png_rows_free(st->rows);
+   st->rows = NULL;
+   stbi__free(st->zin); st->zin = NULL;
+#endif
+   stbi__free(st->in); st->in = NULL;
+   st->in_len = st->in_cap = st->in_pos = 0;
+}
+
+static int stbi__stream_sniff(stbi_stream *st, int more)
+{
+   int enabled = stbi__enabled_formats(st->opt.formats);
+   if (st->in_len < 8 && more) return 1;
+   st->mode = STBI__STREAM_buffer;
+#ifndef STBI_NO_JPEG
+   if (st->in_len >= 2 && st->in[0] == 0xff && st->in[1] == 0xd8 && (enabled & STBI_FORMAT_JPEG))
+      st->mode = STBI__STREAM_jpeg;
+#endif
+#ifndef STBI_NO_PNG
+   if (st->in_len >= 8 && memcmp(st->in, "\x89PNG\r\n\x1a\n", 8) == 0 && (enabled & STBI_FORMAT_PNG))
+      st->mode = STBI__STREAM_png;
+#endif
+   STBI_NOTUSED(enabled);
+   return 1;
+}
+
+static int stbi__stream_load_buffered(stbi_stream *st)
+{
+   stbi__start_mem(&st->s, st->in, st->in_len);
+   st->out = (stbi_uc *) stbi__load_ex(&st->s, &st->opt, &st->x, &st->y, &st->comp);
+   if (!st->out) return 0;
+   st->out_n = st->opt.desired_channels ? st->opt.desired_channels : st->comp;
+   stbi__stream_rows_done(st, st->y);
+   st->mode = STBI__STREAM_done;
+   return 1;
+}
+
+#ifndef STBI_NO_JPEG
+// returns 1 if the input holds every marker segment up to the end of the
+// first SOS, 0 if it's still short, -1 if there's no SOS to wait for
+static int stbi__stream_jpeg_headers(stbi_stream *st)
+{
+   stbi_uc *p = st->in + 2, *end = st->in + st->in_len;
+   for (;;) {
+      int m;
+      while (p < end && *p != 0xff) ++p; // padding after a segment
+      while (p < end && *p == 0xff) ++p; // fill bytes
+      if (p == end) return 0;
+      m = *p++;
+      if (m == 0xd9) return -1; // EOI
+      if (m == 0x01 || (m >= 0xd0 && m <= 0xd8)) continue; // no length
+      if (end - p < 2) return 0;
+      if (end - p < ((p[0] << 8) | p[1])) return 0;
+      if (m == 0xda) return 1;
+      p += (p[0] << 8) | p[1];
+   }
+}
+
+static int stbi__stream_jpeg_start(stbi_stream *st, int more)
+{
+   stbi__jpeg *j;
+   int k, m, r = stbi__stream_jpeg_headers(st);
+   if (r < 0 || (r == 0 && !more)) {
+      st->mode = STBI__STREAM_buffer; // let stbi__load_ex report what's wrong
+      return 1;
+   }
+   if (r == 0) return 1;
+   if (st->opt.desired_channels < 0 || st->opt.desired_channels > 4) return stbi__err("bad req_comp", "Internal error");
+
+   j = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (!j) return stbi__err("outofmem", "Out of memory");
+   memset(j, 0, sizeof(stbi__jpeg));
+   st->jpeg = j;
+   stbi__start_mem(&st->s, st->in, st->in_len);
+   st->s.img_n = 0; // make stbi__cleanup_jpeg safe
+   j->s = &st->s;
+   stbi__setup_jpeg(j);
+   j->flip = st->opt.flip_vertically != 0;
+   j->restart_interval = 0;
+   if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+   m = stbi__get_marker(j);
+   while (!stbi__SOS(m)) {
+      if (m != STBI__MARKER_none && !stbi__process_marker(j, m)) return 0;
+      if (stbi__at_eof(&st->s)) return stbi__err("no SOS", "Corrupt JPEG");
+      m = stbi__get_marker(j);
+   }
+   if (!stbi__process_scan_header(j)) return 0;
+
+   if (j->progressive || j->scan_n != st->s.img_n) {
+      // every block gets refined by later scans, nothing is done before the end
+      st->progressive = j->progressive;
+      st->scan_pos = (int) (st->s.img_buffer - st->in);
+      st->in_scan = 1;
+      stbi__cleanup_jpeg(j);
+      stbi__free(j);
+      st->jpeg = NULL;
+      st->mode = STBI__STREAM_buffer;
+      return 1;
+   }
+
+   if (!stbi__jpeg_begin_output(j, st->opt.desired_channels, st->res_comp, &st->out_n, &st->decode_n, &st->is_rgb)) return 0;
+   st->x = st->s.img_x;
+   st->y = st->s.img_y;
+   st->comp = st->s.img_n >= 3 ? 3 : 1;
+   st->out = (stbi_uc *) stbi__malloc_mad3(st->out_n, st->x, st->y, 1);
+   st->scratch = (stbi_uc *) stbi__malloc_mad2(st->out_n, st->x, 1);
+   if (!st->out || !st->scratch) return stbi__err("outofmem", "Out of memory");
+   for (k=0; k < st->decode_n; ++k)
+      st->linebuf[k] = j->img_comp[k].linebuf;
+
+   if (j->scan_n == 1) {
+      int n = j->order[0];
+      st->mcu_row = (j->img_comp[n].x+7) >> 3;
+      st->mcus = st->mcu_row * ((j->img_comp[n].y+7) >> 3);
+      st->mcu_h = 8;
+      st->mcu_in = STBI__STREAM_BLOCK_IN;
+   } else {
+      st->mcu_row = j->img_mcu_x;
+      st->mcus = j->img_mcu_x * j->img_mcu_y;
+      st->mcu_h = j->img_mcu_h;
+      st->mcu_in = 0;
+      for (k=0; k < j->scan_n; ++k)
+         st->mcu_in += j->img_comp[j->order[k]].h * j->img_comp[j->order[k]].v * STBI__STREAM_BLOCK_IN;
+   }
+   st->mcu_in += 16; // a restart marker and what grow_buffer_unsafe reads ahead
+   // a resampler stretching a component vs times looks up to vs/2 rows ahead
+   st->lag = 0;
+   for (k=0; k < st->decode_n; ++k)
+      if ((st->res_comp[k].vs >> 1) > st->lag)
+         st->lag = st->res_comp[k].vs >> 1;
+
+   st->mcu = 0;
+   j->idct_pending = NULL;
+   stbi__jpeg_reset(j);
+   st->in_pos = (int) (st->s.img_buffer - st->in);
+   st->mode = STBI__STREAM_jpeg_scan;
+   return 1;
+}
+
+// decodes the MCUs the input is known to hold (all of them at the end) and
+// outputs the rows that don't need anything below them anymore
+static int stbi__stream_jpeg_scan(stbi_stream *st, int more)
+{
+   stbi__jpeg *j = st->jpeg;
+   STBI_SIMD_ALIGN(short, data[2][64]);
+   int slot = 0, rows;
+
+   st->s.img_buffer = st->in + st->in_pos;
+   st->s.img_buffer_end = st->in + st->in_len;
+   while (st->mcu < st->mcus) {
+      if (more && st->s.img_buffer_end - st->s.img_buffer < st->mcu_in) break;
+      if (!stbi__jpeg_decode_mcu(j, st->mcu, data, &slot)) return 0;
+      ++st->mcu;
+      if (--j->todo <= 0) {
+         if (j->code_bits < 24) stbi__grow_buffer_unsafe(j);
+         // like the other decoders, a marker that isn't RSTn ends the scan
+         if (!STBI__RESTART(j->marker)) st->mcu = st->mcus;
+         stbi__jpeg_reset(j);
+      }
+   }
+   stbi__jpeg_idct_flush(j);
+   st->in_pos = (int) (st->s.img_buffer - st->in);
+
+   if (st->mcu == st->mcus)
+      rows = st->y;
+   else {
+      rows = st->mcu / st->mcu_row * st->mcu_h - st->lag;
+      if (rows < 0) rows = 0;
+      if (rows > st->y) rows = st->y;
+   }
+   if (rows > st->rows_done)
+      stbi__jpeg_output_band(j, st->res_comp, st->linebuf, st->scratch, st->out, st->out_n * (int) j->s->img_x, st->out_n, st->decode_n, st->is_rgb, st->rows_done, rows);
+   stbi__stream_rows_done(st, rows);
+
+   if (st->mcu == st->mcus) {
+      stbi__cleanup_jpeg(j);
+      stbi__free(j);
+      st->jpeg = NULL;
+      st->mode = STBI__STREAM_done;
+   }
+   return 1;
+}
+#endif // STBI_NO_JPEG
+
+#ifndef STBI_NO_PNG
+static stbi__uint32 stbi__stream_be32(stbi_uc const *p)
+{
+   return ((stbi__uint32) p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+}
+
+static int stbi__stream_png_start(stbi_stream *st, int more)
+{
+   stbi__png *p = &st->png;
+   stbi__context *s = &st->s;
+   stbi__uint32 idat_len = 0;
+   int pos = 8, req_comp = st->opt.desired_channels;
+
+   // wait for every chunk before the first IDAT, and that one's header
+   for (;;) {
+      stbi__uint32 len, type;
+      if (st->in_len - pos < 8) {
+         if (more) return 1;
+         st->mode = STBI__STREAM_buffer;
+         return 1;
+      }
+      len = stbi__stream_be32(st->in + pos);
+      type = stbi__stream_be32(st->in + pos + 4);
+      if (type == STBI__PNG_TYPE('I','D','A','T')) { idat_len = len; break; }
+      if (type == STBI__PNG_TYPE('I','E','N','D') || len > (1u << 30)) {
+         st->mode = STBI__STREAM_buffer;
+         return 1;
+      }
+      pos += 12 + (int) len;
+      if (pos < 0) return stbi__err("too large", "Stream too large");
+   }
+
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   stbi__start_mem(s, st->in, st->in_len);
+   p->s = s;
+   p->flip = st->opt.flip_vertically != 0;
+   if (!stbi__parse_png_file(p, STBI__SCAN_idat, req_comp)) return 0;
+   if (p->interlace || p->depth == 16 || p->is_iphone) {
+      // the passes cover the whole image, 16 bits are converted at the end
+      st->mode = STBI__STREAM_buffer;
+      return 1;
+   }
+   if (idat_len > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
+
+   st->rows = (stbi__png_rows *) stbi__malloc(sizeof(stbi__png_rows));
+   if (!st->rows) return stbi__err("outofmem", "Out of memory");
+   memset(st->rows, 0, sizeof(stbi__png_rows));
+   if (!stbi__png_rows_begin(p, st->rows, req_comp, 1)) return 0;
+   st->x = s->img_x;
+   st->y = s->img_y;
+   st->comp = p->pal_img_n ? p->pal_img_n : s->img_n + (p->has_trans ? 1 : 0);
+   st->out_n = st->rows->out_n;
+   st->out = (stbi_uc *) stbi__malloc_mad3(st->x, st->y, st->out_n, 0);
+   if (!st->out) return stbi__err("outofmem", "Out of memory");
+   st->rows->out = st->out;
+
+   st->in_pos = (int) (s->img_buffer - st->in);
+   st->chunk_left = idat_len + 4;
+   st->chunk_idat = 1;
+   st->iend = 0;
+   st->mode = STBI__STREAM_png_data;
+   return 1;
+}
+
+static int stbi__stream_png_data(stbi_stream *st, int more)
+{
+   stbi__zbuf *z = &st->rows->z;
+   int zpos = st->zin ? (int) (z->zbuffer - st->zin) : 0;
+
+   // drop the IDAT data inflate is done with, but the last 4 bytes (which it
+   // may take back from its bit buffer), and append the new data
+   if (zpos > 4) {
+      memmove(st->zin, st->zin + zpos - 4, st->zin_len - (zpos - 4));
+      st->zin_len -= zpos - 4;
+      zpos = 4;
+   }
+   while (st->in_pos < st->in_len && !st->iend) {
+      int n = st->in_len - st->in_pos;
+      if (st->chunk_left == 0) {
+         stbi__uint32 len, type;
+         if (n < 8) break;
+         len = stbi__stream_be32(st->in + st->in_pos);
+         type = stbi__stream_be32(st->in + st->in_pos + 4);
+         st->in_pos += 8;
+         if (type == STBI__PNG_TYPE('I','E','N','D')) st->iend = 1;
+         if (len > (1u << 30)) return stbi__err("IDAT size limit", "IDAT section larger than 2^30 bytes");
+         st->chunk_left = len + 4;
+         st->chunk_idat = type == STBI__PNG_TYPE('I','D','A','T');
+         continue;
+      }
+      if ((stbi__uint32) n > st->chunk_left) n = (int) st->chunk_left;
+      if (st->chunk_idat && st->chunk_left > 4) {
+         if ((stbi__uint32) n > st->chunk_left - 4) n = (int) (st->chunk_left - 4);
+         if (!stbi__stream_reserve(&st->zin, &st->zin_cap, st->zin_len + n)) return 0;
+         memcpy(st->zin + st->zin_len, st->in + st->in_pos, n);
+         st->zin_len += n;
+      }
+      st->in_pos += n;
+      st->chunk_left -= n;
+   }
+   z->zbuffer = st->zin + zpos;
+   z->zbuffer_end = st->zin + st->zin_len;
+
+   if (!stbi__png_rows_inflate(&st->png, st->rows, more && !st->iend)) return 0;
+   stbi__stream_rows_done(st, (int) st->rows->rows_done);
+
+   if (st->rows->rows_done == st->rows->y) {
+      stbi__png_rows_free(st->rows);
+      st->rows = NULL;
+      st->mode = STBI__STREAM_done;
+   }
+   return 1;
+}
+#endif // STBI_NO_PNG
+
+#ifndef STBI_NO_JPEG
+// counts the scans of a buffered progressive JPEG that are all in the input,
+// carrying on from where the last call stopped
+static void stbi__stream_count_scans(stbi_stream *st)
+{
+   stbi_uc *p = st->in + st->scan_pos, *end = st->in + st->in_len;
+   while (!st->eoi) {
+      if (st->in_scan) {
+         // entropy coded data ends at the first marker that isn't a stuffed 0
+         // or a restart (0xff 0xff is a fill byte before a marker)
+         while (p + 1 < end && (p[0] != 0xff || p[1] == 0 || p[1] == 0xff || (p[1] >= 0xd0 && p[1] <= 0xd7)))
+            ++p;
+         if (p + 1 >= end) break;
+         st->in_scan = 0;
+         ++st->scans_in;
+      } else {
+         stbi_uc *q = p;
+         int m;
+         while (q < end && *q != 0xff) ++q;
+         while (q < end && *q == 0xff) ++q;
+         if (q == end) break;
+         m = *q++;
+         if (m == 0xd9) st->eoi = 1;
+         if (m == 0xd9 || m == 0x01 || (m >= 0xd0 && m <= 0xd8)) {
+            p = q;
+            continue;
+         }
+         if (end - q < 2 || end - q < ((q[0] << 8) | q[1])) break;
+         p = q + ((q[0] << 8) | q[1]);
+         st->in_scan = m == 0xda;
+      }
+   }
+   st->scan_pos = (int) (p - st->in);
+}
+#endif
+
+// runs the stream as far as the input goes, with more == 0 to the end
+static int stbi__stream_run(stbi_stream *st, int more)
+{
+   for (;;) {
+      int mode = st->mode, r;
+      switch (mode) {
+         case STBI__STREAM_sniff:     r = stbi__stream_sniff(st, more); break;
+         case STBI__STREAM_buffer:    r = more ? 1 : stbi__stream_load_buffered(st); break;
+#ifndef STBI_NO_JPEG
+         case STBI__STREAM_jpeg:      r = stbi__stream_jpeg_start(st, more); break;
+         case STBI__STREAM_jpeg_scan: r = stbi__stream_jpeg_scan(st, more); break;
+#endif
+#ifndef STBI_NO_PNG
+         case STBI__STREAM_png:       r = stbi__stream_png_start(st, more); break;
+         case STBI__STREAM_png_data:  r = stbi__stream_png_data(st, more); break;
+#endif
+         case STBI__STREAM_done:      return 1;
+         default:                     return 0;
+      }
+      if (!r) {
+         st->mode = STBI__STREAM_failed;
+         return 0;
+      }
+      if (st->mode == mode) {
+         // waiting for input, drop what's been used if that's most of it
+         if (st->in_pos > 0 && st->in_pos >= st->in_len / 2) {
+            memmove(st->in, st->in + st->in_pos, st->in_len - st->in_pos);
+            st->in_len -= st->in_pos;
+            st->in_pos = 0;
+         }
+         return 1;
+      }
+   }
+}
+
+STBIDEF stbi_stream *stbi_stream_begin(stbi_options const *opt, stbi_stream_rows *on_rows, void *user)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi_stream *st;
+   stbi__allocator = opt->alloc;
+   if (opt->bits_per_channel != 8 && opt->bits_per_channel != 0) {
+      stbi__allocator = prev;
+      return (stbi_stream *) stbi__errpuc("bad bits_per_channel", "Streams are 8 bits per channel");
+   }
+   st = (stbi_stream *) stbi__malloc(sizeof(stbi_stream));
+   if (st) {
+      memset(st, 0, sizeof(*st));
+      st->opt = *opt;
+      st->on_rows = on_rows;
+      st->user = user;
+      st->mode = STBI__STREAM_sniff;
+   } else
+      stbi__err("outofmem", "Out of memory");
+   stbi__allocator = prev;
+   return st;
+}
+
+STBIDEF int stbi_stream_feed(stbi_stream *st, void const *data, int len)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   int result = 1;
+   if (st->mode == STBI__STREAM_failed) return 0;
+   if (st->mode == STBI__STREAM_done) return 1; // trailing data
+   stbi__allocator = st->opt.alloc;
+   if (len < 0 || len > INT_MAX - st->in_len)
+      result = stbi__err("too large", "Stream too large");
+   else if (!stbi__stream_reserve(&st->in, &st->in_cap, st->in_len + len))
+      result = 0;
+   if (result) {
+      memcpy(st->in + st->in_len, data, len);
+      st->in_len += len;
+      result = stbi__stream_run(st, 1);
+   } else
+      st->mode = STBI__STREAM_failed;
+   stbi__allocator = prev;
+   return result;
+}
+
+STBIDEF int stbi_stream_info(stbi_stream *st, int *x, int *y, int *comp)
+{
+   if (!st->out) return 0;
+   if (x) *x = st->x;
+   if (y) *y = st->y;
+   if (comp) *comp = st->comp;
+   return 1;
+}
+
+STBIDEF stbi_uc *stbi_stream_end(stbi_stream *st, int *x, int *y, int *comp)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi_uc *result = NULL;
+   stbi__allocator = st->opt.alloc;
+   if (stbi__stream_run(st, 0) && st->mode == STBI__STREAM_done) {
+      result = st->out;
+      st->out = NULL;
+      if (x) *x = st->x;
+      if (y) *y = st->y;
+      if (comp) *comp = st->comp;
+   }
+   stbi__allocator = prev;
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_stream_preview(stbi_stream *st, int max_scans, int scale_denom, int *x, int *y, int *comp)
+{
+#ifndef STBI_NO_JPEG
+   stbi_allocator const *prev;
+   stbi_options opt;
+   stbi__context s;
+   stbi_uc *result;
+   int shift = stbi__scale_shift(scale_denom);
+   if (shift < 0) return stbi__errpuc("bad scale", "scale_denom must be 1, 2, 4 or 8");
+   if (st->mode != STBI__STREAM_buffer || !st->progressive) return stbi__errpuc("no preview", "Only progressive JPEGs have previews");
+   stbi__stream_count_scans(st);
+   if (!st->eoi && (max_scans <= 0 || st->scans_in < max_scans)) return stbi__errpuc("not enough scans", "Scans not all in yet");
+
+   prev = stbi__allocator;
+   stbi__allocator = st->opt.alloc;
+   opt = st->opt;
+   opt.max_scans = max_scans;
+   stbi__start_mem(&s, st->in, st->in_len);
+   s.scale_shift = shift;
+   result = (stbi_uc *) stbi__load_ex(&s, &opt, x, y, comp);
+   stbi__allocator = prev;
+   return result;
+#else
+   STBI_NOTUSED(st); STBI_NOTUSED(max_scans); STBI_NOTUSED(scale_denom);
+   STBI_NOTUSED(x); STBI_NOTUSED(y); STBI_NOTUSED(comp);
+   return stbi__errpuc("no preview", "Only progressive JPEGs have previews");
+#endif
+}
+
+STBIDEF void stbi_stream_free(stbi_stream *st)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   if (!st) return;
+   stbi__allocator = st->opt.alloc;
+   stbi__stream_release(st);
+   stbi__free(st->out);
+   stbi__free(st);
+   stbi__allocator = prev;
+}
+
 // Microsoft/Windows BMP image
 
 #ifndef STBI_NO_BMP
@@ -5530,20 +9377,21 @@ static void *stbi__bmp_parse_header(stbi__context *s, stbi__bmp_data *info)
 
 static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
-   stbi_uc *out;
+   stbi_uc *out, *o;
    unsigned int mr=0,mg=0,mb=0,ma=0, all_a;
    stbi_uc pal[256][4];
    int psize=0,i,j,width;
-   int flip_vertically, pad, target;
+   int flip_vertically, pad, target, stride;
    stbi__bmp_data info;
-   STBI_NOTUSED(ri);
 
    info.all_a = 255;
    if (stbi__bmp_parse_header(s, &info) == NULL)
       return NULL; // error code already set
 
-   flip_vertically = ((int) s->img_y) > 0;
+   flip_vertically = ((int) s->img_y) > 0; // rows are stored bottom up
    s->img_y = abs((int) s->img_y);
+   // storing them in file order then does a flip on load for free
+   flip_vertically ^= stbi__flip_in_loader(s, ri);
 
    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
    if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
@@ -5593,12 +9441,13 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    // sanity-check size
    if (!stbi__mad3sizes_valid(target, s->img_x, s->img_y, 0))
       return stbi__errpuc("too large", "Corrupt BMP");
+   if (!stbi__out_check(s, s->img_x, s->img_y, req_comp ? req_comp : target)) return NULL;
 
-   out = (stbi_uc *) stbi__malloc_mad3(target, s->img_x, s->img_y, 0);
+   out = stbi__out_image(s, &ri->direct, !req_comp || req_comp == target, s->img_x, s->img_y, target, 0, &stride);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
    if (info.bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { STBI_FREE(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { if (!ri->direct) stbi__free(out); return stbi__errpuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = stbi__get8(s);
          pal[i][1] = stbi__get8(s);
@@ -5610,17 +9459,19 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
       if (info.bpp == 1) width = (s->img_x + 7) >> 3;
       else if (info.bpp == 4) width = (s->img_x + 1) >> 1;
       else if (info.bpp == 8) width = s->img_x;
-      else { STBI_FREE(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
+      else { if (!ri->direct) stbi__free(out); return stbi__errpuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       if (info.bpp == 1) {
          for (j=0; j < (int) s->img_y; ++j) {
             int bit_offset = 7, v = stbi__get8(s);
+            o = out + (size_t) stride * (flip_vertically ? (int) s->img_y-1-j : j);
+            z = 0;
             for (i=0; i < (int) s->img_x; ++i) {
                int color = (v>>bit_offset)&0x1;
-               out[z++] = pal[color][0];
-               out[z++] = pal[color][1];
-               out[z++] = pal[color][2];
-               if (target == 4) out[z++] = 255;
+               o[z++] = pal[color][0];
+               o[z++] = pal[color][1];
+               o[z++] = pal[color][2];
+               if (target == 4) o[z++] = 255;
                if (i+1 == (int) s->img_x) break;
                if((--bit_offset) < 0) {
                   bit_offset = 7;
@@ -5631,22 +9482,24 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
          }
       } else {
          for (j=0; j < (int) s->img_y; ++j) {
+            o = out + (size_t) stride * (flip_vertically ? (int) s->img_y-1-j : j);
+            z = 0;
             for (i=0; i < (int) s->img_x; i += 2) {
                int v=stbi__get8(s),v2=0;
                if (info.bpp == 4) {
                   v2 = v & 15;
                   v >>= 4;
                }
-               out[z++] = pal[v][0];
-               out[z++] = pal[v][1];
-               out[z++] = pal[v][2];
-               if (target == 4) out[z++] = 255;
+               o[z++] = pal[v][0];
+               o[z++] = pal[v][1];
+               o[z++] = pal[v][2];
+               if (target == 4) o[z++] = 255;
                if (i+1 == (int) s->img_x) break;
                v = (info.bpp == 8) ? stbi__get8(s) : v2;
-               out[z++] = pal[v][0];
-               out[z++] = pal[v][1];
-               out[z++] = pal[v][2];
-               if (target == 4) out[z++] = 255;
+               o[z++] = pal[v][0];
+               o[z++] = pal[v][1];
+               o[z++] = pal[v][2];
+               if (target == 4) o[z++] = 255;
             }
             stbi__skip(s, pad);
          }
@@ -5667,37 +9520,39 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { if (!ri->direct) stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = stbi__high_bit(mr)-7; rcount = stbi__bitcount(mr);
          gshift = stbi__high_bit(mg)-7; gcount = stbi__bitcount(mg);
          bshift = stbi__high_bit(mb)-7; bcount = stbi__bitcount(mb);
          ashift = stbi__high_bit(ma)-7; acount = stbi__bitcount(ma);
-         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { STBI_FREE(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
+         if (rcount > 8 || gcount > 8 || bcount > 8 || acount > 8) { if (!ri->direct) stbi__free(out); return stbi__errpuc("bad masks", "Corrupt BMP"); }
       }
       for (j=0; j < (int) s->img_y; ++j) {
+         o = out + (size_t) stride * (flip_vertically ? (int) s->img_y-1-j : j);
+         z = 0;
          if (easy) {
             for (i=0; i < (int) s->img_x; ++i) {
                unsigned char a;
-               out[z+2] = stbi__get8(s);
-               out[z+1] = stbi__get8(s);
-               out[z+0] = stbi__get8(s);
+               o[z+2] = stbi__get8(s);
+               o[z+1] = stbi__get8(s);
+               o[z+0] = stbi__get8(s);
                z += 3;
                a = (easy == 2 ? stbi__get8(s) : 255);
                all_a |= a;
-               if (target == 4) out[z++] = a;
+               if (target == 4) o[z++] = a;
             }
          } else {
             int bpp = info.bpp;
             for (i=0; i < (int) s->img_x; ++i) {
                stbi__uint32 v = (bpp == 16 ? (stbi__uint32) stbi__get16le(s) : stbi__get32le(s));
                unsigned int a;
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mr, rshift, rcount));
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mg, gshift, gcount));
-               out[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mb, bshift, bcount));
+               o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mr, rshift, rcount));
+               o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mg, gshift, gcount));
+               o[z++] = STBI__BYTECAST(stbi__shiftsigned(v & mb, bshift, bcount));
                a = (ma ? stbi__shiftsigned(v & ma, ashift, acount) : 255);
                all_a |= a;
-               if (target == 4) out[z++] = STBI__BYTECAST(a);
+               if (target == 4) o[z++] = STBI__BYTECAST(a);
             }
          }
          stbi__skip(s, pad);
@@ -5706,19 +9561,9 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    // if alpha channel is all 0s, replace with all 255s
    if (target == 4 && all_a == 0)
-      for (i=4*s->img_x*s->img_y-1; i >= 0; i -= 4)
-         out[i] = 255;
-
-   if (flip_vertically) {
-      stbi_uc t;
-      for (j=0; j < (int) s->img_y>>1; ++j) {
-         stbi_uc *p1 = out +      j     *s->img_x*target;
-         stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-         for (i=0; i < (int) s->img_x*target; ++i) {
-            t = p1[i]; p1[i] = p2[i]; p2[i] = t;
-         }
-      }
-   }
+      for (j=0; j < (int) s->img_y; ++j)
+         for (o=out + (size_t) stride * j, i=0; i < (int) s->img_x; ++i)
+            o[i*4 + 3] = 255;
 
    if (req_comp && req_comp != target) {
       out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
@@ -5889,12 +9734,12 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    //   image data
    unsigned char *tga_data;
    unsigned char *tga_palette = NULL;
-   int i, j;
+   unsigned char *tga_out;
+   int i, j, tga_row = 0, tga_col = 0, tga_stride;
    unsigned char raw_data[4] = {0};
    int RLE_count = 0;
    int RLE_repeating = 0;
    int read_next_pixel = 1;
-   STBI_NOTUSED(ri);
    STBI_NOTUSED(tga_x_origin); // @TODO
    STBI_NOTUSED(tga_y_origin); // @TODO
 
@@ -5908,6 +9753,8 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       tga_is_RLE = 1;
    }
    tga_inverted = 1 - ((tga_inverted >> 5) & 1);
+   // storing the rows in file order does a flip on load for free
+   tga_inverted ^= stbi__flip_in_loader(s, ri);
 
    //   If I'm paletted, then I'll use the number of bits from the palette
    if ( tga_indexed ) tga_comp = stbi__tga_get_comp(tga_palette_bits, 0, &tga_rgb16);
@@ -5923,8 +9770,9 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    if (!stbi__mad3sizes_valid(tga_width, tga_height, tga_comp, 0))
       return stbi__errpuc("too large", "Corrupt TGA");
+   if (!stbi__out_check(s, tga_width, tga_height, req_comp ? req_comp : tga_comp)) return NULL;
 
-   tga_data = (unsigned char*)stbi__malloc_mad3(tga_width, tga_height, tga_comp, 0);
+   tga_data = stbi__out_image(s, &ri->direct, !req_comp || req_comp == tga_comp, tga_width, tga_height, tga_comp, 0, &tga_stride);
    if (!tga_data) return stbi__errpuc("outofmem", "Out of memory");
 
    // skip to the data's starting position (offset usually = 0)
@@ -5933,7 +9781,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
    if ( !tga_indexed && !tga_is_RLE && !tga_rgb16 ) {
       for (i=0; i < tga_height; ++i) {
          int row = tga_inverted ? tga_height -i - 1 : i;
-         stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
+         stbi_uc *tga_row = tga_data + (size_t) row*tga_stride;
          stbi__getn(s, tga_row, tga_width * tga_comp);
       }
    } else  {
@@ -5941,7 +9789,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
       if ( tga_indexed)
       {
          if (tga_palette_len == 0) {  /* you have to have at least one entry! */
-            STBI_FREE(tga_data);
+            if (!ri->direct) stbi__free(tga_data);
             return stbi__errpuc("bad palette", "Corrupt TGA");
          }
 
@@ -5950,7 +9798,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
          //   load the palette
          tga_palette = (unsigned char*)stbi__malloc_mad2(tga_palette_len, tga_comp, 0);
          if (!tga_palette) {
-            STBI_FREE(tga_data);
+            if (!ri->direct) stbi__free(tga_data);
             return stbi__errpuc("outofmem", "Out of memory");
          }
          if (tga_rgb16) {
@@ -5961,12 +9809,13 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
                pal_entry += tga_comp;
             }
          } else if (!stbi__getn(s, tga_palette, tga_palette_len * tga_comp)) {
-               STBI_FREE(tga_data);
-               STBI_FREE(tga_palette);
+               if (!ri->direct) stbi__free(tga_data);
+               stbi__free(tga_palette);
                return stbi__errpuc("bad palette", "Corrupt TGA");
          }
       }
       //   load the data
+      tga_out = tga_data + (size_t) (tga_inverted ? tga_height - 1 : 0) * tga_stride;
       for (i=0; i < tga_width * tga_height; ++i)
       {
          //   if I'm in RLE mode, do I need to get a RLE stbi__pngchunk?
@@ -6018,45 +9867,36 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
 
          // copy data
          for (j = 0; j < tga_comp; ++j)
-           tga_data[i*tga_comp+j] = raw_data[j];
+           tga_out[j] = raw_data[j];
+         tga_out += tga_comp;
+         if (++tga_col == tga_width && ++tga_row < tga_height) {
+            tga_col = 0;
+            tga_out = tga_data + (size_t) (tga_inverted ? tga_height - 1 - tga_row : tga_row) * tga_stride;
+         }
 
          //   in case we're in RLE mode, keep counting down
          --RLE_count;
       }
-      //   do I need to invert the image?
-      if ( tga_inverted )
-      {
-         for (j = 0; j*2 < tga_height; ++j)
-         {
-            int index1 = j * tga_width * tga_comp;
-            int index2 = (tga_height - 1 - j) * tga_width * tga_comp;
-            for (i = tga_width * tga_comp; i > 0; --i)
-            {
-               unsigned char temp = tga_data[index1];
-               tga_data[index1] = tga_data[index2];
-               tga_data[index2] = temp;
-               ++index1;
-               ++index2;
-            }
-         }
-      }
       //   clear my palette, if I had one
       if ( tga_palette != NULL )
       {
-         STBI_FREE( tga_palette );
+         stbi__free( tga_palette );
       }
    }
 
    // swap RGB - if the source data was RGB16, it already is in the right order
    if (tga_comp >= 3 && !tga_rgb16)
    {
-      unsigned char* tga_pixel = tga_data;
-      for (i=0; i < tga_width * tga_height; ++i)
+      for (j=0; j < tga_height; ++j)
       {
-         unsigned char temp = tga_pixel[0];
-         tga_pixel[0] = tga_pixel[2];
-         tga_pixel[2] = temp;
-         tga_pixel += tga_comp;
+         unsigned char* tga_pixel = tga_data + (size_t) j * tga_stride;
+         for (i=0; i < tga_width; ++i)
+         {
+            unsigned char temp = tga_pixel[0];
+            tga_pixel[0] = tga_pixel[2];
+            tga_pixel[2] = temp;
+            tga_pixel += tga_comp;
+         }
       }
    }
 
@@ -6194,6 +10034,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
    // Check size
    if (!stbi__mad3sizes_valid(4, w, h, 0))
       return stbi__errpuc("too large", "Corrupt PSD");
+   if (!stbi__out_check(s, w, h, req_comp ? req_comp : 4)) return NULL;
 
    // Create the destination image.
 
@@ -6235,7 +10076,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
          } else {
             // Read the RLE data.
             if (!stbi__psd_decode_rle(s, p, pixelCount)) {
-               STBI_FREE(out);
+               stbi__free(out);
                return stbi__errpuc("corrupt", "bad RLE data");
             }
          }
@@ -6516,6 +10357,8 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
 
    if (stbi__at_eof(s))  return stbi__errpuc("bad file","file too short (pic header)");
    if (!stbi__mad3sizes_valid(x, y, 4, 0)) return stbi__errpuc("too large", "PIC image too large to decode");
+   // without req_comp the channels are only known once the packets are read
+   if (req_comp && !stbi__out_check(s, x, y, req_comp)) return NULL;
 
    stbi__get32be(s); //skip `ratio'
    stbi__get16be(s); //skip `fields'
@@ -6527,7 +10370,7 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
    memset(result, 0xff, x*y*4);
 
    if (!stbi__pic_load_core(s,x,y,comp, result)) {
-      STBI_FREE(result);
+      stbi__free(result);
       result=0;
    }
    *px = x;
@@ -6641,13 +10484,13 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
    stbi__gif* g = (stbi__gif*) stbi__malloc(sizeof(stbi__gif));
    if (!g) return stbi__err("outofmem", "Out of memory");
    if (!stbi__gif_header(s, g, comp, 1)) {
-      STBI_FREE(g);
+      stbi__free(g);
       stbi__rewind( s );
       return 0;
    }
    if (x) *x = g->w;
    if (y) *y = g->h;
-   STBI_FREE(g);
+   stbi__free(g);
    return 1;
 }
 
@@ -6781,7 +10624,6 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
    int first_frame;
    int pi;
    int pcount;
-   STBI_NOTUSED(req_comp);
 
    // on first frame, any non-written pixels get the background colour (non-transparent)
    first_frame = 0;
@@ -6789,6 +10631,7 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
       if (!stbi__gif_header(s, g, comp,0)) return 0; // stbi__g_failure_reason set by stbi__gif_header
       if (!stbi__mad3sizes_valid(4, g->w, g->h, 0))
          return stbi__errpuc("too large", "GIF image is too large");
+      if (!stbi__out_check(s, g->w, g->h, req_comp ? req_comp : 4)) return 0;
       pcount = g->w * g->h;
       g->out = (stbi_uc *) stbi__malloc(4 * pcount);
       g->background = (stbi_uc *) stbi__malloc(4 * pcount);
@@ -6951,12 +10794,12 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 
 static void *stbi__load_gif_main_outofmem(stbi__gif *g, stbi_uc *out, int **delays)
 {
-   STBI_FREE(g->out);
-   STBI_FREE(g->history);
-   STBI_FREE(g->background);
+   stbi__free(g->out);
+   stbi__free(g->history);
+   stbi__free(g->background);
 
-   if (out) STBI_FREE(out);
-   if (delays && *delays) STBI_FREE(*delays);
+   if (out) stbi__free(out);
+   if (delays && *delays) stbi__free(*delays);
    return stbi__errpuc("outofmem", "Out of memory");
 }
 
@@ -6991,7 +10834,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4;
 
             if (out) {
-               void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
+               void *tmp = (stbi_uc*) stbi__realloc_sized(out, out_size, layers * stride );
                if (!tmp)
                   return stbi__load_gif_main_outofmem(&g, out, delays);
                else {
@@ -7000,7 +10843,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                }
 
                if (delays) {
-                  int *new_delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
+                  int *new_delays = (int*) stbi__realloc_sized(*delays, delays_size, sizeof(int) * layers );
                   if (!new_delays)
                      return stbi__load_gif_main_outofmem(&g, out, delays);
                   *delays = new_delays;
@@ -7020,7 +10863,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             }
             memcpy( out + ((layers - 1) * stride), u, stride );
             if (layers >= 2) {
-               two_back = out - 2 * stride;
+               two_back = out + (layers - 2) * stride;
             }
 
             if (delays) {
@@ -7030,9 +10873,9 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
       } while (u != 0);
 
       // free temp buffer;
-      STBI_FREE(g.out);
-      STBI_FREE(g.history);
-      STBI_FREE(g.background);
+      stbi__free(g.out);
+      stbi__free(g.history);
+      stbi__free(g.background);
 
       // do the final conversion after loading everything;
       if (req_comp && req_comp != 4)
@@ -7064,12 +10907,12 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
          u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
    } else if (g.out) {
       // if there was an error and we allocated an image buffer, free it!
-      STBI_FREE(g.out);
+      stbi__free(g.out);
    }
 
    // free buffers needed for multiple frame loading;
-   STBI_FREE(g.history);
-   STBI_FREE(g.background);
+   stbi__free(g.history);
+   stbi__free(g.background);
 
    return u;
 }
@@ -7078,6 +10921,128 @@ static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
    return stbi__gif_info_raw(s,x,y,comp);
 }
+
+// frame n is decoded into g.out, with frame n-2 (for disposal method 3) in
+// back[n & 1], and then copied there and converted into out
+struct stbi__gif_frames
+{
+   stbi_options opt;
+   stbi_uc const *buffer;
+   int len;
+   stbi__context s;
+   stbi__gif g;
+   stbi_uc *back[2];
+   stbi_uc *out;
+   int out_n;
+   int frame, count;
+};
+
+static void stbi__gif_frames_reset(stbi_gif_frames *f)
+{
+   stbi__free(f->g.out);
+   stbi__free(f->g.background);
+   stbi__free(f->g.history);
+   memset(&f->g, 0, sizeof(f->g));
+   stbi__start_mem(&f->s, f->buffer, f->len);
+   f->frame = 0;
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_begin(stbi_options const *opt, stbi_uc const *buffer, int len, int *x, int *y)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi_gif_frames *f;
+   if (opt->desired_channels < 0 || opt->desired_channels > 4)
+      return (stbi_gif_frames *) stbi__errpuc("bad req_comp", "Internal error");
+   stbi__allocator = opt->alloc;
+   f = (stbi_gif_frames *) stbi__malloc(sizeof(stbi_gif_frames));
+   if (!f) {
+      stbi__allocator = prev;
+      return (stbi_gif_frames *) stbi__errpuc("outofmem", "Out of memory");
+   }
+   memset(f, 0, sizeof(*f));
+   f->opt = *opt;
+   f->buffer = buffer;
+   f->len = len;
+   f->out_n = opt->desired_channels ? opt->desired_channels : 4;
+   stbi__start_mem(&f->s, buffer, len);
+   if (!stbi__gif_header(&f->s, &f->g, NULL, 1) || !stbi__mad3sizes_valid(4, f->g.w, f->g.h, 0)) {
+      if (f->g.w) stbi__err("too large", "GIF image is too large");
+      stbi__free(f);
+      stbi__allocator = prev;
+      return NULL;
+   }
+   if (x) *x = f->g.w;
+   if (y) *y = f->g.h;
+   stbi__gif_frames_reset(f);
+   stbi__allocator = prev;
+   return f;
+}
+
+STBIDEF stbi_uc const *stbi_gif_next(stbi_gif_frames *f, int *delay_ms)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi_uc *u, *back;
+   size_t stride;
+   int j, w, h;
+   stbi__allocator = f->opt.alloc;
+   back = f->back[f->frame & 1];
+   u = stbi__gif_load_next(&f->s, &f->g, NULL, 4, f->frame >= 2 ? back : NULL);
+   if (u == (stbi_uc *) &f->s) {
+      // end of the animation
+      if (f->count == 0) f->count = f->frame;
+      u = NULL;
+   }
+   if (u) {
+      w = f->g.w;
+      h = f->g.h;
+      stride = (size_t) w * 4;
+      if (!back) back = f->back[f->frame & 1] = (stbi_uc *) stbi__malloc(stride * h);
+      if (!f->out) f->out = (stbi_uc *) stbi__malloc_mad3(w, h, f->out_n, 0);
+      if (!back || !f->out) {
+         stbi__allocator = prev;
+         return stbi__errpuc("outofmem", "Out of memory");
+      }
+      memcpy(back, u, stride * h);
+      for (j=0; j < h; ++j) {
+         stbi_uc *dest = f->out + (size_t) (f->opt.flip_vertically ? h-1-j : j) * w * f->out_n;
+         if (f->out_n == 4)
+            memcpy(dest, u + stride * j, stride);
+         else
+            stbi__convert_row(dest, u + stride * j, 4, f->out_n, w);
+      }
+      if (delay_ms) *delay_ms = f->g.delay;
+      ++f->frame;
+      u = f->out;
+   }
+   stbi__allocator = prev;
+   return u;
+}
+
+STBIDEF int stbi_gif_frame_count(stbi_gif_frames *f)
+{
+   return f->count;
+}
+
+STBIDEF void stbi_gif_rewind(stbi_gif_frames *f)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   stbi__allocator = f->opt.alloc;
+   stbi__gif_frames_reset(f);
+   stbi__allocator = prev;
+}
+
+STBIDEF void stbi_gif_free(stbi_gif_frames *f)
+{
+   stbi_allocator const *prev = stbi__allocator;
+   if (!f) return;
+   stbi__allocator = f->opt.alloc;
+   stbi__gif_frames_reset(f);
+   stbi__free(f->back[0]);
+   stbi__free(f->back[1]);
+   stbi__free(f->out);
+   stbi__free(f);
+   stbi__allocator = prev;
+}
 #endif
 
 // *************************************************************************************************
@@ -7155,6 +11120,74 @@ static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
+// converts a scanline stored as four planes (all r, then g, b and e) to
+// floats. the SSE2 path does 4 pixels at a time and gives the same bits as
+// stbi__hdr_convert: the scale 2^(e-136) is exact and each channel is
+// rounded once. exponents 1..9 make the scale denormal, those (rare) groups
+// go through stbi__hdr_convert
+static void stbi__hdr_convert_row(float *output, stbi_uc const *scanline, int width, int req_comp)
+{
+   stbi_uc const *r = scanline, *g = scanline + width, *b = scanline + 2*width, *e = scanline + 3*width;
+   stbi_uc rgbe[4];
+   int i = 0;
+#ifdef STBI_SSE2
+   if (stbi__sse2_available()) {
+      // 3 channel groups store 4 floats per pixel, so they stop one pixel short of the end
+      int stop = req_comp == 3 ? width - 1 : width;
+      __m128i zero = _mm_setzero_si128();
+      __m128i nine = _mm_set1_epi32(9), ten = _mm_set1_epi32(10);
+      __m128 one = _mm_set1_ps(1.0f), three = _mm_set1_ps(3.0f);
+      #define stbi__hdr_load4(p)  _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int) ((p)[i] | ((p)[i+1] << 8) | ((p)[i+2] << 16) | ((stbi__uint32) (p)[i+3] << 24))), zero), zero)
+      for (; i + 4 <= stop; i += 4) {
+         __m128i ri = stbi__hdr_load4(r), gi = stbi__hdr_load4(g), bi = stbi__hdr_load4(b), ei = stbi__hdr_load4(e);
+         __m128i nonzero = _mm_cmpgt_epi32(ei, zero);
+         __m128 scale, rf, gf, bf;
+         int k;
+         if (_mm_movemask_epi8(_mm_and_si128(nonzero, _mm_cmplt_epi32(ei, ten)))) {
+            for (k = i; k < i + 4; ++k) {
+               rgbe[0] = r[k]; rgbe[1] = g[k]; rgbe[2] = b[k]; rgbe[3] = e[k];
+               stbi__hdr_convert(output + k*req_comp, rgbe, req_comp);
+            }
+            continue;
+         }
+         // 2^(e-136) built from its exponent bits, 0 for e == 0
+         scale = _mm_castsi128_ps(_mm_and_si128(_mm_slli_epi32(_mm_sub_epi32(ei, nine), 23), nonzero));
+         if (req_comp <= 2) {
+            __m128 gray = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(ri, gi), bi)), scale), three);
+            if (req_comp == 1)
+               _mm_storeu_ps(output + i, gray);
+            else {
+               _mm_storeu_ps(output + i*2,     _mm_unpacklo_ps(gray, one));
+               _mm_storeu_ps(output + i*2 + 4, _mm_unpackhi_ps(gray, one));
+            }
+         } else {
+            __m128 t0, t1, t2, t3;
+            float *o = output + i*req_comp;
+            rf = _mm_mul_ps(_mm_cvtepi32_ps(ri), scale);
+            gf = _mm_mul_ps(_mm_cvtepi32_ps(gi), scale);
+            bf = _mm_mul_ps(_mm_cvtepi32_ps(bi), scale);
+            // transpose to one r,g,b,1 vector per pixel; with 3 channels the 1 is overwritten by the next pixel
+            t0 = _mm_unpacklo_ps(rf, gf);
+            t1 = _mm_unpacklo_ps(bf, one);
+            t2 = _mm_unpackhi_ps(rf, gf);
+            t3 = _mm_unpackhi_ps(bf, one);
+            _mm_storeu_ps(o,              _mm_movelh_ps(t0, t1));
+            _mm_storeu_ps(o + req_comp,   _mm_movehl_ps(t1, t0));
+            _mm_storeu_ps(o + req_comp*2, _mm_movelh_ps(t2, t3));
+            _mm_storeu_ps(o + req_comp*3, _mm_movehl_ps(t3, t2));
+         }
+      }
+      #undef stbi__hdr_load4
+   }
+#endif
+   for (; i < width; ++i) {
+      rgbe[0] = r[i]; rgbe[1] = g[i]; rgbe[2] = b[i]; rgbe[3] = e[i];
+      stbi__hdr_convert(output + i*req_comp, rgbe, req_comp);
+   }
+}
+
+// for stbi_load_into (ri->direct) the rows are converted to LDR and stored in
+// s->out as they're decoded, and the floats returned are only the last row
 static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    char buffer[STBI__HDR_BUFLEN];
@@ -7162,12 +11195,11 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
    int valid = 0;
    int width, height;
    stbi_uc *scanline;
-   float *hdr_data;
+   float *hdr_data, *row;
    int len;
    unsigned char count, value;
-   int i, j, k, c1,c2, z;
+   int i, j, k, c1,c2, flip;
    const char *headerToken;
-   STBI_NOTUSED(ri);
 
    // Check identifier
    headerToken = stbi__hdr_gettoken(s,buffer);
@@ -7205,23 +11237,30 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
 
    if (!stbi__mad4sizes_valid(width, height, req_comp, sizeof(float), 0))
       return stbi__errpf("too large", "HDR image is too large");
+   if (!stbi__out_check(s, width, height, req_comp)) return NULL;
 
    // Read data
-   hdr_data = (float *) stbi__malloc_mad4(width, height, req_comp, sizeof(float), 0);
+   ri->direct = stbi__out_direct(s);
+   hdr_data = (float *) stbi__malloc_mad4(width, ri->direct ? 1 : height, req_comp, sizeof(float), 0);
    if (!hdr_data)
       return stbi__errpf("outofmem", "Out of memory");
 
    // Load image data
    // image data is stored as some number of sca
+   // (rows are stored bottom up right away if the image is to be flipped)
+   flip = stbi__flip_in_loader(s, ri);
    if ( width < 8 || width >= 32768) {
       // Read flat data
       for (j=0; j < height; ++j) {
+         row = ri->direct ? hdr_data : hdr_data + (size_t) (flip ? height-1-j : j) * width * req_comp;
          for (i=0; i < width; ++i) {
             stbi_uc rgbe[4];
            main_decode_loop:
             stbi__getn(s, rgbe, 4);
-            stbi__hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
+            stbi__hdr_convert(row + i * req_comp, rgbe, req_comp);
          }
+         if (ri->direct)
+            stbi__hdr_to_ldr_pixels(s->out + (size_t) s->out_stride * (flip ? height-1-j : j), row, width, req_comp);
       }
    } else {
       // Read RLE-encoded data
@@ -7239,24 +11278,27 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
             rgbe[1] = (stbi_uc) c2;
             rgbe[2] = (stbi_uc) len;
             rgbe[3] = (stbi_uc) stbi__get8(s);
-            stbi__hdr_convert(hdr_data, rgbe, req_comp);
-            i = 1;
             j = 0;
-            STBI_FREE(scanline);
+            row = ri->direct ? hdr_data : hdr_data + (size_t) (flip ? height-1 : 0) * width * req_comp;
+            stbi__hdr_convert(row, rgbe, req_comp);
+            i = 1;
+            stbi__free(scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+         if (len != width) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
          if (scanline == NULL) {
             scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
             if (!scanline) {
-               STBI_FREE(hdr_data);
+               stbi__free(hdr_data);
                return stbi__errpf("outofmem", "Out of memory");
             }
          }
 
+         // the channels are kept in separate planes, like in the file, so runs and dumps are plain copies
          for (k = 0; k < 4; ++k) {
+            stbi_uc *plane = scanline + k * width;
             int nleft;
             i = 0;
             while ((nleft = width - i) > 0) {
@@ -7265,22 +11307,24 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
                   // Run
                   value = stbi__get8(s);
                   count -= 128;
-                  if ((count == 0) || (count > nleft)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = value;
+                  if ((count == 0) || (count > nleft)) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  memset(plane + i, value, count);
                } else {
                   // Dump
-                  if ((count == 0) || (count > nleft)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = stbi__get8(s);
+                  if ((count == 0) || (count > nleft)) { stbi__free(hdr_data); stbi__free(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                  if (!stbi__getn(s, plane + i, count))
+                     memset(plane + i, 0, count); // truncated file
                }
+               i += count;
             }
          }
-         for (i=0; i < width; ++i)
-            stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         row = ri->direct ? hdr_data : hdr_data + (size_t) (flip ? height-1-j : j) * width * req_comp;
+         stbi__hdr_convert_row(row, scanline, width, req_comp);
+         if (ri->direct)
+            stbi__hdr_to_ldr_pixels(s->out + (size_t) s->out_stride * (flip ? height-1-j : j), row, width, req_comp);
       }
       if (scanline)
-         STBI_FREE(scanline);
+         stbi__free(scanline);
    }
 
    return hdr_data;
@@ -7506,7 +11550,7 @@ static int      stbi__pnm_test(stbi__context *s)
 static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    stbi_uc *out;
-   STBI_NOTUSED(ri);
+   int j, stride, flip;
 
    ri->bits_per_channel = stbi__pnm_info(s, (int *)&s->img_x, (int *)&s->img_y, (int *)&s->img_n);
    if (ri->bits_per_channel == 0)
@@ -7521,12 +11565,17 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    if (!stbi__mad4sizes_valid(s->img_n, s->img_x, s->img_y, ri->bits_per_channel / 8, 0))
       return stbi__errpuc("too large", "PNM too large");
+   if (!stbi__out_check(s, s->img_x, s->img_y, req_comp ? req_comp : s->img_n)) return NULL;
 
-   out = (stbi_uc *) stbi__malloc_mad4(s->img_n, s->img_x, s->img_y, ri->bits_per_channel / 8, 0);
+   out = stbi__out_image(s, &ri->direct, ri->bits_per_channel == 8 && (!req_comp || req_comp == s->img_n), s->img_x, s->img_y, s->img_n * (ri->bits_per_channel / 8), 0, &stride);
    if (!out) return stbi__errpuc("outofmem", "Out of memory");
-   if (!stbi__getn(s, out, s->img_n * s->img_x * s->img_y * (ri->bits_per_channel / 8))) {
-      STBI_FREE(out);
-      return stbi__errpuc("bad PNM", "PNM file truncated");
+   // the rows are read one at a time, bottom up right away if the image is to be flipped
+   flip = stbi__flip_in_loader(s, ri);
+   for (j=0; j < (int) s->img_y; ++j) {
+      if (!stbi__getn(s, out + (size_t) stride * (flip ? (int) s->img_y-1-j : j), s->img_n * s->img_x * (ri->bits_per_channel / 8))) {
+         if (!ri->direct) stbi__free(out);
+         return stbi__errpuc("bad PNM", "PNM file truncated");
+      }
    }
 
    if (req_comp && req_comp != s->img_n) {
@@ -7629,43 +11678,50 @@ static int stbi__pnm_is16(stbi__context *s)
 }
 #endif
 
+// the _info functions are their own tests, so after a peek only one runs
+#define STBI__INFO(f, info)  ((fmt ? fmt == (f) : (enabled & (f)) != 0) && (info))
+
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 {
+   int fmt = stbi__peek_format(s), enabled = stbi__enabled_formats(s->formats);
+   if (fmt && fmt != STBI_FORMAT_TGA && !(fmt & enabled))
+      return stbi__err("format disabled", "Image format not enabled");
+
    #ifndef STBI_NO_JPEG
-   if (stbi__jpeg_info(s, x, y, comp)) return 1;
+   if (STBI__INFO(STBI_FORMAT_JPEG, stbi__jpeg_info(s, x, y, comp))) return 1;
    #endif
 
    #ifndef STBI_NO_PNG
-   if (stbi__png_info(s, x, y, comp))  return 1;
+   if (STBI__INFO(STBI_FORMAT_PNG, stbi__png_info(s, x, y, comp)))  return 1;
    #endif
 
    #ifndef STBI_NO_GIF
-   if (stbi__gif_info(s, x, y, comp))  return 1;
+   if (STBI__INFO(STBI_FORMAT_GIF, stbi__gif_info(s, x, y, comp)))  return 1;
    #endif
 
    #ifndef STBI_NO_BMP
-   if (stbi__bmp_info(s, x, y, comp))  return 1;
+   if (STBI__INFO(STBI_FORMAT_BMP, stbi__bmp_info(s, x, y, comp)))  return 1;
    #endif
 
    #ifndef STBI_NO_PSD
-   if (stbi__psd_info(s, x, y, comp))  return 1;
+   if (STBI__INFO(STBI_FORMAT_PSD, stbi__psd_info(s, x, y, comp)))  return 1;
    #endif
 
    #ifndef STBI_NO_PIC
-   if (stbi__pic_info(s, x, y, comp))  return 1;
+   if (STBI__INFO(STBI_FORMAT_PIC, stbi__pic_info(s, x, y, comp)))  return 1;
    #endif
 
    #ifndef STBI_NO_PNM
-   if (stbi__pnm_info(s, x, y, comp))  return 1;
+   if (STBI__INFO(STBI_FORMAT_PNM, stbi__pnm_info(s, x, y, comp)))  return 1;
    #endif
 
    #ifndef STBI_NO_HDR
-   if (stbi__hdr_info(s, x, y, comp))  return 1;
+   if (STBI__INFO(STBI_FORMAT_HDR, stbi__hdr_info(s, x, y, comp)))  return 1;
    #endif
 
    // test tga last because it's a crappy test!
    #ifndef STBI_NO_TGA
-   if (stbi__tga_info(s, x, y, comp))
+   if ((fmt == 0 || fmt == STBI_FORMAT_TGA) && (enabled & STBI_FORMAT_TGA) && stbi__tga_info(s, x, y, comp))
        return 1;
    #endif
    return stbi__err("unknown image type", "Image not of any known type, or corrupt");
@@ -7673,17 +11729,20 @@ static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 
 static int stbi__is_16_main(stbi__context *s)
 {
+   int fmt = stbi__peek_format(s), enabled = stbi__enabled_formats(s->formats);
+
    #ifndef STBI_NO_PNG
-   if (stbi__png_is16(s))  return 1;
+   if (STBI__INFO(STBI_FORMAT_PNG, stbi__png_is16(s)))  return 1;
    #endif
 
    #ifndef STBI_NO_PSD
-   if (stbi__psd_is16(s))  return 1;
+   if (STBI__INFO(STBI_FORMAT_PSD, stbi__psd_is16(s)))  return 1;
    #endif
 
    #ifndef STBI_NO_PNM
-   if (stbi__pnm_is16(s))  return 1;
+   if (STBI__INFO(STBI_FORMAT_PNM, stbi__pnm_is16(s)))  return 1;
    #endif
+   STBI_NOTUSED(fmt); STBI_NOTUSED(enabled);
    return 0;
 }
 
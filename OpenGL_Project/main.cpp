@@ -3,7 +3,13 @@
 #include <windows.h>
 #include <iostream>
 #include <Shader.h>
+#include <VertexLayout.h>
+#include <MeshBuffer.h>
 #include <stb_image.h>
+#include <TextureLoader.h>
+#include <TextureCooker.h>
+#include <TextureManifest.h>
+#include <ImageBenchmark.h>
 #include <math.h>
 
 #include <glm/glm.hpp>
@@ -116,8 +122,21 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset){
         fov = 45.0f;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    // Offline texture cooking, runs without opening a window: OpenGL_Project.exe --cook <image> <output.dds> [bc1|bc3|bc7] [fast|normal|high] [flip]
+    if (argc > 1 && std::string(argv[1]) == "--cook")
+        return TextureCooker::runCommandLine(argc, argv);
+    // Probes every image under a directory and writes their sizes and formats: OpenGL_Project.exe --manifest <directory> <output> [nohash] [threads]
+    if (argc > 1 && std::string(argv[1]) == "--manifest")
+        return TextureManifest::runCommandLine(argc, argv);
+    // Times stb_image's channel count and bit depth conversions: OpenGL_Project.exe --bench-convert [size] [runs]
+    if (argc > 1 && std::string(argv[1]) == "--bench-convert")
+        return ImageBenchmark::runCommandLine(argc, argv);
+    // Decodes every image under a directory with each SIMD kernel and reports the speed and memory use per format: OpenGL_Project.exe --bench-decode <directory> [runs] [output.json]
+    if (argc > 1 && std::string(argv[1]) == "--bench-decode")
+        return ImageBenchmark::runDecodeCommandLine(argc, argv);
+
     HWND consoleWindow = GetConsoleWindow();
     //ShowWindow(consoleWindow, SW_HIDE); // hides the console
 
@@ -199,14 +218,6 @@ int main()
         -0.5f, 0.5f, 0.5f,      0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
         -0.5f, 0.5f, -0.5f,     0.0f, 1.0f, 0.0f, 0.0f, 1.0f
     };
-    unsigned int indices[] = { // Indexed drawing to not write the same vertices repeatedly (allows the reuse of vertices)
-
-        0, 1, 3, // first triangle
-        1, 2, 3, // second triangle
-        //0, 3, 4, // third triangle
-        //1, 2, 5 // fourth triangle
-
-    };
     // Texture coordinates for sampling (retrieving texture colour based of texture coordinates)
     float texCoords[] = {
         0.0f, 0.0f, // lower-left corner
@@ -238,96 +249,52 @@ int main()
     // glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR); // Bilinear filter inside mipmap A then Bilinear filter inside mipmap B then Linear blend between mipmap A and B
     // glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    // Generate a texture object
-    unsigned int texture, texture2;
-    glGenTextures(1, &texture); // args 1: how many textures we want to generate
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    // tells OpenGL how to interpret the textures, args 1: texture target
-    // args 2: which axises to configure the texture to, args 3: how the texture should be wrapped
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-
+    // Textures are decoded on worker threads and uploaded a few rows per frame (see TextureLoader.h)
+    // textureLoader.get() returns a 1x1 placeholder until the image is on the GPU, so the first frame does not wait for any file
+    // args: max bytes uploaded to the GPU per frame
+    TextureLoader textureLoader(4 * 1024 * 1024);
+    // Loading the same file again reuses the texture, past this much video memory the least recently used textures are freed or lose their largest mip level
+    textureLoader.setMemoryBudget(256 * 1024 * 1024);
+
+    TextureOptions textureOptions;
+    // tells OpenGL how to interpret the textures, how the texture should be wrapped on each axis
+    textureOptions.wrapS = GL_MIRRORED_REPEAT;
+    textureOptions.wrapT = GL_MIRRORED_REPEAT;
     // GL_NEAREST: finds the nearest texture pixel from the original texture image, GL_LINEAR interpolates the pixel depending on the surrounding texture pixels in a given coordinate
     // Magnifying and minifying operations (upscaling or downscaling) can use either filitering method
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    int width, height, nrChannels; // these variables will be automatically filled by stb_image.h (nrChannels = # of colour channels)
-    unsigned char* data = stbi_load("wall.jpg", &width, &height, &nrChannels, 0);
-    stbi_set_flip_vertically_on_load(true); // tells stb_image.h to flip the loaded texture on the y axis to correspond to OpenGL coordinate system
-
-    if (data) {
-        // args 1: texture target, args 2: mipmap level for the texture, args 3: format to store the texture, args 4/5 = width and height (already set from stb_image.h)
-        // args 6: border, must be 0 (legacy stuff), args 7/8 = format and data type of the source image, args 9 = actual image data
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else {
-        std::cout << "Failed to load texture" << std::endl;
-    }
-    stbi_image_free(data); // frees up memory allocated when loading the image in stbi_load()
-
-    glGenTextures(1, &texture2);
-    glBindTexture(GL_TEXTURE_2D, texture2);
-    // Wrapping parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-    // filtering parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    // Load images and create mipmaps 
-    data = stbi_load("awesomeface.png", &width, &height, &nrChannels, 0);
-    if (data)
-    {
-        // note that the awesomeface.png has transparency and thus an alpha channel, so make sure to tell OpenGL the data type is of GL_RGBA
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    }
-    else
-    {
-        std::cout << "Failed to load texture" << std::endl;
-    }
-    stbi_image_free(data);
-
-
-    // Make a Vertex Array object
-    unsigned int VAO; // Create the object
-    glGenVertexArrays(1, &VAO); // Store the reference to the Object as an ID
-    glBindVertexArray(VAO); // Binds the Object as the current active object in the OpenGL context
-
-    // Light VAO
-    unsigned int lightVAO;
-    glGenVertexArrays(1, &lightVAO);
-    glBindVertexArray(lightVAO);
-
-    // Make a Elemenet buffer object
-    unsigned int EBO;
-    glGenBuffers(1, &EBO);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO); // EBO = GL_ELEMENT_ARRAYBUFFER type
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW); // store the data of indices into the ebo
-
-
-    // Make a VBO (Vertex Buffer Object) to send all the vertex data at once
-    unsigned int VBO;
-    glGenBuffers(1, &VBO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO); // VBO buffer type is an array buffer (binds the array data to the GL_ARRAY_BUFFER target)
-    // Copies the vertex data in to the current bound buffer, 
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // GL_ARRAY_BUFFER = target buffer, sizeof(vertices) = size of the data, vertices = data to transfer, GL_STATIC_DRAW = how to use the data 
-    // GL_STREAM_DRAW = data is set once and used a few times, GL_STATIC_DRAW = data is set once and used many times, GL_DYNAMIC_DRAW = data is changed alot and used many times
-
-    // arg 1 = location/index in the vertex shader (layout (location = 0)), arg 2 = number of components per vertex attribute (vec3 in this case), arg 3 = data type of each component, 
-    // arg 4 = should the input be normalized (turned to 0,1 or -1,1 for ints, not needed for floats), arg 5 = stride (the byte offset between vector attributes, works as 0 for tightly packed attributes),
-    // arg 6 = pointer = offset in the VBO where this attribute starts (0 for us, requires a void cast for the pointer)
-
-    // Position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0); // tells OpenGL how to interpret the VBO data
-    glEnableVertexAttribArray(0); // Tells the VAO that attribute pointer 0 is enabled
-
-    // Normal attribute
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    textureOptions.minFilter = GL_LINEAR;
+    textureOptions.magFilter = GL_LINEAR;
+    // flip the loaded textures on the y axis to correspond to OpenGL coordinate system
+    // (the flip is passed to each load, so it is the same for both textures whatever order they finish in)
+    textureOptions.flip = true;
+
+    // cookedPath() picks wall.dds instead if it has been cooked (--cook wall.jpg wall.dds bc1 flip) and the GPU supports its format
+    // compressed textures take 1/4 to 1/8 of the memory and keep their own mip chain
+    unsigned int texture = textureLoader.load(TextureCooker::cookedPath("wall.jpg"), textureOptions);
+
+    // the channel count comes from the file, so awesomeface.png's alpha channel makes it a GL_RGBA texture
+    // a cooked awesomeface.dds has to be flipped when it is cooked (--cook awesomeface.png awesomeface.dds bc7 flip)
+    unsigned int texture2 = textureLoader.load(TextureCooker::cookedPath("awesomeface.png"), textureOptions);
+
+
+    // Describe the vertex format once, every buffer with the same layout shares one VAO (see VertexLayout.h)
+    // add args: location/index in the vertex shader (layout (location = 0)), number of components per vertex attribute (vec3 in this case), data type of each component,
+    // should the input be normalized (turned to 0,1 or -1,1 for ints, not needed for floats), byte offset inside one vertex where this attribute starts
+    VertexArrayCache vertexArrays;
+    VertexLayout cubeLayout;
+    cubeLayout.setBinding(0, 8 * sizeof(float)) // binding 0 = one vertex every 8 floats
+        .add(0, 3, GL_FLOAT, GL_FALSE, 0) // Position attribute
+        .add(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float)); // Normal attribute
+
+    // All meshes are packed into one shared vertex buffer + index buffer (see MeshBuffer.h)
+    // args: VAO cache, vertex layout, starting capacity in vertices and in indices (the buffers grow when they fill up)
+    MeshBuffer meshBuffer(vertexArrays, cubeLayout, 64 * 1024, 256 * 1024);
+
+    // The cube vertices are not shared between faces, so the cube's indices are just 0 to 35
+    unsigned int cubeIndices[36];
+    for (unsigned int i = 0; i < 36; i++)
+        cubeIndices[i] = i;
+    unsigned int cubeMesh = meshBuffer.addMesh(vertices, 36, cubeIndices, 36); // handle used to draw the cube
 
     // Vertex Coordinates attributes
     //glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
@@ -383,6 +350,7 @@ int main()
     // Render loop
     while (!glfwWindowShouldClose(window))
     {
+        textureLoader.update(); // uploads the next part of any textures that finished decoding
         float currentFrame = glfwGetTime();
         deltaTime = currentFrame - lastFrame;
         lastFrame = currentFrame;
@@ -423,10 +391,10 @@ int main()
 
         /*
         glActiveTexture(GL_TEXTURE0); // Activates the texture unit (useful for multiple textures, 0 on default, minimum of 16 texture units)
-        glBindTexture(GL_TEXTURE_2D, texture);
+        glBindTexture(GL_TEXTURE_2D, textureLoader.get(texture));
 
         glActiveTexture(GL_TEXTURE1); // Use the second texture
-        glBindTexture(GL_TEXTURE_2D, texture2);
+        glBindTexture(GL_TEXTURE_2D, textureLoader.get(texture2));
         */
         glEnable(GL_DEPTH_TEST); // enable depth testing (calculates which pixels should be on top depending on the stored z values)
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // Clear the depth buffer for each render iteration
@@ -463,8 +431,8 @@ int main()
         shader.setMat4("view", view);
         shader.setMat4("projection", proj);
 
-        glBindVertexArray(lightVAO); // Tells OpenGL which vertex data and attribute setup to use
-        glDrawArrays(GL_TRIANGLES, 0, 36);
+        meshBuffer.bind(); // Tells OpenGL which vertex data and attribute setup to use (one VAO for every mesh)
+        meshBuffer.draw(cubeMesh);
 
         lightCubeShader.use();
         lightCubeShader.setMat4("projection", proj);
@@ -475,8 +443,7 @@ int main()
         model = glm::scale(model, glm::vec3(0.4f)); // a smaller cube
         lightCubeShader.setMat4("model", model);
 
-        glBindVertexArray(lightVAO); // make a different vao for the lighting cube usually
-        glDrawArrays(GL_TRIANGLES, 0, 36);
+        meshBuffer.draw(cubeMesh); // same buffers and VAO, only the draw call changes
         //glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0); // Draw the elements, draw 6 vertices,indices are of type unsigned int, EBO has an offset of 0
 
         processInput(window);
@@ -487,9 +454,9 @@ int main()
     }
     
     // Cleanup
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
-    glDeleteBuffers(1, &EBO);
+    meshBuffer.release();
+    vertexArrays.release();
+    textureLoader.release();
 
     glfwDestroyWindow(window);
     glfwTerminate();